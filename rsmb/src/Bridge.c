@@ -700,11 +700,15 @@ void Bridge_subscribe(BridgeConnections* bc, Clients* client)
 				}
 				else
 				{
-					int isnew = SubscriptionEngines_subscribe(subsengine, client->clientID,				 /* local subscription */
+					int isnew;
+
+					MQTTProtocol_sysRefresh(fulltopic);
+					isnew = SubscriptionEngines_subscribe(subsengine, client->clientID,				 /* local subscription */
 						fulltopic, 2, 1, (client->cleansession == 0), curtopic->priority); /* this is noLocal (and keep retained flags) */
 					if (isnew || client->cleansession == 1)
 					/* retained messages only sent if the subscription was new */
 						MQTTProtocol_processRetaineds(client, fulltopic, 2, curtopic->priority);
+					free(fulltopic);
 				}
 			}
 		}
@@ -739,10 +743,12 @@ void Bridge_subscribe(BridgeConnections* bc, Clients* client)
 				{
 					char* fulltopic = Bridge_addPrefix(curtopic->pattern, curtopic->localPrefix, &len);
 					int qos = (client->protocol == PROTOCOL_MQTTS_MULTICAST) ? 0 : 2;
+					MQTTProtocol_sysRefresh(fulltopic);
 					if (SubscriptionEngines_subscribe(subsengine, client->clientID,				 /* local subscription */
 							fulltopic, qos, 1, (client->cleansession == 0), curtopic->priority)) /* this is noLocal (and keep retained flags) */
 						/* retained messages only sent if the subscription was new */
 						MQTTProtocol_processRetaineds(client, fulltopic, qos, curtopic->priority);
+					free(fulltopic);
 					curtopic->subscribed = 1;
 				}
 			}
@@ -818,6 +824,7 @@ int Bridge_handleConnacks(void* pack, int sock, Clients* client)
 	else if (client) /* now we can issue the subscriptions, both local and remote */
 	{
 		Log(LOG_INFO, 133, NULL, bc->name, bc->cur_address->content);
+		MQTTProtocol_setWindow(client, bc->inflight_window_min, bc->inflight_window_max);
 		if (client->will)
 		{
 			Publish pub;
@@ -103,6 +103,8 @@ def BRIDGECONNECTIONS
 	n32 dec "no_successful_connections"
 	n32 ptr STRING open "notification_topic"
 	n32 dec "keepalive_interval"
+	n32 dec "inflight_window_min"
+	n32 dec "inflight_window_max"
 	n32 dec "inbound_filter"
 	n32 ptr BRIDGETOPICSList open "topics"
 	expr "topics->count" dec "number of topics"
@@ -140,6 +142,8 @@ typedef struct
 	int no_successful_connections;	/**< how many successful connections have there been */
 	char* notification_topic;		/**< what topic to issue the notifications on */
 	int keepalive_interval;			/**< MQTT keepalive interval to use in seconds */
+	int inflight_window_min;		/**< smallest adaptive in-flight window, or 0 */
+	int inflight_window_max;		/**< largest adaptive in-flight window, or 0 */
 	int inbound_filter;				/**< not yet used */
 	List* topics; 					/**< of BridgeTopics */
 	Clients* primary;				/**< primary bridge client */
@@ -69,6 +69,7 @@
 #include "Heap.h"
 #include "Messages.h"
 #include "Topics.h"
+#include "Capture.h"
 
 void Users_initialize(BrokerStates* aBrokerState);
 
@@ -99,6 +100,21 @@ static BrokerStates BrokerState =
 	0, 			  /**< autosave_on_changes */
 	1800, 		/**< autosave_interval */
 	0L, 		  /**< last_autosave */
+	0, 			  /**< persistence_journal */
+	0, 			  /**< persistence_fork */
+	0, 			  /**< persistence_mmap */
+	0, 			  /**< fanout_threads */
+	1000, 		/**< fanout_threshold */
+	1000, 		/**< subscription_cache_size */
+	NULL, 		/**< shared_subscription_policy */
+	NULL, 		/**< capture_file */
+	0, 			  /**< slow_iteration_threshold */
+	0, 			  /**< topic_stats_depth */
+	10, 		  /**< topic_stats_top */
+	10, 		  /**< slow_clients_top */
+	0, 			  /**< max_queued_bytes */
+	0, 			  /**< max_queued_bytes_total */
+	NULL, 		/**< queue_drop_policy */
 	NULL, 		/**< clientid_prefixes */
 	{ NULL }, 	/**< bridge */
 #if defined(SINGLE_LISTENER)
@@ -114,6 +130,7 @@ static BrokerStates BrokerState =
 	NULL,       /**< acl file location */
 	0,          /**< whether anonymous users are allowed to connect */
 	NULL,       /**< default ACL */
+	NULL,       /**< default ACL, compiled */
 	0, 			/**< unsigned int msgs_received; */
 	0, 			/**< unsigned int msgs_sent; */
 	0L,			/**< unsigned long int bytes_received; */
@@ -353,7 +370,11 @@ int Broker_startup()
 	if ((rc = Persistence_read_config(config, &BrokerState, config_set)) == 0)
 	{
 		BrokerState.se = SubscriptionEngines_initialize();
+		SubscriptionEngines_setCacheSize(BrokerState.se, BrokerState.subscription_cache_size);
+		SubscriptionEngines_setSharedPolicy(BrokerState.se, BrokerState.shared_subscription_policy, Protocol_clientLoad);
 		rc = Protocol_initialize(&BrokerState);
+		if (BrokerState.capture_file)
+			Capture_open(BrokerState.capture_file);
 #if !defined(SINGLE_LISTENER)
 		rc = Socket_initialize(BrokerState.listeners);
 #else
@@ -361,6 +382,9 @@ int Broker_startup()
 #endif
 #if !defined(NO_BRIDGE)
 		Bridge_initialize(&(BrokerState.bridge), BrokerState.se);
+#endif
+#if !defined(NO_ADMIN_COMMANDS)
+		Persistence_open_command_channel(&BrokerState);
 #endif
 		Log_setPublish(true);
 	}
@@ -390,9 +414,15 @@ void Broker_shutdown(int rc)
 			{
 				if (BrokerState.persistence)
 					SubscriptionEngines_save(BrokerState.se);
+				Persistence_close_journal(); /* the removal of subscriptions as clients are closed is not a change to keep */
 				Protocol_terminate();
+				Capture_close();
+#if !defined(NO_ADMIN_COMMANDS)
+				Persistence_close_command_channel();
+#endif
 				Socket_terminate();
 				SubscriptionEngines_terminate(BrokerState.se);
+				Topics_terminate();
 
 				Log(LOG_INFO, 44, NULL, BrokerState.msgs_sent);
 				Log(LOG_INFO, 43, NULL, BrokerState.msgs_received);
@@ -95,6 +95,21 @@ $ifdef WIN32
 $else
    n32 time "last_autosave"
 $endif
+   n32 map bool "persistence_journal"
+   n32 map bool "persistence_fork"
+   n32 map bool "persistence_mmap"
+   n32 dec "fanout_threads"
+   n32 dec "fanout_threshold"
+   n32 dec "subscription_cache_size"
+   n32 ptr STRING open "shared_subscription_policy"
+   n32 ptr STRING open "capture_file"
+   n32 dec "slow_iteration_threshold"
+   n32 dec "topic_stats_depth"
+   n32 dec "topic_stats_top"
+   n32 dec "slow_clients_top"
+   n32 dec "max_queued_bytes"
+   n32 dec "max_queued_bytes_total"
+   n32 ptr STRING open "queue_drop_policy"
    n32 ptr STRINGList open "clientid_prefixes"
    BRIDGES "bridge"
 $ifdef SINGLE_LISTENER
@@ -106,10 +121,11 @@ $else
    n32 ptr LISTENERList open "listeners"
 $endif
    n32 ptr STRING open "password_file"
-   n32 ptr USERList open "users"
+   n32 ptr USERTree open "users"
    n32 ptr STRING open "acl_file"
    n32 map bool "allow_anonymous"
    n32 ptr RULEList open "defaultACL"
+   n32 ptr ACLTRIE open "defaultTrie"
    n32 dec "msgs_received"
    n32 dec "msgs_sent"
    n32 unsigned dec "bytes_received"
@@ -153,6 +169,21 @@ typedef struct
 	int autosave_on_changes;	/**< autosave on number of state changes? */
 	int autosave_interval;		/**< autosave on time interval? */
 	time_t last_autosave;		/**< time of last autosave */
+	int persistence_journal;	/**< journal changes between autosaves? */
+	int persistence_fork;		/**< write snapshots in a child process? */
+	int persistence_mmap;		/**< map the retained message file into memory? */
+	int fanout_threads;			/**< number of threads writing out wide publications */
+	int fanout_threshold;		/**< number of subscribers from which a publication is written out in parallel */
+	int subscription_cache_size;	/**< number of topics for which subscribers are cached */
+	char* shared_subscription_policy;	/**< how a shared subscription group member is chosen */
+	char* capture_file;			/**< file to capture inbound packets to, for replay */
+	int slow_iteration_threshold;	/**< event loop iterations longer than this many ms are logged */
+	int topic_stats_depth;		/**< topic levels by which traffic is accounted, 0 for none */
+	int topic_stats_top;		/**< number of the busiest topic subtrees published */
+	int slow_clients_top;		/**< number of the slowest consumers published */
+	int max_queued_bytes;		/**< per client, payload bytes queued and in flight, 0 for no limit */
+	int max_queued_bytes_total;	/**< for all clients together, 0 for no limit */
+	char* queue_drop_policy;	/**< which message is dropped when a queue limit is reached */
 	List* clientid_prefixes;	/**< list of authorized client prefixes */
 	Bridges bridge;				/**< bridge state */
 #if defined(SINGLE_LISTENER)
@@ -164,10 +195,11 @@ typedef struct
 	List* listeners;			/**< list of listeners */
 #endif
 	char* password_file;        /**< password file location */
-	List* users;                /**< known users & passwords */
+	Tree* users;                /**< known users & passwords, by username */
 	char* acl_file;             /**< acl file location */
 	int allow_anonymous;        /**< whether anonymous users are allowed to connect */
 	List* defaultACL;           /**< acl that applied to all users */
+	AclTrie* defaultTrie;       /**< acl that applied to all users, compiled */
 	unsigned int msgs_received;	/**< statistics: number of messages received */
 	unsigned int msgs_sent;		/**< statistics: number of messages sent */
 	unsigned long int bytes_received;	/**< statistics: number of bytes received */
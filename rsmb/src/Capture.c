@@ -0,0 +1,295 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Capture of inbound traffic to a file, for replay.
+ *
+ * Every packet read from a client is written to the capture file named by the capture_file
+ * setting, with the time since the previous packet and the connection it came in on, so that
+ * the traffic can be replayed later against another broker with tools/bench/replay.c.  The
+ * file format is described in Capture.h.  The user names and passwords in CONNECT packets are
+ * masked, but everything else, including the payloads of publications, is written as received.
+ */
+
+#include "Capture.h"
+#include "MQTTPacket.h"
+#include "Log.h"
+#include "StackTrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if !defined(WIN32)
+#define GETTIMEOFDAY 1
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+
+#if defined(GETTIMEOFDAY)
+	#include <sys/time.h>
+#else
+	#include <sys/timeb.h>
+#endif
+
+#include "Heap.h"
+
+static FILE* cfile = NULL;		/**< the capture file, NULL when not capturing */
+static char* cfile_name = NULL;
+static double last_time = 0;	/**< of the last record, in microseconds */
+
+
+/**
+ * The time now, in microseconds since the epoch
+ */
+static double Capture_now()
+{
+#if defined(GETTIMEOFDAY)
+	struct timeval ts;
+
+	gettimeofday(&ts, NULL);
+	return ts.tv_sec * 1e6 + ts.tv_usec;
+#else
+	struct timeb ts;
+
+	ftime(&ts);
+	return ts.time * 1e6 + ts.millitm * 1e3;
+#endif
+}
+
+
+/**
+ * Start capturing inbound packets.
+ * @param filename the file to write, which is replaced if it exists
+ * @return completion code, success == 0
+ */
+int Capture_open(char* filename)
+{
+	unsigned int times[2];
+	int rc = -1;
+
+	FUNC_ENTRY;
+	Capture_close();
+	if ((cfile = fopen(filename, "wb")) == NULL)
+	{
+		Log(LOG_WARNING, 166, NULL, filename, errno);
+		goto exit;
+	}
+	setvbuf(cfile, NULL, _IOFBF, 65536);
+	last_time = Capture_now();
+	times[0] = htonl((unsigned int)(last_time / 1e6));
+	times[1] = htonl((unsigned int)(last_time - (double)(unsigned int)(last_time / 1e6) * 1e6));
+	if (fwrite(CAPTURE_EYECATCHER, 8, 1, cfile) != 1 || fwrite(times, sizeof(times), 1, cfile) != 1)
+	{
+		Log(LOG_WARNING, 167, NULL, filename);
+		fclose(cfile);
+		cfile = NULL;
+		goto exit;
+	}
+	cfile_name = malloc(strlen(filename) + 1);
+	strcpy(cfile_name, filename);
+	Log(LOG_INFO, 165, NULL, filename);
+	rc = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Is inbound traffic being captured?
+ * @return boolean
+ */
+int Capture_active()
+{
+	return cfile != NULL;
+}
+
+
+/**
+ * Write one capture record.  If the write fails, capture stops.
+ * @param type the record type
+ * @param connection the connection id
+ * @param header the first part of the packet, or NULL
+ * @param headerlen the length of header
+ * @param data the rest of the packet, or NULL
+ * @param datalen the length of data
+ */
+static void Capture_write(int type, unsigned int connection, char* header, int headerlen, char* data, int datalen)
+{
+	unsigned char record[CAPTURE_RECORD_HEADER];
+	unsigned int value;
+	double now = Capture_now();
+	double delta = now - last_time;
+
+	/* a gap longer than the 32 bit field, over an hour, is shortened to its maximum */
+	value = htonl((delta < 0) ? 0 : (delta > 4294967295.0) ? 0xFFFFFFFF : (unsigned int)delta);
+	memcpy(&record[0], &value, 4);
+	value = htonl(connection);
+	memcpy(&record[4], &value, 4);
+	record[8] = (unsigned char)type;
+	value = htonl((unsigned int)(headerlen + datalen));
+	memcpy(&record[9], &value, 4);
+	if (fwrite(record, sizeof(record), 1, cfile) != 1 ||
+		(headerlen > 0 && fwrite(header, headerlen, 1, cfile) != 1) ||
+		(datalen > 0 && fwrite(data, datalen, 1, cfile) != 1))
+	{
+		Log(LOG_WARNING, 167, NULL, cfile_name);
+		Capture_close();
+	}
+	else if (delta > 0)
+		last_time = now;
+}
+
+
+/**
+ * Step over a length-prefixed string field of an MQTT packet, optionally overwriting its contents.
+ * @param data the variable header and payload of the packet
+ * @param datalen the length of data
+ * @param pos the offset of the field
+ * @param mask boolean - whether to overwrite the contents with '*'
+ * @return the offset after the field, or -1 if it runs past the end of the packet
+ */
+static int Capture_field(char* data, int datalen, int pos, int mask)
+{
+	int len;
+
+	if (pos < 0 || pos + 2 > datalen)
+		return -1;
+	len = ((unsigned char)data[pos] << 8) + (unsigned char)data[pos + 1];
+	if (pos + 2 + len > datalen)
+		return -1;
+	if (mask)
+		memset(&data[pos + 2], '*', len);
+	return pos + 2 + len;
+}
+
+
+/**
+ * Overwrite the user name and password of an MQTT CONNECT packet, keeping their lengths, so
+ * that credentials are never written to the capture file.
+ * @param data the variable header and payload of the CONNECT packet, which are changed
+ * @param datalen the length of data
+ */
+static void Capture_maskConnect(char* data, int datalen)
+{
+	int pos = Capture_field(data, datalen, 0, 0); /* protocol name */
+	int flags = 0;
+
+	if (pos < 0 || pos + 4 > datalen)
+		return;
+	flags = (unsigned char)data[pos + 1];
+	pos = Capture_field(data, datalen, pos + 4, 0); /* after the version, flags and keepalive: client id */
+	if (flags & 0x04) /* will topic and message */
+		pos = Capture_field(data, datalen, Capture_field(data, datalen, pos, 0), 0);
+	if (flags & 0x80)
+		pos = Capture_field(data, datalen, pos, 1); /* user name */
+	if (flags & 0x40)
+		Capture_field(data, datalen, pos, 1); /* password */
+}
+
+
+/**
+ * Record an inbound packet.  The user name and password of an MQTT CONNECT are masked.
+ * @param type CAPTURE_MQTT or CAPTURE_MQTTS
+ * @param connection the socket for MQTT, the result of Capture_addressId for MQTT-SN
+ * @param header the fixed header of an MQTT packet, or NULL
+ * @param headerlen the length of header
+ * @param data the rest of the packet
+ * @param datalen the length of data
+ */
+void Capture_packet(int type, unsigned int connection, char* header, int headerlen, char* data, int datalen)
+{
+	FUNC_ENTRY;
+	if (cfile && type == CAPTURE_MQTT && headerlen > 0 && ((unsigned char)header[0] >> 4) == CONNECT)
+	{
+		char* copy = malloc(datalen);
+
+		memcpy(copy, data, datalen);
+		Capture_maskConnect(copy, datalen);
+		Capture_write(type, connection, header, headerlen, copy, datalen);
+		free(copy);
+	}
+	else if (cfile)
+		Capture_write(type, connection, header, headerlen, data, datalen);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Record that a client closed its connection.
+ * @param connection the socket
+ */
+void Capture_closed(unsigned int connection)
+{
+	FUNC_ENTRY;
+	if (cfile)
+		Capture_write(CAPTURE_CLOSE, connection, NULL, 0, NULL, 0);
+	FUNC_EXIT;
+}
+
+
+/**
+ * The connection id of an MQTT-SN client, which has no connection of its own.
+ * @param address the client address string
+ * @return the FNV-1a hash of the address
+ */
+unsigned int Capture_addressId(char* address)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*address)
+		hash = (hash ^ (unsigned char)*address++) * 16777619U;
+	return hash;
+}
+
+
+/**
+ * Write out buffered records, so that the file is complete up to now.
+ */
+void Capture_flush()
+{
+	FUNC_ENTRY;
+	if (cfile && fflush(cfile) != 0)
+	{
+		Log(LOG_WARNING, 167, NULL, cfile_name);
+		Capture_close();
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Stop capturing.
+ */
+void Capture_close()
+{
+	FUNC_ENTRY;
+	if (cfile)
+	{
+		fclose(cfile);
+		cfile = NULL;
+	}
+	if (cfile_name)
+	{
+		free(cfile_name);
+		cfile_name = NULL;
+	}
+	FUNC_EXIT;
+}
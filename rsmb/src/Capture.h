@@ -0,0 +1,55 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+#if !defined(CAPTURE_H)
+#define CAPTURE_H
+
+/**
+ * A capture file starts with this eyecatcher, followed by the time the capture started as two
+ * 32 bit integers, seconds and microseconds since the epoch.  Then come the records, each
+ * CAPTURE_RECORD_HEADER bytes:
+ *
+ *    4 bytes   microseconds since the previous record, or since the start for the first
+ *    4 bytes   connection: the socket for MQTT, a hash of the client address for MQTT-SN
+ *    1 byte    record type, one of the CAPTURE_ values
+ *    4 bytes   length of the packet which follows
+ *
+ * followed by the packet as it was received: the whole MQTT packet including its fixed header,
+ * or the whole MQTT-SN datagram.  All the integers are in network byte order.
+ *
+ * The user name and password of an MQTT CONNECT are overwritten with '*', keeping their
+ * lengths, so a capture replayed against a broker with a password_file fails to authenticate.
+ * The rest of every packet, payloads included, is kept as it was, so a capture file must be
+ * protected like the data that flows through the broker.
+ */
+#define CAPTURE_EYECATCHER "RSMBCAP1"
+#define CAPTURE_FILE_HEADER 16
+#define CAPTURE_RECORD_HEADER 13
+
+/**
+ * Capture record types
+ */
+enum { CAPTURE_MQTT = 1, CAPTURE_MQTTS = 2, CAPTURE_CLOSE = 3 };
+
+int Capture_open(char* filename);
+int Capture_active(void);
+void Capture_packet(int type, unsigned int connection, char* header, int headerlen, char* data, int datalen);
+void Capture_closed(unsigned int connection);
+unsigned int Capture_addressId(char* address);
+void Capture_flush(void);
+void Capture_close(void);
+
+#endif
@@ -28,7 +28,7 @@
 
 enum protocols
 {
-	PROTOCOL_MQTT, PROTOCOL_MQTTS, PROTOCOL_MQTTS_MULTICAST
+	PROTOCOL_MQTT, PROTOCOL_MQTTS, PROTOCOL_MQTTS_MULTICAST, PROTOCOL_METRICS
 };
 
 /*BE
@@ -41,6 +41,8 @@ map PROTOCOLS
 {
    "mqtt" .
    "mqtts" .
+   "mqtts_multicast" .
+   "metrics" .
 }
 BE*/
 
@@ -87,6 +89,7 @@ $else
 $endif
    n8 map MESSAGE_TYPES "nextMessageType"
    n32 dec "len"
+   n64 dec "sent"
 }
 defList(MESSAGES)
 BE*/
@@ -102,6 +105,7 @@ typedef struct
 	time_t lastTouch; /* used for retry and expiry */
 	char nextMessageType; /* PUBREC, PUBREL, PUBCOMP */
 	int len; /* length of the whole structure+data */
+	unsigned long long sent; /* when first sent, from Latency_now, for the acknowledgement latency */
 } Messages;
 
 
@@ -198,6 +202,60 @@ $endif
 BE*/
 #endif
 
+/*BE
+def CLIENTSTATS
+{
+	n32 dec "msgs_received"
+	n32 dec "msgs_sent"
+	n64 dec "bytes_received"
+	n64 dec "bytes_sent"
+	n32 dec "acks"
+	n64 dec "ack_time"
+	n32 dec "queued_max"
+	n64 dec "write_blocked"
+	n64 dec "queued_bytes"
+}
+BE*/
+/**
+ * Traffic statistics for one client, to find the slow consumers
+ */
+typedef struct
+{
+	unsigned int msgs_received;		/**< messages received from the client */
+	unsigned int msgs_sent;			/**< messages sent to the client, and acknowledged if QoS 1 or 2 */
+	unsigned long long bytes_received;	/**< payload bytes received */
+	unsigned long long bytes_sent;	/**< payload bytes sent */
+	unsigned int acks;				/**< QoS 1 and 2 messages acknowledged */
+	unsigned long long ack_time;	/**< total time in nanoseconds from sending them to their acknowledgements */
+	int queued_max;					/**< the most messages queued for the client at once */
+	unsigned long long write_blocked;	/**< time in nanoseconds the client's socket has had a write pending */
+	unsigned long long queued_bytes;	/**< payload bytes queued and in flight to the client now */
+} ClientStats;
+
+/*BE
+def INFLIGHTWINDOW
+{
+	n32 dec "size"
+	n32 dec "min"
+	n32 dec "max"
+	n32 dec "acks"
+	n64 dec "rtt"
+}
+BE*/
+/**
+ * The number of QoS 1 and 2 messages which may be in flight to a client.  If its bounds differ,
+ * it adapts to the client and its connection: it grows while acknowledgements come back
+ * promptly, and shrinks when messages have to be retried or writes to the client are blocked.
+ */
+typedef struct
+{
+	int size;			/**< the number of messages, or 0 for max_inflight_messages */
+	int min;			/**< the smallest the size can shrink to */
+	int max;			/**< the largest the size can grow to */
+	int acks;			/**< prompt acknowledgements since the size last changed */
+	unsigned long long rtt;	/**< smoothed acknowledgement time in nanoseconds */
+} InflightWindow;
+
 /*BE
 map CLIENT_BITS
 {
@@ -216,12 +274,14 @@ def CLIENTS
 	n32 ptr STRING open suppress "addr"
 	n32 ptr STRING open "clientID"
 	n32 ptr USER suppress "user"
+	n32 ptr ACLCACHE open "acl_cache"
 	n32 ptr STRING open suppress "username (outbound)"
 	n32 ptr STRING open suppress "password (outbound)"
 	n32 map CLIENT_BITS "bits"
 	n32 dec suppress "msgID"
 	n32 dec suppress "keepAliveInterval"
 	n32 ptr BRIDGECONNECTIONS suppress "bridge_context"
+	n32 ptr LISTENER suppress "listener"
 $ifdef WIN32
 	n64 time suppress "lastContact"
 $else
@@ -232,6 +292,8 @@ $endif
 	n32 ptr MESSAGESList open suppress "outboundMsgs"
 	3 n32 ptr MESSAGESList open suppress "queuedMsgs"
 	n32 dec suppress "discardedMsgs"
+	CLIENTSTATS "stats"
+	INFLIGHTWINDOW "window"
 $ifdef MQTTS
 	n32 map PROTOCOLS "protocol"
 	n32 ptr REGISTRATIONList open suppress "registrations"
@@ -254,6 +316,7 @@ typedef struct
 	char* addr;						/**< remote address as returned by getpeer */
 	char* clientID;					/**< MQTT id of the client */
 	User* user;						/**< Authenticated user object for this client */
+	AclCache* acl_cache;			/**< authorisation decisions recently made for this client */
 	char* username;                 /**< Username for outbound client connections */
 	char* password;                 /**< Password for outbound client connections */
 	unsigned int cleansession : 1;	/**< MQTT cleansession flag */
@@ -267,12 +330,15 @@ typedef struct
 	int msgID;						/**< current outward MQTT message id */
 	int keepAliveInterval;			/**< MQTT keep alive interval in seconds */
 	void* bridge_context; 			/**< for bridge use */
+	void* listener;					/**< the Listener the client last connected through, or NULL */
 	time_t lastContact;				/**< time of last contact with this client */
 	willMessages* will;				/**< will message if set (NULL if not) */
 	List* inboundMsgs;				/**< list of inbound message state */
 	List* outboundMsgs;				/**< list of outbound in flight messages */
 	List* queuedMsgs[PRIORITY_MAX]; /**< list of queued up outbound messages - not in flight */
 	int discardedMsgs;				/**< how many have we had to throw away? */
+	ClientStats stats;				/**< traffic statistics */
+	InflightWindow window;			/**< the number of messages which may be in flight to the client */
 #if defined(MQTTS)
 	int protocol;                   /**< 0=MQTT 1=MQTTS */
 	int sleep_state;                /***< MQTT-S sleep state: asleep, active, awake, lost */
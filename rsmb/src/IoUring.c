@@ -0,0 +1,466 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Minimal io_uring support, for the io_uring socket backend.
+ *
+ * Only what the Socket module needs: submission and completion queues, and provided
+ * buffer rings.  The system calls are made directly, so that the broker does not depend on
+ * liburing.  Requires Linux 6.0 or later.
+ */
+
+#include "IoUring.h"
+
+#if defined(USE_IO_URING)
+
+#include "Log.h"
+#include "StackTrace.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "Heap.h"
+
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/**
+ * Create an io_uring instance and map its queues.
+ * @param ring the structure to initialize
+ * @param entries the number of submission queue entries.  The completion queue is four times larger,
+ * because multishot requests can post many completions each.
+ * @return 0 on success, otherwise the errno value
+ */
+int IoUring_initialize(IoUring* ring, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned* sq_array;
+	unsigned i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	memset(ring, '\0', sizeof(IoUring));
+	memset(&p, '\0', sizeof(p));
+	/* cooperative task running saves an interrupt per completion; kernels before 5.19 refuse it */
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = entries * 4;
+	if ((ring->fd = io_uring_setup(entries, &p)) < 0 && errno == EINVAL)
+	{
+		memset(&p, '\0', sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+		p.cq_entries = entries * 4;
+		ring->fd = io_uring_setup(entries, &p);
+	}
+	if (ring->fd < 0)
+	{
+		rc = errno;
+		goto exit;
+	}
+	if ((p.features & IORING_FEAT_EXT_ARG) == 0 || (p.features & IORING_FEAT_NODROP) == 0)
+	{
+		rc = ENOSYS;
+		goto close_exit;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+	{
+		rc = errno;
+		goto close_exit;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else if ((ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	{
+		rc = errno;
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto close_exit;
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		rc = errno;
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto close_exit;
+	}
+
+	ring->sq_head = (unsigned*)((char*)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i)
+		sq_array[i] = i; /* submission queue entries are always used in order */
+
+	ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+	goto exit;
+
+close_exit:
+	close(ring->fd);
+	ring->fd = -1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Unmap the queues and close an io_uring instance.  Any outstanding requests are cancelled.
+ * @param ring the io_uring instance
+ */
+void IoUring_terminate(IoUring* ring)
+{
+	FUNC_ENTRY;
+	if (ring->fd >= 0)
+	{
+		munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		ring->fd = -1;
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Get the next free submission queue entry, submitting the queue if it is full.
+ * @param ring the io_uring instance
+ * @return the cleared entry, or NULL if the submission queue could not be emptied
+ */
+struct io_uring_sqe* IoUring_getSqe(IoUring* ring)
+{
+	struct io_uring_sqe* sqe = NULL;
+
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+		IoUring_submit(ring, 0, 0);
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->sq_entries)
+	{
+		sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+		memset(sqe, '\0', sizeof(struct io_uring_sqe));
+		++ring->sq_local_tail;
+	}
+	return sqe;
+}
+
+
+/**
+ * Find out how many submission queue entries are waiting to be submitted.
+ * @param ring the io_uring instance
+ * @return the number of entries
+ */
+int IoUring_pending(IoUring* ring)
+{
+	return ring->sq_local_tail - *ring->sq_tail;
+}
+
+
+/**
+ * Submit any queued entries, and optionally wait for a completion.  No system call is made if
+ * there is nothing to submit and no wait is needed.
+ * @param ring the io_uring instance
+ * @param wait boolean - wait for at least one completion?
+ * @param timeout the longest wait in milliseconds, or -1 to wait indefinitely
+ * @return the number of entries submitted, or -1 with errno set.  Timeouts and interruptions are not errors.
+ */
+int IoUring_submit(IoUring* ring, int wait, int timeout)
+{
+	unsigned submit = IoUring_pending(ring);
+	unsigned flags = 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	void* argp = NULL;
+	size_t argsz = 0;
+	int rc = 0;
+
+	if (submit == 0 && !wait)
+		goto exit;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	if (wait)
+	{
+		flags = IORING_ENTER_GETEVENTS;
+		if (timeout >= 0)
+		{
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			memset(&arg, '\0', sizeof(arg));
+			arg.ts = (unsigned long)&ts;
+			argp = &arg;
+			argsz = sizeof(arg);
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+	if ((rc = io_uring_enter(ring->fd, submit, wait ? 1 : 0, flags, argp, argsz)) < 0 &&
+			(errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN))
+		rc = 0;
+exit:
+	return rc;
+}
+
+
+/**
+ * Get the next completion, without waiting.
+ * @param ring the io_uring instance
+ * @return the completion queue entry, or NULL if there is none.  Call IoUring_seen when it has been used.
+ */
+struct io_uring_cqe* IoUring_peek(IoUring* ring)
+{
+	unsigned head = *ring->cq_head;
+	struct io_uring_cqe* cqe = NULL;
+
+	if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		cqe = &ring->cqes[head & ring->cq_mask];
+	return cqe;
+}
+
+
+/**
+ * Release the completion returned by IoUring_peek.
+ * @param ring the io_uring instance
+ */
+void IoUring_seen(IoUring* ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Create and register a provided buffer ring.
+ * @param ring the io_uring instance
+ * @param bufs the structure to initialize
+ * @param bgid the buffer group id
+ * @param count the number of buffers, which must be a power of 2
+ * @param size the size of each buffer
+ * @return 0 on success, otherwise the errno value
+ */
+int IoUring_addBuffers(IoUring* ring, IoUringBuffers* bufs, int bgid, int count, int size)
+{
+	struct io_uring_buf_reg reg;
+	size_t ring_size = count * sizeof(struct io_uring_buf);
+	long page = sysconf(_SC_PAGESIZE);
+	int i, rc = 0;
+
+	FUNC_ENTRY;
+	ring_size = (ring_size + page - 1) & ~(page - 1);
+	memset(bufs, '\0', sizeof(IoUringBuffers));
+	bufs->length = ring_size + (size_t)count * size;
+	if ((bufs->ring = mmap(NULL, bufs->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		rc = errno;
+		bufs->ring = NULL;
+		goto exit;
+	}
+	bufs->buffers = (char*)bufs->ring + ring_size;
+	bufs->count = count;
+	bufs->size = size;
+	bufs->bgid = bgid;
+
+	memset(&reg, '\0', sizeof(reg));
+	reg.ring_addr = (unsigned long)bufs->ring;
+	reg.ring_entries = count;
+	reg.bgid = bgid;
+	if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		rc = errno;
+		munmap(bufs->ring, bufs->length);
+		bufs->ring = NULL;
+		goto exit;
+	}
+	for (i = 0; i < count; ++i)
+		IoUring_returnBuffer(bufs, i);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Wait briefly for the next completion.
+ * @param ring the io_uring instance
+ * @return the completion queue entry, or NULL if none arrived
+ */
+static struct io_uring_cqe* IoUring_wait(IoUring* ring)
+{
+	struct io_uring_cqe* cqe = NULL;
+	int tries = 0;
+
+	while ((cqe = IoUring_peek(ring)) == NULL && tries++ < 10)
+	{
+		if (IoUring_submit(ring, 1, 100) < 0)
+			break;
+	}
+	return cqe;
+}
+
+
+/**
+ * Check that multishot receives into a provided buffer ring work.  Kernels before 6.0 accept
+ * the buffer ring but not IORING_RECV_MULTISHOT, so every receive on a client socket would fail.
+ * One byte is received over a socket pair, and the completion must say that the request stays
+ * armed.  Closing the other end then ends the request.
+ * @param ring the io_uring instance, with no requests outstanding
+ * @param bufs the registered buffer ring
+ * @return 0 if multishot receives work, otherwise an errno value
+ */
+int IoUring_probeRecv(IoUring* ring, IoUringBuffers* bufs)
+{
+	struct io_uring_sqe* sqe = NULL;
+	struct io_uring_cqe* cqe = NULL;
+	int sv[2] = {-1, -1};
+	int more = 0, rc = 0;
+
+	FUNC_ENTRY;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 || write(sv[1], "", 1) != 1)
+	{
+		rc = errno;
+		goto exit;
+	}
+	if ((sqe = IoUring_getSqe(ring)) == NULL)
+	{
+		rc = EBUSY;
+		goto exit;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bufs->bgid;
+	if ((cqe = IoUring_wait(ring)) == NULL)
+	{
+		rc = ETIME;
+		goto exit;
+	}
+	more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	if (cqe->res < 0)
+		rc = -cqe->res;
+	else if (cqe->res != 1 || !more)
+		rc = EOPNOTSUPP;
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		IoUring_returnBuffer(bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	IoUring_seen(ring);
+
+	close(sv[1]); /* the receive completes with end of file, and is no longer armed */
+	sv[1] = -1;
+	while (more && (cqe = IoUring_wait(ring)) != NULL)
+	{
+		more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			IoUring_returnBuffer(bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		IoUring_seen(ring);
+	}
+	if (more && rc == 0)
+		rc = ETIME;
+exit:
+	if (sv[0] != -1)
+		close(sv[0]);
+	if (sv[1] != -1)
+		close(sv[1]);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Unregister and free a provided buffer ring.
+ * @param ring the io_uring instance
+ * @param bufs the buffer ring
+ */
+void IoUring_removeBuffers(IoUring* ring, IoUringBuffers* bufs)
+{
+	struct io_uring_buf_reg reg;
+
+	FUNC_ENTRY;
+	if (bufs->ring)
+	{
+		memset(&reg, '\0', sizeof(reg));
+		reg.bgid = bufs->bgid;
+		if (ring->fd >= 0)
+			io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		munmap(bufs->ring, bufs->length);
+		bufs->ring = NULL;
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Get the address of a provided buffer.
+ * @param bufs the buffer ring
+ * @param bid the buffer id, from the completion flags
+ * @return the buffer
+ */
+char* IoUring_buffer(IoUringBuffers* bufs, int bid)
+{
+	return bufs->buffers + (size_t)bid * bufs->size;
+}
+
+
+/**
+ * Give a buffer back to the kernel once its contents have been used.
+ * @param bufs the buffer ring
+ * @param bid the buffer id
+ */
+void IoUring_returnBuffer(IoUringBuffers* bufs, int bid)
+{
+	unsigned short tail = bufs->ring->tail;
+	struct io_uring_buf* buf = &bufs->ring->bufs[tail & (bufs->count - 1)];
+
+	buf->addr = (unsigned long)IoUring_buffer(bufs, bid);
+	buf->len = bufs->size;
+	buf->bid = bid;
+	__atomic_store_n(&bufs->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif
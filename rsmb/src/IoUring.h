@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+#if !defined(IOURING_H)
+#define IOURING_H
+
+#if defined(USE_IO_URING)
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*BE
+def IOURING
+{
+	n32 dec "fd"
+	n32 ptr VOID "sq_head"
+	n32 ptr VOID "sq_tail"
+	n32 hex "sq_mask"
+	n32 dec "sq_entries"
+	n32 dec "sq_local_tail"
+	n32 ptr VOID "sqes"
+	n32 ptr VOID "cq_head"
+	n32 ptr VOID "cq_tail"
+	n32 hex "cq_mask"
+	n32 ptr VOID "cqes"
+	n32 ptr VOID "sq_ring"
+	n32 dec "sq_ring_size"
+	n32 ptr VOID "cq_ring"
+	n32 dec "cq_ring_size"
+}
+
+def IOURINGBUFFERS
+{
+	n32 ptr VOID "ring"
+	n32 ptr DATA "buffers"
+	n32 dec "count"
+	n32 dec "size"
+	n32 dec "bgid"
+	n32 dec "length"
+}
+BE*/
+
+/**
+ * An io_uring instance, driven with the raw system calls so that no extra library is needed
+ */
+typedef struct
+{
+	int fd;							/**< descriptor returned by io_uring_setup */
+	unsigned* sq_head;				/**< submission queue head, advanced by the kernel */
+	unsigned* sq_tail;				/**< submission queue tail, advanced by us */
+	unsigned sq_mask;				/**< submission queue index mask */
+	unsigned sq_entries;			/**< number of submission queue entries */
+	unsigned sq_local_tail;			/**< tail including entries not yet published to the kernel */
+	struct io_uring_sqe* sqes;		/**< submission queue entries */
+	unsigned* cq_head;				/**< completion queue head, advanced by us */
+	unsigned* cq_tail;				/**< completion queue tail, advanced by the kernel */
+	unsigned cq_mask;				/**< completion queue index mask */
+	struct io_uring_cqe* cqes;		/**< completion queue entries */
+	void* sq_ring;					/**< mapping of the submission ring */
+	size_t sq_ring_size;			/**< length of the submission ring mapping */
+	void* cq_ring;					/**< mapping of the completion ring, which may be the submission ring */
+	size_t cq_ring_size;			/**< length of the completion ring mapping */
+} IoUring;
+
+/**
+ * A provided buffer ring, from which the kernel picks a buffer for each completed receive
+ */
+typedef struct
+{
+	struct io_uring_buf_ring* ring;	/**< the ring shared with the kernel */
+	char* buffers;					/**< the buffers, size bytes each */
+	int count;						/**< number of buffers - a power of 2 */
+	int size;						/**< size of each buffer */
+	int bgid;						/**< buffer group id, used in IOSQE_BUFFER_SELECT requests */
+	size_t length;					/**< length of the mapping holding the ring and buffers */
+} IoUringBuffers;
+
+int IoUring_initialize(IoUring* ring, unsigned entries);
+void IoUring_terminate(IoUring* ring);
+
+struct io_uring_sqe* IoUring_getSqe(IoUring* ring);
+int IoUring_pending(IoUring* ring);
+int IoUring_submit(IoUring* ring, int wait, int timeout);
+struct io_uring_cqe* IoUring_peek(IoUring* ring);
+void IoUring_seen(IoUring* ring);
+
+int IoUring_addBuffers(IoUring* ring, IoUringBuffers* bufs, int bgid, int count, int size);
+void IoUring_removeBuffers(IoUring* ring, IoUringBuffers* bufs);
+int IoUring_probeRecv(IoUring* ring, IoUringBuffers* bufs);
+char* IoUring_buffer(IoUringBuffers* bufs, int bid);
+void IoUring_returnBuffer(IoUringBuffers* bufs, int bid);
+
+#endif
+
+#endif
@@ -0,0 +1,325 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Latency histograms for the stages of the publish pipeline and the event loop.
+ *
+ * Each stage has a histogram of its durations in nanoseconds, from a monotonic clock.  The
+ * buckets are logarithmic, each power of two split into LATENCY_SUB_BUCKETS, so that any value
+ * is known to within an eighth whatever its size, and recording one is a few shifts and an
+ * increment.  The same histograms hold the event loop figures which are counts rather than
+ * times.  The histograms are published to $SYS by MQTTProtocol_update, then emptied, so the
+ * percentiles are for the last update interval.  Each is added to a running total before it
+ * is emptied, for the metrics endpoint, which needs distributions since the broker started.
+ */
+
+#include "Latency.h"
+#include "Log.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "Heap.h"
+
+#define LATENCY_SUB_BUCKETS 8		/**< buckets for each power of two */
+#define LATENCY_LIMIT_BITS 40		/**< durations are recorded up to 2^40 nanoseconds, 18 minutes */
+#define LATENCY_BUCKETS ((LATENCY_LIMIT_BITS - 2) * LATENCY_SUB_BUCKETS)
+
+/**
+ * The durations recorded for one stage
+ */
+typedef struct
+{
+	unsigned int counts[LATENCY_BUCKETS];
+	unsigned int count;
+	unsigned long long sum;
+	unsigned long long max;
+} Histogram;
+
+static Histogram histograms[LATENCY_STAGES];
+
+/**
+ * The values recorded for one stage in all the intervals before the current one
+ */
+typedef struct
+{
+	unsigned long long counts[LATENCY_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+} Totals;
+
+static Totals totals[LATENCY_STAGES];
+
+/**
+ * The $SYS topic under $SYS/broker for each stage, and the units of its values, and its metric
+ * name and the values recorded in one of the metric's base units
+ */
+static struct
+{
+	char* topic;
+	char* units;
+	double scale;	/**< the number of values recorded in one of the units */
+	char* metric;
+	double base;	/**< the number of values recorded in one of the metric's units */
+} stages[LATENCY_STAGES] =
+{
+	{ "latency/read", "microseconds", 1000.0, "latency_read_seconds", 1e9 },
+	{ "latency/acl", "microseconds", 1000.0, "latency_acl_seconds", 1e9 },
+	{ "latency/match", "microseconds", 1000.0, "latency_match_seconds", 1e9 },
+	{ "latency/publish", "microseconds", 1000.0, "latency_publish_seconds", 1e9 },
+	{ "latency/write", "microseconds", 1000.0, "latency_write_seconds", 1e9 },
+	{ "latency/ack", "microseconds", 1000.0, "latency_ack_seconds", 1e9 },
+	{ "event loop/iteration", "microseconds", 1000.0, "event_loop_iteration_seconds", 1e9 },
+	{ "event loop/housekeeping", "microseconds", 1000.0, "event_loop_housekeeping_seconds", 1e9 },
+	{ "event loop/save", "microseconds", 1000.0, "event_loop_save_seconds", 1e9 },
+	{ "event loop/retained delivery", "microseconds", 1000.0, "event_loop_retained_delivery_seconds", 1e9 },
+	{ "event loop/ready wait", "microseconds", 1000.0, "event_loop_ready_wait_seconds", 1e9 },
+	{ "event loop/ready sockets", "sockets", 1.0, "event_loop_ready_sockets", 1.0 },
+};
+
+
+/**
+ * The time now from a monotonic clock.
+ * @return nanoseconds from an arbitrary start
+ */
+unsigned long long Latency_now()
+{
+#if defined(WIN32)
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER now;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)((double)now.QuadPart * 1e9 / frequency.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * The bucket for a duration.
+ * @param ns the duration in nanoseconds
+ * @return the bucket index
+ */
+static int Latency_bucket(unsigned long long ns)
+{
+	int shift = 0;
+
+	if (ns >= (1ULL << LATENCY_LIMIT_BITS))
+		ns = (1ULL << LATENCY_LIMIT_BITS) - 1;
+	while ((ns >> shift) >= 2 * LATENCY_SUB_BUCKETS)
+		++shift;
+	return shift * LATENCY_SUB_BUCKETS + (int)(ns >> shift);
+}
+
+
+/**
+ * The middle of the range of durations of a bucket.
+ * @param bucket the bucket index
+ * @return the duration in nanoseconds
+ */
+static double Latency_bucketValue(int bucket)
+{
+	int shift = (bucket < 2 * LATENCY_SUB_BUCKETS) ? 0 : bucket / LATENCY_SUB_BUCKETS - 1;
+	unsigned long long low = (unsigned long long)(bucket - shift * LATENCY_SUB_BUCKETS) << shift;
+
+	return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+
+/**
+ * Record a value for a stage.
+ * @param stage the stage, one of the LATENCY_ values
+ * @param value the duration in nanoseconds, or the count
+ */
+void Latency_record(int stage, unsigned long long value)
+{
+	Histogram* h = &histograms[stage];
+
+	++(h->counts[Latency_bucket(value)]);
+	++(h->count);
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+
+/**
+ * Record the duration of a stage.
+ * @param stage the stage, one of the LATENCY_ values
+ * @param start the time the stage started, from Latency_now
+ * @return the time now, for the start of the next stage
+ */
+unsigned long long Latency_since(int stage, unsigned long long start)
+{
+	unsigned long long now = Latency_now();
+
+	Latency_record(stage, (now > start) ? now - start : 0);
+	return now;
+}
+
+
+/**
+ * The topic of a stage under $SYS/broker.
+ * @param stage the stage
+ * @return the topic
+ */
+char* Latency_stageTopic(int stage)
+{
+	return stages[stage].topic;
+}
+
+
+/**
+ * The units of the percentiles and maximum of a stage.
+ * @param stage the stage
+ * @return the units
+ */
+char* Latency_stageUnits(int stage)
+{
+	return stages[stage].units;
+}
+
+
+/**
+ * The name of the metric for a stage, without the broker's prefix.
+ * @param stage the stage
+ * @return the metric name
+ */
+char* Latency_stageMetric(int stage)
+{
+	return stages[stage].metric;
+}
+
+
+/**
+ * The number of durations recorded for a stage since the last reset.
+ * @param stage the stage
+ * @return the count
+ */
+unsigned int Latency_count(int stage)
+{
+	return histograms[stage].count;
+}
+
+
+/**
+ * A percentile of the durations of a stage since the last reset.
+ * @param stage the stage
+ * @param percent the percentile wanted, 50 for the median
+ * @return the value in the units of the stage, or 0 if none has been recorded
+ */
+double Latency_percentile(int stage, double percent)
+{
+	Histogram* h = &histograms[stage];
+	unsigned int wanted = (unsigned int)(h->count * percent / 100.0 + 0.5), total = 0;
+	double rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (h->count == 0)
+		goto exit;
+	if (wanted < 1)
+		wanted = 1;
+	for (i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		if ((total += h->counts[i]) >= wanted)
+			break;
+	}
+	rc = Latency_bucketValue(i);
+	if (rc > h->max)
+		rc = (double)h->max;
+	rc /= stages[stage].scale;
+exit:
+	FUNC_EXIT;
+	return rc;
+}
+
+
+/**
+ * The largest value recorded for a stage since the last reset.
+ * @param stage the stage
+ * @return the value in the units of the stage
+ */
+double Latency_max(int stage)
+{
+	return histograms[stage].max / stages[stage].scale;
+}
+
+
+/**
+ * Empty all the histograms, to start a new interval.
+ */
+void Latency_reset()
+{
+	int stage, i;
+
+	FUNC_ENTRY;
+	for (stage = 0; stage < LATENCY_STAGES; ++stage)
+	{
+		if (histograms[stage].count == 0)
+			continue;
+		for (i = 0; i < LATENCY_BUCKETS; ++i)
+			totals[stage].counts[i] += histograms[stage].counts[i];
+		totals[stage].count += histograms[stage].count;
+		totals[stage].sum += histograms[stage].sum;
+	}
+	memset(histograms, '\0', sizeof(histograms));
+	FUNC_EXIT;
+}
+
+
+/**
+ * The distribution of all the values recorded for a stage since the broker started.  The bounds
+ * are bucket boundaries, so the counts below them are exact: every second power of two from about
+ * a microsecond for times, and every power of two from one for counts.
+ * @param stage the stage
+ * @param t the structure to fill in
+ */
+void Latency_totals(int stage, LatencyTotals* t)
+{
+	Histogram* h = &histograms[stage];
+	Totals* tot = &totals[stage];
+	int bits = (stages[stage].base > 1.0) ? 10 : 1,
+		step = (stages[stage].base > 1.0) ? 2 : 1;
+	int i, bucket = 0, limit;
+	unsigned long long below = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < LATENCY_BOUNDS; ++i, bits += step)
+	{
+		/* the values below 2^bits are exactly those in the buckets before its own */
+		for (limit = Latency_bucket(1ULL << bits); bucket < limit; ++bucket)
+			below += tot->counts[bucket] + h->counts[bucket];
+		t->bound[i] = ((1ULL << bits) - 1) / stages[stage].base;
+		t->below[i] = below;
+	}
+	t->count = tot->count + h->count;
+	t->sum = (tot->sum + h->sum) / stages[stage].base;
+	FUNC_EXIT;
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+#if !defined(LATENCY_H)
+#define LATENCY_H
+
+/**
+ * The stages of the publish pipeline and of the event loop which are timed, and the event
+ * loop figures which are not times
+ */
+enum
+{
+	LATENCY_READ,		/**< reading and parsing an inbound packet */
+	LATENCY_ACL,		/**< checking that a client may publish on a topic */
+	LATENCY_MATCH,		/**< finding the subscribers to a topic */
+	LATENCY_PUBLISH,	/**< starting or queueing a publication for all its subscribers */
+	LATENCY_WRITE,		/**< writing a packet to a socket, until the last byte is written */
+	LATENCY_ACK,		/**< from sending a QoS 1 or 2 publication to its PUBACK or PUBCOMP */
+	LATENCY_ITERATION,	/**< one pass of Protocol_timeslice, less the wait for sockets */
+	LATENCY_HOUSEKEEPING,	/**< keepalive, retry and statistics processing */
+	LATENCY_SAVE,		/**< saving retained messages and subscriptions in the broker process */
+	LATENCY_RETAINED,	/**< sending the retained messages for a new subscription */
+	LATENCY_READY_WAIT,	/**< from the wait for sockets returning to a ready socket being serviced */
+	LATENCY_READY_SOCKETS,	/**< the number of sockets found ready by each wait: not a time */
+	LATENCY_STAGES
+};
+
+#define LATENCY_BOUNDS 14	/**< the number of bounds of the distributions since the broker started */
+
+/**
+ * The distribution of all the values recorded for a stage since the broker started, in the base
+ * units of its metric, seconds or a count
+ */
+typedef struct
+{
+	double bound[LATENCY_BOUNDS];				/**< increasing upper bounds */
+	unsigned long long below[LATENCY_BOUNDS];	/**< the number of values not above each bound */
+	unsigned long long count;					/**< the number of values */
+	double sum;									/**< the sum of the values */
+} LatencyTotals;
+
+unsigned long long Latency_now(void);
+unsigned long long Latency_since(int stage, unsigned long long start);
+void Latency_record(int stage, unsigned long long value);
+char* Latency_stageTopic(int stage);
+char* Latency_stageUnits(int stage);
+char* Latency_stageMetric(int stage);
+unsigned int Latency_count(int stage);
+double Latency_percentile(int stage, double percent);
+double Latency_max(int stage);
+void Latency_reset(void);
+void Latency_totals(int stage, LatencyTotals* t);
+
+#endif
@@ -161,37 +161,44 @@ ListElement* ListFindItem(List* aList, void* content, int(*callback)(void*, void
  */
 int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int freeContent)
 {
-	ListElement* next = NULL;
 	ListElement* saved = aList->current;
-	int saveddeleted = 0;
+	ListElement* found = NULL;
 
-	if (!ListFindItem(aList, content, callback))
+	if ((found = ListFindItem(aList, content, callback)) == NULL)
 		return 0; /* false, did not remove item */
 
-	if (aList->current->prev == NULL)
+	aList->current = saved;
+	ListUnlinkElement(aList, found, freeContent);
+	return 1; /* successfully removed item */
+}
+
+
+/**
+ * Removes and optionally frees a known element of a list, without searching for it.
+ * @param aList the list which contains the element
+ * @param elem the list element to remove
+ * @param freeContent boolean value to indicate whether the content is to be freed
+ */
+void ListUnlinkElement(List* aList, ListElement* elem, int freeContent)
+{
+	if (elem->prev == NULL)
 		/* so this is the first element, and we have to update the "first" pointer */
-		aList->first = aList->current->next;
+		aList->first = elem->next;
 	else
-		aList->current->prev->next = aList->current->next;
+		elem->prev->next = elem->next;
 
-	if (aList->current->next == NULL)
-		aList->last = aList->current->prev;
+	if (elem->next == NULL)
+		aList->last = elem->prev;
 	else
-		aList->current->next->prev = aList->current->prev;
+		elem->next->prev = elem->prev;
 
-	next = aList->current->next;
+	if (aList->current == elem)
+		aList->current = elem->next;
 	if (freeContent)
-		free(aList->current->content);
-	if (saved == aList->current)
-		saveddeleted = 1;
-	aList->size -= aList->current->size;
-	free(aList->current);
-	if (saveddeleted)
-		aList->current = next;
-	else
-		aList->current = saved;
+		free(elem->content);
+	aList->size -= elem->size;
+	free(elem);
 	--(aList->count);
-	return 1; /* successfully removed item */
 }
 
 
@@ -87,6 +87,7 @@ void* ListPopTail(List* aList);
 
 int ListDetach(List* aList, void* content);
 int ListDetachItem(List* aList, void* content, int(*callback)(void*, void*));
+void ListUnlinkElement(List* aList, ListElement* elem, int freeContent);
 
 void ListFree(List* aList);
 void ListEmpty(List* aList);
@@ -68,6 +68,28 @@ static int Log_recurse_flag = 0;		/**< To prevent infinite recursion */
 
 static List* log_buffer = NULL;			/**< log buffer - list of log entries */
 
+/**
+ * Number of formatted log messages which can be waiting to be written out
+ */
+#if !defined(MAX_LOG_QUEUE_ENTRIES)
+#define MAX_LOG_QUEUE_ENTRIES 100
+#endif
+
+typedef struct
+{
+	int level;
+	int msgno;
+	int repeats;		/**< number of identical message ids coalesced into this entry */
+	char msg[256];
+} logQueueEntry;
+
+static logQueueEntry* log_queue = NULL;	/**< bounded queue of log messages waiting to be written */
+static int log_queue_start = 0,
+			log_queue_count = 0;
+static int Log_flushing = 0;			/**< set while the log queue is being written out */
+static int log_dropped = 0;				/**< messages dropped since the last report */
+static Log_queueStats log_queue_stats = { 0, 0 };
+
 #define MAX_FUNCTION_NAME_LENGTH 100
 
 typedef struct
@@ -110,6 +132,8 @@ struct timeb ts, last_ts;
  */
 void Log_setPublish(int flag)
 {
+	if (!flag)
+		Log_flush();
 	Log_publishFlag = flag;
 }
 
@@ -124,6 +148,8 @@ int Log_initialize()
 
 	trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries);
 	trace_queue_size = trace_settings.max_trace_entries;
+	log_queue = malloc(sizeof(logQueueEntry) * MAX_LOG_QUEUE_ENTRIES);
+	log_queue_start = log_queue_count = 0;
 
 	if ((log_buffer = ListInitialize()) != NULL)
 		rc = 0;
@@ -136,6 +162,9 @@ int Log_initialize()
  */
 void Log_terminate()
 {
+	Log_flush();
+	free(log_queue);
+	log_queue = NULL;
 	ListFree(log_buffer);
 	log_buffer = NULL;
 	free(trace_queue);
@@ -159,6 +188,119 @@ void Log_Publish(char* topic, char* string)
 }
 
 
+/**
+ * Write one formatted log message to its destinations: stdout or syslog, and
+ * the $SYS log topic if publishing is on.
+ * @param log_level the log level of the message
+ * @param msgno the id of the message
+ * @param msg_buf the formatted message, including the sequence number prefix
+ */
+static void Log_output(int log_level, int msgno, char* msg_buf)
+{
+	char level_char = "     CDIAWESF"[log_level];
+
+#if !defined(WIN32)
+	if (trace_settings.isdaemon)
+	{
+		static char priorities[] = { 7, 7, 7, 7, 6, 6, 5, 5, 4, 3, 1, 0};
+		syslog(priorities[log_level], "%s", &msg_buf[22]);
+	}
+	else
+#endif
+		printf("%s\n", &msg_buf[7]);
+	if (Log_publishFlag)
+	{
+		#define MAX_LOG_TOPIC_NAME_LEN 25
+		static char topic_buf[MAX_LOG_TOPIC_NAME_LEN];
+		sprintf(topic_buf, "$SYS/broker/log/%c/%.4d", level_char, msgno);
+		Log_recurse_flag = 1;
+		Log_Publish(topic_buf, &msg_buf[7]);
+		Log_recurse_flag = 0;
+	}
+}
+
+
+/**
+ * Add a formatted log message to the queue of messages waiting to be written.
+ * A message with the same id as the last one queued is not added again but counted,
+ * and if the queue is full the message is dropped.
+ * @param log_level the log level of the message
+ * @param msgno the id of the message
+ * @param msg_buf the formatted message
+ */
+static void Log_enqueue(int log_level, int msgno, char* msg_buf)
+{
+	logQueueEntry* entry = NULL;
+
+	if (log_queue_count > 0 && msgno != 0)
+	{
+		entry = &log_queue[(log_queue_start + log_queue_count - 1) % MAX_LOG_QUEUE_ENTRIES];
+		if (entry->msgno == msgno && entry->level == log_level)
+		{
+			++(entry->repeats);
+			++(log_queue_stats.coalesced);
+			return;
+		}
+	}
+	if (log_queue_count == MAX_LOG_QUEUE_ENTRIES)
+	{
+		++log_dropped;
+		++(log_queue_stats.dropped);
+		return;
+	}
+	entry = &log_queue[(log_queue_start + log_queue_count++) % MAX_LOG_QUEUE_ENTRIES];
+	entry->level = log_level;
+	entry->msgno = msgno;
+	entry->repeats = 0;
+	strncpy(entry->msg, msg_buf, sizeof(entry->msg) - 1);
+	entry->msg[sizeof(entry->msg) - 1] = '\0';
+}
+
+
+/**
+ * Write out all the log messages waiting in the queue.  Called once per pass of the
+ * main loop, so that log output and log publications are not done in the middle of
+ * processing a packet.
+ */
+void Log_flush()
+{
+	if (Log_flushing || (log_queue_count == 0 && log_dropped == 0))
+		return;
+
+	Log_flushing = 1;
+	while (log_queue_count > 0)
+	{
+		logQueueEntry* entry = &log_queue[log_queue_start];
+
+		if (++log_queue_start == MAX_LOG_QUEUE_ENTRIES)
+			log_queue_start = 0;
+		--log_queue_count;
+		Log_output(entry->level, entry->msgno, entry->msg);
+		if (entry->repeats > 0)
+			Log(entry->level, 154, NULL, entry->msgno, entry->repeats);
+	}
+	if (log_dropped > 0)
+	{
+		int dropped = log_dropped;
+
+		log_dropped = 0;
+		Log(LOG_WARNING, 155, NULL, dropped);
+	}
+	fflush(stdout);
+	Log_flushing = 0;
+}
+
+
+/**
+ * Get the log queue statistics
+ * @return pointer to the log queue statistics structure
+ */
+Log_queueStats* Log_getQueueStats()
+{
+	return &log_queue_stats;
+}
+
+
 /**
  * Add a message to the trace buffer
  * @param msg the message to add
@@ -348,6 +490,11 @@ void Log(int log_level, int msgno, char* format, ...)
 		char level_char = ' ';
 		int buf_pos = 31;
 		va_list args;
+		/* errors are written straight away, as are all messages outside the main loop */
+		int deferred = log_queue && Log_publishFlag && !Log_flushing && log_level < LOG_ERROR;
+
+		if (!deferred)
+			Log_flush(); /* keep the output in order */
 
 #if defined(GETTIMEOFDAY)
 		gettimeofday(&ts, NULL);
@@ -396,28 +543,13 @@ void Log(int log_level, int msgno, char* format, ...)
 		}
 
 		addToBuffer(log_buffer, msg_buf);
-#if !defined(WIN32)
-		if (trace_settings.isdaemon)
-		{
-			static char priorities[] = { 7, 7, 7, 7, 6, 6, 5, 5, 4, 3, 1, 0};
-			syslog(priorities[log_level], "%s", &msg_buf[22]);
-		}
+		if (deferred)
+			Log_enqueue(log_level, msgno, msg_buf);
 		else
 		{
-#endif
-			printf("%s\n", &msg_buf[7]);
-			fflush(stdout);
-#if !defined(WIN32)
-		}
-#endif
-		if (Log_publishFlag)
-		{
-			#define MAX_LOG_TOPIC_NAME_LEN 25
-			static char topic_buf[MAX_LOG_TOPIC_NAME_LEN];
-			sprintf(topic_buf, "$SYS/broker/log/%c/%.4d", level_char, msgno);
-			Log_recurse_flag = 1;
-			Log_Publish(topic_buf, &msg_buf[7]);
-			Log_recurse_flag = 0;
+			Log_output(log_level, msgno, msg_buf);
+			if (!Log_flushing)
+				fflush(stdout);
 		}
 	}
 
@@ -87,6 +87,25 @@ int Log_initialize();
 void Log_terminate();
 
 void Log_setPublish(int flag);
+void Log_flush();
+
+/*BE
+def LOG_QUEUE_STATS
+{
+   n32 dec "dropped"
+   n32 dec "coalesced"
+}
+BE*/
+/**
+ * Counts of log messages not written individually because of the bounded log queue
+ */
+typedef struct
+{
+	int dropped;		/**< messages discarded because the log queue was full */
+	int coalesced;		/**< messages counted against an earlier one with the same id */
+} Log_queueStats;
+
+Log_queueStats* Log_getQueueStats();
 
 void Log(int, int, char *, ...);
 void Log_stackTrace(int, int, int, const char*, int, int*);
@@ -24,6 +24,7 @@
 #include "Log.h"
 #include "Clients.h"
 #include "Messages.h"
+#include "Capture.h"
 #include "StackTrace.h"
 
 #include <stdlib.h>
@@ -146,6 +147,13 @@ void* MQTTPacket_Factory(int socket, int* error)
 		*error = TCPSOCKET_INTERRUPTED;
 	else
 	{
+		if (Capture_active())
+		{
+			char buf[5];
+
+			buf[0] = header.byte;
+			Capture_packet(CAPTURE_MQTT, socket, buf, 1 + MQTTPacket_encode(&buf[1], remaining_length), data, remaining_length);
+		}
 		ptype = header.bits.type;
 		if (ptype < CONNECT || ptype > DISCONNECT || new_packets[ptype] == NULL)
 			Log(TRACE_MAX, 17, NULL, ptype);
@@ -28,6 +28,10 @@
 #include "Messages.h"
 #include "Protocol.h"
 #include "Users.h"
+#include "Persistence.h"
+#include "Capture.h"
+#include "Latency.h"
+#include "TopicStats.h"
 #include "StackTrace.h"
 
 
@@ -100,6 +104,16 @@ MQTTProtocol state;		/**< MQTT protocol state shared with the other MQTTProtocol
 BrokerStates* bstate;	/**< broker state shared with the other MQTTProtocol modules */
 static time_t last_keepalive;	/**< time of last keep alive processing */
 static int restarts = -1;	/**< number of MQTT protocol module restarts */
+static char* sys_filter = NULL;	/**< a new $SYS subscription, whose statistics are being refreshed */
+static int sys_wildcards = 0;	/**< does sys_filter have wildcards? */
+
+/**
+ * Message and byte rates per second over the last update interval
+ */
+static struct
+{
+	int sent, received, bytes_sent, bytes_received;
+} rates;
 
 /**
  *  This flag indicates when we are reading, or trying to read, a packet from its socket.
@@ -146,6 +160,7 @@ int MQTTProtocol_initialize(BrokerStates* aBrokerState)
 
 	bstate = aBrokerState;
 	memset(&state, '\0', sizeof(state));
+	MQTTProtocol_setDropPolicy(bstate->queue_drop_policy);
 	rc = MQTTProtocol_reinitialize();
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -230,108 +245,626 @@ void MQTTProtocol_sys_publish(char* topic, char* string)
 
 
 /**
- * Update the MQTT protocol statistics on the $SYS topics.
+ * Whether a shared subscription group has a filter in the $SYS topic space, and so its members
+ * are sent statistics.
+ * @param topic the statistic's topic to match the group's filter against, or NULL for any statistic
+ * @return boolean
  */
-void MQTTProtocol_update(time_t now)
+static int MQTTProtocol_sysShared(char* topic)
+{
+	Node* current = NULL;
+	int rc = 0;
+
+	while ((current = TreeNextElement(bstate->se->shared, current)) != NULL)
+	{
+		SharedSubscriptions* ss = (SharedSubscriptions*)(current->content);
+
+		if (ss->members->count > 0 && strncmp(ss->filter, sysprefix, strlen(sysprefix)) == 0 &&
+			(topic == NULL || Topics_matches(ss->filter, ss->wildcards, topic)))
+		{
+			rc = 1;
+			break;
+		}
+	}
+	return rc;
+}
+
+
+/**
+ * Whether a $SYS statistic should be published: only if a client is subscribed to it, directly
+ * or through a shared subscription group, or it is being refreshed for a new subscription.
+ * @param topic the statistic's topic
+ * @return boolean
+ */
+static int MQTTProtocol_sysWanted(char* topic)
+{
+	ListElement* current = NULL;
+	int rc = 0;
+
+	if (sys_filter && Topics_matches(sys_filter, sys_wildcards, topic))
+		rc = 1;
+	else while (ListNextElement(bstate->se->system.subs, &current))
+	{
+		Subscriptions* sub = (Subscriptions*)(current->content);
+
+		if ((rc = Topics_matches(sub->topicName, sub->wildcards, topic)) != 0)
+			break;
+	}
+	if (rc == 0)
+		rc = MQTTProtocol_sysShared(topic);
+	return rc;
+}
+
+
+/**
+ * Publish a $SYS statistic, if it is wanted.  The value is kept as a retained message, and only
+ * published when it changes.
+ * @param topic the statistic's topic
+ * @param string the value
+ */
+static void MQTTProtocol_sysStat(char* topic, char* string)
+{
+	if (MQTTProtocol_sysWanted(topic))
+		MQTTProtocol_sys_publish(topic, string);
+}
+
+
+/**
+ * Remove a $SYS statistic which no longer has a value, by publishing an empty retained message
+ * if one is held.
+ * @param topic the statistic's topic
+ */
+static void MQTTProtocol_sysClear(char* topic)
+{
+	List* rpl = SubscriptionEngines_getRetained(bstate->se, topic);
+
+	if (rpl->count > 0)
+		MQTTProtocol_sys_publish(topic, "");
+	ListFreeNoContent(rpl);
+}
+
+
+/**
+ * Publish the number of members of each shared subscription group, and the number of
+ * publications given to them, to the $SYS topics
+ */
+static void MQTTProtocol_sharedStats(void)
 {
 	static char buf[30];
-	static time_t last = 0;
-	static int last_received = 0;
-	static int last_sent = 0;
-	static long unsigned int last_bytes_received = 0;
-	static long unsigned int last_bytes_sent = 0;
+	Node* current = NULL;
+	char* topic = NULL;
+	int members = 0;
+	unsigned int delivered = 0;
+
+	FUNC_ENTRY;
+	current = TreeNextElement(bstate->se->shared, current);
+	while (current)
+	{
+		SharedSubscriptions* ss = (SharedSubscriptions*)(current->content);
+		char* group = ss->topicName + strlen(SHARED_SUBSCRIPTION_PREFIX);
+		int grouplen = ss->filter - group - 1;
+
+		/* the entries for one group are together in the tree, so totals are kept until the group changes */
+		members += ss->members->count;
+		delivered += ss->delivered;
+		current = TreeNextElement(bstate->se->shared, current);
+		if (current == NULL || strncmp(((SharedSubscriptions*)(current->content))->topicName, ss->topicName,
+				ss->filter - ss->topicName) != 0)
+		{
+			topic = malloc(strlen("$SYS/broker/shared subscriptions//delivered") + grouplen + 1);
+			sprintf(topic, "$SYS/broker/shared subscriptions/%.*s/members", grouplen, group);
+			sprintf(buf, "%d", members);
+			MQTTProtocol_sysStat(topic, buf);
+
+			sprintf(topic, "$SYS/broker/shared subscriptions/%.*s/delivered", grouplen, group);
+			sprintf(buf, "%u", delivered);
+			MQTTProtocol_sysStat(topic, buf);
+			free(topic);
+			members = 0;
+			delivered = 0;
+		}
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Publish the median, 99th percentile and maximum time taken by each stage of the publish
+ * pipeline and the event loop since the last update to the $SYS topics
+ */
+static void MQTTProtocol_latencyStats(void)
+{
+	static char buf[40];
+	char topic[80];
+	int stage;
+
+	FUNC_ENTRY;
+	for (stage = 0; stage < LATENCY_STAGES; ++stage)
+	{
+		sprintf(topic, "$SYS/broker/%s/p50", Latency_stageTopic(stage));
+		sprintf(buf, "%.1f %s", Latency_percentile(stage, 50), Latency_stageUnits(stage));
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/%s/p99", Latency_stageTopic(stage));
+		sprintf(buf, "%.1f %s", Latency_percentile(stage, 99), Latency_stageUnits(stage));
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/%s/max", Latency_stageTopic(stage));
+		sprintf(buf, "%.1f %s", Latency_max(stage), Latency_stageUnits(stage));
+		MQTTProtocol_sysStat(topic, buf);
+	}
+
+	sprintf(buf, "%u", Protocol_slowIterations());
+	MQTTProtocol_sysStat("$SYS/broker/event loop/slow iterations", buf);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Publish the traffic of the busiest topic subtrees to the $SYS topics, by rank.  Subtrees are
+ * only ever replaced in the table, so once a rank has been published it always has a subtree.
+ */
+static void MQTTProtocol_topicStats(void)
+{
+	static char buf[30];
+	char topic[80];
+	TopicStat** ranked = NULL;
+	int count = TopicStats_ranked(&ranked);
+	int rank;
+
+	FUNC_ENTRY;
+	for (rank = 0; rank < count && rank < bstate->topic_stats_top; ++rank)
+	{
+		TopicStat* ts = ranked[rank];
+
+		sprintf(topic, "$SYS/broker/topics/top/%d/subtree", rank + 1);
+		MQTTProtocol_sysStat(topic, ts->subtree);
+
+		sprintf(topic, "$SYS/broker/topics/top/%d/messages received", rank + 1);
+		sprintf(buf, "%u", ts->msgs_received);
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/topics/top/%d/messages sent", rank + 1);
+		sprintf(buf, "%u", ts->msgs_sent);
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/topics/top/%d/bytes received", rank + 1);
+		sprintf(buf, "%llu", ts->bytes_received);
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/topics/top/%d/bytes sent", rank + 1);
+		sprintf(buf, "%llu", ts->bytes_sent);
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/topics/top/%d/fan-out", rank + 1);
+		sprintf(buf, "%.1f", (ts->msgs_received > 0) ? (double)ts->msgs_sent / ts->msgs_received : 0.0);
+		MQTTProtocol_sysStat(topic, buf);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * The number of messages waiting to be sent to a client, queued or in flight.
+ * @param client the client
+ * @return the number of messages
+ */
+static int MQTTProtocol_backlog(Clients* client)
+{
+	return queuedMsgsCount(client) + client->outboundMsgs->count;
+}
+
+
+/**
+ * The average time a client has taken to acknowledge QoS 1 and 2 messages.
+ * @param client the client
+ * @return the time in milliseconds, or 0 if none has been acknowledged
+ */
+static double MQTTProtocol_ackTime(Clients* client)
+{
+	return (client->stats.acks > 0) ? client->stats.ack_time / 1e6 / client->stats.acks : 0.0;
+}
+
+
+/**
+ * Add a connected client to the ranking of slow consumers if it is one of the slowest so far,
+ * which are those with the most messages waiting to be sent to them, and then the longest
+ * average time to acknowledge them.  A client with no messages waiting is not slow.
+ * @param client the client
+ * @param slowest the slowest clients so far, slowest first
+ * @param count the number of clients in slowest
+ * @return the new number of clients in slowest
+ */
+static int MQTTProtocol_rankSlow(Clients* client, Clients** slowest, int count)
+{
+	int backlog = MQTTProtocol_backlog(client);
 	int i;
+
+#if defined(MQTTS)
+	if (client->protocol == PROTOCOL_MQTT)
+#endif
+		client->stats.write_blocked += Socket_writeBlocked(client->socket);
+	if (!client->connected || backlog == 0)
+		return count;
+	for (i = count; i > 0; --i)
+	{
+		Clients* other = slowest[i - 1];
+		int other_backlog = MQTTProtocol_backlog(other);
+
+		if (backlog < other_backlog || (backlog == other_backlog &&
+				MQTTProtocol_ackTime(client) <= MQTTProtocol_ackTime(other)))
+			break;
+		if (i < bstate->slow_clients_top)
+			slowest[i] = other;
+	}
+	if (i < bstate->slow_clients_top)
+	{
+		slowest[i] = client;
+		if (count < bstate->slow_clients_top)
+			++count;
+	}
+	return count;
+}
+
+
+/**
+ * Publish one statistic of a slow consumer, or clear it if the rank is not held.
+ * @param rank the rank of the client, from 0
+ * @param name the name of the statistic
+ * @param value the value, or NULL to clear it
+ */
+static void MQTTProtocol_slowStat(int rank, char* name, char* value)
+{
+	char topic[80];
+
+	sprintf(topic, "$SYS/broker/clients/slow/%d/%s", rank + 1, name);
+	if (value)
+		MQTTProtocol_sysStat(topic, value);
+	else
+		MQTTProtocol_sysClear(topic);
+}
+
+
+/**
+ * Publish the slowest consumers, with their traffic statistics, to the $SYS topics by rank.
+ * The ranks which no client holds any more are cleared.
+ */
+static void MQTTProtocol_slowClients(void)
+{
+	static char buf[40];
+	Clients** slowest = malloc(sizeof(Clients*) * bstate->slow_clients_top);
+	Node* current = NULL;
+	int count = 0, rank;
+
+	FUNC_ENTRY;
+	while ((current = TreeNextElement(bstate->clients, current)) != NULL)
+		count = MQTTProtocol_rankSlow((Clients*)(current->content), slowest, count);
+#if defined(MQTTS)
+	while ((current = TreeNextElement(bstate->mqtts_clients, current)) != NULL)
+		count = MQTTProtocol_rankSlow((Clients*)(current->content), slowest, count);
+#endif
+	for (rank = 0; rank < bstate->slow_clients_top; ++rank)
+	{
+		Clients* client = (rank < count) ? slowest[rank] : NULL;
+		char* value = (client) ? buf : NULL;
+
+		MQTTProtocol_slowStat(rank, "client id", (client) ? client->clientID : NULL);
+
+		if (client)
+			sprintf(buf, "%d", queuedMsgsCount(client));
+		MQTTProtocol_slowStat(rank, "queued", value);
+
+		if (client)
+			sprintf(buf, "%d", client->stats.queued_max);
+		MQTTProtocol_slowStat(rank, "queued maximum", value);
+
+		if (client)
+			sprintf(buf, "%llu", client->stats.queued_bytes);
+		MQTTProtocol_slowStat(rank, "queued bytes", value);
+
+		if (client)
+			sprintf(buf, "%d", client->outboundMsgs->count);
+		MQTTProtocol_slowStat(rank, "in flight", value);
+
+		if (client)
+			sprintf(buf, "%d", MQTTProtocol_inflightWindow(client));
+		MQTTProtocol_slowStat(rank, "in flight window", value);
+
+		if (client)
+			sprintf(buf, "%.1f milliseconds", MQTTProtocol_ackTime(client));
+		MQTTProtocol_slowStat(rank, "ack time", value);
+
+		if (client)
+			sprintf(buf, "%.1f seconds", client->stats.write_blocked / 1e9);
+		MQTTProtocol_slowStat(rank, "write blocked", value);
+
+		if (client)
+			sprintf(buf, "%d", client->discardedMsgs);
+		MQTTProtocol_slowStat(rank, "discarded", value);
+
+		if (client)
+			sprintf(buf, "%u", client->stats.msgs_sent);
+		MQTTProtocol_slowStat(rank, "messages sent", value);
+
+		if (client)
+			sprintf(buf, "%u", client->stats.msgs_received);
+		MQTTProtocol_slowStat(rank, "messages received", value);
+
+		if (client)
+			sprintf(buf, "%llu", client->stats.bytes_sent);
+		MQTTProtocol_slowStat(rank, "bytes sent", value);
+
+		if (client)
+			sprintf(buf, "%llu", client->stats.bytes_received);
+		MQTTProtocol_slowStat(rank, "bytes received", value);
+	}
+	free(slowest);
+	FUNC_EXIT;
+}
+
+
+#if !defined(SINGLE_LISTENER)
+/**
+ * Publish the accounting of each listener's clients' queues to the $SYS topics.
+ */
+static void MQTTProtocol_listenerStats(void)
+{
+	static char topic[60], buf[30];
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	while (ListNextElement(bstate->listeners, &current))
+	{
+		Listener* listener = (Listener*)(current->content);
+
+		if (listener->protocol == PROTOCOL_METRICS)
+			continue;
+		sprintf(topic, "$SYS/broker/listeners/%d/queued bytes", listener->port);
+		sprintf(buf, "%llu", listener->queued_bytes);
+		MQTTProtocol_sysStat(topic, buf);
+
+		sprintf(topic, "$SYS/broker/listeners/%d/dropped", listener->port);
+		sprintf(buf, "%u", listener->dropped);
+		MQTTProtocol_sysStat(topic, buf);
+	}
+	FUNC_EXIT;
+}
+#endif
+
+
+/**
+ * Publish the statistics on the $SYS topics which are wanted.
+ * @param now the time now
+ */
+static void MQTTProtocol_sysStats(time_t now)
+{
+	static char buf[30];
 	socket_stats* ss = Socket_getStats();
+	unsigned long long queued_bytes = 0;
+	unsigned int dropped = 0;
 
 	FUNC_ENTRY;
 	sprintf(buf, "%d", (ss->more_work_count * 100) / (ss->more_work_count + ss->not_more_work_count));
-	MQTTProtocol_sys_publish("$SYS/broker/internal/more_work%", buf);
+	MQTTProtocol_sysStat("$SYS/broker/internal/more_work%", buf);
 
 	sprintf(buf, "%d", (ss->not_more_work_count * 100) / (ss->more_work_count + ss->not_more_work_count));
-	MQTTProtocol_sys_publish("$SYS/broker/internal/not_more_work%", buf);
+	MQTTProtocol_sysStat("$SYS/broker/internal/not_more_work%", buf);
 
 	sprintf(buf, "%d", (ss->timeout_zero_count * 100) / (ss->timeout_zero_count + ss->timeout_non_zero_count));
-	MQTTProtocol_sys_publish("$SYS/broker/internal/timeout_zero%", buf);
+	MQTTProtocol_sysStat("$SYS/broker/internal/timeout_zero%", buf);
 
 	sprintf(buf, "%d", (ss->timeout_non_zero_count * 100) / (ss->timeout_zero_count + ss->timeout_non_zero_count));
-	MQTTProtocol_sys_publish("$SYS/broker/internal/timeout_non_zero%", buf);
+	MQTTProtocol_sysStat("$SYS/broker/internal/timeout_non_zero%", buf);
 
 	sprintf(buf, "%d", bstate->msgs_sent);
-	MQTTProtocol_sys_publish("$SYS/broker/messages/sent", buf);
-	i = bstate->msgs_sent - last_sent;
-	sprintf(buf, "%ld", i < 1 ? 0 : i /(now - last));
-	MQTTProtocol_sys_publish("$SYS/broker/messages/per second/sent", buf);
-	last_sent = bstate->msgs_sent;
+	MQTTProtocol_sysStat("$SYS/broker/messages/sent", buf);
+	sprintf(buf, "%d", rates.sent);
+	MQTTProtocol_sysStat("$SYS/broker/messages/per second/sent", buf);
 
 	sprintf(buf, "%d", bstate->msgs_received);
-	MQTTProtocol_sys_publish("$SYS/broker/messages/received", buf);
-	i = bstate->msgs_received - last_received;
-	sprintf(buf, "%ld", i < 1 ? 0 : i /(now - last));
-	MQTTProtocol_sys_publish("$SYS/broker/messages/per second/received", buf);
-	last_received = bstate->msgs_received;
+	MQTTProtocol_sysStat("$SYS/broker/messages/received", buf);
+	sprintf(buf, "%d", rates.received);
+	MQTTProtocol_sysStat("$SYS/broker/messages/per second/received", buf);
 
 	sprintf(buf, "%ld", bstate->bytes_sent);
-	MQTTProtocol_sys_publish("$SYS/broker/bytes/sent", buf);
-	i = bstate->bytes_sent - last_bytes_sent;
-	sprintf(buf, "%ld", i < 1 ? 0 : i /(now - last));
-	MQTTProtocol_sys_publish("$SYS/broker/bytes/per second/sent", buf);
-	last_bytes_sent = bstate->bytes_sent;
+	MQTTProtocol_sysStat("$SYS/broker/bytes/sent", buf);
+	sprintf(buf, "%d", rates.bytes_sent);
+	MQTTProtocol_sysStat("$SYS/broker/bytes/per second/sent", buf);
 
 	sprintf(buf, "%ld", bstate->bytes_received);
-	MQTTProtocol_sys_publish("$SYS/broker/bytes/received", buf);
-	i = bstate->bytes_received - last_bytes_received;
-	sprintf(buf, "%ld", i < 1 ? 0 : i /(now - last));
-	MQTTProtocol_sys_publish("$SYS/broker/bytes/per second/received", buf);
-	last_bytes_received = bstate->bytes_received;
+	MQTTProtocol_sysStat("$SYS/broker/bytes/received", buf);
+	sprintf(buf, "%d", rates.bytes_received);
+	MQTTProtocol_sysStat("$SYS/broker/bytes/per second/received", buf);
 
 	sprintf(buf, "%d bytes", Heap_get_info()->current_size);
-	MQTTProtocol_sys_publish("$SYS/broker/heap/current size", buf);
+	MQTTProtocol_sysStat("$SYS/broker/heap/current size", buf);
 	sprintf(buf, "%d bytes", Heap_get_info()->max_size);
-	MQTTProtocol_sys_publish("$SYS/broker/heap/maximum size", buf);
+	MQTTProtocol_sysStat("$SYS/broker/heap/maximum size", buf);
 	sprintf(buf, "%d seconds", (int)difftime(now, bstate->start_time));
-	MQTTProtocol_sys_publish("$SYS/broker/uptime", buf);
+	MQTTProtocol_sysStat("$SYS/broker/uptime", buf);
 	sprintf(buf, "%d", restarts);
-	MQTTProtocol_sys_publish("$SYS/broker/restart count", buf);
+	MQTTProtocol_sysStat("$SYS/broker/restart count", buf);
 
 	sprintf(buf, "%d", bstate->clients->count);
-	MQTTProtocol_sys_publish("$SYS/broker/client count/connected", buf);
+	MQTTProtocol_sysStat("$SYS/broker/client count/connected", buf);
 	
 	sprintf(buf, "%d", bstate->disconnected_clients->count);
-	MQTTProtocol_sys_publish("$SYS/broker/client count/disconnected", buf);
+	MQTTProtocol_sysStat("$SYS/broker/client count/disconnected", buf);
 	
 	sprintf(buf, "%d", bstate->se->subs->count);
-	MQTTProtocol_sys_publish("$SYS/broker/subscriptions/count", buf);
+	MQTTProtocol_sysStat("$SYS/broker/subscriptions/count", buf);
 	
 	sprintf(buf, "%d", bstate->se->wsubs->count);
-	MQTTProtocol_sys_publish("$SYS/broker/wildcard_subscriptions/count", buf);
+	MQTTProtocol_sysStat("$SYS/broker/wildcard_subscriptions/count", buf);
+
+	if (bstate->se->cache.size > 0)
+	{
+		sprintf(buf, "%d", bstate->se->cache.entries->count);
+		MQTTProtocol_sysStat("$SYS/broker/subscriptions/cache/entries", buf);
+
+		sprintf(buf, "%u", bstate->se->cache.hits);
+		MQTTProtocol_sysStat("$SYS/broker/subscriptions/cache/hits", buf);
 
-	sprintf(buf, "%d", bstate->se->retaineds->count);
-	MQTTProtocol_sys_publish("$SYS/broker/retained messages/count", buf);
+		sprintf(buf, "%u", bstate->se->cache.misses);
+		MQTTProtocol_sysStat("$SYS/broker/subscriptions/cache/misses", buf);
+
+		sprintf(buf, "%u", bstate->se->cache.evictions);
+		MQTTProtocol_sysStat("$SYS/broker/subscriptions/cache/evictions", buf);
+	}
+
+	sprintf(buf, "%d", bstate->se->shared->count);
+	MQTTProtocol_sysStat("$SYS/broker/shared subscriptions/count", buf);
+	MQTTProtocol_sharedStats();
+
+	sprintf(buf, "%d", Topics_internInfo()->count);
+	MQTTProtocol_sysStat("$SYS/broker/topics/interned/count", buf);
+
+	sprintf(buf, "%d", Topics_internInfo()->size);
+	MQTTProtocol_sysStat("$SYS/broker/topics/interned/bytes", buf);
+
+	sprintf(buf, "%u", Topics_internInfo()->hits);
+	MQTTProtocol_sysStat("$SYS/broker/topics/interned/hits", buf);
+
+	sprintf(buf, "%u", Topics_internInfo()->misses);
+	MQTTProtocol_sysStat("$SYS/broker/topics/interned/misses", buf);
+
+	if (bstate->password_file && bstate->acl_file)
+	{
+		sprintf(buf, "%u", Users_getCacheStats()->hits);
+		MQTTProtocol_sysStat("$SYS/broker/acl cache/hits", buf);
+
+		sprintf(buf, "%u", Users_getCacheStats()->misses);
+		MQTTProtocol_sysStat("$SYS/broker/acl cache/misses", buf);
+	}
+
+	sprintf(buf, "%d", SubscriptionEngines_retainedCount(bstate->se));
+	MQTTProtocol_sysStat("$SYS/broker/retained messages/count", buf);
 
 	sprintf(buf, "%d", bstate->max_queued_messages);
-	MQTTProtocol_sys_publish("$SYS/broker/settings/max_queued_messages", buf);
+	MQTTProtocol_sysStat("$SYS/broker/settings/max_queued_messages", buf);
 
 	sprintf(buf, "%d", bstate->max_inflight_messages);
-	MQTTProtocol_sys_publish("$SYS/broker/settings/max_inflight_messages", buf);
+	MQTTProtocol_sysStat("$SYS/broker/settings/max_inflight_messages", buf);
+
+	sprintf(buf, "%d", bstate->max_queued_bytes);
+	MQTTProtocol_sysStat("$SYS/broker/settings/max_queued_bytes", buf);
+
+	sprintf(buf, "%d", bstate->max_queued_bytes_total);
+	MQTTProtocol_sysStat("$SYS/broker/settings/max_queued_bytes_total", buf);
+
+	MQTTProtocol_queueTotals(&queued_bytes, &dropped);
+	sprintf(buf, "%llu", queued_bytes);
+	MQTTProtocol_sysStat("$SYS/broker/messages/queued bytes", buf);
+
+	sprintf(buf, "%u", dropped);
+	MQTTProtocol_sysStat("$SYS/broker/messages/dropped", buf);
 	
 	sprintf(buf, "%d", bstate->ffdc_count);
-	MQTTProtocol_sys_publish("$SYS/broker/ffdc/count", buf);
+	MQTTProtocol_sysStat("$SYS/broker/ffdc/count", buf);
+
+	sprintf(buf, "%d", Log_getQueueStats()->dropped);
+	MQTTProtocol_sysStat("$SYS/broker/log queue/dropped", buf);
+
+	sprintf(buf, "%d", Log_getQueueStats()->coalesced);
+	MQTTProtocol_sysStat("$SYS/broker/log queue/coalesced", buf);
+
+	MQTTProtocol_latencyStats();
+#if !defined(SINGLE_LISTENER)
+	MQTTProtocol_listenerStats();
+#endif
+	if (bstate->topic_stats_depth > 0)
+		MQTTProtocol_topicStats();
+	if (bstate->slow_clients_top > 0)
+		MQTTProtocol_slowClients();
+
+	if (bstate->persistence == 1)
+	{
+		sprintf(buf, "%d milliseconds", Persistence_getSnapshotStats()->duration);
+		MQTTProtocol_sysStat("$SYS/broker/last snapshot/duration", buf);
+
+		sprintf(buf, "%ld bytes", Persistence_getSnapshotStats()->size);
+		MQTTProtocol_sysStat("$SYS/broker/last snapshot/size", buf);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Bring the $SYS statistics matching a subscription up to date in the retained messages, before
+ * the subscription is made, so that they are current when they are sent to the subscriber.
+ * A shared subscription is refreshed for its topic filter.  Nothing is done for other subscriptions.
+ * @param filter the subscription topic
+ */
+void MQTTProtocol_sysRefresh(char* filter)
+{
+	char* shared = NULL;
+
+	FUNC_ENTRY;
+	if ((shared = Topics_sharedFilter(filter)) != NULL)
+		filter = shared;
+	if (strncmp(filter, sysprefix, strlen(sysprefix)) == 0)
+	{
+		sys_filter = filter;
+		sys_wildcards = Topics_hasWildcards(filter);
+		MQTTProtocol_sysStats(time(NULL));
+		sys_filter = NULL;
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Update the MQTT protocol statistics, and publish those which are subscribed to on the $SYS
+ * topics.
+ */
+void MQTTProtocol_update(time_t now)
+{
+	static time_t last = 0;
+	static unsigned int last_received = 0;
+	static unsigned int last_sent = 0;
+	static long unsigned int last_bytes_received = 0;
+	static long unsigned int last_bytes_sent = 0;
+
+	FUNC_ENTRY;
+	if (now > last)
+	{
+		rates.sent = (bstate->msgs_sent - last_sent) / (now - last);
+		rates.received = (bstate->msgs_received - last_received) / (now - last);
+		rates.bytes_sent = (bstate->bytes_sent - last_bytes_sent) / (now - last);
+		rates.bytes_received = (bstate->bytes_received - last_bytes_received) / (now - last);
+	}
+	last_sent = bstate->msgs_sent;
+	last_received = bstate->msgs_received;
+	last_bytes_sent = bstate->bytes_sent;
+	last_bytes_received = bstate->bytes_received;
+
+	/* no work for statistics nobody is subscribed to */
+	if (bstate->se->system.subs->count > 0 || (bstate->se->shared->count > 0 && MQTTProtocol_sysShared(NULL)))
+		MQTTProtocol_sysStats(now);
+	Latency_reset();
 
 	if (bstate->persistence == 1)
 	{
 		if (bstate->autosave_on_changes == 0 && bstate->autosave_interval > 0
-			&& bstate->se->retained_changes > 0 && (int)difftime(now, bstate->last_autosave) > bstate->autosave_interval)
+			&& bstate->se->retained_changes > 0 && (int)difftime(now, bstate->last_autosave) > bstate->autosave_interval
+			&& !Persistence_snapshot_running()) /* otherwise the interval is not restarted until one is taken */
 		{
 			Log(LOG_INFO,  101, NULL, bstate->autosave_interval);
-			SubscriptionEngines_save(bstate->se);
+			SubscriptionEngines_snapshot(bstate->se);
 			bstate->last_autosave = now;
 		}
+		else if (bstate->autosave_on_changes == 1 && bstate->persistence_journal == 1 && bstate->autosave_interval > 0
+			&& bstate->se->retained_changes >= bstate->autosave_interval && !Persistence_snapshot_running())
+		{
+			Log(LOG_INFO, 100, NULL, bstate->autosave_interval);
+			SubscriptionEngines_snapshot(bstate->se);
+		}
 		if (bstate->hup_signal)
 		{
 			if (bstate->se->retained_changes > 0)
 			{
 				Log(LOG_INFO, 104, NULL);
-				SubscriptionEngines_save(bstate->se);
+				SubscriptionEngines_snapshot(bstate->se);
 			}
 			else
 				Log(LOG_INFO, 105, NULL);
@@ -387,11 +920,15 @@ int MQTTProtocol_housekeeping(int more_work)
 	time(&(now));
 	if (difftime(now, last_keepalive) > 5)
 	{
+		unsigned long long start = Latency_now();
+
 		time(&(last_keepalive));
 		MQTTProtocol_keepalive(now);
 		more_work = MQTTProtocol_retry(now, 1);
 		MQTTProtocol_update(now);
 		Socket_cleanNew(now);
+		Capture_flush();
+		Latency_since(LATENCY_HOUSEKEEPING, start);
 	}
 	/*else
 		more_work = MQTTProtocol_retry(now, 0);*/
@@ -409,16 +946,22 @@ void MQTTProtocol_timeslice(int sock, Clients* client)
 {
 	int error;
 	MQTTPacket* pack;
+	unsigned long long start;
 
 	FUNC_ENTRY;
 
 	Log(TRACE_MIN, -1, "%d %s About to read packet for peer address %s",
 			sock, (client == NULL) ? "unknown" : client->clientID, Socket_getpeer(sock));
 	in_MQTTPacket_Factory = sock;
+	start = Latency_now();
 	pack = MQTTPacket_Factory(sock, &error);
 	in_MQTTPacket_Factory = -1;
+	if (pack)
+		Latency_since(LATENCY_READ, start);
 	if (pack == NULL)
 	{ /* there was an error on the socket, so clean it up */
+		if (error == SOCKET_ERROR && Capture_active())
+			Capture_closed(sock);
 		if (error == SOCKET_ERROR || error == BAD_MQTT_PACKET)
 		{
 			if (client != NULL)
@@ -493,21 +1036,40 @@ void MQTTProtocol_timeslice(int sock, Clients* client)
 void MQTTProtocol_clean_clients(Tree* clients)
 {
 	Node* current = NULL;
+	ListElement* elem = NULL;
+	List* sockets = ListInitialize();
 
 	FUNC_ENTRY;
-	current = TreeNextElement(clients, current);
-	while (current)
+	/* Removing a client from the tree can free the node of the client after it, and closing a
+	 * session can close others, so find the sockets of all the clients to close first, then
+	 * look each one up again as it is closed. */
+	while ((current = TreeNextElement(clients, current)) != NULL)
 	{
-		Clients* client =	(Clients*)(current->content);
-		current = TreeNextElement(clients, current);
+		Clients* client = (Clients*)(current->content);
 
 		if (client->good == 0)
 		{
-			Log(LOG_WARNING, 18, NULL, client->clientID, client->socket,
-					Socket_getpeer(client->socket));
-			MQTTProtocol_closeSession(client, 1);
+			int* sock = malloc(sizeof(int));
+
+			*sock = client->socket;
+			ListAppend(sockets, sock, sizeof(int));
 		}
 	}
+	while (ListNextElement(sockets, &elem))
+	{
+		if ((current = TreeFind(clients, elem->content)) != NULL)
+		{
+			Clients* client = (Clients*)(current->content);
+
+			if (client->good == 0)
+			{
+				Log(LOG_WARNING, 18, NULL, client->clientID, client->socket,
+						Socket_getpeer(client->socket));
+				MQTTProtocol_closeSession(client, 1);
+			}
+		}
+	}
+	ListFree(sockets);
 	FUNC_EXIT;
 }
 
@@ -755,6 +1317,7 @@ int MQTTProtocol_handleConnects(void* pack, int sock, Clients* client)
 			MQTTProtocol_emptyMessageList(client->inboundMsgs);
 			for (i = 0; i < PRIORITY_MAX; ++i)
 				MQTTProtocol_emptyMessageList(client->queuedMsgs[i]);
+			MQTTProtocol_dequeued(client, client->stats.queued_bytes);
 			client->msgID = client->outbound = client->ping_outstanding = 0;
 		}
 
@@ -769,6 +1332,12 @@ int MQTTProtocol_handleConnects(void* pack, int sock, Clients* client)
 	}
 
 	client->good = client->connected = 1;
+#if !defined(SINGLE_LISTENER)
+	MQTTProtocol_setWindow(client, listener ? listener->inflight_window_min : 0, listener ? listener->inflight_window_max : 0);
+	MQTTProtocol_setListener(client, listener);
+#else
+	MQTTProtocol_setWindow(client, 0, 0);
+#endif
 	client->cleansession = connect->flags.bits.cleanstart;
 	client->keepAliveInterval = connect->keepAliveTimer;
 	client->noLocal = (connect->version == PRIVATE_PROTOCOL_VERSION) ? 1 : 0;
@@ -818,7 +1387,7 @@ int MQTTProtocol_handleConnects(void* pack, int sock, Clients* client)
 			Messages* m = (Messages*)(outcurrent->content);
 			m->lastTouch = 0;
 		}
-		MQTTProtocol_retries(now, client);
+		MQTTProtocol_retries(now, client, 1);
 		MQTTProtocol_processQueued(client);
 	}
 	time(&(client->lastContact));
@@ -878,6 +1447,7 @@ void MQTTProtocol_processRetaineds(Clients* client, char* topic, int qos, int pr
 {
 	List* rpl = NULL;
 	ListElement* currp = NULL;
+	unsigned long long start = Latency_now();
 #if defined(QOS0_SEND_LIMIT)
 	int qos0count = 0;
 #endif
@@ -913,6 +1483,7 @@ void MQTTProtocol_processRetaineds(Clients* client, char* topic, int qos, int pr
 #endif
 	}
 	ListFreeNoContent(rpl);
+	Latency_since(LATENCY_RETAINED, start);
 	FUNC_EXIT;
 }
 
@@ -943,9 +1514,6 @@ int MQTTProtocol_handleSubscribes(void* pack, int sock, Clients* client)
 	authorized = malloc(sizeof(int)*(subscribe->noTopics));
 	for (i = 0; i < subscribe->noTopics; ++i)
 	{
-		int j;
-		ListElement *duptopic = NULL;
-
 		ListNextElement(subscribe->topics, &curtopic);
 		aq[i] = *(int*)(ListNextElement(subscribe->qoss, &curqos)->content);
 
@@ -956,8 +1524,12 @@ int MQTTProtocol_handleSubscribes(void* pack, int sock, Clients* client)
 		if (listener && listener->mount_point)
 		{
 			char* temp = malloc(strlen((char*)(curtopic->content)) + strlen(listener->mount_point) + 1);
-			strcpy(temp, listener->mount_point);
-			strcat(temp, (char*)(curtopic->content));
+			char* filter = Topics_sharedFilter((char*)(curtopic->content));
+			int prefixlen = (filter) ? filter - (char*)(curtopic->content) : 0; /* the mount point goes before the filter */
+
+			strncpy(temp, (char*)(curtopic->content), prefixlen);
+			strcpy(&temp[prefixlen], listener->mount_point);
+			strcat(temp, (char*)(curtopic->content) + prefixlen);
 			free((char*)(curtopic->content));
 			curtopic->content = temp;
 			subscribe->topics->size += strlen(listener->mount_point);
@@ -967,24 +1539,22 @@ int MQTTProtocol_handleSubscribes(void* pack, int sock, Clients* client)
 		if (!Topics_isValidName((char*)curtopic->content))
 		{
 			Log(LOG_WARNING, 153, NULL, (char*)curtopic->content, client->clientID, client->addr);
-			free(curtopic->content);
+			authorized[i] = false;
 			continue;
 		}
 
 		authorized[i] = true;
 		if (bstate->password_file && bstate->acl_file)
 		{
-			authorized[i] = Users_authorise(client->user,(char*)(curtopic->content),ACL_READ);
+			char* filter = Topics_sharedFilter((char*)(curtopic->content));
+
+			authorized[i] = Users_authoriseCached(&client->acl_cache, client->user,
+				(filter) ? filter : (char*)(curtopic->content), ACL_READ);
 			if (!authorized[i])
 				Log(LOG_AUDIT, 150, NULL, client->clientID, (char*)(curtopic->content));
 		}
 
-		for (j = 0; j < i; ++j)
-		{
-			char* prevtopic = (char*)(ListNextElement(subscribe->topics, &duptopic)->content);
-			if (strcmp(prevtopic, (char*)(curtopic->content)) == 0)
-				duptopic->content = curtopic->content;
-		}
+		MQTTProtocol_sysRefresh((char*)(curtopic->content));
 		isnew[i] = SubscriptionEngines_subscribe(bstate->se, client->clientID,
 			(char*)(curtopic->content), aq[i], client->noLocal, (client->cleansession == 0), PRIORITY_NORMAL);
 	}
@@ -1008,7 +1578,7 @@ int MQTTProtocol_handleSubscribes(void* pack, int sock, Clients* client)
 	free(isnew);
 	free(authorized);
 exit:
-	MQTTPacket_freeSubscribe(subscribe, 0);
+	MQTTPacket_freeSubscribe(subscribe, 1);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1042,8 +1612,12 @@ int MQTTProtocol_handleUnsubscribes(void* pack, int sock, Clients* client)
 		if (listener && listener->mount_point)
 		{
 			char* temp = malloc(strlen((char*)(curtopic->content)) + strlen(listener->mount_point) + 1);
-			strcpy(temp, listener->mount_point);
-			strcat(temp, (char*)(curtopic->content));
+			char* filter = Topics_sharedFilter((char*)(curtopic->content));
+			int prefixlen = (filter) ? filter - (char*)(curtopic->content) : 0; /* the mount point goes before the filter */
+
+			strncpy(temp, (char*)(curtopic->content), prefixlen);
+			strcpy(&temp[prefixlen], listener->mount_point);
+			strcat(temp, (char*)(curtopic->content) + prefixlen);
 			free((char*)(curtopic->content));
 			curtopic->content = temp;
 			unsubscribe->topics->size += strlen(listener->mount_point);
@@ -1114,7 +1688,10 @@ void MQTTProtocol_closeSession(Clients* client, int send_will)
 				Socket_close_only(client->socket);
 			else
 #endif
+			{
+				client->stats.write_blocked += Socket_writeBlocked(client->socket);
 				Socket_close(client->socket);
+			}
 #if defined(MQTTS)
 		}
 #endif
@@ -1132,7 +1709,7 @@ void MQTTProtocol_closeSession(Clients* client, int send_will)
 		publish.topic = client->will->topic;
 		publish.header.bits.qos = client->will->qos;
 		publish.header.bits.retain = client->will->retained;
-		Protocol_processPublication(&publish, client->clientID);
+		Protocol_processPublication(&publish, client, client->clientID);
 	}
 	if (client->cleansession)
 	{
@@ -1144,6 +1721,7 @@ void MQTTProtocol_closeSession(Clients* client, int send_will)
 			MQTTProtocol_emptyMessageList(client->outboundMsgs);
 			for (i = 0; i < PRIORITY_MAX; ++i)
 				MQTTProtocol_emptyMessageList(client->queuedMsgs[i]);
+			MQTTProtocol_dequeued(client, client->stats.queued_bytes);
 			client->msgID = 0;
 		}
 		else
@@ -1173,7 +1751,7 @@ void MQTTProtocol_closeSession(Clients* client, int send_will)
 	{
 		int i;
 		for (i = 0; i < PRIORITY_MAX; ++i)
-			MQTTProtocol_removeQoS0Messages(client->queuedMsgs[i]);
+			MQTTProtocol_dequeued(client, MQTTProtocol_removeQoS0Messages(client->queuedMsgs[i]));
 #if defined(MQTTS)
 		if (client->protocol == PROTOCOL_MQTTS && client->outbound == 0)
 		{
@@ -96,6 +96,7 @@ void MQTTProtocol_terminate();
 void MQTTProtocol_closeSession(Clients* client, int unclean);
 void MQTTProtocol_removeAllSubscriptions(char* clientID);
 void MQTTProtocol_sys_publish(char* topic, char* string);
+void MQTTProtocol_sysRefresh(char* filter);
 
 int MQTTProtocol_handleConnects(void* pack, int sock, Clients* client);
 int MQTTProtocol_handlePingreqs(void* pack, int sock, Clients* client);
@@ -27,7 +27,9 @@
 #endif
 #include "Protocol.h"
 #include "SocketBuffer.h"
+#include "Latency.h"
 #include "StackTrace.h"
+#include "Topics.h"
 #include "Heap.h"
 
 #if defined(MQTTS)
@@ -39,7 +41,12 @@ extern MQTTProtocol state;		/**< MQTT Protocol state shared with the MQTTProtoco
 extern BrokerStates* bstate; 	/**< broker state shared with the MQTTProtocol module */
 extern int in_MQTTPacket_Factory;	/**< flag shared with the MQTTProtocol module */
 
+static int drop_policy = DROP_NEWEST;	/**< what is dropped when a client's queue reaches a limit */
+static unsigned long long queued_bytes = 0;	/**< payload bytes queued and in flight to all clients */
+static unsigned int dropped = 0;	/**< messages dropped from all clients' queues */
+
 void MQTTProtocol_removePublication(Publications* p);
+static void MQTTProtocol_enqueued(Clients* client, int bytes);
 
 /**
  * List callback function for comparing Message structures by message id
@@ -73,6 +80,97 @@ int MQTTProtocol_assignMsgId(Clients* client)
 }
 
 
+/**
+ * Set the bounds of a client's in-flight window, when it connects.  The window starts at
+ * max_inflight_messages, brought within the bounds.  With no bounds it stays there.
+ * @param client the client
+ * @param min the smallest window, or 0 for 1 if max is set
+ * @param max the largest window, or 0 for max_inflight_messages if min is set
+ */
+void MQTTProtocol_setWindow(Clients* client, int min, int max)
+{
+	InflightWindow* w = &client->window;
+
+	FUNC_ENTRY;
+	memset(w, '\0', sizeof(InflightWindow));
+	if (min <= 0 && max <= 0)
+		goto exit;
+	w->min = (min > 0) ? min : 1;
+	w->max = (max > 0) ? max : bstate->max_inflight_messages;
+	if (w->max < w->min)
+		w->max = w->min;
+	w->size = bstate->max_inflight_messages;
+	if (w->size < w->min)
+		w->size = w->min;
+	else if (w->size > w->max)
+		w->size = w->max;
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * The number of QoS 1 and 2 messages which may be in flight to a client.
+ * @param client the client
+ * @return the size of the client's window
+ */
+int MQTTProtocol_inflightWindow(Clients* client)
+{
+	return (client->window.size > 0) ? client->window.size : bstate->max_inflight_messages;
+}
+
+
+/**
+ * Shrink a client's in-flight window, if it adapts, but not below its minimum.
+ * @param client the client
+ * @param size the new size
+ */
+static void MQTTProtocol_shrinkWindow(Clients* client, int size)
+{
+	InflightWindow* w = &client->window;
+
+	if (w->size == 0 || w->size == w->min)
+		return;
+	w->size = (size > w->min) ? size : w->min;
+	w->acks = 0;
+	Log(TRACE_MIN, -1, "In-flight window for client %s shrunk to %d", client->clientID, w->size);
+}
+
+
+/**
+ * Account for the acknowledgement of a QoS 1 or 2 message sent to a client, which completes its
+ * delivery.  An acknowledgement is prompt if it has taken no more than twice the smoothed
+ * acknowledgement time, and an adapting window grows by one for each window's worth of prompt
+ * acknowledgements, as TCP's congestion window does in congestion avoidance.
+ * @param client the client
+ * @param m the message acknowledged
+ */
+void MQTTProtocol_acknowledged(Clients* client, Messages* m)
+{
+	InflightWindow* w = &client->window;
+	unsigned long long rtt = Latency_since(LATENCY_ACK, m->sent) - m->sent;
+
+	FUNC_ENTRY;
+	client->stats.ack_time += rtt;
+	++(client->stats.acks);
+	++(bstate->msgs_sent);
+	bstate->bytes_sent += m->publish->payloadlen;
+	++(client->stats.msgs_sent);
+	client->stats.bytes_sent += m->publish->payloadlen;
+	MQTTProtocol_dequeued(client, m->publish->payloadlen);
+	if (w->size > 0)
+	{
+		if ((w->rtt == 0 || rtt <= 2 * w->rtt) && ++(w->acks) >= w->size && w->size < w->max)
+		{
+			++(w->size);
+			w->acks = 0;
+		}
+		w->rtt = (w->rtt == 0) ? rtt : w->rtt - w->rtt / 8 + rtt / 8;
+	}
+	FUNC_EXIT;
+}
+
+
 void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish)
 {
 	int len;
@@ -111,6 +209,8 @@ int MQTTProtocol_startPublishCommon(Clients* pubclient, Publish* publish, int qo
 	{
 		++(bstate->msgs_sent);
 		bstate->bytes_sent += publish->payloadlen;
+		++(pubclient->stats.msgs_sent);
+		pubclient->stats.bytes_sent += publish->payloadlen;
 	}
 #if defined(MQTTS)
 	if (pubclient->protocol == PROTOCOL_MQTTS)
@@ -123,6 +223,8 @@ int MQTTProtocol_startPublishCommon(Clients* pubclient, Publish* publish, int qo
 	rc = MQTTPacket_send_publish(publish, 0, qos, retained, pubclient->socket, pubclient->clientID);
 	if (qos == 0 && rc == TCPSOCKET_INTERRUPTED)
 		MQTTProtocol_storeQoS0(pubclient, publish);
+	if (rc == TCPSOCKET_INTERRUPTED)
+		MQTTProtocol_shrinkWindow(pubclient, pubclient->window.size - 1); /* the client is not keeping up */
 #if defined(MQTTS)
 	}
 #endif
@@ -151,6 +253,7 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 		p.msgId = publish->msgId = MQTTProtocol_assignMsgId(pubclient);
 		*mm = MQTTProtocol_createMessage(publish, mm, qos, retained);
 		ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len);
+		MQTTProtocol_enqueued(pubclient, publish->payloadlen);
 		/* we change these pointers to the saved message location just in case the packet could not be written
 		entirely; the socket buffer will use these locations to finish writing the packet */
 		p.payload = (*mm)->publish->payload;
@@ -177,6 +280,7 @@ int MQTTProtocol_startQueuedPublish(Clients* pubclient, Messages* m)
 	if (m->qos > 0)
 	{
 		m->msgid = MQTTProtocol_assignMsgId(pubclient);
+		m->sent = Latency_now();
 		ListAppend(pubclient->outboundMsgs, m, m->len);
 	}
 	publish.header.byte = 0;
@@ -193,6 +297,231 @@ int MQTTProtocol_startQueuedPublish(Clients* pubclient, Messages* m)
 }
 
 
+/**
+ * Set which message is dropped when a client's queue reaches one of its limits.
+ * @param policy "drop_newest", "drop_oldest", "drop_lowest_priority" or "disconnect";
+ * NULL for the default, drop_newest
+ */
+void MQTTProtocol_setDropPolicy(char* policy)
+{
+	FUNC_ENTRY;
+	drop_policy = DROP_NEWEST;
+	if (policy && strcmp(policy, "drop_oldest") == 0)
+		drop_policy = DROP_OLDEST;
+	else if (policy && strcmp(policy, "drop_lowest_priority") == 0)
+		drop_policy = DROP_LOWEST_PRIORITY;
+	else if (policy && strcmp(policy, "disconnect") == 0)
+		drop_policy = DROP_DISCONNECT;
+	else if (policy && strcmp(policy, "drop_newest") != 0)
+		Log(LOG_WARNING, 170, NULL, policy);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Record the listener a client has connected through, moving the accounting of its queues
+ * from the listener it last connected through.
+ * @param client the client
+ * @param listener the Listener, or NULL
+ */
+void MQTTProtocol_setListener(Clients* client, void* listener)
+{
+#if !defined(SINGLE_LISTENER)
+	if (client->listener)
+		((Listener*)client->listener)->queued_bytes -= client->stats.queued_bytes;
+	if (listener)
+		((Listener*)listener)->queued_bytes += client->stats.queued_bytes;
+#endif
+	client->listener = listener;
+}
+
+
+/**
+ * Account for a message joining a client's queued or in-flight messages.
+ * @param client the client
+ * @param bytes the length of the message's payload
+ */
+static void MQTTProtocol_enqueued(Clients* client, int bytes)
+{
+	client->stats.queued_bytes += bytes;
+	queued_bytes += bytes;
+#if !defined(SINGLE_LISTENER)
+	if (client->listener)
+		((Listener*)client->listener)->queued_bytes += bytes;
+#endif
+}
+
+
+/**
+ * Account for messages leaving a client's queued and in-flight messages, because they have been
+ * delivered or dropped.
+ * @param client the client
+ * @param bytes the length of the messages' payloads
+ */
+void MQTTProtocol_dequeued(Clients* client, unsigned long long bytes)
+{
+	client->stats.queued_bytes -= bytes;
+	queued_bytes -= bytes;
+#if !defined(SINGLE_LISTENER)
+	if (client->listener)
+		((Listener*)client->listener)->queued_bytes -= bytes;
+#endif
+}
+
+
+/**
+ * The accounting of all clients' queues together.
+ * @param bytes set to the payload bytes queued and in flight
+ * @param dropped_msgs set to the number of messages dropped since the broker started
+ */
+void MQTTProtocol_queueTotals(unsigned long long* bytes, unsigned int* dropped_msgs)
+{
+	*bytes = queued_bytes;
+	*dropped_msgs = dropped;
+}
+
+
+/**
+ * Count a message dropped from a client's queue, or not queued, because the queue was at a limit.
+ * @param client the client
+ */
+static void MQTTProtocol_dropped(Clients* client)
+{
+	++dropped;
+#if !defined(SINGLE_LISTENER)
+	if (client->listener)
+		++(((Listener*)client->listener)->dropped);
+#endif
+	++(client->discardedMsgs);
+	if ((client->discardedMsgs == 1) || (client->discardedMsgs == 10) || (client->discardedMsgs % 100 == 0))
+		Log(LOG_WARNING, 45, NULL, client->clientID, client->discardedMsgs);
+}
+
+
+/**
+ * Would queueing a message for a client take it over its message limit, or it or all the clients
+ * over their byte limits?  Messages in flight count towards the byte limits.
+ * @param client the client
+ * @param bytes the length of the message's payload
+ * @return boolean
+ */
+static int MQTTProtocol_overLimit(Clients* client, int bytes)
+{
+	return queuedMsgsCount(client) >= bstate->max_queued_messages ||
+		(bstate->max_queued_bytes > 0 && client->stats.queued_bytes + bytes > bstate->max_queued_bytes) ||
+		(bstate->max_queued_bytes_total > 0 && queued_bytes + bytes > bstate->max_queued_bytes_total);
+}
+
+
+/**
+ * Choose a queued message to drop for a new one, by the drop policy.  Messages in flight are
+ * never dropped.
+ * @param client the client
+ * @param priority the priority of the new message
+ * @param queue set to the queue of the message chosen
+ * @return the message, or NULL if there is none to drop
+ */
+static Messages* MQTTProtocol_dropCandidate(Clients* client, int priority, List** queue)
+{
+	Messages* m = NULL;
+	int i;
+
+	for (i = 0; i < PRIORITY_MAX; ++i)
+	{
+		Messages* first = NULL;
+
+		if (client->queuedMsgs[i]->count == 0)
+			continue;
+		first = (Messages*)(client->queuedMsgs[i]->first->content);
+		if (drop_policy == DROP_LOWEST_PRIORITY)
+		{
+			if (i <= priority)
+			{
+				m = first;
+				*queue = client->queuedMsgs[i];
+			}
+			break;
+		}
+		if (drop_policy == DROP_OLDEST && (m == NULL || first->sent < m->sent))
+		{
+			m = first;
+			*queue = client->queuedMsgs[i];
+		}
+	}
+	return m;
+}
+
+
+/**
+ * Could dropping all the queued messages the drop policy allows make room for a new message?
+ * Messages in flight, and other clients' messages, count towards the byte limits but cannot be
+ * dropped.
+ * @param client the client
+ * @param priority the priority of the new message
+ * @param bytes the length of its payload
+ * @return boolean
+ */
+static int MQTTProtocol_roomPossible(Clients* client, int priority, int bytes)
+{
+	unsigned long long droppable_bytes = 0;
+	int droppable = 0;
+	int i;
+
+	for (i = 0; i < PRIORITY_MAX; ++i)
+	{
+		ListElement* current = NULL;
+
+		if (drop_policy == DROP_LOWEST_PRIORITY && i > priority)
+			break;
+		droppable += client->queuedMsgs[i]->count;
+		while (ListNextElement(client->queuedMsgs[i], &current))
+			droppable_bytes += ((Messages*)(current->content))->publish->payloadlen;
+	}
+	return queuedMsgsCount(client) - droppable < bstate->max_queued_messages &&
+		(bstate->max_queued_bytes == 0 || client->stats.queued_bytes - droppable_bytes + bytes <= bstate->max_queued_bytes) &&
+		(bstate->max_queued_bytes_total == 0 || queued_bytes - droppable_bytes + bytes <= bstate->max_queued_bytes_total);
+}
+
+
+/**
+ * Make room for a new message in a client's queue, when it is at one of the limits, by dropping
+ * queued messages as the drop policy says.  Nothing is dropped unless that makes enough room.
+ * @param client the client
+ * @param priority the priority of the new message
+ * @param bytes the length of its payload
+ * @param mm pointer to the stored copy of the publication, cleared if that is dropped
+ * @return boolean - can the new message be queued?
+ */
+static int MQTTProtocol_makeRoom(Clients* client, int priority, int bytes, Messages** mm)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (drop_policy != DROP_OLDEST && drop_policy != DROP_LOWEST_PRIORITY)
+		goto exit;
+	if (!MQTTProtocol_roomPossible(client, priority, bytes))
+		goto exit; /* the new message is dropped instead */
+	while (MQTTProtocol_overLimit(client, bytes))
+	{
+		List* queue = NULL;
+		Messages* m = MQTTProtocol_dropCandidate(client, priority, &queue);
+
+		if (m == NULL)
+			goto exit;
+		if (m == *mm)
+			*mm = NULL; /* the same publication was queued for this client by another subscription */
+		MQTTProtocol_dequeued(client, m->publish->payloadlen);
+		MQTTProtocol_removePublication(m->publish);
+		ListRemove(queue, m);
+		MQTTProtocol_dropped(client);
+	}
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Add a new publication to a client outbound message queue.
  * @param pubclient the client to send the publication to
@@ -212,25 +541,34 @@ int MQTTProtocol_queuePublish(Clients* pubclient, Publish* publish, int qos, int
 	/* if qos == 0 then add this client to the list of clients with queued QoS 0 */
 
 	Log(TRACE_MAXIMUM, 3, NULL, pubclient->clientID, qos);
-	if (queuedMsgsCount(pubclient) < bstate->max_queued_messages)
+	if (priority < PRIORITY_LOW || priority > PRIORITY_HIGH)
+	{
+		Log(LOG_ERROR, 13, "Priority %d reassigned to normal", priority);
+		priority = PRIORITY_NORMAL;
+	}
+	if (!MQTTProtocol_overLimit(pubclient, publish->payloadlen) ||
+		MQTTProtocol_makeRoom(pubclient, priority, publish->payloadlen, mm))
 	{
 		int threshold = (THRESHOLD * bstate->max_queued_messages) / 100;
+		int queued = 0;
 		*mm = MQTTProtocol_createMessage(publish, mm, qos, retained);
-		if (priority < PRIORITY_LOW || priority > PRIORITY_HIGH)
-		{
-			Log(LOG_ERROR, 13, "Priority %d reassigned to normal", priority);
-			priority = PRIORITY_NORMAL;
-		}
 		ListAppend(pubclient->queuedMsgs[priority], *mm, (*mm)->len);
-		if (queuedMsgsCount(pubclient) == threshold + 1)
+		MQTTProtocol_enqueued(pubclient, publish->payloadlen);
+		if ((queued = queuedMsgsCount(pubclient)) > pubclient->stats.queued_max)
+			pubclient->stats.queued_max = queued;
+		if (queued == threshold + 1)
 			Log(LOG_WARNING, 145, NULL, pubclient->clientID, THRESHOLD);
 	}
+	else if (drop_policy == DROP_DISCONNECT && pubclient->connected)
+	{
+		Log(LOG_WARNING, 171, NULL, pubclient->clientID);
+		rc = SOCKET_ERROR;
+	}
 	else
 	{
-		if (++(pubclient->discardedMsgs) > bstate->max_queued_messages * 10)
+		MQTTProtocol_dropped(pubclient);
+		if (drop_policy == DROP_NEWEST && pubclient->discardedMsgs > bstate->max_queued_messages * 10)
 			rc = SOCKET_ERROR;
-		if ((pubclient->discardedMsgs == 1) || (pubclient->discardedMsgs == 10) || (pubclient->discardedMsgs % 100 == 0))
-			Log(LOG_WARNING, 45, NULL, pubclient->clientID, pubclient->discardedMsgs);
 	}
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -267,6 +605,7 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, i
 	m->qos = qos;
 	m->retain = retained;
 	time(&(m->lastTouch));
+	m->sent = Latency_now();
 	if (qos == 2)
 		m->nextMessageType = PUBREC;
 	FUNC_EXIT;
@@ -288,8 +627,7 @@ Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 	p->refcount = 1;
 
 	*len = strlen(publish->topic)+1;
-	p->topic = malloc(*len);
-	strcpy(p->topic, publish->topic);
+	p->topic = Topics_intern(publish->topic);
 	*len += sizeof(Publications);
 
 	p->payloadlen = publish->payloadlen;
@@ -347,7 +685,7 @@ void MQTTProtocol_removePublication(Publications* p)
 	else if (--(p->refcount) == 0)
 	{
 		free(p->payload);
-		free(p->topic);
+		Topics_release(p->topic);
 		ListRemove(&(state.publications), p);
 	}
 	FUNC_EXIT;
@@ -380,8 +718,7 @@ int MQTTProtocol_handlePubacks(void* pack, int sock, Clients* client)
 		else
 		{
 			Log(TRACE_MIN, 4, NULL, client->clientID, puback->msgId);
-			++(bstate->msgs_sent);
-			bstate->bytes_sent += m->publish->payloadlen;
+			MQTTProtocol_acknowledged(client, m);
 			MQTTProtocol_removePublication(m->publish);
 			ListRemove(client->outboundMsgs, m);
 			/* now there is space in the inflight message queue we can process any queued messages */
@@ -488,13 +825,15 @@ int MQTTProtocol_handlePubrels(void* pack, int sock, Clients* client)
 			publish.payloadlen = m->publish->payloadlen;
 			++(bstate->msgs_received);
 			bstate->bytes_received += m->publish->payloadlen;
-			Protocol_processPublication(&publish, client->clientID);
+			++(client->stats.msgs_received);
+			client->stats.bytes_received += m->publish->payloadlen;
+			Protocol_processPublication(&publish, client, client->clientID);
 
 			/* The client structure might have been removed in processPublication, on error */
 			if (TreeFind(bstate->clients, &sock) || TreeFind(bstate->disconnected_clients, saved_clientid))
 			{
-				ListRemove(client->inboundMsgs, m);
 				MQTTProtocol_removePublication(m->publish);
+				ListRemove(client->inboundMsgs, m);
 			}
 			free(saved_clientid);
 		}
@@ -538,8 +877,7 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock, Clients* client)
 			else
 			{
 				Log(TRACE_MIN, 5, NULL, client->clientID, pubcomp->msgId);
-				++(bstate->msgs_sent);
-				bstate->bytes_sent += m->publish->payloadlen;
+				MQTTProtocol_acknowledged(client, m);
 				MQTTProtocol_removePublication(m->publish);
 				ListRemove(client->outboundMsgs, m);
 				/* now there is space in the inflight message queue we can process any queued messages */
@@ -628,7 +966,7 @@ int MQTTProtocol_processQueued(Clients* client)
 
 	Log(TRACE_MAXIMUM, 0, NULL, client->clientID);
 	while (client->good && Socket_noPendingWrites(client->socket) && /* no point in starting a publish if a write is still pending */
-		client->outboundMsgs->count < bstate->max_inflight_messages &&
+		client->outboundMsgs->count < MQTTProtocol_inflightWindow(client) &&
 		queuedMsgsCount(client) > 0
 #if defined(QOS0_SEND_LIMIT) 
 		&& qos0count < bstate->max_inflight_messages /* an arbitrary criterion - but when would we restart? */
@@ -690,6 +1028,7 @@ int MQTTProtocol_processQueued(Clients* client)
 			 *
 			 * Note (IGC): this is also a bug fix I just implemented - applies equally to MQTTs and MQTT!
 			 */
+			MQTTProtocol_dequeued(client, m->publish->payloadlen);
 			MQTTProtocol_removePublication(m->publish);
 			if (!ListRemove(queue, m))
 				Log(LOG_ERROR, 38, NULL);
@@ -716,10 +1055,13 @@ exit:
  * MQTT retry processing per client
  * @param now current time
  * @param client - the client to which to apply the retry processing
+ * @param reconnect boolean - whether the in-flight messages are being resent because the client
+ * has reconnected, rather than because they have timed out, so the window is left alone
  */
-void MQTTProtocol_retries(time_t now, Clients* client)
+void MQTTProtocol_retries(time_t now, Clients* client, int reconnect)
 {
 	ListElement* outcurrent = NULL;
+	int shrunk = 0;
 
 	FUNC_ENTRY;
 #if defined(MQTTS)
@@ -772,6 +1114,11 @@ void MQTTProtocol_retries(time_t now, Clients* client)
 				int rc;
 
 				Log(LOG_INFO, 28, NULL, client->clientID, client->socket, m->msgid);
+				if (!shrunk && !reconnect)
+				{ /* a lost or very late message: halve the window, once for all the messages retried */
+					MQTTProtocol_shrinkWindow(client, client->window.size / 2);
+					shrunk = 1;
+				}
 				publish.msgId = m->msgid;
 				publish.topic = m->publish->topic;
 				publish.payload = m->publish->payload;
@@ -899,7 +1246,7 @@ int MQTTProtocol_retry(time_t now, int doRetry)
 		if (Socket_noPendingWrites(client->socket) == 0)
 			continue;
 		if (doRetry)
-			MQTTProtocol_retries(now, client);
+			MQTTProtocol_retries(now, client, 0);
 		if (client)
 		{
 			if (MQTTProtocol_processQueued(client))
@@ -928,6 +1275,7 @@ void MQTTProtocol_freeClient(Clients* client)
 		Log(LOG_WARNING, 64, NULL, queuedMsgsCount(client), client->clientID);
 	for (i = 0; i < PRIORITY_MAX; ++i)
 		MQTTProtocol_freeMessageList(client->queuedMsgs[i]);
+	MQTTProtocol_dequeued(client, client->stats.queued_bytes);
 #if defined(MQTTS)
 	if (client->registrations != NULL)
 		MQTTSProtocol_freeRegistrationList(client->registrations);
@@ -946,6 +1294,8 @@ void MQTTProtocol_freeClient(Clients* client)
 #endif
 	if (client->addr != NULL)
 		free(client->addr);
+	if (client->acl_cache != NULL)
+		Users_freeCache(client->acl_cache);
 	free(client->clientID);
 	if (client->will != NULL)
 	{
@@ -964,10 +1314,12 @@ void MQTTProtocol_freeClient(Clients* client)
  * This is used to clean up a session for a client which is non-cleansession.  QoS 0 messages
  * are non-persistent, so they are removed from the queue.
  * @param msgList the message list to empty
+ * @return the length of the payloads removed
  */
-void MQTTProtocol_removeQoS0Messages(List* msgList)
+int MQTTProtocol_removeQoS0Messages(List* msgList)
 {
 	ListElement* current = NULL;
+	int bytes = 0;
 
 	FUNC_ENTRY;
 	ListNextElement(msgList, &current);
@@ -976,6 +1328,7 @@ void MQTTProtocol_removeQoS0Messages(List* msgList)
 		Messages* m = (Messages*)(current->content);
 		if (m->qos == 0)
 		{
+			bytes += m->publish->payloadlen;
 			MQTTProtocol_removePublication(m->publish);
 			msgList->current = current;
 			ListRemove(msgList, current->content);
@@ -984,7 +1337,8 @@ void MQTTProtocol_removeQoS0Messages(List* msgList)
 		else
 			ListNextElement(msgList, &current);
 	}
-	FUNC_EXIT;
+	FUNC_EXIT_RC(bytes);
+	return bytes;
 }
 
 
@@ -37,6 +37,17 @@
  */
 #define MAX_CLIENTID_LEN 23
 
+/**
+ * What is dropped when a client's queue reaches one of its limits
+ */
+enum queue_drop_policies
+{
+	DROP_NEWEST,			/**< the message being queued */
+	DROP_OLDEST,			/**< the queued message created first */
+	DROP_LOWEST_PRIORITY,	/**< the oldest queued message of the lowest priority, if no higher than the new one */
+	DROP_DISCONNECT			/**< nothing: the client is disconnected */
+};
+
 int MQTTProtocol_assignMsgId(Clients* client);
 int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int retained, Messages** m);
 int MQTTProtocol_queuePublish(Clients* pubclient, Publish* publish, int qos, int retained, int priority, Messages** m);
@@ -52,12 +63,21 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock, Clients* client);
 int MQTTProtocol_handlePubrels(void* pack, int sock, Clients* client);
 int MQTTProtocol_handlePubcomps(void* pack, int sock, Clients* client);
 
+void MQTTProtocol_setWindow(Clients* client, int min, int max);
+int MQTTProtocol_inflightWindow(Clients* client);
+void MQTTProtocol_acknowledged(Clients* client, Messages* m);
+
+void MQTTProtocol_setDropPolicy(char* policy);
+void MQTTProtocol_setListener(Clients* client, void* listener);
+void MQTTProtocol_dequeued(Clients* client, unsigned long long bytes);
+void MQTTProtocol_queueTotals(unsigned long long* bytes, unsigned int* dropped);
+
 void MQTTProtocol_keepalive(time_t);
 int MQTTProtocol_processQueued(Clients* client);
 int MQTTProtocol_retry(time_t, int);
-void MQTTProtocol_retries(time_t now, Clients* client);
+void MQTTProtocol_retries(time_t now, Clients* client, int reconnect);
 void MQTTProtocol_freeClient(Clients* client);
-void MQTTProtocol_removeQoS0Messages(List* msgList);
+int MQTTProtocol_removeQoS0Messages(List* msgList);
 void MQTTProtocol_emptyMessageList(List* msgList);
 void MQTTProtocol_freeMessageList(List* msgList);
 
@@ -26,6 +26,7 @@
 #include "Messages.h"
 #include "Protocol.h"
 #include "Socket.h"
+#include "Capture.h"
 #include "StackTrace.h"
 #include "MQTTSPacketSerialize.h"
 #include "Heap.h"
@@ -177,6 +178,8 @@ void* MQTTSPacket_Factory(int sock, char** clientAddr, struct sockaddr* from, ui
 	}
 
 	*clientAddr = Socket_getaddrname(from, sock);
+	if (Capture_active())
+		Capture_packet(CAPTURE_MQTTS, Capture_addressId(*clientAddr), NULL, 0, msg, n);
 /*
 	printf("%d bytes of data on socket %d from %s\n",n,sock,*clientAddr);
 	if (n>0) {
@@ -25,6 +25,7 @@
 #include "Log.h"
 #include "Messages.h"
 #include "Protocol.h"
+#include "Latency.h"
 #include "StackTrace.h"
 
 #if !defined(NO_BRIDGE)
@@ -206,9 +207,13 @@ void MQTTSProtocol_timeslice(int sock)
 	struct sockaddr_in6 from;
 	uint8_t *wirelessNodeId = NULL ;
 	uint8_t wirelessNodeIdLen = 0 ;
+	unsigned long long start;
 
 	FUNC_ENTRY;
+	start = Latency_now();
 	pack = MQTTSPacket_Factory(sock, &clientAddr, (struct sockaddr *)&from, &wirelessNodeId , &wirelessNodeIdLen , &error);
+	if (pack)
+		Latency_since(LATENCY_READ, start);
 
 	if (clientAddr)
 	{
@@ -426,6 +431,7 @@ int MQTTSProtocol_handleConnects(void* pack, int sock, char* clientAddr, Clients
 		else /* there is an existing disconnected client */
 		{
 			/* Reconnect of a disconnected client */
+			existingClient = 1;
 			free(client->addr);
 			client->connect_state = 0;
 			client->connected = 0; /* Do not connect until we know the connack has been sent */
@@ -473,6 +479,7 @@ int MQTTSProtocol_handleConnects(void* pack, int sock, char* clientAddr, Clients
 	else
 	{
 		/* Reconnect of a connected client */
+		existingClient = 1;
 		client = (Clients*)(elem->content);
 		if (client->connected)
 		{
@@ -518,6 +525,7 @@ int MQTTSProtocol_handleConnects(void* pack, int sock, char* clientAddr, Clients
 			MQTTProtocol_emptyMessageList(client->inboundMsgs);
 			for (i = 0; i < PRIORITY_MAX; ++i)
 				MQTTProtocol_emptyMessageList(client->queuedMsgs[i]);
+			MQTTProtocol_dequeued(client, client->stats.queued_bytes);
 			MQTTProtocol_clearWill(client);
 		}
 		/* registrations are always cleared */
@@ -549,9 +557,25 @@ int MQTTSProtocol_handleConnects(void* pack, int sock, char* clientAddr, Clients
 			rc = MQTTSPacket_send_connack(client,0); /* send response */
 		}
 	}
+	MQTTProtocol_setListener(client, Socket_getParentListener(sock));
 	
 	if (existingClient)
+	{
+		if (client->cleansession == 0)
+		{
+			ListElement* outcurrent = NULL;
+			time_t now = 0;
+
+			/* ensure that inflight messages are retried now by setting the last touched time
+			 * to very old (0) before calling the retry function
+			 */
+			time(&(now));
+			while (ListNextElement(client->outboundMsgs, &outcurrent))
+				((Messages*)(outcurrent->content))->lastTouch = 0;
+			MQTTProtocol_retries(now, client, 1);
+		}
 		MQTTProtocol_processQueued(client);
+	}
 
 	Log(LOG_INFO, 0, "Client connected to udp port %d from %s (%s)", list->port, client->clientID, clientAddr);
 
@@ -620,7 +644,6 @@ int MQTTSProtocol_handleRegisters(void* pack, int sock, char* clientAddr, Client
 	if ((elem = ListFindItem(client->registrations, registerPack->topicName, registeredTopicNameCompare)) == NULL)
 	{
 		topicId = (MQTTSProtocol_registerTopic(client, registerPack->topicName))->id;
-		registerPack->topicName = NULL;
 	}
 	else
 		topicId = ((Registration*)(elem->content))->id;
@@ -798,10 +821,11 @@ int MQTTSProtocol_handlePubacks(void* pack, int sock, char* clientAddr, Clients*
 		else
 		{
 			Log(TRACE_MAX, 4, NULL, client->clientID, puback->msgId);
+			MQTTProtocol_acknowledged(client, m);
 			MQTTProtocol_removePublication(m->publish);
 			ListRemove(client->outboundMsgs, m);
-			/* TODO: msgs counts */
-			/* (++state.msgs_sent);*/
+			/* now there is space in the inflight message queue we can process any queued messages */
+			MQTTProtocol_processQueued(client);
 		}
 	}
 	MQTTSPacket_free_packet(pack);
@@ -838,10 +862,11 @@ int MQTTSProtocol_handlePubcomps(void* pack, int sock, char* clientAddr, Clients
 			else
 			{
 				Log(TRACE_MAX, 5, NULL, client->clientID, pubcomp->msgId);
+				MQTTProtocol_acknowledged(client, m);
 				MQTTProtocol_removePublication(m->publish);
 				ListRemove(client->outboundMsgs, m);
-				/* TODO: msgs counts */
-				/*(++state.msgs_sent); */
+				/* now there is space in the inflight message queue we can process any queued messages */
+				MQTTProtocol_processQueued(client);
 			}
 		}
 	}
@@ -934,7 +959,7 @@ int MQTTSProtocol_handlePubrels(void* pack, int sock, char* clientAddr, Clients*
 			publish.topic = m->publish->topic;
 			publish.payload = m->publish->payload;
 			publish.payloadlen = m->publish->payloadlen;
-			Protocol_processPublication(&publish, client->clientID);
+			Protocol_processPublication(&publish, client, client->clientID);
 			MQTTProtocol_removePublication(m->publish);
 			ListRemove(client->inboundMsgs, m);
 			/* TODO: msgs counts */
@@ -964,17 +989,11 @@ int MQTTSProtocol_handleSubscribes(void* pack, int sock, char* clientAddr, Clien
 
 	// NORMAL (topic name is in subscribe packet) or SHORT topic name
 	if (sub->flags.topicIdType == MQTTS_TOPIC_TYPE_NORMAL || sub->flags.topicIdType == MQTTS_TOPIC_TYPE_SHORT)
-	{
 		topicName = sub->topicName;
-		sub->topicName = NULL;
-	}
 	// Pre-defined topic
 	else if (sub->flags.topicIdType == MQTTS_TOPIC_TYPE_PREDEFINED && client != NULL && sub->topicId != 0)
 	{
-		char *predefinedTopicName = MQTTSProtocol_getPreDefinedTopicName(client, sub->topicId) ;
-		// copy the topic name as it will be freed by subscription engine
-		topicName = malloc(strlen(predefinedTopicName)+1);
-		strcpy(topicName, predefinedTopicName);
+		topicName = MQTTSProtocol_getPreDefinedTopicName(client, sub->topicId);
 		topicId = sub->topicId;
 	}
 
@@ -985,18 +1004,11 @@ int MQTTSProtocol_handleSubscribes(void* pack, int sock, char* clientAddr, Clien
 	{
 		// Topic name
 		if (sub->flags.topicIdType == MQTTS_TOPIC_TYPE_NORMAL && !Topics_hasWildcards(topicName))
-		{
-			char* regTopicName = malloc(strlen(topicName)+1);
-			strcpy(regTopicName, topicName);
-			topicId = (MQTTSProtocol_registerTopic(client, regTopicName))->id;
-		}
+			topicId = (MQTTSProtocol_registerTopic(client, topicName))->id;
 		// Pre-defined topic
 		else if (sub->flags.topicIdType == MQTTS_TOPIC_TYPE_PREDEFINED)
-		{
-			char* regTopicName = malloc(strlen(topicName)+1);
-			strcpy(regTopicName, topicName);
-			MQTTSProtocol_registerPreDefinedTopic(client, topicId, regTopicName);
-		}
+			MQTTSProtocol_registerPreDefinedTopic(client, topicId, topicName);
+		MQTTProtocol_sysRefresh(topicName);
 		isnew = SubscriptionEngines_subscribe(bstate->se, client->clientID,
 				topicName, sub->flags.QoS, client->noLocal, (client->cleansession == 0), PRIORITY_NORMAL);
 
@@ -1261,7 +1273,7 @@ void MQTTSProtocol_emptyRegistrationList(List* regList)
 	while (ListNextElement(regList, &current))
 	{
 		Registration* m = (Registration*)(current->content);
-		free(m->topicName);
+		Topics_release(m->topicName);
 	}
 	ListEmpty(regList);
 	FUNC_EXIT;
@@ -1282,7 +1294,7 @@ Registration* MQTTSProtocol_registerTopic(Clients* client, char* topicName)
 	Registration* reg = malloc(sizeof(Registration));
 
 	FUNC_ENTRY;
-	reg->topicName = topicName;
+	reg->topicName = Topics_intern(topicName);
 	reg->topicIdType = MQTTS_TOPIC_TYPE_NORMAL;
 	reg->id = client->registrations->count+1 + bstate->topic_id_offset;
 	ListAppend(client->registrations, reg, sizeof(reg) + strlen(reg->topicName)+1);
@@ -1296,7 +1308,7 @@ Registration* MQTTSProtocol_registerPreDefinedTopic(Clients* client, int topicId
 	Registration* reg = malloc(sizeof(Registration));
 
 	FUNC_ENTRY;
-	reg->topicName = topicName;
+	reg->topicName = Topics_intern(topicName);
 	reg->topicIdType = MQTTS_TOPIC_TYPE_PREDEFINED;
 	reg->id = topicId;
 	ListAppend(client->registrations, reg, sizeof(reg) + strlen(reg->topicName)+1);
@@ -1317,14 +1329,12 @@ int MQTTSProtocol_startRegistration(Clients* client, char* topic)
 		PendingRegistration* pendingReg = malloc(sizeof(PendingRegistration));
 		Registration* reg;
 		int msgId = MQTTProtocol_assignMsgId(client);
-		char* regTopicName = malloc(strlen(topic)+1);
-		strcpy(regTopicName,topic);
-		reg = MQTTSProtocol_registerTopic(client, regTopicName);
+		reg = MQTTSProtocol_registerTopic(client, topic);
 		pendingReg->msgId = msgId;
 		pendingReg->registration = reg;
 		time(&(pendingReg->sent));
 		client->pendingRegistration = pendingReg;
-		rc = MQTTSPacket_send_register(client, reg->id, regTopicName, msgId);
+		rc = MQTTSPacket_send_register(client, reg->id, reg->topicName, msgId);
 	}
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -22,6 +22,7 @@
 #include "Protocol.h"
 #include "MQTTProtocolClient.h"
 #include "StackTrace.h"
+#include "Topics.h"
 
 #include <stdlib.h>
 #if defined(WIN32)
@@ -367,12 +368,11 @@ int MQTTSProtocol_handleSubacks(void* pack, int sock, char* clientAddr, Clients*
 		if (suback->topicId > 0)
 		{
 			Registration* reg = malloc(sizeof(Registration));
-			reg->topicName = client->pendingSubscription->topicName;
+			reg->topicName = Topics_intern(client->pendingSubscription->topicName);
 			reg->id = suback->topicId;
 			ListAppend(client->registrations, reg, sizeof(reg) + strlen(reg->topicName)+1);
 		}
-		else
-			free(client->pendingSubscription->topicName);
+		free(client->pendingSubscription->topicName);
 		free(client->pendingSubscription);
 		client->pendingSubscription = NULL;
 		/* TODO: could proactively call Bridge_subscribe() */
@@ -408,21 +408,18 @@ int MQTTSProtocol_startClientRegistration(Clients* client, char* topic)
 	PendingRegistration* pendingReg = malloc(sizeof(PendingRegistration));
 	Registration* reg;
 	int msgId = MQTTProtocol_assignMsgId(client);
-	char* regTopicName = malloc(strlen(topic)+1);
 	int rc = 0;
 
 	FUNC_ENTRY;
-	strcpy(regTopicName,topic);
-
 	reg = malloc(sizeof(Registration));
-	reg->topicName = regTopicName;
+	reg->topicName = Topics_intern(topic);
 	reg->id = 0;
 
 	pendingReg->msgId = msgId;
 	pendingReg->registration = reg;
 	time(&(pendingReg->sent));
 	client->pendingRegistration = pendingReg;
-	rc = MQTTSPacket_send_register(client, reg->id, regTopicName, msgId);
+	rc = MQTTSPacket_send_register(client, reg->id, reg->topicName, msgId);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -22,16 +22,16 @@
  * Number of messages in the file
  */
 #if !defined(MQTTS)
-#define MESSAGE_COUNT 103
+#define MESSAGE_COUNT 120
 #else
-#define MESSAGE_COUNT 110
+#define MESSAGE_COUNT 127
 #endif
 
 /**
  * Largest message number
  */
 #if !defined(MQTTS)
-#define MAX_MESSAGE_INDEX 153
+#define MAX_MESSAGE_INDEX 171
 #else
 #define MAX_MESSAGE_INDEX 402
 #endif
@@ -0,0 +1,615 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Metrics endpoint, serving the broker's statistics over HTTP in Prometheus text format.
+ *
+ * A listener declared with the metrics protocol accepts HTTP connections through the same
+ * sockets and event loop as the MQTT listeners.  Each GET of /metrics is answered with the
+ * current values of the counters and gauges, and the latency histograms since the broker
+ * started, all read from the broker state when the request arrives, so nothing is done between
+ * scrapes.  Connections are kept open for the next scrape unless the client asks otherwise.
+ */
+
+#include "Metrics.h"
+#include "Broker.h"
+#include "Socket.h"
+#include "Log.h"
+#include "Protocol.h"
+#include "MQTTProtocolClient.h"
+#include "Latency.h"
+#include "Topics.h"
+#include "Users.h"
+#include "StackTrace.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(WIN32)
+#define vsnprintf _vsnprintf
+#endif
+
+#include "Heap.h"
+
+#define METRICS_PREFIX "rsmb_"
+
+extern BrokerStates* bstate;
+
+/**
+ * The partial HTTP request read from one connection
+ */
+typedef struct
+{
+	int socket;		/**< must be first, for intcompare */
+	int len;
+	int waiting;	/**< waiting for the last response to be written, before answering or closing */
+	int closing;	/**< close the connection once the last response has been written */
+	char request[METRICS_REQUEST_MAX];
+} Request;
+
+static List* requests = NULL;	/**< of Request, one for each connection to a metrics listener */
+
+/**
+ * A metrics response being built
+ */
+typedef struct
+{
+	char* buf;
+	int len;
+	int size;
+} Exposition;
+
+
+/**
+ * Forget the request of a connection which is being closed, by Socket_close.
+ * @param sock the socket
+ */
+static void Metrics_closed(int sock)
+{
+	ListRemoveItem(requests, &sock, intcompare);
+}
+
+
+/**
+ * Initialize the metrics module.
+ */
+void Metrics_initialize()
+{
+	FUNC_ENTRY;
+	requests = ListInitialize();
+	Socket_setCloseCallback(Metrics_closed);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Terminate the metrics module.  The connections are closed with all the other sockets.
+ */
+void Metrics_terminate()
+{
+	FUNC_ENTRY;
+	Socket_setCloseCallback(NULL);
+	if (requests)
+		ListFree(requests);
+	requests = NULL;
+	FUNC_EXIT;
+}
+
+
+/**
+ * Append formatted text to a response, extending it as needed.
+ * @param e the response
+ * @param format printf format string
+ */
+static void Metrics_printf(Exposition* e, char* format, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;)
+	{
+		va_start(args, format);
+		n = vsnprintf(&e->buf[e->len], e->size - e->len, format, args);
+		va_end(args);
+		if (n >= 0 && n < e->size - e->len)
+			break;
+		e->size *= 2; /* Windows returns -1 rather than the length needed */
+		e->buf = realloc(e->buf, e->size);
+	}
+	e->len += n;
+}
+
+
+/**
+ * Append the help and type lines which introduce a metric.
+ * @param e the response
+ * @param name the metric name, without the broker's prefix
+ * @param type counter, gauge or histogram
+ * @param help the description of the metric
+ */
+static void Metrics_type(Exposition* e, char* name, char* type, char* help)
+{
+	Metrics_printf(e, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", name, help, name, type);
+}
+
+
+/**
+ * Append a metric with no labels.
+ * @param e the response
+ * @param name the metric name, without the broker's prefix
+ * @param type counter or gauge
+ * @param help the description of the metric
+ * @param value the value
+ */
+static void Metrics_value(Exposition* e, char* name, char* type, char* help, double value)
+{
+	Metrics_type(e, name, type, help);
+	Metrics_printf(e, METRICS_PREFIX "%s %.15g\n", name, value);
+}
+
+
+/**
+ * Append a label value, escaped as the text format requires.
+ * @param e the response
+ * @param value the label value
+ */
+static void Metrics_label(Exposition* e, char* value)
+{
+	for (; *value; ++value)
+	{
+		if (*value == '\\' || *value == '"')
+			Metrics_printf(e, "\\%c", *value);
+		else if (*value == '\n')
+			Metrics_printf(e, "\\n");
+		else
+			Metrics_printf(e, "%c", *value);
+	}
+}
+
+
+/**
+ * Append the distribution of a latency stage since the broker started as a histogram.
+ * @param e the response
+ * @param stage the stage
+ */
+static void Metrics_histogram(Exposition* e, int stage)
+{
+	char* name = Latency_stageMetric(stage);
+	LatencyTotals t;
+	int i;
+
+	Latency_totals(stage, &t);
+	Metrics_printf(e, "# TYPE " METRICS_PREFIX "%s histogram\n", name);
+	for (i = 0; i < LATENCY_BOUNDS; ++i)
+		Metrics_printf(e, METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n", name, t.bound[i], t.below[i]);
+	Metrics_printf(e, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name, t.count);
+	Metrics_printf(e, METRICS_PREFIX "%s_sum %.15g\n", name, t.sum);
+	Metrics_printf(e, METRICS_PREFIX "%s_count %llu\n", name, t.count);
+}
+
+
+/**
+ * Append the client, queue and MQTT-SN registration metrics, from one pass over the clients.
+ * @param e the response
+ */
+static void Metrics_clients(Exposition* e)
+{
+	Tree* trees[2];
+	char* states[2] = { "connected", "disconnected" };
+	int queued[2] = { 0, 0 }, outbound = 0, inbound = 0, discarded = 0, t, i;
+	unsigned long long queued_bytes = 0;
+	unsigned int dropped = 0;
+#if defined(MQTTS)
+	int mqtts = 0, registrations = 0;
+#endif
+
+	FUNC_ENTRY;
+	trees[0] = bstate->clients;
+	trees[1] = bstate->disconnected_clients;
+	for (t = 0; t < 2; ++t)
+	{
+		Node* current = NULL;
+
+		while ((current = TreeNextElement(trees[t], current)) != NULL)
+		{
+			Clients* client = (Clients*)(current->content);
+
+			for (i = 0; i < PRIORITY_MAX; ++i)
+				queued[t] += client->queuedMsgs[i]->count;
+			outbound += client->outboundMsgs->count;
+			inbound += client->inboundMsgs->count;
+			discarded += client->discardedMsgs;
+#if defined(MQTTS)
+			if (t == 0 && client->protocol == PROTOCOL_MQTTS)
+				++mqtts;
+			if (client->registrations)
+				registrations += client->registrations->count;
+#endif
+		}
+	}
+
+	Metrics_type(e, "clients", "gauge", "Clients known to the broker.");
+	for (t = 0; t < 2; ++t)
+		Metrics_printf(e, METRICS_PREFIX "clients{state=\"%s\"} %d\n", states[t], trees[t]->count);
+	Metrics_type(e, "queued_messages", "gauge", "Messages queued for clients, not yet in flight.");
+	for (t = 0; t < 2; ++t)
+		Metrics_printf(e, METRICS_PREFIX "queued_messages{clients=\"%s\"} %d\n", states[t], queued[t]);
+	Metrics_type(e, "inflight_messages", "gauge", "QoS 1 and 2 messages in flight, not yet acknowledged.");
+	Metrics_printf(e, METRICS_PREFIX "inflight_messages{direction=\"outbound\"} %d\n", outbound);
+	Metrics_printf(e, METRICS_PREFIX "inflight_messages{direction=\"inbound\"} %d\n", inbound);
+	Metrics_value(e, "discarded_messages", "gauge", "Messages discarded because a client's queue was full, for the clients known now.", discarded);
+	MQTTProtocol_queueTotals(&queued_bytes, &dropped);
+	Metrics_type(e, "queued_bytes", "gauge", "Payload bytes queued and in flight to clients.");
+	Metrics_printf(e, METRICS_PREFIX "queued_bytes %llu\n", queued_bytes);
+	Metrics_type(e, "dropped_messages_total", "counter", "Messages dropped from clients' queues at their limits.");
+	Metrics_printf(e, METRICS_PREFIX "dropped_messages_total %u\n", dropped);
+#if defined(MQTTS)
+	Metrics_value(e, "mqttsn_clients", "gauge", "Connected MQTT-SN clients.", mqtts);
+	Metrics_value(e, "mqttsn_registrations", "gauge", "MQTT-SN topic registrations held for clients.", registrations);
+#endif
+	FUNC_EXIT;
+}
+
+
+/**
+ * Append the listener and bridge connection metrics.
+ * @param e the response
+ */
+static void Metrics_connections(Exposition* e)
+{
+	static char* protocols[] = { "mqtt", "mqtts", "mqtts_multicast", "metrics" };
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+#if !defined(SINGLE_LISTENER)
+	Metrics_type(e, "listener_connections", "gauge", "Open connections accepted by each listener.");
+	while (ListNextElement(bstate->listeners, &current))
+	{
+		Listener* listener = (Listener*)(current->content);
+
+		Metrics_printf(e, METRICS_PREFIX "listener_connections{port=\"%d\",protocol=\"%s\"} %d\n",
+			listener->port, protocols[listener->protocol], listener->connections->count);
+	}
+	Metrics_type(e, "listener_queued_bytes", "gauge", "Payload bytes queued and in flight to the clients of each listener.");
+	for (current = NULL; ListNextElement(bstate->listeners, &current); )
+	{
+		Listener* listener = (Listener*)(current->content);
+
+		if (listener->protocol != PROTOCOL_METRICS)
+			Metrics_printf(e, METRICS_PREFIX "listener_queued_bytes{port=\"%d\",protocol=\"%s\"} %llu\n",
+				listener->port, protocols[listener->protocol], listener->queued_bytes);
+	}
+	Metrics_type(e, "listener_dropped_messages_total", "counter", "Messages dropped from the queues of each listener's clients at their limits.");
+	for (current = NULL; ListNextElement(bstate->listeners, &current); )
+	{
+		Listener* listener = (Listener*)(current->content);
+
+		if (listener->protocol != PROTOCOL_METRICS)
+			Metrics_printf(e, METRICS_PREFIX "listener_dropped_messages_total{port=\"%d\",protocol=\"%s\"} %u\n",
+				listener->port, protocols[listener->protocol], listener->dropped);
+	}
+#endif
+#if !defined(NO_BRIDGE)
+	if (bstate->bridge.connections && bstate->bridge.connections->count > 0)
+	{
+		Metrics_type(e, "bridge_up", "gauge", "Whether each bridge connection is connected to its remote broker.");
+		for (current = NULL; ListNextElement(bstate->bridge.connections, &current); )
+		{
+			BridgeConnections* bc = (BridgeConnections*)(current->content);
+			int up = (bc->primary && bc->primary->connected) || (bc->backup && bc->backup->connected);
+
+			Metrics_printf(e, METRICS_PREFIX "bridge_up{connection=\"");
+			Metrics_label(e, bc->name);
+			Metrics_printf(e, "\"} %d\n", up);
+		}
+		Metrics_type(e, "bridge_running", "gauge", "Whether each bridge connection is started.");
+		for (current = NULL; ListNextElement(bstate->bridge.connections, &current); )
+		{
+			BridgeConnections* bc = (BridgeConnections*)(current->content);
+
+			Metrics_printf(e, METRICS_PREFIX "bridge_running{connection=\"");
+			Metrics_label(e, bc->name);
+			Metrics_printf(e, "\"} %d\n", bc->state == CONNECTION_RUNNING);
+		}
+		Metrics_type(e, "bridge_connects_total", "counter", "Successful connections made by each bridge connection.");
+		for (current = NULL; ListNextElement(bstate->bridge.connections, &current); )
+		{
+			BridgeConnections* bc = (BridgeConnections*)(current->content);
+
+			Metrics_printf(e, METRICS_PREFIX "bridge_connects_total{connection=\"");
+			Metrics_label(e, bc->name);
+			Metrics_printf(e, "\"} %d\n", bc->no_successful_connections);
+		}
+	}
+#endif
+	FUNC_EXIT;
+}
+
+
+/**
+ * Write the numbers of subscriptions.  Non-wildcard subscriptions are held in one list per
+ * topic, and shared subscriptions in one list per group, so the lists are added up.
+ * @param e the response to fill in
+ */
+static void Metrics_subscriptions(Exposition* e)
+{
+	Node* current = NULL;
+	int subs = 0, members = 0;
+
+	FUNC_ENTRY;
+	while ((current = TreeNextElement(bstate->se->subs, current)) != NULL)
+		subs += ((List*)(current->content))->count;
+	while ((current = TreeNextElement(bstate->se->shared, current)) != NULL)
+		members += ((SharedSubscriptions*)(current->content))->members->count;
+
+	Metrics_value(e, "subscriptions", "gauge", "Non-wildcard subscriptions, other than shared subscriptions.", subs);
+	Metrics_value(e, "wildcard_subscriptions", "gauge", "Wildcard subscriptions, other than shared subscriptions.", bstate->se->wsubs->count);
+	Metrics_value(e, "shared_subscriptions", "gauge", "Subscriptions of members of shared subscription groups.", members);
+	Metrics_value(e, "shared_subscription_groups", "gauge", "Shared subscription groups.", bstate->se->shared->count);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Build the metrics response body from the current broker state.
+ * @param e the response to fill in
+ */
+static void Metrics_expose(Exposition* e)
+{
+	socket_stats* ss = Socket_getStats();
+	time_t now;
+	int stage;
+
+	FUNC_ENTRY;
+	time(&now);
+	Metrics_value(e, "uptime_seconds", "gauge", "Time since the broker started.", difftime(now, bstate->start_time));
+	Metrics_value(e, "messages_received_total", "counter", "Messages received.", bstate->msgs_received);
+	Metrics_value(e, "messages_sent_total", "counter", "Messages sent.", bstate->msgs_sent);
+	Metrics_value(e, "bytes_received_total", "counter", "Bytes received.", bstate->bytes_received);
+	Metrics_value(e, "bytes_sent_total", "counter", "Bytes sent.", bstate->bytes_sent);
+	Metrics_value(e, "heap_bytes", "gauge", "Heap in use.", Heap_get_info()->current_size);
+	Metrics_value(e, "heap_max_bytes", "gauge", "Most heap in use since the broker started.", Heap_get_info()->max_size);
+
+	Metrics_clients(e);
+	Metrics_subscriptions(e);
+	Metrics_value(e, "retained_messages", "gauge", "Retained messages.", SubscriptionEngines_retainedCount(bstate->se));
+	if (bstate->se->cache.size > 0)
+	{
+		Metrics_value(e, "subscription_cache_hits_total", "counter", "Publications whose subscribers were cached.", bstate->se->cache.hits);
+		Metrics_value(e, "subscription_cache_misses_total", "counter", "Publications whose subscribers were searched for.", bstate->se->cache.misses);
+	}
+	Metrics_value(e, "interned_topics", "gauge", "Topic names interned.", Topics_internInfo()->count);
+	if (bstate->password_file && bstate->acl_file)
+	{
+		Metrics_value(e, "acl_cache_hits_total", "counter", "Access decisions answered from the cache.", Users_getCacheStats()->hits);
+		Metrics_value(e, "acl_cache_misses_total", "counter", "Access decisions made from the access control list.", Users_getCacheStats()->misses);
+	}
+
+	Metrics_connections(e);
+	Metrics_type(e, "socket_waits_total", "counter", "Waits for sockets, by whether the broker had more work to do.");
+	Metrics_printf(e, METRICS_PREFIX "socket_waits_total{more_work=\"true\"} %d\n", ss->more_work_count);
+	Metrics_printf(e, METRICS_PREFIX "socket_waits_total{more_work=\"false\"} %d\n", ss->not_more_work_count);
+
+	for (stage = 0; stage < LATENCY_STAGES; ++stage)
+		Metrics_histogram(e, stage);
+	Metrics_value(e, "event_loop_slow_iterations_total", "counter", "Event loop iterations longer than slow_iteration_threshold.", Protocol_slowIterations());
+	Metrics_value(e, "log_queue_dropped_total", "counter", "Log messages dropped because the log queue was full.", Log_getQueueStats()->dropped);
+	Metrics_value(e, "ffdc_total", "counter", "Failure data captures written.", bstate->ffdc_count);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Find the value of a header in a request.
+ * @param request the request, with the header lines separated by CRLF
+ * @param name the header name, in lower case
+ * @return the value, or NULL if the header is not present
+ */
+static char* Metrics_header(char* request, char* name)
+{
+	char* line = request;
+	int len = strlen(name);
+
+	while ((line = strstr(line, "\r\n")) != NULL)
+	{
+		int i = 0;
+
+		line += 2;
+		while (i < len && tolower((unsigned char)line[i]) == name[i])
+			++i;
+		if (i == len && line[i] == ':')
+		{
+			for (line += len + 1; *line == ' '; ++line)
+				;
+			return line;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Answer one complete request.
+ * @param req the connection's request, which starts with the request to answer
+ * @param len the length of the request to answer, which is terminated
+ * @return 0 if the connection is still open, when req is still valid
+ */
+static int Metrics_respond(Request* req, int len)
+{
+	Exposition e;
+	char* status = "200 OK";
+	char* header = NULL;
+	char* value = NULL;
+	int closing = 0, head = 0, rc = 0, headerlen;
+
+	FUNC_ENTRY;
+	e.len = 0;
+	e.size = 1024;
+	e.buf = malloc(e.size);
+	head = strncmp(req->request, "HEAD ", 5) == 0;
+	if ((value = Metrics_header(req->request, "connection")) != NULL)
+		closing = (tolower((unsigned char)*value) == 'c');
+	else
+		closing = strstr(req->request, " HTTP/1.0\r\n") != NULL;
+
+	Log(TRACE_MIN, -1, "Metrics request on socket %d: %.*s", req->socket, (int)strcspn(req->request, "\r"), req->request);
+	if (strncmp(req->request, "GET ", 4) != 0 && !head)
+	{
+		status = "405 Method Not Allowed";
+		Metrics_printf(&e, "Only GET is supported\n");
+	}
+	else if (strncmp(&req->request[head ? 5 : 4], "/metrics ", 9) != 0 && strncmp(&req->request[head ? 5 : 4], "/ ", 2) != 0)
+	{
+		status = "404 Not Found";
+		Metrics_printf(&e, "Metrics are at /metrics\n");
+	}
+	else
+		Metrics_expose(&e);
+
+	header = malloc(160);
+	headerlen = sprintf(header, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		"Content-Length: %d\r\n%s\r\n", status, e.len, closing ? "Connection: close\r\n" : "");
+	if (head)
+		e.len = 0;
+	/* if the write is incomplete, the buffers are freed when it is finished */
+	if ((rc = Socket_putdatas(req->socket, header, headerlen, 1, &e.buf, &e.len)) != TCPSOCKET_INTERRUPTED)
+	{
+		free(header);
+		free(e.buf);
+	}
+	if (rc == SOCKET_ERROR || rc == TCPSOCKET_NOWORK || (rc == TCPSOCKET_COMPLETE && closing))
+	{
+		Socket_close(req->socket);
+		rc = SOCKET_ERROR;
+	}
+	else
+	{
+		req->closing = closing; /* an incomplete write is finished by the event loop first */
+		rc = 0;
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Answer the complete requests read from a connection.  Each is answered once the response to
+ * the one before has been written, so a request which has to wait is answered by
+ * Metrics_checkPendingWrites.
+ * @param req the connection's request
+ * @return 0 if the connection is still open, when req is still valid
+ */
+static int Metrics_process(Request* req)
+{
+	char* end = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	req->waiting = 0;
+	while (req->closing || (end = strstr(req->request, "\r\n\r\n")) != NULL)
+	{
+		int len = 0;
+
+		if (!Socket_noPendingWrites(req->socket))
+		{
+			req->waiting = 1;
+			break;
+		}
+		if (req->closing)
+		{
+			Socket_close(req->socket);
+			rc = SOCKET_ERROR;
+			break;
+		}
+		len = end - req->request + 4;
+		end[2] = '\0'; /* the header lines still each end with CRLF */
+		if ((rc = Metrics_respond(req, len)) != 0)
+			break;
+		req->len -= len;
+		memmove(req->request, &req->request[len], req->len + 1);
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Answer the requests which were waiting for a response to be written, now that the write has
+ * finished, and close the connections which asked to be closed after it.
+ */
+void Metrics_checkPendingWrites()
+{
+	ListElement* elem = NULL;
+
+	FUNC_ENTRY;
+	elem = requests->first;
+	while (elem)
+	{
+		Request* req = (Request*)(elem->content);
+
+		elem = elem->next; /* closing the connection frees the current element only */
+		if (req->waiting && Socket_noPendingWrites(req->socket))
+			Metrics_process(req);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Read from a metrics connection, and answer any complete request.
+ * @param sock the socket which is ready
+ */
+void Metrics_timeslice(int sock)
+{
+	Request* req = NULL;
+	int rc;
+
+	FUNC_ENTRY;
+	if (ListFindItem(requests, &sock, intcompare))
+		req = (Request*)(requests->current->content);
+	else
+	{
+		req = malloc(sizeof(Request));
+		req->socket = sock;
+		req->len = 0;
+		req->waiting = req->closing = 0;
+		ListAppend(requests, req, sizeof(Request));
+		Socket_removeNew(sock); /* no MQTT CONNECT is expected */
+	}
+
+	if ((rc = Socket_read(sock, &req->request[req->len], sizeof(req->request) - 1 - req->len)) == TCPSOCKET_INTERRUPTED)
+		goto exit;
+	if (rc == SOCKET_ERROR)
+	{
+		Socket_close(sock);
+		goto exit;
+	}
+	req->len += rc;
+	req->request[req->len] = '\0';
+
+	if (Metrics_process(req) != 0)
+		goto exit;
+	if (req->len == sizeof(req->request) - 1)
+	{
+		Log(TRACE_MIN, -1, "Metrics request on socket %d is too long", sock);
+		Socket_close(sock);
+	}
+exit:
+	FUNC_EXIT;
+}
@@ -0,0 +1,27 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+#if !defined(METRICS_H)
+#define METRICS_H
+
+#define METRICS_REQUEST_MAX 4096	/**< the longest HTTP request header accepted */
+
+void Metrics_initialize(void);
+void Metrics_terminate(void);
+void Metrics_timeslice(int sock);
+void Metrics_checkPendingWrites(void);
+
+#endif
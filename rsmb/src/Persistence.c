@@ -39,6 +39,27 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 
+#if defined(__linux__) && !defined(NO_ADMIN_COMMANDS) && !defined(NO_INOTIFY)
+/**
+ * Use inotify to find out when an admin command file arrives, rather than polling for it
+ */
+#define USE_INOTIFY 1
+#include <sys/inotify.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+#if defined(WIN32)
+#include <sys/timeb.h>
+#else
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
 #include "Heap.h"
 
 #if defined(WIN32)
@@ -83,6 +104,21 @@ property brokerProps[] =
 	{ "persistence", 2, offsetof(BrokerStates, persistence) }, /* synonym for retained_persistence */
 	{ "autosave_on_changes", 2, offsetof(BrokerStates, autosave_on_changes) },
 	{ "autosave_interval", PROPERTY_INT, offsetof(BrokerStates, autosave_interval) },
+	{ "persistence_journal", PROPERTY_BOOLEAN, offsetof(BrokerStates, persistence_journal) },
+	{ "persistence_fork", PROPERTY_BOOLEAN, offsetof(BrokerStates, persistence_fork) },
+	{ "persistence_mmap", PROPERTY_BOOLEAN, offsetof(BrokerStates, persistence_mmap) },
+	{ "fanout_threads", PROPERTY_INT, offsetof(BrokerStates, fanout_threads) },
+	{ "fanout_threshold", PROPERTY_INT, offsetof(BrokerStates, fanout_threshold) },
+	{ "subscription_cache_size", PROPERTY_INT, offsetof(BrokerStates, subscription_cache_size) },
+	{ "shared_subscription_policy", PROPERTY_STRING, offsetof(BrokerStates, shared_subscription_policy) },
+	{ "capture_file", PROPERTY_STRING, offsetof(BrokerStates, capture_file) },
+	{ "slow_iteration_threshold", PROPERTY_INT, offsetof(BrokerStates, slow_iteration_threshold) },
+	{ "topic_stats_depth", PROPERTY_INT, offsetof(BrokerStates, topic_stats_depth) },
+	{ "topic_stats_top", PROPERTY_INT, offsetof(BrokerStates, topic_stats_top) },
+	{ "slow_clients_top", PROPERTY_INT, offsetof(BrokerStates, slow_clients_top) },
+	{ "max_queued_bytes", PROPERTY_INT, offsetof(BrokerStates, max_queued_bytes) },
+	{ "max_queued_bytes_total", PROPERTY_INT, offsetof(BrokerStates, max_queued_bytes_total) },
+	{ "queue_drop_policy", PROPERTY_STRING, offsetof(BrokerStates, queue_drop_policy) },
 	{ "clientid_prefixes", 3, offsetof(BrokerStates, clientid_prefixes) },
 #if !defined(NO_BRIDGE)
 	{ "connection", 1, offsetof(BridgeConnections, name) },
@@ -134,6 +170,8 @@ property bridgeProps[] =
 	{ "connection", 1, offsetof(BridgeConnections, name) },
 	{ "notification_topic", 1, offsetof(BridgeConnections, notification_topic) },
 	{ "keepalive_interval", 0, offsetof(BridgeConnections, keepalive_interval) },
+	{ "inflight_window_min", PROPERTY_INT, offsetof(BridgeConnections, inflight_window_min) },
+	{ "inflight_window_max", PROPERTY_INT, offsetof(BridgeConnections, inflight_window_max) },
 	{ "start_type", 0, offsetof(BridgeConnections, start_type) },
 	{ "idle_timeout", 0, offsetof(BridgeConnections, idle_timeout) },
 	{ "threshold", 0, offsetof(BridgeConnections, threshold) },
@@ -165,6 +203,8 @@ property listenerProps[] =
 	{ "max_connections", 0, offsetof(Listener, max_connections) },
 	{ "mount_point", 1, offsetof(Listener, mount_point) },
 	{ "ipv6", 2, offsetof(Listener, ipv6) },
+	{ "inflight_window_min", PROPERTY_INT, offsetof(Listener, inflight_window_min) },
+	{ "inflight_window_max", PROPERTY_INT, offsetof(Listener, inflight_window_max) },
 #if defined(MQTTS)
 	{ "multicast_groups", 3, offsetof(Listener, multicast_groups) },
 	{ "advertise", 1, offsetof(Listener, advertise) },
@@ -537,7 +577,7 @@ Persistence_process_file(FILE* cfile, BrokerStates* bs, property* propsTable, in
 						}
 						else if (strcmp(pword, "listener") == 0)
 						{
-							/* listener port [address] [mqtt|mqtts] */
+							/* listener port [address] [mqtt|mqtts|metrics] */
 							propsTable = listenerProps;
 							props_count = listener_props_count;
 							s = Socket_new_listener();
@@ -550,6 +590,8 @@ Persistence_process_file(FILE* cfile, BrokerStates* bs, property* propsTable, in
 								{
 									if (strcmp(val, "mqtt") == 0)
 										((Listener*)s)->protocol = PROTOCOL_MQTT;
+									else if (strcmp(val, "metrics") == 0)
+										((Listener*)s)->protocol = PROTOCOL_METRICS;
 #if defined(MQTTS)
 									else if (strcmp(val, "mqtts") == 0)
 										((Listener*)s)->protocol = PROTOCOL_MQTTS;
@@ -789,7 +831,7 @@ int Persistence_read_config(char* filename, BrokerStates* bs, int config_set)
 	}
 #endif
 
-	bs->users = ListInitialize();
+	bs->users = TreeInitialize(userCompare);
 
 #if !defined(NO_BRIDGE)
 	if (bs->bridge.connections != NULL)
@@ -881,6 +923,12 @@ void Persistence_free_config(BrokerStates* bs)
 		free(bs->persistence_location);
 	if (bs->ffdc_location)
 		free(bs->ffdc_location);
+	if (bs->shared_subscription_policy)
+		free(bs->shared_subscription_policy);
+	if (bs->queue_drop_policy)
+		free(bs->queue_drop_policy);
+	if (bs->capture_file)
+		free(bs->capture_file);
 	ListFree(bs->clientid_prefixes);
 
     if (bs->password_file)
@@ -948,6 +996,27 @@ void Persistence_free_config(BrokerStates* bs)
 static FILE* rfile = NULL;	/**< Current persistence file handle */
 static char *cur_fn, *cur_backup_fn, *cur_backup_fn1;
 
+#if !defined(WIN32)
+/**
+ * Header of the retained message map file, broker.rmm.  It is followed by the topic names and
+ * payloads, then by the index, which has one entry per message in descending topic name order.
+ */
+typedef struct
+{
+	char eyecatcher[8];		/**< "RSMBRMM" */
+	int count;				/**< number of retained messages */
+	int reserved;			/**< unused */
+	long long index;		/**< offset of the index */
+} RetainedMapHeader;
+
+static char retained_map_eyecatcher[8] = "RSMBRMM";
+
+static RetainedMapEntry* map_index = NULL;	/**< index of the retained message map being written */
+static int map_count = 0,					/**< number of entries in the index */
+	map_size = 0;							/**< number of entries allocated */
+static long long map_offset = 0;			/**< where the next record goes in the map being written */
+#endif
+
 
 /**
  * Add the persistence location prefix to a filename
@@ -1034,12 +1103,31 @@ FILE* Persistence_open_common(char mode, char* fn, char* backup_fn, char* backup
 
 
 /**
- * Open the retained message persistence file
+ * Open the retained message persistence file.  With persistence_mmap, the file written is
+ * broker.rmm, which is mapped into memory at startup rather than read.
  * @param mode file mode to use
  * @return the opened file handle
  */
 FILE* Persistence_open_retained(char mode)
 {
+#if !defined(WIN32)
+	/* broker.rms is still read when there is no map, so that existing retained messages are kept */
+	if (mode == 'w' && bstate->persistence && bstate->persistence_mmap)
+	{
+		if (Persistence_open_common(mode, "broker.rmm", "broker.1mm", "broker.2mm") != NULL)
+		{
+			RetainedMapHeader header;
+
+			memset(&header, '\0', sizeof(header)); /* filled in when the file is closed */
+			fwrite(&header, sizeof(header), 1, rfile);
+			map_offset = sizeof(header);
+			map_count = 0;
+			map_size = 1024;
+			map_index = malloc(sizeof(RetainedMapEntry) * map_size);
+		}
+		return rfile;
+	}
+#endif
 	return Persistence_open_common(mode, "broker.rms", "broker.1ms", "broker.2ms");
 }
 
@@ -1056,30 +1144,31 @@ FILE* Persistence_open_subscriptions(char mode)
 
 
 /**
- * Write a retained message to the current persistence file
+ * Write a retained message to a persistence file
+ * @param file the file to write to
  * @param payload the message contents
  * @param payloadlen the length of the payload
  * @param qos quality of service
  * @param topicName the name of the topic
  * @return success indicator - success = 0, -1 otherwise
  */
-int Persistence_write_retained(char* payload, int payloadlen, int qos, char* topicName)
+static int Persistence_write_retained1(FILE* file, char* payload, int payloadlen, int qos, char* topicName)
 {
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if (rfile)
+	if (file)
 	{
 		int topiclen = strlen(topicName);
-		if (fwrite(&payloadlen, sizeof(int), 1, rfile) != 1)
+		if (fwrite(&payloadlen, sizeof(int), 1, file) != 1)
 			rc = -1;
-		if (fwrite(payload, payloadlen, 1, rfile) != 1)
+		if (fwrite(payload, payloadlen, 1, file) != 1)
 			rc = -1;
-		if (fwrite(&qos, sizeof(int), 1, rfile) != 1)
+		if (fwrite(&qos, sizeof(int), 1, file) != 1)
 			rc = -1;
-		if (fwrite(&topiclen, sizeof(int), 1, rfile) != 1)
+		if (fwrite(&topiclen, sizeof(int), 1, file) != 1)
 			rc = -1;
-		if (fwrite(topicName, topiclen, 1, rfile) != 1)
+		if (fwrite(topicName, topiclen, 1, file) != 1)
 			rc = -1;
 	}
 	else
@@ -1090,29 +1179,64 @@ int Persistence_write_retained(char* payload, int payloadlen, int qos, char* top
 
 
 /**
- * Read a retained publication from the current persistence file
+ * Write a retained message to the current persistence file
+ * @param payload the message contents
+ * @param payloadlen the length of the payload
+ * @param qos quality of service
+ * @param topicName the name of the topic
+ * @return success indicator - success = 0, -1 otherwise
+ */
+int Persistence_write_retained(char* payload, int payloadlen, int qos, char* topicName)
+{
+#if !defined(WIN32)
+	if (map_index)
+	{
+		int topiclen = strlen(topicName) + 1; /* including the null, so the map can be used directly */
+		RetainedMapEntry* e = NULL;
+
+		if (map_count == map_size)
+		{
+			map_size *= 2;
+			map_index = realloc(map_index, sizeof(RetainedMapEntry) * map_size);
+		}
+		e = &map_index[map_count++];
+		e->topic = map_offset;
+		e->payload = map_offset + topiclen;
+		e->payloadlen = payloadlen;
+		e->qos = qos;
+		map_offset += topiclen + payloadlen;
+		return (fwrite(topicName, topiclen, 1, rfile) == 1 && fwrite(payload, payloadlen, 1, rfile) == 1) ? 0 : -1;
+	}
+#endif
+	return Persistence_write_retained1(rfile, payload, payloadlen, qos, topicName);
+}
+
+
+/**
+ * Read a retained publication from a persistence file
+ * @param file the file to read from
  * @return the retained publication read from the file
  */
-RetainedPublications* Persistence_read_retained()
+static RetainedPublications* Persistence_read_retained1(FILE* file)
 {
 	RetainedPublications* r = NULL;
 
 	FUNC_ENTRY;
-	if (rfile != NULL)
+	if (file != NULL)
 	{
 		int topiclen;
 		int success = 0;
 		r = malloc(sizeof(RetainedPublications));
 
-		if (fread(&(r->payloadlen), sizeof(int), 1, rfile) == 1)
+		if (fread(&(r->payloadlen), sizeof(int), 1, file) == 1)
 		{
 			r->payload = malloc(r->payloadlen);
-			if (fread(r->payload, r->payloadlen, 1, rfile) == 1 &&
-				fread(&(r->qos), sizeof(int), 1, rfile) == 1 &&
-				fread(&topiclen, sizeof(int), 1, rfile) == 1)
+			if (fread(r->payload, r->payloadlen, 1, file) == 1 &&
+				fread(&(r->qos), sizeof(int), 1, file) == 1 &&
+				fread(&topiclen, sizeof(int), 1, file) == 1)
 			{
 				r->topicName = malloc(topiclen + 1);
-				if (fread(r->topicName, topiclen, 1, rfile) == 1)
+				if (fread(r->topicName, topiclen, 1, file) == 1)
 				{
 					r->topicName[topiclen] = '\0';
 					success = 1;
@@ -1138,31 +1262,42 @@ RetainedPublications* Persistence_read_retained()
 
 
 /**
- * Write a subscription to the current persistence file
+ * Read a retained publication from the current persistence file
+ * @return the retained publication read from the file
+ */
+RetainedPublications* Persistence_read_retained()
+{
+	return Persistence_read_retained1(rfile);
+}
+
+
+/**
+ * Write a subscription to a persistence file
+ * @param file the file to write to
  * @param s pointer to the subcription information
  * @return success indicator - success = 0, -1 otherwise
  */
-int Persistence_write_subscription(Subscriptions* s)
+static int Persistence_write_subscription1(FILE* file, Subscriptions* s)
 {
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if (rfile)
+	if (file)
 	{
 		int len = strlen(s->clientName);
 
-		if (fwrite(&len, sizeof(int), 1, rfile) != 1)
+		if (fwrite(&len, sizeof(int), 1, file) != 1)
 			rc = -1;
-		if (fwrite(s->clientName, len, 1, rfile) != 1)
+		if (fwrite(s->clientName, len, 1, file) != 1)
 			rc = -1;
-		if (fwrite(&(s->noLocal), sizeof(int), 1, rfile) != 1)
+		if (fwrite(&(s->noLocal), sizeof(int), 1, file) != 1)
 			rc = -1;
-		if (fwrite(&(s->qos), sizeof(int), 1, rfile) != 1)
+		if (fwrite(&(s->qos), sizeof(int), 1, file) != 1)
 			rc = -1;
 		len = strlen(s->topicName);
-		if (fwrite(&len, sizeof(int), 1, rfile) != 1)
+		if (fwrite(&len, sizeof(int), 1, file) != 1)
 			rc = -1;
-		if (fwrite(s->topicName, len, 1, rfile) != 1)
+		if (fwrite(s->topicName, len, 1, file) != 1)
 			rc = -1;
 	}
 	else
@@ -1172,6 +1307,17 @@ int Persistence_write_subscription(Subscriptions* s)
 }
 
 
+/**
+ * Write a subscription to the current persistence file
+ * @param s pointer to the subcription information
+ * @return success indicator - success = 0, -1 otherwise
+ */
+int Persistence_write_subscription(Subscriptions* s)
+{
+	return Persistence_write_subscription1(rfile, s);
+}
+
+
 /**
  * Create a default client structure with suitably allocated storage
  * @param clientID the client id string to use
@@ -1195,34 +1341,36 @@ Clients* Persistence_createDefaultClient(char* clientID)
 
 
 /**
- * Read a subscription entry from the current persistence file
+ * Read a subscription entry from a persistence file
+ * @param file the file to read from
+ * @param add_client boolean - should the client be added to the disconnected clients if it is not known?
  * @return pointer to the subscription structure read, or NULL if there was an error
  */
-Subscriptions* Persistence_read_subscription()
+static Subscriptions* Persistence_read_subscription1(FILE* file, int add_client)
 {
 	Subscriptions* s = NULL;
 
 	FUNC_ENTRY;
-	if (rfile != NULL)
+	if (file != NULL)
 	{
 		int len;
 		int success = 0;
 		s = malloc(sizeof(Subscriptions));
 		memset(s, '\0', sizeof(Subscriptions));
 
-		if (fread(&(len), sizeof(int), 1, rfile) == 1)
+		if (fread(&(len), sizeof(int), 1, file) == 1)
 		{
 			/* s->was_persisted = 1; */
 			s->clientName = malloc(len+1);
 			s->clientName[len] = '\0';
 
-			if (fread(s->clientName, len, 1, rfile) == 1 &&
-				fread(&(s->noLocal), sizeof(int), 1, rfile) == 1 &&
-				fread(&(s->qos), sizeof(int), 1, rfile) == 1 &&
-				fread(&len, sizeof(int), 1, rfile) == 1)
+			if (fread(s->clientName, len, 1, file) == 1 &&
+				fread(&(s->noLocal), sizeof(int), 1, file) == 1 &&
+				fread(&(s->qos), sizeof(int), 1, file) == 1 &&
+				fread(&len, sizeof(int), 1, file) == 1)
 			{
 				s->topicName = malloc(len + 1);
-				if (fread(s->topicName, len, 1, rfile) == 1)
+				if (fread(s->topicName, len, 1, file) == 1)
 				{
 					Node* elem = NULL;
 					s->topicName[len] = '\0';
@@ -1231,7 +1379,9 @@ Subscriptions* Persistence_read_subscription()
 					s->priority = PRIORITY_NORMAL;
 					success = 1;
 					 
-					if ((elem = TreeFind(bstate->disconnected_clients, s->clientName)) == NULL)
+					if (!add_client)
+						;
+					else if ((elem = TreeFind(bstate->disconnected_clients, s->clientName)) == NULL)
 					{
 						/*printf("adding sub for client %s\n", s->clientName);*/ 
 						TreeAdd(bstate->disconnected_clients, Persistence_createDefaultClient(s->clientName),
@@ -1263,11 +1413,44 @@ Subscriptions* Persistence_read_subscription()
 }
 
 
+/**
+ * Read a subscription entry from the current persistence file
+ * @return pointer to the subscription structure read, or NULL if there was an error
+ */
+Subscriptions* Persistence_read_subscription()
+{
+	return Persistence_read_subscription1(rfile, 1);
+}
+
+
 /**
  * Close the current persistence file.
  */
 void Persistence_close_file(int write_error)
 {
+#if !defined(WIN32)
+	if (map_index)
+	{
+		if (rfile && write_error == 0)
+		{
+			RetainedMapHeader header;
+			char pad[8];
+			int padlen = (8 - (map_offset % 8)) % 8; /* align the index */
+
+			memset(pad, '\0', sizeof(pad));
+			memset(&header, '\0', sizeof(header));
+			memcpy(header.eyecatcher, retained_map_eyecatcher, sizeof(header.eyecatcher));
+			header.count = map_count;
+			header.index = map_offset + padlen;
+			if ((padlen > 0 && fwrite(pad, padlen, 1, rfile) != 1) ||
+				(map_count > 0 && fwrite(map_index, sizeof(RetainedMapEntry), map_count, rfile) != map_count) ||
+				fseek(rfile, 0L, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, rfile) != 1)
+				write_error = -1;
+		}
+		free(map_index);
+		map_index = NULL;
+	}
+#endif
 	if (rfile)
 	{
 		char* bak1 = add_prefix(cur_backup_fn1);
@@ -1294,6 +1477,660 @@ void Persistence_close_file(int write_error)
 }
 
 
+/**
+ * Check that every index entry of a mapped retained message file refers to a topic name and
+ * payload within the data, between the header and the index, so that a truncated or corrupt
+ * file is never read outside the mapping.
+ * @param base the start of the mapped file
+ * @param header the file header, already checked to place the index within the file
+ * @return boolean - are all the entries within bounds?
+ */
+static int Persistence_check_map(char* base, RetainedMapHeader* header)
+{
+	RetainedMapEntry* index = (RetainedMapEntry*)(base + header->index);
+	long long start = sizeof(RetainedMapHeader);
+	long long end = header->index; /* the topic names and payloads come before the index */
+	int i;
+
+	for (i = 0; i < header->count; ++i)
+	{
+		RetainedMapEntry* e = &index[i];
+
+		if (e->topic < start || e->topic >= end || memchr(base + e->topic, '\0', end - e->topic) == NULL
+			|| e->payloadlen < 0 || e->payload < start || e->payload > end || e->payloadlen > end - e->payload
+			|| e->qos < 0 || e->qos > 2)
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Map the retained message file written with persistence_mmap into memory, so that the
+ * retained messages can be used without reading them in.  If the file is not a complete,
+ * consistent map, it is not used and broker.rms is read instead.
+ * @return the retained message map, or NULL if there is no map to use
+ */
+RetainedMap* Persistence_map_retained()
+{
+	RetainedMap* m = NULL;
+
+	FUNC_ENTRY;
+#if !defined(WIN32)
+	if (bstate->persistence && bstate->persistence_mmap)
+	{
+		char* fn = "broker.rmm";
+		char* loc = add_prefix(fn);
+		struct stat buf;
+		int fd = -1;
+
+		/* if there is no map yet, broker.rms is read instead */
+		if ((fd = open(loc, O_RDONLY)) != -1 && fstat(fd, &buf) == 0 && buf.st_size >= sizeof(RetainedMapHeader))
+		{
+			char* base = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			RetainedMapHeader* header = (RetainedMapHeader*)base;
+
+			if (base == MAP_FAILED)
+				Log(LOG_WARNING, 161, NULL, loc, errno);
+			else if (memcmp(header->eyecatcher, retained_map_eyecatcher, sizeof(header->eyecatcher)) != 0
+				|| header->count < 0 || header->index < sizeof(RetainedMapHeader)
+				|| header->index % 8 != 0
+				|| header->index + header->count * (long long)sizeof(RetainedMapEntry) > buf.st_size
+				|| !Persistence_check_map(base, header))
+			{
+				Log(LOG_WARNING, 161, NULL, loc, 0);
+				munmap(base, buf.st_size);
+			}
+			else
+			{
+				/* the publication structures are filled in as they are used: anonymous pages
+				   don't take up memory until then */
+				size_t entries_len = sizeof(RetainedPublications) * ((header->count > 0) ? header->count : 1);
+				void* entries = mmap(NULL, entries_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+				if (entries == MAP_FAILED)
+				{
+					Log(LOG_WARNING, 161, NULL, loc, errno);
+					munmap(base, buf.st_size);
+				}
+				else
+				{
+					m = malloc(sizeof(RetainedMap));
+					m->base = base;
+					m->length = buf.st_size;
+					m->count = header->count;
+					m->index = (RetainedMapEntry*)(base + header->index);
+					m->entries = entries;
+					if (bstate->se == NULL) /* starting up, rather than mapping a new save */
+						Log(LOG_INFO, 11, NULL, Messages_get(139, LOG_INFO), loc);
+				}
+			}
+		}
+		if (fd != -1)
+			close(fd);
+		free_prefix(loc, fn);
+	}
+#endif
+	FUNC_EXIT;
+	return m;
+}
+
+
+/**
+ * Unmap a retained message file.
+ * @param m the retained message map, as returned by Persistence_map_retained
+ */
+void Persistence_unmap_retained(RetainedMap* m)
+{
+	FUNC_ENTRY;
+#if !defined(WIN32)
+	munmap(m->entries, sizeof(RetainedPublications) * ((m->count > 0) ? m->count : 1));
+	munmap(m->base, m->length);
+	free(m);
+#endif
+	FUNC_EXIT;
+}
+
+
+static char* journal_fn = "broker.jnl";		/**< journal file name */
+static char* prev_journal_fn = "broker.1nl";	/**< journal being superseded by a background snapshot */
+static FILE* jfile = NULL;		/**< journal file handle */
+static int jfile_writing = 0;	/**< is the journal open for writing? */
+static int journal_pending = 0;	/**< have records been written since the journal was last flushed? */
+
+
+/**
+ * Add the contents of one file to the end of another, then remove the first.  If the
+ * second file does not exist, the first is just renamed.
+ * @param from the name of the file to be added, with the persistence location prefix
+ * @param to the name of the file to add to, with the persistence location prefix
+ * @return 0 if the contents of from, if any, are now in to, -1 otherwise
+ */
+static int Persistence_append_file(char* from, char* to)
+{
+	FILE *ffile = NULL,
+		*tfile = NULL;
+	char buf[4096];
+	size_t len;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((ffile = fopen(from, "rb")) == NULL)
+		goto exit; /* nothing to add */
+	if ((tfile = fopen(to, "rb")) == NULL)
+	{
+		fclose(ffile);
+		rc = rename(from, to);
+		goto exit;
+	}
+	fclose(tfile);
+	if ((tfile = fopen(to, "ab")) == NULL)
+		rc = -1;
+	else
+	{
+		while (rc == 0 && (len = fread(buf, 1, sizeof(buf), ffile)) > 0)
+			if (fwrite(buf, 1, len, tfile) != len)
+				rc = -1;
+		if (fclose(tfile) != 0)
+			rc = -1;
+	}
+	fclose(ffile);
+	if (rc == 0)
+		_unlink(from);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Open the journal of changes made to retained messages and durable subscriptions since
+ * the last save.  Any currently open journal is closed first.
+ * @param mode 'r' to replay the journal, 'a' to add to it, 'w' to start an empty journal
+ * @return the opened file handle
+ */
+FILE* Persistence_open_journal(char mode)
+{
+	char* fn = journal_fn;
+
+	FUNC_ENTRY;
+	Persistence_close_journal();
+	if (bstate->persistence && bstate->persistence_journal)
+	{
+		char* type = Messages_get(157, LOG_INFO);
+		char* loc = add_prefix(fn);
+
+		if (mode == 'r')
+		{
+			char* prev = add_prefix(prev_journal_fn);
+
+			/* a journal left by an unfinished background snapshot holds the earlier records */
+			if (Persistence_append_file(loc, prev) == 0)
+				rename(prev, loc);
+			free_prefix(prev, prev_journal_fn);
+			/* no journal just means there were no changes after the last save */
+			if ((jfile = fopen(loc, "rb")) != NULL)
+				Log(LOG_INFO, 11, NULL, type, loc);
+		}
+		else if ((jfile = fopen(loc, (mode == 'w') ? "wb" : "ab")) == NULL)
+			Log(LOG_WARNING, 9, NULL, type, loc, type);
+		else
+			jfile_writing = 1;
+		free_prefix(loc, fn);
+	}
+	FUNC_EXIT;
+	return jfile;
+}
+
+
+/**
+ * Close the journal file.
+ */
+void Persistence_close_journal()
+{
+	FUNC_ENTRY;
+	if (jfile)
+	{
+		fclose(jfile);
+		jfile = NULL;
+	}
+	jfile_writing = journal_pending = 0;
+	FUNC_EXIT;
+}
+
+
+/**
+ * Write out any journal records held in the file buffer.  Called once per pass of the
+ * main loop, so that many changes made in one pass cost one write.
+ */
+void Persistence_flush_journal()
+{
+	if (journal_pending)
+	{
+		if (fflush(jfile) != 0)
+		{
+			Log(LOG_WARNING, 158, NULL);
+			Persistence_close_journal();
+		}
+		journal_pending = 0;
+	}
+}
+
+
+/**
+ * Finish writing a journal record.  If the write failed, stop journaling - changes are
+ * then only saved by the next autosave, which also starts a new journal.
+ * @param rc the return code from writing the record
+ * @return the return code
+ */
+static int Persistence_journal_written(int rc)
+{
+	if (rc != 0)
+	{
+		Log(LOG_WARNING, 158, NULL);
+		Persistence_close_journal();
+	}
+	else
+		journal_pending = 1;
+	return rc;
+}
+
+
+/**
+ * Add the setting or clearing of a retained message to the journal.
+ * @param topicName the name of the topic
+ * @param qos quality of service
+ * @param payload the message contents
+ * @param payloadlen the length of the payload - 0 means clear the retained message
+ * @return success indicator - success = 0, -1 otherwise
+ */
+int Persistence_journal_retained(char* topicName, int qos, char* payload, int payloadlen)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (jfile_writing)
+	{
+		int type = (payloadlen == 0) ? JOURNAL_CLEAR_RETAINED : JOURNAL_SET_RETAINED;
+
+		if (fwrite(&type, sizeof(int), 1, jfile) != 1)
+			rc = -1;
+		else if (type == JOURNAL_SET_RETAINED)
+			rc = Persistence_write_retained1(jfile, payload, payloadlen, qos, topicName);
+		else
+		{
+			int topiclen = strlen(topicName);
+
+			if (fwrite(&topiclen, sizeof(int), 1, jfile) != 1 || fwrite(topicName, topiclen, 1, jfile) != 1)
+				rc = -1;
+		}
+		rc = Persistence_journal_written(rc);
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Add the creation or removal of a durable subscription to the journal.
+ * @param s pointer to the subscription information
+ * @param subscribe boolean - is the subscription being made (rather than removed)?
+ * @return success indicator - success = 0, -1 otherwise
+ */
+int Persistence_journal_subscription(Subscriptions* s, int subscribe)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (jfile_writing)
+	{
+		int type = (subscribe) ? JOURNAL_SUBSCRIBE : JOURNAL_UNSUBSCRIBE;
+
+		if (fwrite(&type, sizeof(int), 1, jfile) != 1)
+			rc = -1;
+		else
+			rc = Persistence_write_subscription1(jfile, s);
+		rc = Persistence_journal_written(rc);
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Read the next record from the journal.  An incomplete record at the end of the file,
+ * as left by a crash while it was being written, is treated as the end of the journal.
+ * @param content returns a RetainedPublications structure for retained message records
+ * (with a NULL payload for a clear), or a Subscriptions structure for subscription records
+ * @return the record type, or 0 at the end of the journal
+ */
+int Persistence_read_journal(void** content)
+{
+	int type = 0;
+
+	FUNC_ENTRY;
+	*content = NULL;
+	if (jfile != NULL && !jfile_writing && fread(&type, sizeof(int), 1, jfile) == 1)
+	{
+		if (type == JOURNAL_SET_RETAINED)
+			*content = Persistence_read_retained1(jfile);
+		else if (type == JOURNAL_CLEAR_RETAINED)
+		{
+			int topiclen;
+
+			if (fread(&topiclen, sizeof(int), 1, jfile) == 1 && topiclen >= 0)
+			{
+				RetainedPublications* r = malloc(sizeof(RetainedPublications));
+
+				memset(r, '\0', sizeof(RetainedPublications));
+				r->topicName = malloc(topiclen + 1);
+				if (fread(r->topicName, topiclen, 1, jfile) == 1 || topiclen == 0)
+				{
+					r->topicName[topiclen] = '\0';
+					*content = r;
+				}
+				else
+				{
+					free(r->topicName);
+					free(r);
+				}
+			}
+		}
+		else if (type == JOURNAL_SUBSCRIBE || type == JOURNAL_UNSUBSCRIBE)
+			*content = Persistence_read_subscription1(jfile, type == JOURNAL_SUBSCRIBE);
+		if (*content == NULL)
+			type = 0;
+	}
+	FUNC_EXIT_RC(type);
+	return type;
+}
+
+
+
+static Persistence_snapshotStats snapshot_stats = { 0, 0, 0, 0L };
+static struct
+{
+	int pid;		/**< process id of the running background snapshot, 0 if there is none */
+	int fd;			/**< pipe on which the background snapshot reports how long it took */
+	int changes;	/**< count of changes saved by the background snapshot */
+	double start;	/**< when the current snapshot was started, in milliseconds */
+} snapshot = { 0, -1, 0, 0.0 };
+
+
+/**
+ * Get the current time for timing snapshots.
+ * @return the time in milliseconds
+ */
+static double Persistence_now()
+{
+#if defined(WIN32)
+	struct timeb ts;
+
+	ftime(&ts);
+	return ts.time * 1000.0 + ts.millitm;
+#else
+	struct timeval ts;
+
+	gettimeofday(&ts, NULL);
+	return ts.tv_sec * 1000.0 + ts.tv_usec / 1000.0;
+#endif
+}
+
+
+/**
+ * Get the size of the saved retained message and subscription files.
+ * @return the total size in bytes
+ */
+static long Persistence_snapshot_size()
+{
+	char* fns[] = { "broker.rms", "broker.sub" };
+	long size = 0L;
+	int i;
+
+	if (bstate->persistence_mmap)
+		fns[0] = "broker.rmm";
+
+	for (i = 0; i < sizeof(fns)/sizeof(fns[0]); ++i)
+	{
+		char* loc = add_prefix(fns[i]);
+		struct stat buf;
+
+		if (stat(loc, &buf) == 0)
+			size += (long)buf.st_size;
+		free_prefix(loc, fns[i]);
+	}
+	return size;
+}
+
+
+/**
+ * Record the outcome of a snapshot.
+ * @param rc the return code from writing the snapshot - 0 is success
+ * @param duration how long the snapshot took, in milliseconds
+ */
+static void Persistence_snapshot_taken(int rc, int duration)
+{
+	if (rc == 0)
+	{
+		char* prev = add_prefix(prev_journal_fn);
+
+		_unlink(prev); /* the records in the previous journal are now in the saved state */
+		free_prefix(prev, prev_journal_fn);
+		snapshot_stats.count++;
+		snapshot_stats.duration = duration;
+		snapshot_stats.size = Persistence_snapshot_size();
+	}
+	else
+		snapshot_stats.failures++;
+}
+
+
+/**
+ * Start timing a snapshot taken in the broker process.
+ */
+void Persistence_begin_snapshot()
+{
+	snapshot.start = Persistence_now();
+}
+
+
+/**
+ * Finish timing a snapshot taken in the broker process.
+ * @param rc the return code from writing the snapshot - 0 is success
+ */
+void Persistence_end_snapshot(int rc)
+{
+	Persistence_snapshot_taken(rc, (int)(Persistence_now() - snapshot.start));
+}
+
+
+#if !defined(WIN32)
+/**
+ * Start a new journal for the changes made while a background snapshot is running, by renaming
+ * the old one, which is kept until the snapshot has succeeded.  If there is still one from an
+ * earlier snapshot which failed, the current journal is kept instead: its records are replayed
+ * after the snapshot is loaded, which is harmless.  Nothing is copied, so the broker is not held
+ * up by a long journal.
+ */
+static void Persistence_rotate_journal()
+{
+	FUNC_ENTRY;
+	if (bstate->persistence_journal)
+	{
+		char* loc = add_prefix(journal_fn);
+		char* prev = add_prefix(prev_journal_fn);
+		struct stat buf;
+
+		if (stat(prev, &buf) != 0)
+		{
+			char mode = 'w';
+
+			Persistence_close_journal();
+			if (rename(loc, prev) != 0 && errno != ENOENT)
+			{
+				Log(LOG_WARNING, 158, NULL);
+				mode = 'a'; /* the records couldn't be moved, so keep adding to them */
+			}
+			Persistence_open_journal(mode);
+		}
+		free_prefix(loc, journal_fn);
+		free_prefix(prev, prev_journal_fn);
+	}
+	FUNC_EXIT;
+}
+#endif
+
+
+/**
+ * Start a snapshot of the retained messages and subscriptions in a child process.  The
+ * child has a copy-on-write image of the broker's memory, so it can write out the state as
+ * it was at the time of the fork while the broker carries on serving clients.
+ * @param changes the number of changes the snapshot will save, counted again if it fails
+ * @return 0 in the child, the child process id in the broker, -1 if the snapshot is to be
+ * taken in the broker process instead, or -2 if a background snapshot is already running
+ */
+int Persistence_fork_snapshot(int changes)
+{
+	int rc = -1;
+
+	FUNC_ENTRY;
+#if !defined(WIN32)
+	if (bstate->persistence && bstate->persistence_fork)
+	{
+		int fds[2];
+
+		if (snapshot.pid != 0)
+			rc = -2;
+		else if (pipe(fds) != 0)
+			Log(LOG_WARNING, 159, NULL, errno);
+		else
+		{
+			Log_flush(); /* so that queued log messages aren't written out by both processes */
+			snapshot.start = Persistence_now();
+			if ((rc = fork()) == 0)
+			{
+				close(fds[0]);
+				snapshot.fd = fds[1];
+				Log_setPublish(0); /* the child must not write to client sockets */
+			}
+			else if (rc > 0)
+			{
+				close(fds[1]);
+				snapshot.fd = fds[0];
+				snapshot.pid = rc;
+				snapshot.changes = changes;
+				Persistence_rotate_journal();
+			}
+			else
+			{
+				Log(LOG_WARNING, 159, NULL, errno);
+				close(fds[0]);
+				close(fds[1]);
+				rc = -1;
+			}
+		}
+	}
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * End a background snapshot, reporting how long it took to the broker process.  Called in
+ * the child process, and does not return.
+ * @param rc the return code from writing the snapshot - 0 is success
+ */
+void Persistence_exit_snapshot(int rc)
+{
+#if !defined(WIN32)
+	int duration = (int)(Persistence_now() - snapshot.start);
+
+	if (write(snapshot.fd, &duration, sizeof(int)) != sizeof(int))
+		rc = -1;
+	fflush(stdout);
+	_exit((rc == 0) ? 0 : 1); /* leave the broker's buffered files and sockets alone */
+#endif
+}
+
+
+/**
+ * Collect the result of a background snapshot, if one has finished.
+ * @param wait whether to wait for a running snapshot to finish
+ */
+static void Persistence_reap_snapshot(int wait)
+{
+#if !defined(WIN32)
+	int status = 0;
+	int pid = 0;
+
+	if (snapshot.pid == 0)
+		return;
+	while ((pid = waitpid(snapshot.pid, &status, wait ? 0 : WNOHANG)) == -1 && errno == EINTR)
+		;
+	if (pid == snapshot.pid || pid == -1)
+	{
+		int duration = 0;
+		int rc = (pid == snapshot.pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+
+		if (rc == 0 && read(snapshot.fd, &duration, sizeof(int)) != sizeof(int))
+			rc = -1;
+		close(snapshot.fd);
+		snapshot.fd = -1;
+		snapshot.pid = 0;
+		if (rc != 0)
+		{
+			Log(LOG_WARNING, 160, NULL, status);
+			bstate->se->retained_changes += snapshot.changes;
+		}
+		else
+			SubscriptionEngines_remapRetained(bstate->se);
+		Persistence_snapshot_taken(rc, duration);
+	}
+#endif
+}
+
+
+/**
+ * Collect the result of a background snapshot without waiting for it.  Called once per
+ * pass of the main loop.
+ */
+void Persistence_check_snapshot()
+{
+	Persistence_reap_snapshot(0);
+}
+
+
+/**
+ * Wait for any running background snapshot to finish.
+ */
+void Persistence_wait_snapshot()
+{
+	FUNC_ENTRY;
+	Persistence_reap_snapshot(1);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Is a background snapshot running?
+ * @return boolean
+ */
+int Persistence_snapshot_running()
+{
+	return snapshot.pid != 0;
+}
+
+
+/**
+ * Get the statistics about snapshots of the retained messages and subscriptions.
+ * @return pointer to the statistics structure
+ */
+Persistence_snapshotStats* Persistence_getSnapshotStats()
+{
+	return &snapshot_stats;
+}
+
 #if !defined(NO_ADMIN_COMMANDS)
 int xxx_create_segfault(char* dest)
 {
@@ -1391,6 +2228,124 @@ int Persistence_read_admin(char* filename, BrokerStates* bs)
 }
 
 
+#if defined(USE_INOTIFY)
+static int command_watch_fd = -1;		/**< inotify descriptor watching the command file directory */
+static char* command_file_name = NULL;	/**< name of the command file within the watched directory */
+static int command_pending = 0;			/**< a command file may be waiting to be read */
+
+
+/**
+ * Start watching the persistence directory for the arrival of the update file, so
+ * that the main loop need not look for it on every pass.  If the directory cannot be
+ * watched, the update file is looked for on every pass as before.
+ * @param bs pointer to the broker state structure
+ */
+void Persistence_open_command_channel(BrokerStates* bs)
+{
+	char* fn = "broker.upd";
+	char* cmd_file = add_prefix(fn);
+	char* dir = NULL;
+	char* sep = strrchr(cmd_file, '/');
+
+	FUNC_ENTRY;
+	if (sep == NULL)
+	{
+		dir = ".";
+		command_file_name = malloc(strlen(cmd_file) + 1);
+		strcpy(command_file_name, cmd_file);
+	}
+	else
+	{
+		command_file_name = malloc(strlen(sep + 1) + 1);
+		strcpy(command_file_name, sep + 1);
+		dir = malloc(sep - cmd_file + 2);
+		strncpy(dir, cmd_file, sep - cmd_file + 1); /* keep the separator, so that "/" works */
+		dir[sep - cmd_file + 1] = '\0';
+	}
+
+	if ((command_watch_fd = inotify_init()) == -1 ||
+		inotify_add_watch(command_watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+	{
+		Log(LOG_WARNING, 156, NULL, dir, errno);
+		if (command_watch_fd != -1)
+			close(command_watch_fd);
+		command_watch_fd = -1;
+	}
+	else
+	{
+		fcntl(command_watch_fd, F_SETFL, fcntl(command_watch_fd, F_GETFL, 0) | O_NONBLOCK);
+		Socket_setNotifier(command_watch_fd);
+		command_pending = 1; /* pick up any command file written before we started watching */
+	}
+	if (sep != NULL)
+		free(dir);
+	free_prefix(cmd_file, fn);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Stop watching for the update file.
+ */
+void Persistence_close_command_channel()
+{
+	FUNC_ENTRY;
+	if (command_watch_fd != -1)
+	{
+		Socket_setNotifier(-1);
+		close(command_watch_fd);
+		command_watch_fd = -1;
+	}
+	if (command_file_name)
+	{
+		free(command_file_name);
+		command_file_name = NULL;
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Read any inotify events which have arrived, to see if the update file has been written.
+ * @return boolean - should the update file be read?
+ */
+static int Persistence_command_arrived()
+{
+	int rc = command_pending;
+
+	command_pending = 0;
+	if (Socket_notified())
+	{
+		char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+		int len;
+
+		while ((len = read(command_watch_fd, buf, sizeof(buf))) > 0)
+		{
+			char* ptr = buf;
+
+			while (ptr < buf + len)
+			{
+				struct inotify_event* event = (struct inotify_event*)ptr;
+
+				if (event->len > 0 && strcmp(event->name, command_file_name) == 0)
+					rc = 1;
+				ptr += sizeof(struct inotify_event) + event->len;
+			}
+		}
+	}
+	return rc;
+}
+#else
+void Persistence_open_command_channel(BrokerStates* bs)
+{
+}
+
+void Persistence_close_command_channel()
+{
+}
+#endif
+
+
 /**
  * Read a command from the update file and run it.
  * @param bs pointer to the broker state structure
@@ -1398,10 +2353,15 @@ int Persistence_read_admin(char* filename, BrokerStates* bs)
 void Persistence_read_command(BrokerStates* bs)
 {
 	char* fn = "broker.upd";
-	char* cmd_file = add_prefix(fn);
+	char* cmd_file = NULL;
 	struct stat buf;
 
 	FUNC_ENTRY;
+#if defined(USE_INOTIFY)
+	if (command_watch_fd != -1 && !Persistence_command_arrived())
+		goto exit; /* no filesystem work unless the command file has been written */
+#endif
+	cmd_file = add_prefix(fn);
 	if (stat(cmd_file, &buf) != -1)
 	{
 		int saved = trace_settings.log_level;
@@ -1413,6 +2373,9 @@ void Persistence_read_command(BrokerStates* bs)
 		trace_settings.log_level = saved;
 	}
 	free_prefix(cmd_file, fn);
+#if defined(USE_INOTIFY)
+exit:
+#endif
 	FUNC_EXIT;
 }
 
@@ -33,6 +33,55 @@ int Persistence_write_subscription(Subscriptions*);
 Subscriptions* Persistence_read_subscription();
 void Persistence_close_file(int);
 
+RetainedMap* Persistence_map_retained();
+void Persistence_unmap_retained(RetainedMap* m);
+
+/**
+ * Types of record in the persistence journal
+ */
+enum
+{
+	JOURNAL_SET_RETAINED = 1,
+	JOURNAL_CLEAR_RETAINED,
+	JOURNAL_SUBSCRIBE,
+	JOURNAL_UNSUBSCRIBE
+};
+
+FILE* Persistence_open_journal(char mode);
+void Persistence_close_journal();
+void Persistence_flush_journal();
+int Persistence_journal_retained(char* topicName, int qos, char* payload, int payloadlen);
+int Persistence_journal_subscription(Subscriptions* s, int subscribe);
+int Persistence_read_journal(void** content);
+
+/*BE
+def SNAPSHOT_STATS
+{
+   n32 dec "count"
+   n32 dec "failures"
+   n32 dec "duration"
+   n32 dec "size"
+}
+BE*/
+typedef struct
+{
+	int count;			/**< snapshots taken since the broker started */
+	int failures;		/**< snapshots which could not be written */
+	int duration;		/**< time taken to write the last snapshot, in milliseconds */
+	long size;			/**< size of the last snapshot, in bytes */
+} Persistence_snapshotStats;
+
+void Persistence_begin_snapshot();
+void Persistence_end_snapshot(int rc);
+int Persistence_fork_snapshot(int changes);
+void Persistence_exit_snapshot(int rc);
+void Persistence_check_snapshot();
+void Persistence_wait_snapshot();
+int Persistence_snapshot_running();
+Persistence_snapshotStats* Persistence_getSnapshotStats();
+
 void Persistence_read_command(BrokerStates* bs);
+void Persistence_open_command_channel(BrokerStates* bs);
+void Persistence_close_command_channel();
 
 #endif /* PERSISTENCE_H */
@@ -28,6 +28,9 @@
 #include "MQTTProtocol.h"
 #include "Topics.h"
 #include "Persistence.h"
+#include "Latency.h"
+#include "Metrics.h"
+#include "TopicStats.h"
 #include "StackTrace.h"
 
 #include "Heap.h"
@@ -43,6 +46,8 @@
  */
 BrokerStates* bstate;
 
+static unsigned int slow_iterations = 0;	/**< iterations longer than slow_iteration_threshold */
+
 /**
  * Initializes the protocol module
  * @param bs pointer to a broker state structure
@@ -53,6 +58,9 @@ int Protocol_initialize(BrokerStates* bs)
 
 	FUNC_ENTRY;
 	bstate = bs;
+	Socket_fanoutInitialize(bs->fanout_threads);
+	Metrics_initialize();
+	TopicStats_initialize(bs->topic_stats_depth, bs->topic_stats_top);
 	rc = MQTTProtocol_initialize(bs);
 #if defined(MQTTS)
 	rc = MQTTSProtocol_initialize(bs);
@@ -69,6 +77,9 @@ void Protocol_terminate()
 {
 	FUNC_ENTRY;
 	MQTTProtocol_terminate();
+	Metrics_terminate();
+	TopicStats_terminate();
+	Socket_fanoutTerminate();
 #if defined(MQTTS)
 	MQTTSProtocol_terminate();
 #endif
@@ -119,6 +130,35 @@ void Protocol_closing()
 }
 
 
+/**
+ * The number of event loop iterations which have taken longer than slow_iteration_threshold.
+ * @return the count
+ */
+unsigned int Protocol_slowIterations()
+{
+	return slow_iterations;
+}
+
+
+/**
+ * Record the time taken by one iteration of the event loop, and log it if it was slow, with the
+ * time taken by each part so that the stall can be attributed.
+ * @param sock the socket serviced, or 0
+ * @param times when the iteration started, the socket had been serviced, housekeeping started
+ * and ended, and the iteration ended
+ */
+static void Protocol_iterationTime(int sock, unsigned long long times[5])
+{
+	Latency_record(LATENCY_ITERATION, times[4] - times[0]);
+	if (bstate->slow_iteration_threshold > 0 && times[4] - times[0] >= bstate->slow_iteration_threshold * 1000000ULL)
+	{
+		++slow_iterations;
+		Log(LOG_WARNING, 168, NULL, (int)((times[4] - times[0]) / 1000000), (int)((times[1] - times[0]) / 1000000),
+			sock, (int)((times[3] - times[2]) / 1000000), (int)((times[4] - times[3]) / 1000000));
+	}
+}
+
+
 /**
  * Timeslice function to run protocol exchanges
  */
@@ -127,9 +167,14 @@ void Protocol_timeslice()
 	int sock;
 	int bridge_connection = 0;
 	static int more_work = 0;
+	unsigned long long times[5];
 
 	FUNC_ENTRY;
-	if ((sock = Socket_getReadySocket(more_work, NULL)) == SOCKET_ERROR)
+	/* before the wait, as this can close sockets which the wait would otherwise return */
+	Metrics_checkPendingWrites();
+	sock = Socket_getReadySocket(more_work, NULL);
+	times[0] = times[1] = times[2] = times[3] = Latency_now(); /* the wait for a socket is not counted */
+	if (sock == SOCKET_ERROR)
 	{
 #if defined(WIN32)
 		int errno;
@@ -139,7 +184,7 @@ void Protocol_timeslice()
 		{
 			Log(LOG_SEVERE, 0, "Restarting MQTT protocol to resolve socket problems");
 			MQTTProtocol_shutdown(0);
-			SubscriptionEngines_save(bstate->se);
+			SubscriptionEngines_snapshot(bstate->se);
 			MQTTProtocol_reinitialize();
 			goto exit;
 		}
@@ -164,22 +209,31 @@ void Protocol_timeslice()
 		}
 		
 		if (bridge_connection == 0)
-#if defined(MQTTS)
 		{
 			int protocol = PROTOCOL_MQTT;
+#if !defined(SINGLE_LISTENER)
 			if (client == NULL)
-				protocol = Socket_getParentListener(sock)->protocol;
-			else
+			{
+				Listener* listener = Socket_getParentListener(sock);
+				if (listener)
+					protocol = listener->protocol;
+			}
+#endif
+#if defined(MQTTS)
+			if (client != NULL)
 				protocol = client->protocol;
+#endif
 
 			if (protocol == PROTOCOL_MQTT)
-#endif
 				MQTTProtocol_timeslice(sock, client);
+			else if (protocol == PROTOCOL_METRICS)
+				Metrics_timeslice(sock);
 #if defined(MQTTS)
 			else if (protocol == PROTOCOL_MQTTS)
 			    MQTTSProtocol_timeslice(sock);
-		}
 #endif
+		}
+		times[1] = Latency_now();
 	}
 	if (bstate->state != BROKER_STOPPING)
 #if !defined(NO_ADMIN_COMMANDS)
@@ -189,11 +243,18 @@ void Protocol_timeslice()
 #endif
 	else
 		Protocol_closing();
+	times[2] = Latency_now();
 	more_work = MQTTProtocol_housekeeping(more_work);
 #if defined(MQTTS)
 	MQTTSProtocol_housekeeping();
 #endif
+	times[3] = Latency_now();
 exit:
+	Persistence_flush_journal();
+	Persistence_check_snapshot();
+	Log_flush();
+	times[4] = Latency_now();
+	Protocol_iterationTime(sock, times);
 	FUNC_EXIT;
 }
 
@@ -201,15 +262,20 @@ exit:
 /**
  * Originates a new publication - sends it to all clients subscribed.
  * @param publish pointer to a stucture which contains all the publication information
- * @param originator the originating client
+ * @param client the originating client structure, or NULL if there is none
+ * @param originator the originating client id
  */
-void Protocol_processPublication(Publish* publish, char* originator)
+void Protocol_processPublication(Publish* publish, Clients* client, char* originator)
 {
 	Messages* stored = NULL; /* to avoid duplication of data where possible */
 	List* clients;
 	ListElement* current = NULL;
 	int savedMsgId = publish->msgId;
 	int clean_needed = 0;
+	int fanout = 0;
+	int deliveries = 0;
+	int timed = strcmp(INTERNAL_CLIENTID, originator) != 0; /* not the broker's own $SYS and log publications */
+	unsigned long long start = 0;
 
 	FUNC_ENTRY;
 	
@@ -221,9 +287,13 @@ void Protocol_processPublication(Publish* publish, char* originator)
 
 	if ((strcmp(INTERNAL_CLIENTID, originator) != 0) && bstate->password_file && bstate->acl_file)
 	{
-		Clients* client = (Clients*)(TreeFindIndex(bstate->clients, originator, 1)->content);
-		
-		if (Users_authorise(client->user, publish->topic, ACL_WRITE) == false)
+		int allowed;
+
+		start = Latency_now();
+		allowed = (client) ? Users_authoriseCached(&client->acl_cache, client->user, publish->topic, ACL_WRITE)
+				: Users_authorise(NULL, publish->topic, ACL_WRITE);
+		Latency_since(LATENCY_ACL, start);
+		if (allowed == false)
 		{
 			Log(LOG_AUDIT, 149, NULL, originator, publish->topic);
 			goto exit;
@@ -233,17 +303,23 @@ void Protocol_processPublication(Publish* publish, char* originator)
 	if (publish->header.bits.retain)
 	{
 		SubscriptionEngines_setRetained(bstate->se, publish->topic, publish->header.bits.qos, publish->payload, publish->payloadlen);
-		if (bstate->persistence == 1 && bstate->autosave_on_changes == 1 && bstate->autosave_interval > 0
-			&& bstate->se->retained_changes >= bstate->autosave_interval)
+		/* with a journal, the changes are already on disk and the save is left to housekeeping */
+		if (bstate->persistence == 1 && bstate->persistence_journal == 0 && bstate->autosave_on_changes == 1
+			&& bstate->autosave_interval > 0 && bstate->se->retained_changes >= bstate->autosave_interval
+			&& !Persistence_snapshot_running())
 		{
 			Log(LOG_INFO, 100, NULL, bstate->autosave_interval);
-			SubscriptionEngines_save(bstate->se);
+			SubscriptionEngines_snapshot(bstate->se);
 		}
 	}
 
+	if (timed)
+		start = Latency_now();
 	clients = SubscriptionEngines_getSubscribers(bstate->se, publish->topic, originator);
+	if (timed)
+		start = Latency_since(LATENCY_MATCH, start);
 	if (strncmp(publish->topic, "$SYS/client/", 12) == 0)
-	{ /* default subscription for a client */
+	{ /* default subscription for a client - system topic subscriber lists are not cached, so can be added to */
 		Node* node = TreeFindIndex(bstate->clients, &publish->topic[12], 1);
 		if (node == NULL)
 			node = TreeFind(bstate->disconnected_clients, &publish->topic[12]);
@@ -257,6 +333,10 @@ void Protocol_processPublication(Publish* publish, char* originator)
 			ListAppend(clients, rcs, sizeof(Subscriptions));
 		}
 	}
+	/* a wide publication is written out to the subscribers' sockets in parallel, once it has
+	   been processed for every subscriber */
+	if ((fanout = (Socket_fanoutThreads() > 0 && clients->count >= bstate->fanout_threshold)))
+		Socket_startFanout();
 	current = NULL;
 	while (ListNextElement(clients, &current))
 	{
@@ -304,6 +384,8 @@ void Protocol_processPublication(Publish* publish, char* originator)
 				pubclient->good = pubclient->connected = 0; /* flag this client as needing to be cleaned up */
 				clean_needed = 1;
 			}
+			else
+				++deliveries;
 			if (publish->topic != original_topic)
 			{
 				stored = saved;  /* restore the stored pointer for the next loop iteration */
@@ -312,12 +394,38 @@ void Protocol_processPublication(Publish* publish, char* originator)
 			}
 		}
 	}
+	if (fanout)
+	{
+		List* failed = ListInitialize();
+
+		if (Socket_endFanout(failed) > 0)
+		{
+			current = NULL;
+			while (ListNextElement(failed, &current))
+			{
+				Node* curnode = TreeFind(bstate->clients, current->content);
+
+				if (curnode)
+				{
+					Clients* pubclient = (Clients*)(curnode->content);
+					pubclient->good = pubclient->connected = 0;
+					clean_needed = 1;
+				}
+			}
+		}
+		ListFree(failed);
+	}
+	if (timed)
+	{
+		Latency_since(LATENCY_PUBLISH, start);
+		TopicStats_record(publish->topic, publish->payloadlen, deliveries);
+	}
 	publish->msgId = savedMsgId;
 	/* INTERNAL_CLIENTID means that we are publishing data to the log,
 			and we don't want to interfere with other close processing */
 	if (clean_needed && strcmp(originator, INTERNAL_CLIENTID) != 0)
 		MQTTProtocol_clean_clients(bstate->clients);
-	ListFree(clients);
+	SubscriptionEngines_releaseSubscribers(bstate->se, publish->topic, clients);
 exit:
 	FUNC_EXIT;
 }
@@ -340,7 +448,7 @@ int Protocol_startOrQueuePublish(Clients* pubclient, Publish* publish, int qos,
 	if (pubclient->connected && pubclient->good &&           /* client is connected and has no errors */
 		Socket_noPendingWrites(pubclient->socket) &&         /* there aren't any previous packets still stacked up on the socket */
 		queuedMsgsCount(pubclient) == 0 &&                   /* there are no messages ahead in the queue */
-		pubclient->outboundMsgs->count < bstate->max_inflight_messages) /* the queue is not full */
+		pubclient->outboundMsgs->count < MQTTProtocol_inflightWindow(pubclient)) /* the in-flight window is not full */
 	{
 #if defined(MQTTS)
 		if (pubclient->protocol == PROTOCOL_MQTTS_MULTICAST)
@@ -433,6 +541,31 @@ int Protocol_isClientQuiescing(Clients* client)
 }
 
 
+/**
+ * Find how many messages are waiting to be delivered to a client, for choosing between the
+ * members of a shared subscription group
+ * @param clientID the id of the client
+ * @return the number of queued and in-flight messages, or -1 if the client is not connected
+ */
+int Protocol_clientLoad(char* clientID)
+{
+	Node* curnode = NULL;
+	Clients* client = NULL;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	curnode = TreeFindIndex(bstate->clients, clientID, 1);
+#if defined(MQTTS)
+	if (curnode == NULL)
+		curnode = TreeFindIndex(bstate->mqtts_clients, clientID, 1);
+#endif
+	if (curnode && (client = (Clients*)(curnode->content))->connected && client->good)
+		rc = queuedMsgsCount(client) + client->outboundMsgs->count;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 #if defined(MQTTS)
 int Protocol_handlePublishes(Publish* publish, int sock, Clients* client, char* clientid, short topicId)
 #else
@@ -470,8 +603,13 @@ int Protocol_handlePublishes(Publish* publish, int sock, Clients* client, char*
 		{
 			++(bstate->msgs_received);
 			bstate->bytes_received += publish->payloadlen;
+			if (client)
+			{
+				++(client->stats.msgs_received);
+				client->stats.bytes_received += publish->payloadlen;
+			}
 		}
-		Protocol_processPublication(publish, clientid);
+		Protocol_processPublication(publish, client, clientid);
 	}
 	else if (publish->header.bits.qos == 1)
 	{
@@ -483,9 +621,11 @@ int Protocol_handlePublishes(Publish* publish, int sock, Clients* client, char*
 #endif
 			rc = MQTTPacket_send_puback(publish->msgId, sock, clientid);
 		/* if we get a socket error from sending the puback, should we ignore the publication? */
-		Protocol_processPublication(publish, clientid);
+		Protocol_processPublication(publish, client, clientid);
 		++(bstate->msgs_received);
 		bstate->bytes_received += publish->payloadlen;
+		++(client->stats.msgs_received);
+		client->stats.bytes_received += publish->payloadlen;
 	}
 	else if (publish->header.bits.qos == 2 && client->inboundMsgs->count < bstate->max_inflight_messages)
 	{
@@ -521,7 +661,7 @@ int Protocol_handlePublishes(Publish* publish, int sock, Clients* client, char*
 	else if (publish->header.bits.qos == 3) /* only applies to MQTT-S */
 	{
 		publish->header.bits.qos = 0;
-		Protocol_processPublication(publish, clientid);
+		Protocol_processPublication(publish, client, clientid);
 	}
 exit:
 	if (sock > 0)
@@ -18,7 +18,7 @@
 #define PROTOCOL_H_
 
 void Protocol_timeslice();
-void Protocol_processPublication(Publish* publish, char* originator);
+void Protocol_processPublication(Publish* publish, Clients* client, char* originator);
 int Protocol_startOrQueuePublish(Clients* pubclient, Publish* publish, int qos, int retained, int priority, Messages** m);
 
 int Protocol_initialize(BrokerStates* bs);
@@ -27,6 +27,8 @@ Clients* Protocol_getclientbyaddr(char* addr);
 int clientPrefixCompare(void* prefix, void* clientid);
 int Protocol_isClientQuiescing(Clients* client);
 int Protocol_inProcess(Clients* client);
+int Protocol_clientLoad(char* clientID);
+unsigned int Protocol_slowIterations(void);
 
 #if !defined(NO_BRIDGE)
 Clients* Protocol_getoutboundclient(int sock);
@@ -24,6 +24,7 @@
 #include "Log.h"
 #include "SocketBuffer.h"
 #include "Messages.h"
+#include "Latency.h"
 #include "StackTrace.h"
 
 #include <stdlib.h>
@@ -39,6 +40,7 @@
 #include <sys/uio.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 #endif
 
 #if defined(USE_POLL)
@@ -50,15 +52,73 @@
 int Socket_close_only(int socket);
 #if defined(USE_POLL)
 int Socket_continueWrite(int socket);
+static int Socket_watch(struct socket_info* si);
+static void Socket_unwatch(int socket);
+static void Socket_setEvents(struct socket_info* si, int events);
+static void Socket_freeInfo(struct socket_info* si);
 #else
 int Socket_continueWrites(fd_set* pwset);
 #endif
+#if defined(USE_IO_URING)
+static void Socket_uringInitialize();
+static void Socket_uringTerminate();
+static int Socket_uringGetReady(int timeout);
+static int Socket_recv(int socket, char* buf, size_t len);
+#else
+#define Socket_recv(socket, buf, len) recv(socket, buf, len, 0)
+#endif
 
 /**
  * Structure to hold all socket data for the module
  */
 static Sockets s;
 
+static int notifier_fd = -1;	/**< non-socket descriptor watched for readability, or -1 */
+static int notified = 0;		/**< set when the notifier descriptor has been found readable */
+static unsigned long long ready_time = 0;	/**< when the last wait for sockets found some ready */
+static Socket_closeCallback* close_callback = NULL;	/**< called as each socket is closed, or NULL */
+
+/**
+ * The time a socket has spent with a write pending, for the writes completed since it was last
+ * asked for
+ */
+typedef struct
+{
+	int socket;
+	unsigned long long blocked;	/**< in nanoseconds */
+} write_blocked;
+
+static Tree* blocked_times = NULL;	/**< the write_blocked structures, by socket */
+#if defined(USE_POLL)
+static struct socket_info notifier_info;
+#endif
+
+#if defined(USE_IO_URING)
+/**
+ * io_uring request types, which are also the flags in socket_info.armed
+ */
+enum
+{
+	URING_ACCEPT = 1,
+	URING_RECV = 2,
+	URING_POLLIN = 4,
+	URING_POLLOUT = 8,
+	URING_CANCEL = 16
+};
+#define URING_ENTRIES 256			/**< size of the submission queue */
+#define URING_BUFFERS 256			/**< number of provided receive buffers - a power of 2 */
+#define URING_BUFFER_SIZE 4096		/**< size of each provided receive buffer */
+#define URING_BGID 0				/**< buffer group id of the receive buffers */
+#define READAHEAD_MAX 65536			/**< receiving pauses when a socket has this much unread input */
+
+static IoUring uring;
+static struct socket_info* Socket_findInfo(int fd);
+static void Socket_uringArm(struct socket_info* si, int ops);
+static void Socket_rearm(struct socket_info* si);
+static void Socket_uringCancel(struct socket_info* si);
+static void Socket_addConnection(Listener* list, int newSd);
+#endif
+
 /**
  * Set a socket non-blocking, OS independently
  * @param sock the socket to set non-blocking
@@ -128,6 +188,56 @@ int TreeSockCompare(void* a, void* b, int value)
 #endif
 
 
+#if defined(USE_IO_URING)
+/**
+ * Set up io_uring for socket I/O.  If it cannot be used, s.uring is left NULL and epoll is used instead.
+ * That includes kernels which have provided buffer rings but not multishot receives.
+ */
+static void Socket_uringInitialize()
+{
+	int rc;
+
+	FUNC_ENTRY;
+	s.uring = NULL;
+	s.ready = ListInitialize();
+	s.rearm = ListInitialize();
+	s.cur_info = NULL;
+	if ((rc = IoUring_initialize(&uring, URING_ENTRIES)) == 0)
+	{
+		if ((rc = IoUring_addBuffers(&uring, &s.buffers, URING_BGID, URING_BUFFERS, URING_BUFFER_SIZE)) == 0 &&
+				(rc = IoUring_probeRecv(&uring, &s.buffers)) != 0)
+			IoUring_removeBuffers(&uring, &s.buffers);
+		if (rc != 0)
+			IoUring_terminate(&uring);
+	}
+	if (rc == 0)
+		s.uring = &uring;
+	else
+		Log(LOG_WARNING, 163, NULL, rc);
+	FUNC_EXIT_RC(rc);
+}
+
+
+/**
+ * Close the io_uring instance, cancelling any requests still outstanding.
+ */
+static void Socket_uringTerminate()
+{
+	FUNC_ENTRY;
+	if (s.uring)
+	{
+		IoUring_removeBuffers(s.uring, &s.buffers);
+		IoUring_terminate(s.uring);
+		s.uring = NULL;
+	}
+	ListFree(s.ready);
+	ListFree(s.rearm);
+	s.cur_info = NULL;
+	FUNC_EXIT;
+}
+#endif
+
+
 /**
  * Initialize the socket module for outbound communications
  */
@@ -144,6 +254,7 @@ void Socket_outInitialize()
 	signal(SIGPIPE, SIG_IGN);
 #endif
 	SocketBuffer_initialize();
+	blocked_times = TreeInitialize(TreeIntCompare);
 	
 #if !defined(USE_POLL)
 	s.clientsds = ListInitialize();
@@ -157,9 +268,14 @@ void Socket_outInitialize()
 	FD_ZERO(&(s.pending_wset));
 #else
 	s.fds_tree = TreeInitialize(TreeSockCompare);
-	s.epoll_fds = epoll_create(1024);
+	s.epoll_fds = -1;
 	s.cur_sds = 0;
 	s.no_ready = 0;
+#if defined(USE_IO_URING)
+	Socket_uringInitialize();
+	if (s.uring == NULL)
+#endif
+		s.epoll_fds = epoll_create(1024);
 #endif
 	s.newSockets = ListInitialize();
 	FUNC_EXIT;
@@ -401,7 +517,7 @@ int Socket_addServerSocket(Listener* list)
 		}
 	}
 	list->socket = -1;
-	if (list->protocol == PROTOCOL_MQTT)
+	if (list->protocol == PROTOCOL_MQTT || list->protocol == PROTOCOL_METRICS)
 	{
 		if (list->ipv6)
 			list->socket = socket(AF_INET6, SOCK_STREAM, 0);
@@ -456,8 +572,8 @@ int Socket_addServerSocket(Listener* list)
 		goto exit;
 	}
 
-	/* Only listen if this is mqtt/tcp */
-	if (list->protocol == PROTOCOL_MQTT &&
+	/* Only listen if this is tcp */
+	if (list->protocol != PROTOCOL_MQTTS &&
 			listen(list->socket, SOMAXCONN) == SOCKET_ERROR) /* second parm is max no of connections */
 	{
 		Socket_error("listen", list->socket);
@@ -495,6 +611,9 @@ int Socket_addServerSocket(Listener* list)
 	}
 	else
 #endif
+	if (list->protocol == PROTOCOL_METRICS)
+		Log(LOG_INFO, 169, NULL, list->port);
+	else
 		Log(LOG_INFO, 14, NULL, list->port);
 
 #if defined(USE_POLL)
@@ -506,7 +625,7 @@ int Socket_addServerSocket(Listener* list)
 	si->event.events = EPOLLIN;
 	si->event.data.ptr = si;
 	TreeAdd(s.fds_tree, si, sizeof(struct socket_info));
-	if (epoll_ctl(s.epoll_fds, EPOLL_CTL_ADD, list->socket, &si->event) != 0)
+	if (Socket_watch(si) != 0)
 		Socket_error("epoll_ctl add", list->socket);
 #else
 	FD_SET((u_int)list->socket, &(s.rset));         /* Add the current socket descriptor */
@@ -629,6 +748,9 @@ void Socket_outTerminate()
 {
 	FUNC_ENTRY;
 #if defined(USE_POLL)
+#if defined(USE_IO_URING)
+	Socket_uringTerminate();
+#endif
 	TreeFree(s.fds_tree);
 #else
 	ListFree(s.connect_pending);
@@ -636,6 +758,7 @@ void Socket_outTerminate()
 	ListFree(s.clientsds);
 #endif
 	ListFree(s.newSockets);
+	TreeFree(blocked_times);
 	SocketBuffer_terminate();
 #if defined(WIN32)
 	WSACleanup();
@@ -658,12 +781,15 @@ void Socket_terminate()
 	while (ListNextElement(s.listeners, &current))
 	{
 		Listener* listener = (Listener*)(current->content);
+#if defined(USE_POLL)
+		Socket_unwatch(listener->socket);
+#endif
 		Socket_close_only(listener->socket);
 #if defined(USE_POLL)
 		if ((si = TreeRemoveKey(s.fds_tree, &listener->socket)) == NULL)
 			Log(LOG_WARNING, 13, "Failed to remove socket %d", listener->socket);
 		else
-			free(si);
+			Socket_freeInfo(si);
 #endif
 	}
 #else
@@ -737,7 +863,7 @@ int Socket_addSocket(int newSd, int outbound)
 		si->event.events = EPOLLIN;
 		si->event.data.ptr = *ssi = si;
 		TreeAdd(s.fds_tree, si, sizeof(struct socket_info));
-		if (epoll_ctl(s.epoll_fds, EPOLL_CTL_ADD, newSd, &si->event) != 0)
+		if (Socket_watch(si) != 0)
 			Socket_error("epoll_ctl add", newSd);
 		rc = Socket_setnonblocking(newSd);
 		new->socket = newSd;
@@ -843,6 +969,28 @@ socket_stats* Socket_getStats()
 }
 
 
+/**
+ * Add a newly accepted socket to the listener's connections, and start reading from it.
+ * @param list the listener which accepted the connection
+ * @param newSd the new socket
+ */
+static void Socket_addConnection(Listener* list, int newSd)
+{
+	int* sockmem = (int*)malloc(sizeof(int));
+#if defined(USE_POLL)
+	struct socket_info* si;
+#endif
+
+	*sockmem = newSd;
+	ListAppend(list->connections, sockmem, sizeof(sockmem));
+#if defined(USE_POLL)
+	Socket_addSocket(newSd, &si, 0);
+#else
+	Socket_addSocket(newSd, 0);
+#endif
+}
+
+
 void newConnection(Listener* list)
 {
 	int newSd;
@@ -861,12 +1009,8 @@ void newConnection(Listener* list)
 		Socket_error("accept", list->socket);
 	else
 	{
-		int* sockmem = (int*)malloc(sizeof(int));
 		char buf[INET6_ADDRSTRLEN];
-#if defined(USE_POLL)
-		struct socket_info* si;
-#endif
-		
+
 		if (list->ipv6)
 		{
 			Socket_getaddrname((struct sockaddr*)&addr6, addr6.sin6_port);
@@ -877,198 +1021,763 @@ void newConnection(Listener* list)
 			Socket_getaddrname((struct sockaddr*)&addr, addr.sin_port);
 			Log(TRACE_MAX, 10, NULL, newSd, buf, addr.sin_port);
 		}
-		*sockmem = newSd;
-		ListAppend(list->connections, sockmem, sizeof(sockmem));
-#if defined(USE_POLL)
-		Socket_addSocket(newSd, &si, 0);
-#else
-		Socket_addSocket(newSd, 0);
-#endif
+		Socket_addConnection(list, newSd);
 	}
 }
 
 
-#if defined(USE_POLL)
-void Socket_epollprocess()
+/**
+ * Add a descriptor which is not a client socket, such as an inotify descriptor, to the set
+ * watched by select or epoll.  When it becomes readable, the notified flag is set instead of
+ * the descriptor being returned by Socket_getReadySocket.
+ * @param fd the descriptor to watch, or -1 to stop watching the current one
+ */
+void Socket_setNotifier(int fd)
 {
 	FUNC_ENTRY;
-	/* cycle through the list of returned socket structures, processing each */
-	while (s.cur_sds < s.no_ready)
+#if defined(USE_POLL)
+	if (notifier_fd != -1)
+		Socket_unwatch(notifier_fd);
+#else
+	if (notifier_fd != -1)
+		FD_CLR((u_int)notifier_fd, &(s.rset_saved));
+#endif
+	notifier_fd = fd;
+	notified = 0;
+	if (fd != -1)
 	{
-		struct socket_info* cur_info = s.events[s.cur_sds].data.ptr;
-			
-		if (cur_info->event.events & EPOLLIN) /* if this socket is readable */
-		{
-			if (cur_info->listener && cur_info->listener->protocol == 0) /* if it is a listener, and not MQTTs */
-				newConnection(cur_info->listener);
-			else if (isReady(cur_info))
-				break;
-		}	
-		else if ((cur_info->event.events & EPOLLOUT)) /* has a pending write or connect */
-		{
-			if (cur_info->connect_pending)
-			{
-				cur_info->connect_pending = 0;
-				cur_info->event.events = EPOLLIN;
-				if (epoll_ctl(s.epoll_fds, EPOLL_CTL_MOD, cur_info->fd, &cur_info->event) != 0)
-					Socket_error("epoll ctl MOD", cur_info->fd);
-				break;
-			}
-			if (Socket_continueWrite(cur_info->fd))
-			{
-				if (!SocketBuffer_writeComplete(cur_info->fd))
-					Log(LOG_SEVERE, 35, NULL);
-				else
-				{
-					cur_info->event.events = EPOLLIN;
-					if (epoll_ctl(s.epoll_fds, EPOLL_CTL_MOD, cur_info->fd, &cur_info->event) != 0)
-						Socket_error("epoll ctl MOD", cur_info->fd);
-				}
-			}
-		}
-
-		++s.cur_sds;
+#if defined(USE_POLL)
+		memset(&notifier_info, '\0', sizeof(notifier_info));
+		notifier_info.fd = fd;
+		notifier_info.event.events = EPOLLIN;
+		notifier_info.event.data.ptr = &notifier_info;
+		if (Socket_watch(&notifier_info) != 0)
+			Socket_error("epoll_ctl add", fd);
+#else
+		FD_SET((u_int)fd, &(s.rset_saved));
+		s.maxfdp1 = max(s.maxfdp1, fd + 1);
+#endif
 	}
 	FUNC_EXIT;
 }
-#endif
 
 
 /**
- *  Returns the next socket ready for communications as indicated by select.
- *  We have two types of socket, the main broker one on which connections are accepted,
- *  and client sockets which are generated as a result of accepting connections.  So there
- *  are two different actions to be taken depending on the type of the connection.  We can use the
- *  select() call to check for actions to be taken on both types of socket when especially when
- *  we are in single-threaded mode.
- *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
- *  be used for the select
- *  @param tp the timeout to be used for the select, unless overridden
- *  @return the socket next ready, or 0 if none is ready
+ * Set the function called by Socket_close, so that state kept elsewhere for a socket is freed
+ * however the socket is closed, before its descriptor can be reused.
+ * @param callback the function, or NULL for none
  */
-int Socket_getReadySocket(int more_work, struct timeval *tp)
+void Socket_setCloseCallback(Socket_closeCallback* callback)
 {
-	int retval = 0;
-#if defined(USE_POLL)
-	int timeout = 1000; /* default one second */
-#else
-	static struct timeval zero = {0L, 0L}; /* 0 seconds */
-	static fd_set wset;
-	static struct timeval one = {1L, 0L}; /* 1 second */
-	struct timeval timeout = one;
-	static int done = 1, rc1 = 0;
-	#if !defined(SINGLE_LISTENER)
-		ListElement* current = NULL;
-	#endif
-#endif
-	static int rc = 0;
+	close_callback = callback;
+}
 
-	FUNC_ENTRY;
-#if !defined(USE_POLL)
-	if (more_work)
-		timeout = zero;
-	else if (tp)
-		timeout = *tp;
-#else
-	if (more_work)
-		timeout = 0;
-	else if (tp)
-		timeout = (tp->tv_sec * 1000) + (tp->tv_usec / 1000);
-#endif
 
-	if (more_work)
-		(ss.more_work_count)++;
-	else
-		(ss.not_more_work_count)++;
-		
-#if defined(USE_POLL)
-	if (timeout == 0)
-		(ss.timeout_zero_count)++;
-	else
-		(ss.timeout_non_zero_count)++;
-#else
-	if (timeout.tv_sec == 0L && timeout.tv_usec == 0L)
-		(ss.timeout_zero_count)++;
-	else
-		(ss.timeout_non_zero_count)++;
-#endif
+/**
+ * Find out whether the notifier descriptor has become readable since the last call.
+ * @return boolean - has the notifier descriptor been readable?
+ */
+int Socket_notified()
+{
+	int rc = notified;
 
-#if !defined(USE_POLL)
-	while (s.cur_clientsds != NULL)
+	notified = 0;
+	return rc;
+}
+
+
+#if defined(USE_IO_URING)
+/**
+ * Find the socket information for a descriptor, including the notifier descriptor.
+ * @param fd the descriptor
+ * @return the socket information, or NULL if the descriptor is not known
+ */
+static struct socket_info* Socket_findInfo(int fd)
+{
+	struct socket_info* si = NULL;
+	Node* node = NULL;
+
+	if (s.cur_info && s.cur_info->fd == fd)
+		si = s.cur_info;
+	else if (fd == notifier_fd)
+		si = &notifier_info;
+	else if ((node = TreeFind(s.fds_tree, &fd)) != NULL)
+		si = (struct socket_info*)(node->content);
+	return si;
+}
+
+
+/**
+ * Find which io_uring requests a socket needs outstanding to receive input.
+ * TCP listeners use multishot accept and client sockets multishot receive.  MQTT-S listeners and the
+ * notifier use one-shot polls, because their readers take one datagram or event batch at a time.
+ * @param si the socket information
+ * @return URING_ flags
+ */
+static int Socket_uringWanted(struct socket_info* si)
+{
+	int rc = 0;
+
+	if (si == &notifier_info || (si->listener && si->listener->protocol == PROTOCOL_MQTTS))
+		rc = URING_POLLIN;
+	else if (si->listener)
+		rc = URING_ACCEPT;
+	else if (!si->connect_pending && !si->eof && si->ra_end - si->ra_start < READAHEAD_MAX)
+		rc = URING_RECV;
+	return rc;
+}
+
+
+/**
+ * Queue io_uring requests for a socket, unless they are already outstanding.  The requests
+ * are submitted the next time the ring is entered.
+ * @param si the socket information
+ * @param ops the URING_ flags of the requests wanted
+ */
+static void Socket_uringArm(struct socket_info* si, int ops)
+{
+	int op;
+
+	for (op = URING_ACCEPT; op <= URING_POLLOUT; op <<= 1)
 	{
-		if (done >= rc)
+		struct io_uring_sqe* sqe = NULL;
+
+		if ((ops & op) == 0 || (si->armed & op))
+			continue;
+		if ((sqe = IoUring_getSqe(s.uring)) == NULL)
 		{
-			s.cur_clientsds = NULL;
+			Socket_rearm(si); /* try again next time */
 			break;
 		}
-		if (isReady(*((int*)(s.cur_clientsds->content)), &(s.rset), &wset))
+		sqe->fd = si->fd;
+		sqe->user_data = ((unsigned long long)si->generation << 32) | ((unsigned long long)si->fd << 8) | op;
+		switch (op)
+		{
+		case URING_ACCEPT:
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
 			break;
-		ListNextElement(s.clientsds, &s.cur_clientsds);
+		case URING_RECV:
+			sqe->opcode = IORING_OP_RECV;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = s.buffers.bgid;
+			break;
+		case URING_POLLIN:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = POLLIN;
+			break;
+		case URING_POLLOUT:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = POLLOUT;
+			break;
+		}
+		si->armed |= op;
 	}
-#else
-	Socket_epollprocess();
-#endif
+}
 
-#if !defined(USE_POLL)
-	if (s.cur_clientsds == NULL)
-	{
-		fd_set pwset;
-		fd_set errorset;
 
-		memcpy((void*)&(s.rset), (void*)&(s.rset_saved), sizeof(s.rset));
-		memcpy((void*)&(pwset), (void*)&(s.pending_wset), sizeof(pwset));
-		memcpy((void*)&(errorset), (void*)&(s.rset_saved), sizeof(errorset));
-		if ((rc = select(s.maxfdp1, &(s.rset), &pwset, &errorset, &timeout)) == SOCKET_ERROR)
-		{
-			Socket_error("read select", 0);
-			goto exit;
-		}
-		Log(TRACE_MAX, 8, NULL, rc);
+/**
+ * Schedule a socket's input requests to be resubmitted by Socket_getReadySocket, once the
+ * completions already received have been processed.
+ * @param si the socket information
+ */
+static void Socket_rearm(struct socket_info* si)
+{
+	if (!si->rearm)
+	{
+		int* fd = (int*)malloc(sizeof(int));
 
-		if (Socket_continueWrites(&pwset) == SOCKET_ERROR)
-		{
-			rc = 0;
-			goto exit;
-		}
+		*fd = si->fd;
+		ListAppend(s.rearm, fd, sizeof(int));
+		si->rearm = 1;
+	}
+}
 
-		memcpy((void*)&wset, (void*)&(s.rset_saved), sizeof(wset));
-		memcpy((void*)&(errorset), (void*)&(s.rset_saved), sizeof(errorset));
-		if ((rc1 = select(s.maxfdp1, NULL, &(wset), &(errorset), &zero)) == SOCKET_ERROR)
-		{
-			Socket_error("write select", 0);
-			rc = rc1;
-			goto exit;
-		}
-		Log(TRACE_MAX, 9, NULL, rc1);
-		//printf("select rc %d rc1 %d\n", rc, rc1);
-		
-		if (rc == 0 && rc1 == 0)
-			goto exit; /* no work to do */
-#else
-	if (s.cur_sds >= s.no_ready)
-	{	
-		/* check for any readable sockets, or writeable for pending writes */
-		/* the events field has already been modified for pending writes in Socket_putdatas */
-		rc = epoll_wait(s.epoll_fds, s.events, MAX_EVENTS, timeout);
-		if (rc == SOCKET_ERROR)
-		{
-			Socket_error("read epoll_wait", 0);
-			goto exit;
-		}
-		Log(TRACE_MAX, 8, NULL, rc);
-		
-		if (rc == 0)
-			goto exit; /* no work to do */
-#endif
+
+/**
+ * Add a socket to the list returned by Socket_getReadySocket, if it is not already there.
+ * @param si the socket information
+ */
+static void Socket_queue(struct socket_info* si)
+{
+	if (!si->queued)
+	{
+		int* fd = (int*)malloc(sizeof(int));
+
+		*fd = si->fd;
+		ListAppend(s.ready, fd, sizeof(int));
+		si->queued = 1;
+	}
+}
+
+
+/**
+ * Cancel all io_uring requests for a socket which is about to be closed, and forget it.
+ * The cancellation is submitted immediately, because the kernel finds the requests by descriptor.
+ * @param si the socket information
+ */
+static void Socket_uringCancel(struct socket_info* si)
+{
+	struct io_uring_sqe* sqe = NULL;
+
+	if (si->armed && (sqe = IoUring_getSqe(s.uring)) != NULL)
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = si->fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = URING_CANCEL;
+		if (IoUring_submit(s.uring, 0, 0) == SOCKET_ERROR)
+			Socket_error("io_uring_enter", si->fd);
+	}
+	si->armed = 0;
+	if (si->queued)
+		ListRemoveItem(s.ready, &si->fd, intcompare);
+	if (si->rearm)
+		ListRemoveItem(s.rearm, &si->fd, intcompare);
+	si->queued = si->rearm = 0;
+	si->generation = 0; /* ignore any completions still to come */
+	if (s.cur_info == si)
+		s.cur_info = NULL;
+}
+
+
+/**
+ * Add received data to a socket's readahead buffer.
+ * @param si the socket information
+ * @param data the data
+ * @param len the length of the data
+ */
+static void Socket_readahead(struct socket_info* si, char* data, int len)
+{
+	if (si->ra_start > 0 && si->ra_end + len > si->ra_size)
+	{
+		memmove(si->readahead, &si->readahead[si->ra_start], si->ra_end - si->ra_start);
+		si->ra_end -= si->ra_start;
+		si->ra_start = 0;
+	}
+	if (si->ra_end + len > si->ra_size)
+	{
+		si->ra_size = max(si->ra_end + len, URING_BUFFER_SIZE * 2);
+		if (si->readahead)
+			si->readahead = realloc(si->readahead, si->ra_size);
+		else
+			si->readahead = malloc(si->ra_size);
+	}
+	memcpy(&si->readahead[si->ra_end], data, len);
+	si->ra_end += len;
+}
+
+
+/**
+ * Process one io_uring completion.
+ * @param cqe the completion queue entry
+ */
+static void Socket_uringComplete(struct io_uring_cqe* cqe)
+{
+	int op = (int)(cqe->user_data & 0xFF);
+	int fd = (int)((cqe->user_data >> 8) & 0xFFFFFF);
+	unsigned int generation = (unsigned int)(cqe->user_data >> 32);
+	struct socket_info* si = NULL;
+	int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	int bid = -1;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	if (op == URING_CANCEL)
+		goto exit;
+	if ((si = Socket_findInfo(fd)) == NULL || si->generation != generation)
+	{
+		if (op == URING_ACCEPT && cqe->res >= 0)
+			close(cqe->res); /* accepted after its listener was closed */
+		goto exit;
+	}
+	if (!more)
+		si->armed &= ~op;
+
+	switch (op)
+	{
+	case URING_ACCEPT:
+		if (cqe->res >= 0)
+			Socket_addConnection(si->listener, cqe->res);
+		else if (cqe->res != -ECANCELED)
+		{
+			errno = -cqe->res;
+			Socket_error("accept", fd);
+		}
+		if (!more)
+			Socket_rearm(si);
+		break;
+	case URING_RECV:
+		if (cqe->res > 0)
+		{
+			Socket_readahead(si, IoUring_buffer(&s.buffers, bid), cqe->res);
+			Socket_queue(si);
+			if (more && si->ra_end - si->ra_start >= READAHEAD_MAX)
+			{ /* stop receiving until the reader catches up */
+				struct io_uring_sqe* sqe = IoUring_getSqe(s.uring);
+
+				if (sqe)
+				{
+					sqe->opcode = IORING_OP_ASYNC_CANCEL;
+					sqe->addr = cqe->user_data;
+					sqe->user_data = URING_CANCEL;
+				}
+			}
+			else if (!more)
+				Socket_rearm(si);
+		}
+		else if (cqe->res == 0 || (cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+		{
+			si->eof = 1;
+			si->error = (cqe->res < 0) ? -cqe->res : 0;
+			Socket_queue(si);
+		}
+		else if (!more)
+			Socket_rearm(si); /* out of buffers or throttled: resume when there is room */
+		break;
+	case URING_POLLIN:
+		if (si == &notifier_info)
+			notified = 1; /* rearmed when the notification has been handled */
+		else
+			Socket_queue(si); /* rearmed when it has been returned */
+		break;
+	case URING_POLLOUT:
+		if (si->connect_pending)
+		{
+			si->connect_pending = 0;
+			Socket_setEvents(si, EPOLLIN);
+			Socket_queue(si);
+		}
+		else if ((si->event.events & EPOLLOUT) && Socket_continueWrite(si->fd))
+		{
+			if (!SocketBuffer_writeComplete(si->fd))
+				Log(LOG_SEVERE, 35, NULL);
+			else
+			{
+				Socket_setEvents(si, EPOLLIN);
+				if (si->ra_end > si->ra_start || si->eof)
+					Socket_queue(si); /* held back while the write was pending */
+			}
+		}
+		else if (si->event.events & EPOLLOUT)
+			Socket_uringArm(si, URING_POLLOUT);
+		break;
+	}
+exit:
+	if (bid >= 0)
+		IoUring_returnBuffer(&s.buffers, bid);
+}
+
+
+/**
+ * Process all the io_uring completions available.
+ */
+static void Socket_uringReap()
+{
+	struct io_uring_cqe* cqe = NULL;
+
+	while ((cqe = IoUring_peek(s.uring)) != NULL)
+	{
+		struct io_uring_cqe copy = *cqe;
+
+		IoUring_seen(s.uring);
+		Socket_uringComplete(&copy);
+	}
+}
+
+
+/**
+ * The io_uring version of Socket_getReadySocket.  Input arrives through multishot requests into
+ * readahead buffers, so the socket returned can usually be read without a system call, and one
+ * io_uring_enter both submits new requests and waits for completions.
+ * @param timeout the longest time to wait in milliseconds
+ * @return the socket next ready, 0 if none is ready, or SOCKET_ERROR
+ */
+static int Socket_uringGetReady(int timeout)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (s.cur_info)
+	{ /* the socket returned last time may have more input waiting, or need its poll rearming */
+		if (s.cur_info->listener)
+			Socket_rearm(s.cur_info);
+		else if (s.cur_info->ra_end > s.cur_info->ra_start || s.cur_info->eof)
+			Socket_queue(s.cur_info);
+		s.cur_info = NULL;
+	}
+	if (notifier_fd != -1)
+		Socket_uringArm(&notifier_info, URING_POLLIN);
+
+	Socket_uringReap();
+	while (s.rearm->count > 0)
+	{
+		int fd = *(int*)(s.rearm->first->content);
+		struct socket_info* si = Socket_findInfo(fd);
+
+		ListRemoveHead(s.rearm);
+		if (si && si->rearm)
+		{
+			si->rearm = 0;
+			Socket_uringArm(si, Socket_uringWanted(si));
+		}
+	}
+	if (s.ready->count == 0 || IoUring_pending(s.uring) >= URING_ENTRIES / 2)
+	{
+		if ((rc = IoUring_submit(s.uring, s.ready->count == 0 && timeout != 0, timeout)) == SOCKET_ERROR)
+		{
+			Socket_error("io_uring_enter", 0);
+			goto exit;
+		}
+		Socket_uringReap();
+		if (s.ready->count > 0)
+		{
+			ready_time = Latency_now();
+			Latency_record(LATENCY_READY_SOCKETS, s.ready->count);
+		}
+	}
+	Log(TRACE_MAX, 8, NULL, s.ready->count);
+
+	rc = 0;
+	while (rc == 0 && s.ready->count > 0)
+	{
+		int fd = *(int*)(s.ready->first->content);
+		struct socket_info* si = Socket_findInfo(fd);
+
+		ListRemoveHead(s.ready);
+		if (si == NULL || !si->queued)
+			continue;
+		si->queued = 0;
+		if (si->event.events & EPOLLOUT)
+			continue; /* pending write: queued again when it completes */
+		s.cur_info = si;
+		rc = fd;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * The io_uring replacement for recv on a client socket: read from the readahead buffer.
+ * @param socket the socket
+ * @param buf the buffer to read into
+ * @param len the number of bytes wanted
+ * @return the number of bytes read, 0 at end of file, or SOCKET_ERROR with errno set
+ */
+static int Socket_recv(int socket, char* buf, size_t len)
+{
+	struct socket_info* si = NULL;
+	int rc = SOCKET_ERROR;
+
+	if (s.uring == NULL || (si = Socket_findInfo(socket)) == NULL || si->listener)
+		rc = recv(socket, buf, len, 0);
+	else if (si->ra_end > si->ra_start)
+	{
+		rc = min((int)len, si->ra_end - si->ra_start);
+		memcpy(buf, &si->readahead[si->ra_start], rc);
+		if ((si->ra_start += rc) == si->ra_end)
+			si->ra_start = si->ra_end = 0;
+		if ((si->armed & URING_RECV) == 0 && Socket_uringWanted(si) == URING_RECV)
+			Socket_rearm(si);
+	}
+	else if (si->eof)
+	{
+		if (si->error)
+			errno = si->error;
+		else
+			rc = 0;
+	}
+	else
+		errno = EAGAIN;
+	return rc;
+}
+#endif
+
+
+#if defined(USE_POLL)
+/**
+ * Start watching a socket for the events in its socket_info structure.
+ * @param si the socket information
+ * @return completion code
+ */
+static int Socket_watch(struct socket_info* si)
+{
+	int rc = 0;
+
+#if defined(USE_IO_URING)
+	si->generation = ++s.generation;
+	si->armed = si->queued = si->rearm = si->eof = si->error = 0;
+	si->readahead = NULL;
+	si->ra_size = si->ra_start = si->ra_end = 0;
+	if (s.uring)
+	{
+		Socket_rearm(si);
+		goto exit;
+	}
+#endif
+	rc = epoll_ctl(s.epoll_fds, EPOLL_CTL_ADD, si->fd, &si->event);
+#if defined(USE_IO_URING)
+exit:
+#endif
+	return rc;
+}
+
+
+/**
+ * Change the events being watched for on a socket.
+ * @param si the socket information
+ * @param events EPOLLIN, or EPOLLOUT for a pending write or connect
+ */
+static void Socket_setEvents(struct socket_info* si, int events)
+{
+	si->event.events = events;
+#if defined(USE_IO_URING)
+	if (s.uring)
+	{
+		if (events & EPOLLOUT)
+			Socket_uringArm(si, URING_POLLOUT);
+		else
+			Socket_rearm(si);
+		return;
+	}
+#endif
+	if (epoll_ctl(s.epoll_fds, EPOLL_CTL_MOD, si->fd, &si->event) != 0)
+		Socket_error("epoll ctl MOD", si->fd);
+}
+
+
+/**
+ * Stop watching a socket, before it is closed.
+ * @param socket the socket
+ */
+static void Socket_unwatch(int socket)
+{
+#if defined(USE_IO_URING)
+	if (s.uring)
+	{
+		struct socket_info* si = Socket_findInfo(socket);
+
+		if (si)
+			Socket_uringCancel(si);
+		return;
+	}
+#endif
+	if (epoll_ctl(s.epoll_fds, EPOLL_CTL_DEL, socket, NULL) != 0)
+		Socket_error("epoll_ctl del", socket);
+}
+
+
+/**
+ * Free a socket information structure, which has been removed from the socket tree.
+ * @param si the socket information
+ */
+static void Socket_freeInfo(struct socket_info* si)
+{
+#if defined(USE_IO_URING)
+	if (si->readahead)
+		free(si->readahead);
+#endif
+	free(si);
+}
+#endif
+
+
+#if defined(USE_POLL)
+void Socket_epollprocess()
+{
+	FUNC_ENTRY;
+	/* cycle through the list of returned socket structures, processing each */
+	while (s.cur_sds < s.no_ready)
+	{
+		struct socket_info* cur_info = s.events[s.cur_sds].data.ptr;
+			
+		if (cur_info == NULL)
+			; /* closed since epoll_wait */
+		else if (cur_info == &notifier_info)
+			notified = 1;
+		else if (cur_info->event.events & EPOLLIN) /* if this socket is readable */
+		{
+			if (cur_info->listener && cur_info->listener->protocol != PROTOCOL_MQTTS) /* if it is a listener, and not MQTTs */
+				newConnection(cur_info->listener);
+			else if (isReady(cur_info))
+				break;
+		}	
+		else if ((cur_info->event.events & EPOLLOUT)) /* has a pending write or connect */
+		{
+			if (cur_info->connect_pending)
+			{
+				cur_info->connect_pending = 0;
+				Socket_setEvents(cur_info, EPOLLIN);
+				break;
+			}
+			if (Socket_continueWrite(cur_info->fd))
+			{
+				if (!SocketBuffer_writeComplete(cur_info->fd))
+					Log(LOG_SEVERE, 35, NULL);
+				else
+					Socket_setEvents(cur_info, EPOLLIN);
+			}
+		}
+
+		++s.cur_sds;
+	}
+	FUNC_EXIT;
+}
+#endif
+
+
+/**
+ *  Returns the next socket ready for communications as indicated by select.
+ *  We have two types of socket, the main broker one on which connections are accepted,
+ *  and client sockets which are generated as a result of accepting connections.  So there
+ *  are two different actions to be taken depending on the type of the connection.  We can use the
+ *  select() call to check for actions to be taken on both types of socket when especially when
+ *  we are in single-threaded mode.
+ *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
+ *  be used for the select
+ *  @param tp the timeout to be used for the select, unless overridden
+ *  @return the socket next ready, or 0 if none is ready
+ */
+int Socket_getReadySocket(int more_work, struct timeval *tp)
+{
+	int retval = 0;
+#if defined(USE_POLL)
+	int timeout = 1000; /* default one second */
+#else
+	static struct timeval zero = {0L, 0L}; /* 0 seconds */
+	static fd_set wset;
+	static struct timeval one = {1L, 0L}; /* 1 second */
+	struct timeval timeout = one;
+	static int done = 1, rc1 = 0;
+	#if !defined(SINGLE_LISTENER)
+		ListElement* current = NULL;
+	#endif
+#endif
+	static int rc = 0;
+
+	FUNC_ENTRY;
+#if !defined(USE_POLL)
+	if (more_work)
+		timeout = zero;
+	else if (tp)
+		timeout = *tp;
+#else
+	if (more_work)
+		timeout = 0;
+	else if (tp)
+		timeout = (tp->tv_sec * 1000) + (tp->tv_usec / 1000);
+#endif
+
+	if (more_work)
+		(ss.more_work_count)++;
+	else
+		(ss.not_more_work_count)++;
+		
+#if defined(USE_POLL)
+	if (timeout == 0)
+		(ss.timeout_zero_count)++;
+	else
+		(ss.timeout_non_zero_count)++;
+#else
+	if (timeout.tv_sec == 0L && timeout.tv_usec == 0L)
+		(ss.timeout_zero_count)++;
+	else
+		(ss.timeout_non_zero_count)++;
+#endif
+
+#if defined(USE_IO_URING)
+	if (s.uring)
+	{
+		retval = Socket_uringGetReady(timeout);
+		goto exit;
+	}
+#endif
+
+#if !defined(USE_POLL)
+	while (s.cur_clientsds != NULL)
+	{
+		if (done >= rc)
+		{
+			s.cur_clientsds = NULL;
+			break;
+		}
+		if (isReady(*((int*)(s.cur_clientsds->content)), &(s.rset), &wset))
+			break;
+		ListNextElement(s.clientsds, &s.cur_clientsds);
+	}
+#else
+	Socket_epollprocess();
+#endif
+
+#if !defined(USE_POLL)
+	if (s.cur_clientsds == NULL)
+	{
+		fd_set pwset;
+		fd_set errorset;
+
+		memcpy((void*)&(s.rset), (void*)&(s.rset_saved), sizeof(s.rset));
+		memcpy((void*)&(pwset), (void*)&(s.pending_wset), sizeof(pwset));
+		memcpy((void*)&(errorset), (void*)&(s.rset_saved), sizeof(errorset));
+		if ((rc = select(s.maxfdp1, &(s.rset), &pwset, &errorset, &timeout)) == SOCKET_ERROR)
+		{
+			Socket_error("read select", 0);
+			goto exit;
+		}
+		Log(TRACE_MAX, 8, NULL, rc);
+
+		if (Socket_continueWrites(&pwset) == SOCKET_ERROR)
+		{
+			rc = 0;
+			goto exit;
+		}
+
+		memcpy((void*)&wset, (void*)&(s.rset_saved), sizeof(wset));
+		memcpy((void*)&(errorset), (void*)&(s.rset_saved), sizeof(errorset));
+		if ((rc1 = select(s.maxfdp1, NULL, &(wset), &(errorset), &zero)) == SOCKET_ERROR)
+		{
+			Socket_error("write select", 0);
+			rc = rc1;
+			goto exit;
+		}
+		Log(TRACE_MAX, 9, NULL, rc1);
+		//printf("select rc %d rc1 %d\n", rc, rc1);
+		
+		if (rc == 0 && rc1 == 0)
+			goto exit; /* no work to do */
+		ready_time = Latency_now();
+		Latency_record(LATENCY_READY_SOCKETS, (rc > rc1) ? rc : rc1);
+		if (notifier_fd != -1 && FD_ISSET(notifier_fd, &(s.rset)))
+			notified = 1;
+#else
+	if (s.cur_sds >= s.no_ready)
+	{	
+		/* check for any readable sockets, or writeable for pending writes */
+		/* the events field has already been modified for pending writes in Socket_putdatas */
+		rc = epoll_wait(s.epoll_fds, s.events, MAX_EVENTS, timeout);
+		if (rc == SOCKET_ERROR)
+		{
+			Socket_error("read epoll_wait", 0);
+			goto exit;
+		}
+		Log(TRACE_MAX, 8, NULL, rc);
+		
+		if (rc == 0)
+			goto exit; /* no work to do */
+		ready_time = Latency_now();
+		Latency_record(LATENCY_READY_SOCKETS, rc);
+#endif
 
 #if !defined(SINGLE_LISTENER)
 #if !defined(USE_POLL)
 		while (ListNextElement(s.listeners, &current))
 		{
 			Listener* list = (Listener*)(current->content);
-			/* New connections only exist for mqtt/tcp listeners
+			/* New connections only exist for tcp listeners
 			 */
-			if (list->protocol == 0 && FD_ISSET(list->socket, &(s.rset)))  /* if this is a new connection attempt */
+			if (list->protocol != PROTOCOL_MQTTS && FD_ISSET(list->socket, &(s.rset)))  /* if this is a new connection attempt */
 				newConnection(list);
 		}
 #endif
@@ -1156,6 +1865,8 @@ int Socket_getReadySocket(int more_work, struct timeval *tp)
 	}
 #endif
 exit:
+	if (retval > 0)
+		Latency_since(LATENCY_READY_WAIT, ready_time);
 	FUNC_EXIT_RC(retval);
 	return retval;
 } /* end getReadySocket */
@@ -1175,7 +1886,7 @@ int Socket_getch(int socket, char* c)
 	if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
 		goto exit;
 
-	if ((rc = recv(socket, c, (size_t)1, 0)) == SOCKET_ERROR)
+	if ((rc = Socket_recv(socket, c, (size_t)1)) == SOCKET_ERROR)
 	{
 		int err = Socket_error("recv - getch", socket);
 		if (err == EWOULDBLOCK || err == EAGAIN)
@@ -1197,6 +1908,32 @@ exit:
 }
 
 
+/**
+ *  Reads whatever is available from a socket, non-blocking, for protocols other than MQTT which
+ *  keep their own partial input.
+ *  @param socket the socket to read from
+ *  @param buf the buffer to read into
+ *  @param len the size of the buffer
+ *  @return the number of bytes read, TCPSOCKET_INTERRUPTED if there are none, or SOCKET_ERROR
+ */
+int Socket_read(int socket, char* buf, int len)
+{
+	int rc;
+
+	FUNC_ENTRY;
+	if ((rc = Socket_recv(socket, buf, (size_t)len)) == SOCKET_ERROR)
+	{
+		int err = Socket_error("recv - read", socket);
+		if (err == EWOULDBLOCK || err == EAGAIN)
+			rc = TCPSOCKET_INTERRUPTED;
+	}
+	else if (rc == 0)
+		rc = SOCKET_ERROR; 	/* The return value from recv is 0 when the peer has performed an orderly shutdown. */
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  *  Attempts to read a number of bytes from a socket, non-blocking. If a previous read did not
  *  finish, then retrieve that data.
@@ -1219,7 +1956,7 @@ char *Socket_getdata(int socket, int bytes, int* actual_len)
 
 	buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
 
-	if ((rc = recv(socket, buf + (*actual_len), (size_t)(bytes - (*actual_len)), 0)) == SOCKET_ERROR)
+	if ((rc = Socket_recv(socket, buf + (*actual_len), (size_t)(bytes - (*actual_len)))) == SOCKET_ERROR)
 	{
 		rc = Socket_error("recv - getdata", socket);
 		if (rc != EAGAIN && rc != EWOULDBLOCK)
@@ -1316,6 +2053,396 @@ int Socket_writev(int socket, iobuf* iovecs, int count, unsigned long* bytes)
 }
 
 
+/**
+ * Start waiting for a pending write to complete on a socket
+ * @param socket the socket
+ */
+static void Socket_addPendingWrite(int socket)
+{
+#if defined(USE_POLL)
+	struct socket_info* si = (struct socket_info*)(TreeFind(s.fds_tree, &socket)->content); /* find socket_info stucture by socket */
+	Socket_setEvents(si, EPOLLOUT);
+#else
+	int* sockmem = (int*)malloc(sizeof(int));
+
+	*sockmem = socket;
+	ListAppend(s.write_pending, sockmem, sizeof(int));
+	FD_SET(socket, &(s.pending_wset));
+#endif
+}
+
+
+/**
+ * A packet written while a fan-out is in progress, held until the fan-out ends
+ */
+typedef struct
+{
+	int socket;				/**< the socket to write to, or -1 if merged into an earlier write */
+	int seqno;				/**< order in which the packets were written */
+	iobuf iovecs[2];		/**< copies of the first buffer, and of the rest of the packet */
+	int total;				/**< total length of the packet */
+	unsigned long bytes;	/**< number of bytes written */
+	int err;				/**< errno from a failed write, or 0 */
+} fanout_write;
+
+/**
+ * State of the fan-out of wide publications
+ */
+static struct
+{
+	int active;				/**< are writes being collected? */
+	fanout_write* writes;	/**< writes collected */
+	int count;				/**< number of writes collected */
+	int size;				/**< number of writes there is room for */
+	int threads;			/**< number of worker threads */
+#if !defined(WIN32)
+	pthread_t* workers;		/**< worker thread ids */
+	pthread_mutex_t mutex;	/**< protects generation, busy and stopping */
+	pthread_cond_t start;	/**< signalled when there is a new batch for the workers */
+	pthread_cond_t done;	/**< signalled when a worker has finished its part of a batch */
+	unsigned int generation;	/**< incremented for each batch given to the workers */
+	int busy;				/**< number of workers still writing the current batch */
+	int stopping;			/**< are the workers to end? */
+#endif
+} fanout;
+
+
+/**
+ * Write a fan-out packet to its socket.  This is called on worker threads, so it must not use
+ * the heap, log or stack trace functions.
+ * @param fw the write
+ */
+static void Socket_fanoutWrite(fanout_write* fw)
+{
+	iobuf iovecs[2];
+	int i;
+
+	while (fw->bytes < fw->total)
+	{
+		int count = 0;
+		unsigned long offset = fw->bytes;
+#if defined(WIN32)
+		DWORD written = 0;
+#else
+		int written = 0;
+#endif
+
+		for (i = 0; i < 2; ++i)
+		{
+			if (offset >= fw->iovecs[i].iov_len)
+				offset -= fw->iovecs[i].iov_len;
+			else
+			{
+				iovecs[count].iov_base = (char*)fw->iovecs[i].iov_base + offset;
+				iovecs[count++].iov_len = fw->iovecs[i].iov_len - offset;
+				offset = 0;
+			}
+		}
+#if defined(WIN32)
+		if (WSASend(fw->socket, iovecs, count, &written, 0, NULL, NULL) == SOCKET_ERROR)
+		{
+			fw->err = WSAGetLastError();
+			break;
+		}
+#else
+		if ((written = writev(fw->socket, iovecs, count)) == SOCKET_ERROR)
+		{
+			if (errno == EINTR)
+				continue;
+			fw->err = errno;
+			break;
+		}
+#endif
+		fw->bytes += written;
+	}
+}
+
+
+#if !defined(WIN32)
+/**
+ * Worker thread for fan-outs.  Each worker writes the packets for the sockets which are its
+ * share of the socket numbers, so that no socket is written to by more than one thread.
+ * @param arg the worker's number, from 1; the broker thread itself takes share 0
+ */
+static void* Socket_fanoutWorker(void* arg)
+{
+	int share = (int)(size_t)arg;
+	unsigned int generation = 0;
+
+	pthread_mutex_lock(&fanout.mutex);
+	while (1)
+	{
+		int i;
+
+		while (!fanout.stopping && fanout.generation == generation)
+			pthread_cond_wait(&fanout.start, &fanout.mutex);
+		if (fanout.stopping)
+			break;
+		generation = fanout.generation;
+		pthread_mutex_unlock(&fanout.mutex);
+
+		for (i = 0; i < fanout.count; ++i)
+		{
+			if (fanout.writes[i].socket >= 0 && fanout.writes[i].socket % (fanout.threads + 1) == share)
+				Socket_fanoutWrite(&fanout.writes[i]);
+		}
+
+		pthread_mutex_lock(&fanout.mutex);
+		if (--fanout.busy == 0)
+			pthread_cond_signal(&fanout.done);
+	}
+	pthread_mutex_unlock(&fanout.mutex);
+	return NULL;
+}
+#endif
+
+
+/**
+ * Start the worker threads used to write out wide publications.
+ * @param threads the number of worker threads, 0 to write on the broker thread only
+ */
+void Socket_fanoutInitialize(int threads)
+{
+	FUNC_ENTRY;
+	memset(&fanout, '\0', sizeof(fanout));
+#if !defined(WIN32)
+	if (threads > 0)
+	{
+		int i;
+
+		pthread_mutex_init(&fanout.mutex, NULL);
+		pthread_cond_init(&fanout.start, NULL);
+		pthread_cond_init(&fanout.done, NULL);
+		fanout.workers = malloc(sizeof(pthread_t) * threads);
+		for (i = 0; i < threads; ++i)
+		{
+			if (pthread_create(&fanout.workers[i], NULL, Socket_fanoutWorker, (void*)(size_t)(i + 1)) != 0)
+			{
+				Socket_error("pthread_create", i + 1);
+				break;
+			}
+		}
+		fanout.threads = i;
+	}
+#endif
+	FUNC_EXIT;
+}
+
+
+/**
+ * Stop the fan-out worker threads.
+ */
+void Socket_fanoutTerminate()
+{
+	FUNC_ENTRY;
+#if !defined(WIN32)
+	if (fanout.workers)
+	{
+		int i;
+
+		pthread_mutex_lock(&fanout.mutex);
+		fanout.stopping = 1;
+		pthread_cond_broadcast(&fanout.start);
+		pthread_mutex_unlock(&fanout.mutex);
+		for (i = 0; i < fanout.threads; ++i)
+			pthread_join(fanout.workers[i], NULL);
+		free(fanout.workers);
+		pthread_cond_destroy(&fanout.done);
+		pthread_cond_destroy(&fanout.start);
+		pthread_mutex_destroy(&fanout.mutex);
+	}
+#endif
+	if (fanout.writes)
+		free(fanout.writes);
+	memset(&fanout, '\0', sizeof(fanout));
+	FUNC_EXIT;
+}
+
+
+/**
+ * Indicates whether wide publications can be written out in parallel
+ * @return the number of fan-out worker threads
+ */
+int Socket_fanoutThreads()
+{
+	return fanout.threads;
+}
+
+
+/**
+ * Start collecting packets written to sockets, instead of writing them straight away.  The
+ * packets are written by Socket_endFanout.
+ */
+void Socket_startFanout()
+{
+	fanout.active = 1;
+	fanout.count = 0;
+}
+
+
+/**
+ * Take a copy of a packet written while a fan-out is in progress.  The caller carries on as if
+ * the whole packet had been written; anything which cannot be written when the fan-out ends
+ * becomes a pending write.
+ * @param socket the socket to write to
+ * @param iovecs the buffers making up the packet, the first being the fixed header
+ * @param count number of buffers in iovecs
+ * @param total length of the packet
+ * @return completion code
+ */
+static int Socket_deferWrite(int socket, iobuf* iovecs, int count, int total)
+{
+	fanout_write* fw = NULL;
+	char* ptr = NULL;
+	int i;
+
+	FUNC_ENTRY;
+	if (fanout.count == fanout.size)
+	{
+		fanout.size = (fanout.size == 0) ? 64 : fanout.size * 2;
+		if (fanout.writes == NULL)
+			fanout.writes = malloc(sizeof(fanout_write) * fanout.size);
+		else
+			fanout.writes = realloc(fanout.writes, sizeof(fanout_write) * fanout.size);
+	}
+	fw = &fanout.writes[fanout.count];
+	fw->socket = socket;
+	fw->seqno = fanout.count++;
+	fw->total = total;
+	fw->bytes = 0L;
+	fw->err = 0;
+	fw->iovecs[0].iov_len = iovecs[0].iov_len;
+	fw->iovecs[0].iov_base = malloc(iovecs[0].iov_len);
+	memcpy(fw->iovecs[0].iov_base, iovecs[0].iov_base, iovecs[0].iov_len);
+	fw->iovecs[1].iov_len = total - iovecs[0].iov_len;
+	ptr = fw->iovecs[1].iov_base = malloc(fw->iovecs[1].iov_len + 1);
+	for (i = 1; i < count; ++i)
+	{
+		memcpy(ptr, iovecs[i].iov_base, iovecs[i].iov_len);
+		ptr += iovecs[i].iov_len;
+	}
+	FUNC_EXIT;
+	return TCPSOCKET_COMPLETE;
+}
+
+
+/**
+ * qsort callback comparing fan-out writes by socket, then by the order in which they were made
+ */
+static int Socket_fanoutCompare(const void* a, const void* b)
+{
+	const fanout_write* fa = (const fanout_write*)a;
+	const fanout_write* fb = (const fanout_write*)b;
+
+	if (fa->socket != fb->socket)
+		return (fa->socket < fb->socket) ? -1 : 1;
+	return fa->seqno - fb->seqno;
+}
+
+
+/**
+ * Write out the packets collected since Socket_startFanout, sharing them between the worker
+ * threads by socket, so that the packets for any one socket are still written in order.
+ * @param failed list to which the sockets which could not be written to are added
+ * @return the number of sockets which could not be written to
+ */
+int Socket_endFanout(List* failed)
+{
+	int i, rc = 0;
+
+	FUNC_ENTRY;
+	fanout.active = 0;
+	if (fanout.count == 0)
+		goto exit;
+
+	/* a socket written to more than once gets one write, so that the packets stay in order */
+	qsort(fanout.writes, fanout.count, sizeof(fanout_write), Socket_fanoutCompare);
+	for (i = 1; i < fanout.count; ++i)
+	{
+		fanout_write* fw = &fanout.writes[i];
+		int j = i - 1;
+
+		while (fanout.writes[j].socket == -1)
+			--j;
+		if (fanout.writes[j].socket == fw->socket)
+		{
+			fanout_write* first = &fanout.writes[j];
+			int len = first->iovecs[1].iov_len;
+
+			first->iovecs[1].iov_base = realloc(first->iovecs[1].iov_base, len + fw->total + 1);
+			memcpy((char*)first->iovecs[1].iov_base + len, fw->iovecs[0].iov_base, fw->iovecs[0].iov_len);
+			len += fw->iovecs[0].iov_len;
+			memcpy((char*)first->iovecs[1].iov_base + len, fw->iovecs[1].iov_base, fw->iovecs[1].iov_len);
+			first->iovecs[1].iov_len = len + fw->iovecs[1].iov_len;
+			first->total += fw->total;
+			free(fw->iovecs[0].iov_base);
+			free(fw->iovecs[1].iov_base);
+			fw->socket = -1;
+		}
+	}
+
+#if !defined(WIN32)
+	if (fanout.threads > 0)
+	{
+		pthread_mutex_lock(&fanout.mutex);
+		++fanout.generation;
+		fanout.busy = fanout.threads;
+		pthread_cond_broadcast(&fanout.start);
+		pthread_mutex_unlock(&fanout.mutex);
+	}
+#endif
+	for (i = 0; i < fanout.count; ++i)
+	{
+		if (fanout.writes[i].socket >= 0 && fanout.writes[i].socket % (fanout.threads + 1) == 0)
+			Socket_fanoutWrite(&fanout.writes[i]);
+	}
+#if !defined(WIN32)
+	if (fanout.threads > 0)
+	{
+		pthread_mutex_lock(&fanout.mutex);
+		while (fanout.busy > 0)
+			pthread_cond_wait(&fanout.done, &fanout.mutex);
+		pthread_mutex_unlock(&fanout.mutex);
+	}
+#endif
+
+	for (i = 0; i < fanout.count; ++i)
+	{
+		fanout_write* fw = &fanout.writes[i];
+
+		if (fw->socket == -1)
+			continue;
+		if (fw->err != 0 && fw->err != EAGAIN && fw->err != EWOULDBLOCK)
+		{
+			int* sockmem = (int*)malloc(sizeof(int));
+
+			errno = fw->err;
+			Socket_error("writev - fanout", fw->socket);
+			free(fw->iovecs[0].iov_base);
+			free(fw->iovecs[1].iov_base);
+			*sockmem = fw->socket;
+			ListAppend(failed, sockmem, sizeof(int));
+			++rc;
+		}
+		else if (fw->bytes == fw->total)
+		{
+			free(fw->iovecs[0].iov_base);
+			free(fw->iovecs[1].iov_base);
+		}
+		else
+		{ /* the rest is written when the socket becomes writable, as for any other partial write */
+			Log(TRACE_MIN, 33, NULL, fw->bytes, fw->total, fw->socket);
+			SocketBuffer_pendingWrite(fw->socket, 2, fw->iovecs, fw->total, fw->bytes, 0);
+			Socket_addPendingWrite(fw->socket);
+		}
+	}
+	fanout.count = 0;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  *  Attempts to write a series of buffers to a socket in *one* system call so that they are
  *  sent as one packet.
@@ -1330,6 +2457,7 @@ int Socket_writev(int socket, iobuf* iovecs, int count, unsigned long* bytes)
 int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffers, int* buflens)
 {
 	unsigned long bytes = 0L;
+	unsigned long long start;
 	iobuf iovecs[5];
 	int rc = TCPSOCKET_NOWORK, i, total = buf0len;
 
@@ -1352,10 +2480,20 @@ int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffe
 		iovecs[i+1].iov_len = buflens[i];
 	}
 
+	if (fanout.active)
+	{
+		rc = Socket_deferWrite(socket, iovecs, count+1, total);
+		goto exit;
+	}
+
+	start = Latency_now();
 	if ((rc = Socket_writev(socket, iovecs, count+1, &bytes)) != SOCKET_ERROR)
 	{
 		if (bytes == total)
+		{
+			Latency_since(LATENCY_WRITE, start);
 			rc = TCPSOCKET_COMPLETE;
+		}
 		else if (bytes == 0)
 		{
 		  Log(TRACE_MIN, 32, NULL);
@@ -1363,22 +2501,9 @@ int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffe
 		}
 		else /* the packet was partially written, so we have to buffer for the write to be finished later */
 		{
-#if !defined(USE_POLL)
-			int* sockmem = NULL;
-#endif
-			
 			Log(TRACE_MIN, 33, NULL, bytes, total, socket);
-			SocketBuffer_pendingWrite(socket, count+1, iovecs, total, bytes);
-#if defined(USE_POLL)
-			struct socket_info* si = (struct socket_info*)(TreeFind(s.fds_tree, &socket)->content); /* find socket_info stucture by socket */
-			si->event.events = EPOLLOUT;
-			rc = epoll_ctl(s.epoll_fds, EPOLL_CTL_MOD, socket, &si->event);
-#else
-			sockmem = (int*)malloc(sizeof(int));
-			*sockmem = socket;
-			ListAppend(s.write_pending, sockmem, sizeof(int));
-			FD_SET(socket, &(s.pending_wset));
-#endif
+			SocketBuffer_pendingWrite(socket, count+1, iovecs, total, bytes, start);
+			Socket_addPendingWrite(socket);
 			rc = TCPSOCKET_INTERRUPTED;
 		}
 	}
@@ -1425,6 +2550,7 @@ void Socket_close(int socket)
 	ListElement* current = NULL;
 	int found = 0;
 #endif
+	write_blocked* wb = NULL;
 #if defined(USE_POLL)
 	struct socket_info* si;
 #endif
@@ -1432,8 +2558,7 @@ void Socket_close(int socket)
 	FUNC_ENTRY;
 #if defined(USE_POLL)
 	/* have to call epoll_ctl DEL before closing the socket */
-	if (epoll_ctl(s.epoll_fds, EPOLL_CTL_DEL, socket, NULL) != 0)
-		Socket_error("epoll_ctl del", socket);
+	Socket_unwatch(socket);
 #endif
 
 	Socket_close_only(socket);
@@ -1450,12 +2575,24 @@ void Socket_close(int socket)
 	if ((si = TreeRemoveKey(s.fds_tree, &socket)) == NULL)
 		Log(LOG_ERROR, 13, "Failed to remove socket %d", socket);
 	else
-		free(si);
-	if (s.cur_sds < s.no_ready && ((struct socket_info*)s.events[s.cur_sds].data.ptr)->fd == socket)
-		++s.cur_sds;
+	{
+		int i;
+
+		/* the socket can be closed while events from the last epoll_wait are still to be processed */
+		for (i = s.cur_sds; i < s.no_ready; ++i)
+		{
+			if (s.events[i].data.ptr == si)
+				s.events[i].data.ptr = NULL;
+		}
+		Socket_freeInfo(si);
+	}
 #endif
 	SocketBuffer_cleanup(socket);
 	Socket_removeNew(socket);
+	if (close_callback)
+		(*close_callback)(socket);
+	if ((wb = TreeRemoveKey(blocked_times, &socket)) != NULL)
+		free(wb);
 
 #if !defined(SINGLE_LISTENER)
 	while (ListNextElement(s.listeners, &current))
@@ -1619,9 +2756,7 @@ int Socket_new_type(char* addr, int port, int* sock, int type)
 					ListAppend(s.connect_pending, pnewSd, sizeof(int));
 #else
 					si->connect_pending = 1;
-					si->event.events = EPOLLOUT;
-					if (epoll_ctl(s.epoll_fds, EPOLL_CTL_MOD, si->fd, &si->event) != 0)
-						Socket_error("epoll ctl MOD", si->fd);
+					Socket_setEvents(si, EPOLLOUT);
 #endif
 					Log(TRACE_MIN, 15, NULL);
 				}
@@ -1634,6 +2769,59 @@ int Socket_new_type(char* addr, int port, int* sock, int type)
 }
 
 
+/**
+ * Add to the time a socket has spent with a write pending.
+ * @param socket the socket
+ * @param blocked the time in nanoseconds
+ */
+static void Socket_addBlocked(int socket, unsigned long long blocked)
+{
+	Node* found = TreeFind(blocked_times, &socket);
+	write_blocked* wb = NULL;
+
+	if (found)
+		wb = (write_blocked*)(found->content);
+	else
+	{
+		wb = malloc(sizeof(write_blocked));
+		wb->socket = socket;
+		wb->blocked = 0;
+		TreeAdd(blocked_times, wb, sizeof(write_blocked));
+	}
+	wb->blocked += blocked;
+}
+
+
+/**
+ * The time a socket has spent with a write pending since the last call, including the time so
+ * far of a write which is still pending.  Slow consumers spend much of their time like this.
+ * @param socket the socket
+ * @return the time in nanoseconds
+ */
+unsigned long long Socket_writeBlocked(int socket)
+{
+	write_blocked* wb = NULL;
+	pending_writes* pw = NULL;
+	unsigned long long rc = 0;
+
+	FUNC_ENTRY;
+	if ((wb = TreeRemoveKey(blocked_times, &socket)) != NULL)
+	{
+		rc = wb->blocked;
+		free(wb);
+	}
+	if ((pw = SocketBuffer_getWrite(socket)) != NULL)
+	{
+		unsigned long long now = Latency_now();
+
+		rc += now - pw->pending;
+		pw->pending = now;
+	}
+	FUNC_EXIT;
+	return rc;
+}
+
+
 /**
  *  Continue any outstanding writes for a single socket
  *  @param socket socket with outstanding writes
@@ -1679,11 +2867,21 @@ int Socket_continueWrite(int socket)
 			free(pw->iovecs[1].iov_base);
 			if (pw->count == 5)
 				free(pw->iovecs[3].iov_base);
+			if (pw->started)
+				Latency_since(LATENCY_WRITE, pw->started);
+			Socket_addBlocked(socket, Latency_now() - pw->pending);
 			Log(TRACE_MIN, 0, "ContinueWrite: partial write now complete for socket %d", socket);
 		}
 		else
 			Log(TRACE_MIN, 16, NULL, bytes, socket);
 	}
+	else
+	{  /* the write is abandoned, and removed by the caller as if it were complete */
+		free(pw->iovecs[0].iov_base);
+		free(pw->iovecs[1].iov_base);
+		if (pw->count == 5)
+			free(pw->iovecs[3].iov_base);
+	}
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
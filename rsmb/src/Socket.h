@@ -17,6 +17,10 @@
 #if !defined(SOCKET_H)
 #define SOCKET_H
 
+#if defined(USE_IO_URING) && !defined(USE_POLL)
+#define USE_POLL /* the io_uring backend keeps its sockets in the epoll backend's structures */
+#endif
+
 #include <sys/types.h>
 
 #if defined(WIN32)
@@ -129,6 +133,10 @@ def LISTENER
 	n32 ptr CONNECTIONList open "connections"
 	n32 signed dec "max_connections"
 	n32 ptr STRING "mount_point"
+	n32 dec "inflight_window_min"
+	n32 dec "inflight_window_max"
+	n64 dec "queued_bytes"
+	n32 dec "dropped"
 $ifdef MQTTS
 	n32 ptr STRINGList open "multicast_groups"
 	n32 ptr ADVERTISE_PARMS "advertise"
@@ -152,6 +160,10 @@ typedef struct
 	List* connections;
 	int max_connections;
 	char* mount_point;
+	int inflight_window_min; /* adaptive in-flight window bounds for clients, 0 for a fixed window */
+	int inflight_window_max;
+	unsigned long long queued_bytes; /* payload bytes queued and in flight to the listener's clients */
+	unsigned int dropped; /* messages dropped from those clients' queues */
 #if defined(MQTTS)
 	List* multicast_groups;
 	advertise_parms* advertise;
@@ -223,6 +235,14 @@ $ifdef USE_POLL
 	25 EPOLL_EVENT "events"
 	n32 dec "no_ready"
 	n32 dec "cur_sds"
+$ifdef USE_IO_URING
+	n32 ptr IOURING "uring"
+	IOURINGBUFFERS "buffers"
+	n32 ptr INTList open "ready"
+	n32 ptr INTList open "rearm"
+	n32 ptr VOID "cur_info"
+	n32 dec "generation"
+$endif
 $else
 	FD_SET "rset"
 	FD_SET "rset_saved"
@@ -247,9 +267,25 @@ BE*/
 		int connect_pending;
 		int fd;
 		struct epoll_event event;
+#if defined(USE_IO_URING)
+		unsigned int generation; /**< distinguishes completions for an earlier socket with the same descriptor */
+		int armed;		/**< io_uring requests outstanding for this socket */
+		int queued;		/**< on the ready list? */
+		int rearm;		/**< on the rearm list? */
+		int eof;		/**< has the receive side finished? */
+		int error;		/**< errno value which ended the receive side, or 0 */
+		char* readahead;	/**< data received but not yet read */
+		int ra_size;	/**< size of the readahead buffer */
+		int ra_start;	/**< offset of the first unread byte */
+		int ra_end;		/**< offset after the last unread byte */
+#endif
 	};
 #endif
 
+#if defined(USE_IO_URING)
+#include "IoUring.h"
+#endif
+
 /**
  * Structure to hold all socket data for the module
  */
@@ -270,6 +306,14 @@ typedef struct
 	struct epoll_event events[MAX_EVENTS];
 	int no_ready;
 	int cur_sds;
+#if defined(USE_IO_URING)
+	IoUring* uring;                    /**< io_uring instance, or NULL if epoll is being used */
+	IoUringBuffers buffers;            /**< provided buffers for multishot receives */
+	List* ready;                       /**< sockets with input or events to be returned by getReadySocket */
+	List* rearm;                       /**< sockets whose io_uring requests are to be resubmitted */
+	struct socket_info* cur_info;      /**< the socket last returned by getReadySocket */
+	unsigned int generation;           /**< generation number for the next socket */
+#endif
 #else
 	fd_set rset, /**< socket read set (see select doc) */
 		rset_saved; /**< saved socket read set */
@@ -300,6 +344,7 @@ void Socket_outTerminate();
 void Socket_terminate();
 int Socket_getReadySocket(int more_work, struct timeval *tp);
 int Socket_getch(int socket, char* c);
+int Socket_read(int socket, char* buf, int len);
 char *Socket_getdata(int socket, int bytes, int* actual_len);
 int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffers, int* buflens);
 int Socket_close_only(int socket);
@@ -314,6 +359,19 @@ char* Socket_getpeer(int sock);
 char* Socket_getaddrname(struct sockaddr* sa, int sock);
 
 int Socket_noPendingWrites(int socket);
+unsigned long long Socket_writeBlocked(int socket);
+
+void Socket_setNotifier(int fd);
+int Socket_notified();
+
+typedef void Socket_closeCallback(int socket);
+void Socket_setCloseCallback(Socket_closeCallback* callback);
+
+void Socket_fanoutInitialize(int threads);
+void Socket_fanoutTerminate();
+int Socket_fanoutThreads();
+void Socket_startFanout();
+int Socket_endFanout(List* failed);
 
 typedef struct
 {
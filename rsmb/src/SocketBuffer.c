@@ -24,6 +24,7 @@
 #include "LinkedList.h"
 #include "Log.h"
 #include "Messages.h"
+#include "Latency.h"
 #include "StackTrace.h"
 
 #include <stdlib.h>
@@ -316,8 +317,9 @@ void SocketBuffer_queueChar(int socket, char c)
  * @param iovecs buffer array
  * @param total total data length to be written
  * @param bytes actual data length that was written
+ * @param started when the write started, from Latency_now, or 0 if it is not to be timed
  */
-void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total, int bytes)
+void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total, int bytes, unsigned long long started)
 {
 	int i = 0;
 	pending_writes* pw = NULL;
@@ -329,6 +331,8 @@ void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total,
 	pw->bytes = bytes;
 	pw->total = total;
 	pw->count = count;
+	pw->started = started;
+	pw->pending = Latency_now();
 	for (i = 0; i < count; i++)
 		pw->iovecs[i] = iovecs[i];
 	ListAppend(&writes, pw, sizeof(pw) + total);
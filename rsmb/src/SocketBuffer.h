@@ -46,6 +46,8 @@ typedef struct
 	int socket, total, count;
 	unsigned long bytes;
 	iobuf iovecs[5];
+	unsigned long long started; /* when the write started, for the write latency, or 0 */
+	unsigned long long pending; /* when the write became pending, or the time blocked was last taken */
 } pending_writes;
 
 #define SOCKETBUFFER_COMPLETE 0
@@ -63,7 +65,7 @@ void SocketBuffer_interrupted(int socket, int actual_len);
 char* SocketBuffer_complete(int socket);
 void SocketBuffer_queueChar(int socket, char c);
 
-void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total, int bytes);
+void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total, int bytes, unsigned long long started);
 pending_writes* SocketBuffer_getWrite(int socket);
 int SocketBuffer_writeComplete(int socket);
 pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload);
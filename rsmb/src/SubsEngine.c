@@ -26,16 +26,21 @@
 #include "Log.h"
 #include "Persistence.h"
 #include "Messages.h"
+#include "Latency.h"
 #include "StackTrace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #if !defined(SUBSENGINE_UNIT_TESTS)
 #include "Heap.h"
 #endif
 
+static void SubscriptionEngines_freeEntry(SubscribersCache* cache, SubscribersCacheEntry* entry);
+int saveOrFreeSubscriptions(List* subs, int must_free, int must_save);
+
 /**
  * Initialize one subscription record
  * @param clientid the id of the client
@@ -75,6 +80,111 @@ int subsTopicCompare(void* a, void* b, int value)
 }
 
 
+/**
+ * Get a retained publication from a retained message map.
+ * @param m the retained message map
+ * @param i the position of the publication in the map
+ * @return the retained publication, which points into the map
+ */
+static RetainedPublications* SubscriptionEngines_mapped(RetainedMap* m, int i)
+{
+	RetainedPublications* r = &m->entries[i];
+
+	if (r->topicName == NULL)
+	{
+		RetainedMapEntry* e = &m->index[i];
+
+		r->topicName = m->base + e->topic;
+		r->payload = m->base + e->payload;
+		r->payloadlen = e->payloadlen;
+		r->qos = e->qos;
+	}
+	return r;
+}
+
+
+/**
+ * Compare topic names in the order that retained messages are held in the map, which is
+ * the order the retained message tree iterates in - descending.
+ * @param a first topic name
+ * @param b second topic name
+ * @return less than, equal to or greater than 0, as a comes before, with, or after b
+ */
+static int SubscriptionEngines_mapOrder(char* a, char* b)
+{
+	return strcmp(b, a);
+}
+
+
+/**
+ * Find a topic in a retained message map.
+ * @param m the retained message map - can be NULL
+ * @param topicName the topic name to look for
+ * @return the position of the topic in the map, or -1 if it is not there
+ */
+static int SubscriptionEngines_findMapped(RetainedMap* m, char* topicName)
+{
+	int lo = 0,
+		hi = (m) ? m->count - 1 : -1;
+
+	while (lo <= hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		int cmp = SubscriptionEngines_mapOrder(m->base + m->index[mid].topic, topicName);
+
+		if (cmp == 0)
+			return mid;
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+
+/**
+ * Get the next retained publication, in map order.  The mapped publications are
+ * merged with the changes since the map was made: a retained publication in the tree
+ * replaces the mapped one for the same topic, and one with no payload hides it.
+ * @param se pointer to the subscription engine state structure
+ * @param pos position in the map, 0 to start
+ * @param node current node in the tree, NULL to start
+ * @return the next retained publication, or NULL at the end
+ */
+static RetainedPublications* SubscriptionEngines_nextRetained(SubscriptionEngines* se, int* pos, Node** node)
+{
+	RetainedPublications* rc = NULL;
+
+	while (rc == NULL)
+	{
+		RetainedMap* m = se->retained_map;
+		RetainedPublications* mapped = (m && *pos < m->count) ? SubscriptionEngines_mapped(m, *pos) : NULL;
+		Node* next = TreeNextElement(se->retaineds, *node);
+		RetainedPublications* changed = (next) ? next->content : NULL;
+		int cmp = 0;
+
+		if (mapped == NULL && changed == NULL)
+			break;
+		cmp = (mapped == NULL) ? 1 : (changed == NULL) ? -1 : SubscriptionEngines_mapOrder(mapped->topicName, changed->topicName);
+		if (cmp < 0)
+		{
+			rc = mapped;
+			(*pos)++;
+		}
+		else
+		{
+			if (cmp == 0)
+				(*pos)++;
+			*node = next;
+			if (changed->payloadlen > 0)
+				rc = changed;
+		}
+	}
+	return rc;
+}
+
+
 /**
  * Compare topics in the the topic tree to that it is ordered by topic.
  */
@@ -88,6 +198,138 @@ int retainedTopicCompare(void* a, void* b, int value)
 }
 
 
+/**
+ * Compare cache entries by topic, so that the cache tree is ordered by topic.
+ */
+int subscribersCacheCompare(void* a, void* b, int value)
+{
+	char* as = ((SubscribersCacheEntry*)a)->topic;
+	char* bs = (value) ? ((SubscribersCacheEntry*)b)->topic : (char*)b;
+
+	return strcmp(as, bs);
+}
+
+
+/**
+ * Compare client subscription indexes by client id, so that the index tree is ordered by client.
+ */
+int clientSubscriptionsCompare(void* a, void* b, int value)
+{
+	char* as = ((ClientSubscriptions*)a)->clientName;
+	char* bs = (value) ? ((ClientSubscriptions*)b)->clientName : (char*)b;
+
+	return strcmp(as, bs);
+}
+
+
+/**
+ * Find the subscription index for a client.
+ * @param se pointer to the subscription engine state structure
+ * @param clientName the id of the client
+ * @param create boolean - whether to create the index if the client does not have one
+ * @return the client's subscription index, or NULL
+ */
+static ClientSubscriptions* SubscriptionEngines_findClient(SubscriptionEngines* se, char* clientName, int create)
+{
+	ClientSubscriptions* cs = NULL;
+	Node* node = NULL;
+
+	if ((node = TreeFind(se->clients, clientName)) != NULL)
+		cs = (ClientSubscriptions*)(node->content);
+	else if (create)
+	{
+		cs = malloc(sizeof(ClientSubscriptions));
+		cs->clientName = malloc(strlen(clientName) + 1);
+		strcpy(cs->clientName, clientName);
+		cs->elements = ListInitialize();
+		TreeAdd(se->clients, cs, sizeof(ClientSubscriptions) + strlen(clientName) + 1);
+	}
+	return cs;
+}
+
+
+/**
+ * Add a subscription to its client's index.
+ * @param se pointer to the subscription engine state structure
+ * @param elem the subscription list element holding the subscription
+ */
+static void SubscriptionEngines_index(SubscriptionEngines* se, ListElement* elem)
+{
+	ClientSubscriptions* cs = SubscriptionEngines_findClient(se, ((Subscriptions*)(elem->content))->clientName, 1);
+
+	ListAppend(cs->elements, elem, sizeof(ListElement));
+}
+
+
+/**
+ * Remove a client's subscription index from the index tree, and free it.
+ * @param se pointer to the subscription engine state structure
+ * @param cs the client's subscription index
+ */
+static void SubscriptionEngines_freeClient(SubscriptionEngines* se, ClientSubscriptions* cs)
+{
+	TreeRemove(se->clients, cs);
+	ListFreeNoContent(cs->elements);
+	free(cs->clientName);
+	free(cs);
+}
+
+
+/**
+ * Compare shared subscription groups by shared subscription name, so that the group tree is
+ * ordered by name.  The members of one group are then next to each other in the tree.
+ */
+int sharedSubscriptionsCompare(void* a, void* b, int value)
+{
+	char* as = ((SharedSubscriptions*)a)->topicName;
+	char* bs = (value) ? ((SharedSubscriptions*)b)->topicName : (char*)b;
+
+	return strcmp(as, bs);
+}
+
+
+/**
+ * Find the shared subscription group for a shared subscription name.
+ * @param se pointer to the subscription engine state structure
+ * @param topicName the interned shared subscription name, "$share/<group>/<filter>"
+ * @param create boolean - whether to create the group if it does not exist
+ * @return the shared subscription group, or NULL
+ */
+static SharedSubscriptions* SubscriptionEngines_findShared(SubscriptionEngines* se, char* topicName, int create)
+{
+	SharedSubscriptions* ss = NULL;
+	Node* node = NULL;
+
+	if ((node = TreeFind(se->shared, topicName)) != NULL)
+		ss = (SharedSubscriptions*)(node->content);
+	else if (create)
+	{
+		ss = malloc(sizeof(SharedSubscriptions));
+		ss->topicName = Topics_intern(topicName);
+		ss->filter = Topics_sharedFilter(ss->topicName);
+		ss->wildcards = Topics_hasWildcards(ss->filter);
+		ss->members = ListInitialize();
+		ss->next = ss->delivered = 0;
+		TreeAdd(se->shared, ss, sizeof(SharedSubscriptions));
+	}
+	return ss;
+}
+
+
+/**
+ * Remove a shared subscription group from the group tree, and free it and its members.
+ * @param se pointer to the subscription engine state structure
+ * @param ss the shared subscription group
+ */
+static void SubscriptionEngines_freeShared(SubscriptionEngines* se, SharedSubscriptions* ss)
+{
+	TreeRemove(se->shared, ss);
+	saveOrFreeSubscriptions(ss->members, 1, 0);
+	Topics_release(ss->topicName);
+	free(ss);
+}
+
+
 /**
  * Create and initialize a new subscription engine
  * @return pointer to the new subscription engine structure
@@ -100,12 +342,19 @@ SubscriptionEngines* SubscriptionEngines_initialize()
 	newse->subs = TreeInitialize(subsTopicCompare);
 	newse->wsubs = ListInitialize();
 	newse->retaineds = TreeInitialize(retainedTopicCompare);
+	newse->retained_map = NULL;
 	newse->retained_changes = 0;
+	memset(&newse->cache, '\0', sizeof(SubscribersCache));
+	newse->cache.entries = TreeInitialize(subscribersCacheCompare);
+	newse->clients = TreeInitialize(clientSubscriptionsCompare);
+	newse->shared = TreeInitialize(sharedSubscriptionsCompare);
+	newse->shared_policy = SHARED_ROUND_ROBIN;
+	newse->client_load = NULL;
 	newse->system.subs = ListInitialize();
 	newse->system.retaineds = TreeInitialize(retainedTopicCompare);
 
 #if !defined(SUBSENGINE_UNIT_TESTS)
-	if (Persistence_open_retained('r'))
+	if ((newse->retained_map = Persistence_map_retained()) == NULL && Persistence_open_retained('r'))
 	{
 		RetainedPublications* r;
 		while ((r = Persistence_read_retained()))
@@ -119,7 +368,13 @@ SubscriptionEngines* SubscriptionEngines_initialize()
 				free(r);
 			}
 			else
+			{
+				char* topicName = r->topicName;
+
+				r->topicName = Topics_intern(topicName);
+				free(topicName);
 				TreeAdd(newse->retaineds, r, sizeof(RetainedPublications)+strlen(r->topicName)+r->payloadlen);
+			}
 		}
 		Persistence_close_file(0);
 	}
@@ -128,8 +383,22 @@ SubscriptionEngines* SubscriptionEngines_initialize()
 		Subscriptions* s;
 		while ((s = Persistence_read_subscription()))
 		{
-			if (Topics_hasWildcards(s->topicName))
+			char* topicName = s->topicName;
+
+			s->topicName = Topics_intern(topicName);
+			free(topicName);
+			if (strncmp(s->topicName, SHARED_SUBSCRIPTION_PREFIX, strlen(SHARED_SUBSCRIPTION_PREFIX)) == 0)
+			{
+				SharedSubscriptions* ss = SubscriptionEngines_findShared(newse, s->topicName, 1);
+
+				ListAppend(ss->members, s, sizeof(Subscriptions)+strlen(s->clientName)+strlen(s->topicName));
+				SubscriptionEngines_index(newse, ss->members->last);
+			}
+			else if (Topics_hasWildcards(s->topicName))
+			{
 				ListAppend(newse->wsubs, s, sizeof(Subscriptions)+strlen(s->clientName)+strlen(s->topicName));
+				SubscriptionEngines_index(newse, newse->wsubs->last);
+			}
 			else
 			{
 				List* curlist = NULL;
@@ -144,18 +413,68 @@ SubscriptionEngines* SubscriptionEngines_initialize()
 				else
 					curlist = curnode->content;
 				ListAppend(curlist, s, sizeof(Subscriptions)+strlen(s->clientName)+strlen(s->topicName));
+				SubscriptionEngines_index(newse, curlist->last);
 				if (new)
 					TreeAdd(newse->subs, curlist, sizeof(List*));
 			}
 		}
 		Persistence_close_file(0);
 	}
+	if (Persistence_open_journal('r'))
+	{
+		void* content = NULL;
+		int type = 0;
+
+		while ((type = Persistence_read_journal(&content)) != 0)
+			SubscriptionEngines_replay(newse, type, content);
+	}
+	Persistence_open_journal('a');
 #endif
 	FUNC_EXIT;
 	return newse;
 }
 
 
+#if !defined(SUBSENGINE_UNIT_TESTS)
+/**
+ * Apply one change read from the persistence journal.  The journal is not open for writing
+ * while it is being replayed, so the changes are not journaled again.
+ * @param se pointer to the subscription engine state structure
+ * @param type the journal record type
+ * @param content the retained publication or subscription read from the journal
+ */
+void SubscriptionEngines_replay(SubscriptionEngines* se, int type, void* content)
+{
+	FUNC_ENTRY;
+	if (type == JOURNAL_SET_RETAINED || type == JOURNAL_CLEAR_RETAINED)
+	{
+		RetainedPublications* r = (RetainedPublications*)content;
+
+		SubscriptionEngines_setRetained(se, r->topicName, r->qos, r->payload, r->payloadlen);
+		free(r->topicName);
+		if (r->payload)
+			free(r->payload);
+		free(r);
+	}
+	else
+	{
+		Subscriptions* s = (Subscriptions*)content;
+
+		if (type == JOURNAL_SUBSCRIBE) /* the subscription takes over the client id storage */
+			SubscriptionEngines_subscribe(se, s->clientName, s->topicName, s->qos, s->noLocal, 1, s->priority);
+		else
+		{
+			SubscriptionEngines_unsubscribe(se, s->clientName, s->topicName);
+			free(s->clientName);
+		}
+		free(s->topicName);
+		free(s);
+	}
+	FUNC_EXIT;
+}
+#endif
+
+
 /**
  * Save the retained message table to disk and/or free al the retained messages.
  * If neither free nor save flag is true, no work is done.
@@ -185,8 +504,9 @@ int saveOrFreeRetaineds(Tree* retaineds, int must_free, int must_save)
 		}
 		if (must_free)
 		{
-			free(r->topicName);
-			free(r->payload);
+			Topics_release(r->topicName);
+			if (r->payload)
+				free(r->payload);
 		}
 	}
 	if (must_free)
@@ -196,6 +516,31 @@ int saveOrFreeRetaineds(Tree* retaineds, int must_free, int must_save)
 }
 
 
+/**
+ * Save the retained messages to disk, in map order.
+ * @param se pointer to the subscription engine state structure
+ * @return success or error code
+ */
+static int SubscriptionEngines_saveRetained(SubscriptionEngines* se)
+{
+	RetainedPublications* r = NULL;
+	Node* node = NULL;
+	int pos = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	while ((r = SubscriptionEngines_nextRetained(se, &pos, &node)) != NULL)
+	{
+#if !defined(SUBSENGINE_UNIT_TESTS)
+		if (Persistence_write_retained(r->payload, r->payloadlen, r->qos, r->topicName) != 0)
+			rc = -1;
+#endif
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Save the subscription table to disk and/or free al the subscriptions.
  * If neither free nor save flag is true, no work is done.
@@ -224,7 +569,7 @@ int saveOrFreeSubscriptions(List* subs, int must_free, int must_save)
 #endif
 		}
 		if (must_free)
-			free(s->topicName);
+			Topics_release(s->topicName);
 	}
 	if (must_free)
 		ListFree(subs);
@@ -254,28 +599,32 @@ int saveOrFreeSubscriptions1(Tree* subs, int must_free, int must_save)
 		rc = saveOrFreeSubscriptions(subs, must_free, must_save);
 	}
 	if (must_free)
-		TreeFree(subs);
+	{
+		/* the lists have been freed already, so only the nodes are left */
+		while ((current = TreeNextElement(subs, NULL)) != NULL)
+			TreeRemoveNodeIndex(subs, current, 0);
+		free(subs);
+	}
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
 /**
- * Save the subscription engine state to persistence.
+ * Write the retained messages and durable subscriptions to the persistence files.
  * @param se pointer to a subscription engine state structure
+ * @return success or error code
  */
-void SubscriptionEngines_save(SubscriptionEngines* se)
+static int SubscriptionEngines_write(SubscriptionEngines* se)
 {
 	int rc = 0;
-	
+
 	FUNC_ENTRY;
 #if !defined(SUBSENGINE_UNIT_TESTS)
 	Persistence_open_retained('w');
-	if ((rc = saveOrFreeRetaineds(se->retaineds, 0, 1)) != 0)
+	if ((rc = SubscriptionEngines_saveRetained(se)) != 0)
 		Log(LOG_WARNING, 147, NULL);
 	Persistence_close_file(rc);
-	if (rc == 0)
-		se->retained_changes = 0;
 	
 	if (rc == 0)
 	{
@@ -284,8 +633,69 @@ void SubscriptionEngines_save(SubscriptionEngines* se)
 			Log(LOG_WARNING, 148, NULL);
 		else if ((rc = saveOrFreeSubscriptions1(se->subs, 0, 1)) != 0)
 			Log(LOG_WARNING, 148, NULL);
+		else
+		{
+			Node* current = NULL;
+
+			while (rc == 0 && (current = TreeNextElement(se->shared, current)) != NULL)
+			{
+				if ((rc = saveOrFreeSubscriptions(((SharedSubscriptions*)(current->content))->members, 0, 1)) != 0)
+					Log(LOG_WARNING, 148, NULL);
+			}
+		}
 		Persistence_close_file(rc);
 	}
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Save the subscription engine state to persistence, in the broker process.
+ * @param se pointer to a subscription engine state structure
+ */
+void SubscriptionEngines_save(SubscriptionEngines* se)
+{
+	int rc = 0;
+	
+	FUNC_ENTRY;
+#if !defined(SUBSENGINE_UNIT_TESTS)
+	unsigned long long start = Latency_now();
+
+	Persistence_wait_snapshot(); /* a background snapshot may be writing the same files */
+	Persistence_begin_snapshot();
+	if ((rc = SubscriptionEngines_write(se)) == 0)
+	{
+		se->retained_changes = 0;
+		Persistence_open_journal('w'); /* the journaled changes are now in the saved state */
+		SubscriptionEngines_remapRetained(se);
+	}
+	Persistence_end_snapshot(rc);
+	Latency_since(LATENCY_SAVE, start);
+#endif
+	FUNC_EXIT;
+}
+
+
+/**
+ * Save the subscription engine state to persistence, in a child process if
+ * persistence_fork is set, otherwise in the broker process.
+ * @param se pointer to a subscription engine state structure
+ */
+void SubscriptionEngines_snapshot(SubscriptionEngines* se)
+{
+	int pid = 0;
+
+	FUNC_ENTRY;
+#if !defined(SUBSENGINE_UNIT_TESTS)
+	if ((pid = Persistence_fork_snapshot(se->retained_changes)) == 0)
+		Persistence_exit_snapshot(SubscriptionEngines_write(se)); /* in the child - does not return */
+	else if (pid > 0)
+		se->retained_changes = 0; /* counted again if the snapshot fails */
+	else if (pid == -1)
+		SubscriptionEngines_save(se);
+	/* else a snapshot is already running, so the changes are left for the next one */
 #endif
 	FUNC_EXIT;
 }
@@ -298,12 +708,28 @@ void SubscriptionEngines_save(SubscriptionEngines* se)
 void SubscriptionEngines_terminate(SubscriptionEngines* se)
 {
 	FUNC_ENTRY;
+#if !defined(SUBSENGINE_UNIT_TESTS)
+	Persistence_close_journal();
+	if (se->retained_map)
+		Persistence_unmap_retained(se->retained_map);
+#endif
 	saveOrFreeRetaineds(se->retaineds, 1, 0);
 	saveOrFreeRetaineds(se->system.retaineds, 1, 0);
 
 	saveOrFreeSubscriptions(se->wsubs, 1, 0);
 	saveOrFreeSubscriptions(se->system.subs, 1, 0);
 	saveOrFreeSubscriptions1(se->subs, 1, 0);
+	while (se->shared->count > 0)
+		SubscriptionEngines_freeShared(se, (SharedSubscriptions*)(TreeNextElement(se->shared, NULL)->content));
+	TreeFree(se->shared);
+
+	while (se->cache.oldest)
+		SubscriptionEngines_freeEntry(&se->cache, se->cache.oldest);
+	TreeFree(se->cache.entries);
+
+	while (se->clients->count > 0)
+		SubscriptionEngines_freeClient(se, (ClientSubscriptions*)(TreeNextElement(se->clients, NULL)->content));
+	TreeFree(se->clients);
 
 	free(se);
 	FUNC_EXIT;
@@ -315,7 +741,7 @@ void SubscriptionEngines_terminate(SubscriptionEngines* se)
  * @param se pointer to the subscription engine state structure
  * @param sl subscription list to add to
  * @param aClientid the id of the client which is subscribing
- * @param aTopic a topic name string - can have wildcards
+ * @param aTopic an interned topic name string - can have wildcards.  The reference is taken over.
  * @param qos the MQTT Quality of Service
  * @param noLocal boolean - whether the subscription is "noLocal"
  * @param durable boolean - whether the subscription is to be persisted
@@ -324,34 +750,54 @@ void SubscriptionEngines_terminate(SubscriptionEngines* se)
 int SubscriptionEngines_subscribe1(SubscriptionEngines* se, List* sl, char* aClientid, char* aTopic, int qos, int noLocal, int durable, int priority)
 {
 	int changed = 0;
+	ClientSubscriptions* cs = NULL;
 	ListElement *current = NULL;
 
 	FUNC_ENTRY;
-	while (ListNextElement(sl, &current))
+	/* a topic name belongs in only one subscription list, so the client's index is enough to find it */
+	cs = SubscriptionEngines_findClient(se, aClientid, 0);
+	while (cs && ListNextElement(cs->elements, &current))
 	{
-		Subscriptions* s = current->content;
-		if (strcmp(s->clientName, aClientid) == 0 && strcmp(s->topicName, aTopic) == 0)
+		Subscriptions* s = ((ListElement*)(current->content))->content;
+		if (s->topicName == aTopic)
 		{
+			int durable_change = 0;
+
 			Log(TRACE_MINIMUM, 21, NULL, aClientid, aTopic, qos);
 			if (s->durable != durable || (durable && (s->qos != qos || s->noLocal != noLocal || s->priority != priority)))
+			{
 				(se->retained_changes)++;
+				durable_change = 1;
+			}
 			if (s->durable != durable || s->qos != qos || s->noLocal != noLocal || s->priority != priority)
 				changed = 1;
-			free(s->topicName); /* make sure we free the old topic name, even though it is the same */
-			s->topicName = aTopic; /* point to the new (same value) one */
+			Topics_release(aTopic); /* the subscription already holds a reference to the same name */
 			s->qos = qos;
 			s->noLocal = noLocal;
 			s->durable = durable;
 			s->priority = priority;
+#if !defined(SUBSENGINE_UNIT_TESTS)
+			if (durable_change && sl != se->system.subs)
+				Persistence_journal_subscription(s, durable);
+#endif
 			break;
 		}
 	}
 	if (current == NULL)
 	{
+		Subscriptions* s = Subscriptions_initialize(aClientid, aTopic, qos, noLocal, durable, priority);
+
 		Log(TRACE_MINIMUM, 22, NULL, aClientid, aTopic, qos);
-		ListAppend(sl, Subscriptions_initialize(aClientid, aTopic, qos, noLocal, durable, priority), sizeof(Subscriptions));
+		ListAppend(sl, s, sizeof(Subscriptions));
+		SubscriptionEngines_index(se, sl->last);
 		if (durable)
+		{
 			(se->retained_changes)++;
+#if !defined(SUBSENGINE_UNIT_TESTS)
+			if (sl != se->system.subs)
+				Persistence_journal_subscription(s, 1);
+#endif
+		}
 		changed = 1;
 	}
 	FUNC_EXIT_RC(changed);
@@ -386,7 +832,7 @@ int SubscriptionEngines_subscribe2(SubscriptionEngines* se, Tree* sl, char* aCli
  * Make a subscription
  * @param se pointer to the subscription engine state structure
  * @param aClientid the id of the client which is subscribing
- * @param aTopic a topic name string - can have wildcards
+ * @param aTopic a topic name string - can have wildcards.  It is not taken over.
  * @param qos the MQTT Quality of Service
  * @param noLocal boolean - whether the subscription is "noLocal"
  * @param durable boolean - whether the subscription is to be persisted
@@ -397,8 +843,16 @@ int SubscriptionEngines_subscribe(SubscriptionEngines* se, char* aClientid, char
 	int changed = 0;
 
 	FUNC_ENTRY;
+	++(se->cache.generation);
+	aTopic = Topics_intern(aTopic);
 	if (strncmp(aTopic, sysprefix, strlen(sysprefix)) == 0)
 		changed = SubscriptionEngines_subscribe1(se, se->system.subs, aClientid, aTopic, qos, noLocal, durable, priority);
+	else if (strncmp(aTopic, SHARED_SUBSCRIPTION_PREFIX, strlen(SHARED_SUBSCRIPTION_PREFIX)) == 0)
+	{
+		SharedSubscriptions* ss = SubscriptionEngines_findShared(se, aTopic, 1);
+
+		changed = SubscriptionEngines_subscribe1(se, ss->members, aClientid, aTopic, qos, noLocal, durable, priority);
+	}
 	else
 	{
 		if (Topics_hasWildcards(aTopic))
@@ -413,88 +867,91 @@ int SubscriptionEngines_subscribe(SubscriptionEngines* se, char* aClientid, char
 
 
 /**
- * Try to remove a subscription
+ * Remove one subscription from its subscription list
  * @param se pointer to the subscription engine state structure
- * @param sl subscription list to remove from
- * @param aClientid the id of the client which is subscribing
- * @param aTopic a topic name string - can have wildcards
- * @param wildcard is this a global wildcard?
+ * @param elem the subscription list element holding the subscription
  */
-void SubscriptionEngines_unsubscribe1(SubscriptionEngines* se, List* sl, char* aClientid, char* aTopic, char* wildcard)
+static void SubscriptionEngines_unsubscribe1(SubscriptionEngines* se, ListElement* elem)
 {
-	ListElement* current = NULL;
+	Subscriptions* s = elem->content;
+	List* sl = NULL;
+	Node* node = NULL;
+	SharedSubscriptions* ss = NULL;
 
 	FUNC_ENTRY;
-	ListNextElement(sl, &current);
-	while (current)
+	if (strncmp(s->topicName, sysprefix, strlen(sysprefix)) == 0)
+		sl = se->system.subs;
+	else if (strncmp(s->topicName, SHARED_SUBSCRIPTION_PREFIX, strlen(SHARED_SUBSCRIPTION_PREFIX)) == 0 &&
+			(ss = SubscriptionEngines_findShared(se, s->topicName, 0)) != NULL)
+		sl = ss->members;
+	else if (s->wildcards)
+		sl = se->wsubs;
+	else if ((node = TreeFind(se->subs, s->topicName)) != NULL)
+		sl = (List*)(node->content);
+	else
 	{
-		Subscriptions* s = current->content;
-		ListNextElement(sl, &current);
-		if (strcmp(s->clientName, aClientid) == 0 &&
-			(strcmp(s->topicName, aTopic) == 0 || strcmp(aTopic, wildcard) == 0))
-		{
-			Log(TRACE_MINIMUM, 23, NULL, s->clientName, s->topicName, s->qos);
-			free(s->topicName);
-			if (s->durable)
-				(se->retained_changes)++;
-			if (ListRemove(sl, s) == 0)
-				Log(LOG_SEVERE, 0, "Failed to remove subscription %s from client %s", s->topicName, s->clientName);
-			if (strcmp(aTopic, wildcard) != 0) /* wildcard removes all subscriptions */
-				break;
-		}
+		Log(LOG_SEVERE, 0, "Failed to remove subscription %s from client %s", s->topicName, s->clientName);
+		goto exit;
 	}
-	FUNC_EXIT;
-}
-
-
-void SubscriptionEngines_unsubscribeAll(SubscriptionEngines* se, Tree* sl, char* aClientid, char* aTopic, char* wildcard)
-{
-	Node *current = NULL;
-	Node *previous = NULL;
-
-	FUNC_ENTRY;
 
-	while ((current = TreeNextElement(sl, current)) != NULL)
+	Log(TRACE_MINIMUM, 23, NULL, s->clientName, s->topicName, s->qos);
+	if (s->durable)
 	{
-		List* curlist = (List*)(current->content);
-
-		SubscriptionEngines_unsubscribe1(se, curlist, aClientid, aTopic, wildcard);
-		if (curlist->count == 0)
-		{
-			/* calling TreeRemoveNodeIndex means that the current node pointer is no longer valid, so
-			 * we have to revert to the previous pointer.  It also means that if we had called TreeNextElement
-			 */
-			free(TreeRemoveNodeIndex(sl, current, 0));
-			current = previous;
-		}
-		else
-			previous = current;
+		(se->retained_changes)++;
+#if !defined(SUBSENGINE_UNIT_TESTS)
+		if (sl != se->system.subs)
+			Persistence_journal_subscription(s, 0);
+#endif
 	}
+	Topics_release(s->topicName);
+	ListUnlinkElement(sl, elem, 1);
+	if (node && sl->count == 0)
+		free(TreeRemoveNodeIndex(se->subs, node, 0));
+	else if (ss && sl->count == 0)
+		SubscriptionEngines_freeShared(se, ss);
+exit:
 	FUNC_EXIT;
-	return;
 }
 
 
 /**
- * Try to remove a subscription
+ * Try to remove a subscription.  Only the client's own subscriptions are searched.
  * @param se pointer to the subscription engine state structure
  * @param aClientid the id of the client which is subscribing
- * @param aTopic a topic name string - can have wildcards
+ * @param aTopic a topic name string - can have wildcards.  "#" removes all the client's
+ * subscriptions outside the system topic space, and "$SYS/#" all those inside it.
  */
 void SubscriptionEngines_unsubscribe(SubscriptionEngines* se, char* aClientid, char* aTopic)
 {
+	ClientSubscriptions* cs = NULL;
+	char* topic = Topics_interned(aTopic); /* if the name is not interned, nothing is subscribed to it */
+	int system = (strncmp(aTopic, sysprefix, strlen(sysprefix)) == 0);
+	int all = strcmp(aTopic, (system) ? "$SYS/#" : (char*)MULTI_LEVEL_WILDCARD) == 0;
+
 	FUNC_ENTRY;
-	if (strncmp(aTopic, sysprefix, strlen(sysprefix)) == 0)
-		SubscriptionEngines_unsubscribe1(se, se->system.subs, aClientid, aTopic, "$SYS/#");
-	else
+	++(se->cache.generation);
+	if ((cs = SubscriptionEngines_findClient(se, aClientid, 0)) != NULL)
 	{
-		int wildcards = Topics_hasWildcards(aTopic);
+		ListElement* current = NULL;
 
-		if (wildcards)
-			SubscriptionEngines_unsubscribe1(se, se->wsubs, aClientid, aTopic, (char*)MULTI_LEVEL_WILDCARD);
+		ListNextElement(cs->elements, &current);
+		while (current)
+		{
+			ListElement* elem = current;
+			Subscriptions* s = ((ListElement*)(elem->content))->content;
 
-		if (!wildcards || strcmp(aTopic, MULTI_LEVEL_WILDCARD) == 0)
-			SubscriptionEngines_unsubscribeAll(se, se->subs, aClientid, aTopic, (char*)MULTI_LEVEL_WILDCARD);
+			ListNextElement(cs->elements, &current);
+			if (s->topicName == topic ||
+				(all && (strncmp(s->topicName, sysprefix, strlen(sysprefix)) == 0) == system))
+			{
+				SubscriptionEngines_unsubscribe1(se, elem->content);
+				ListUnlinkElement(cs->elements, elem, 0);
+				if (!all)
+					break;
+			}
+		}
+		if (cs->elements->count == 0)
+			SubscriptionEngines_freeClient(se, cs);
 	}
 	FUNC_EXIT;
 }
@@ -540,9 +997,10 @@ char* SubscriptionEngines_mostSpecific(char* topicA, char* topicB)
  * @param sl pointer to the subscription list for a topic space
  * @param aTopic a topic name string
  * @param clientID	the id of the client
+ * @param nolocal set to 1 if any noLocal subscription matched the topic
  * @return a List of clients subscribed to the topic
  */
-List* SubscriptionEngines_getSubscribers1(List* sl, char* aTopic, char* clientID)
+List* SubscriptionEngines_getSubscribers1(List* sl, char* aTopic, char* clientID, int* nolocal)
 {
 	List* rc = ListInitialize(); /* list of subscription structures */
 	ListElement* current = NULL;
@@ -552,6 +1010,8 @@ List* SubscriptionEngines_getSubscribers1(List* sl, char* aTopic, char* clientID
 	{
 		Subscriptions* s = current->content;
 		Log(TRACE_MAXIMUM, 24, NULL, s->clientName, s->qos, s->topicName);
+		if (s->noLocal && Topics_matches(s->topicName, s->wildcards, aTopic))
+			*nolocal = 1;
 		if (Topics_matches(s->topicName, s->wildcards, aTopic) &&
 			((s->noLocal == 0) || (strcmp(s->clientName, clientID) != 0)))
 		{
@@ -584,7 +1044,7 @@ List* SubscriptionEngines_getSubscribers1(List* sl, char* aTopic, char* clientID
 }
 
 
-List* SubscriptionEngines_getSubscribers2(Tree* st, List* rc, char* aTopic, char* clientID)
+List* SubscriptionEngines_getSubscribers2(Tree* st, List* rc, char* aTopic, char* clientID, int* nolocal)
 {
 	Node* curnode = NULL;
 
@@ -599,6 +1059,8 @@ List* SubscriptionEngines_getSubscribers2(Tree* st, List* rc, char* aTopic, char
 		{
 			Subscriptions* s = current->content;
 			Log(TRACE_MAXIMUM, 24, NULL, s->clientName, s->qos, s->topicName);
+			if (s->noLocal)
+				*nolocal = 1;
 			if (((s->noLocal == 0) || (strcmp(s->clientName, clientID) != 0)))
 			{
 				rc->current = NULL;
@@ -631,29 +1093,371 @@ List* SubscriptionEngines_getSubscribers2(Tree* st, List* rc, char* aTopic, char
 
 
 /**
- * Find all the subscribers for a topic
+ * Remove a subscribers cache entry from the least recently used chain
+ * @param cache the subscribers cache
+ * @param entry the entry to remove
+ */
+static void SubscriptionEngines_unlinkEntry(SubscribersCache* cache, SubscribersCacheEntry* entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+	entry->newer = entry->older = NULL;
+}
+
+
+/**
+ * Make a subscribers cache entry the most recently used
+ * @param cache the subscribers cache
+ * @param entry the entry, which must not be in the least recently used chain
+ */
+static void SubscriptionEngines_linkEntry(SubscribersCache* cache, SubscribersCacheEntry* entry)
+{
+	entry->older = cache->newest;
+	entry->newer = NULL;
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+}
+
+
+/**
+ * Free the subscriber list held by a subscribers cache entry
+ * @param entry the entry
+ */
+static void SubscriptionEngines_emptyEntry(SubscribersCacheEntry* entry)
+{
+	if (entry->clientID)
+		free(entry->clientID);
+	if (entry->contents)
+		free(entry->contents);
+	if (entry->elements)
+		free(entry->elements);
+	entry->clientID = NULL;
+	entry->contents = NULL;
+	entry->elements = NULL;
+	ListZero(&entry->subscribers);
+}
+
+
+/**
+ * Remove an entry from the subscribers cache and free it
+ * @param cache the subscribers cache
+ * @param entry the entry to free, which must not be in use
+ */
+static void SubscriptionEngines_freeEntry(SubscribersCache* cache, SubscribersCacheEntry* entry)
+{
+	SubscriptionEngines_unlinkEntry(cache, entry);
+	TreeRemove(cache->entries, entry);
+	SubscriptionEngines_emptyEntry(entry);
+	free(entry->topic);
+	free(entry);
+}
+
+
+/**
+ * Store the subscribers found for a topic in a subscribers cache entry
+ * @param entry the entry, which must not be in use
+ * @param found the subscribers found
+ * @param clientID the publishing client, if it affected the subscribers found; otherwise NULL
+ * @param generation the current subscription generation
+ */
+static void SubscriptionEngines_fillEntry(SubscribersCacheEntry* entry, List* found, char* clientID, unsigned int generation)
+{
+	ListElement* current = NULL;
+	int i = 0;
+
+	SubscriptionEngines_emptyEntry(entry);
+	if (found->count > 0)
+	{
+		entry->contents = malloc(sizeof(Subscriptions) * found->count);
+		entry->elements = malloc(sizeof(ListElement) * found->count);
+	}
+	while (ListNextElement(found, &current))
+	{
+		entry->contents[i] = *(Subscriptions*)(current->content);
+		ListAppendNoMalloc(&entry->subscribers, &entry->contents[i], &entry->elements[i], sizeof(Subscriptions));
+		++i;
+	}
+	if (clientID)
+	{
+		entry->clientID = malloc(strlen(clientID) + 1);
+		strcpy(entry->clientID, clientID);
+	}
+	entry->generation = generation;
+}
+
+
+/**
+ * Find a subscribers cache entry which can be filled with the subscribers for a topic.
+ * @param cache the subscribers cache
+ * @param entry the existing entry for the topic, or NULL
+ * @param aTopic the topic
+ * @return the entry to fill, or NULL if the subscribers cannot be cached
+ */
+static SubscribersCacheEntry* SubscriptionEngines_newEntry(SubscribersCache* cache, SubscribersCacheEntry* entry, char* aTopic)
+{
+	FUNC_ENTRY;
+	if (entry)
+	{
+		if (entry->inuse > 0)
+			entry = NULL; /* the out of date list is still being used, so it can't be replaced yet */
+		else
+			SubscriptionEngines_unlinkEntry(cache, entry);
+		goto exit;
+	}
+	if (cache->entries->count >= cache->size)
+	{
+		SubscribersCacheEntry* oldest = cache->oldest;
+
+		while (oldest && oldest->inuse > 0)
+			oldest = oldest->newer;
+		if (oldest == NULL)
+			goto exit;
+		SubscriptionEngines_freeEntry(cache, oldest);
+		++(cache->evictions);
+	}
+	entry = malloc(sizeof(SubscribersCacheEntry));
+	memset(entry, '\0', sizeof(SubscribersCacheEntry));
+	entry->topic = malloc(strlen(aTopic) + 1);
+	strcpy(entry->topic, aTopic);
+	TreeAdd(cache->entries, entry, sizeof(SubscribersCacheEntry) + strlen(aTopic) + 1);
+exit:
+	if (entry)
+		SubscriptionEngines_linkEntry(cache, entry);
+	FUNC_EXIT;
+	return entry;
+}
+
+
+/**
+ * Choose the member of a shared subscription group to give a publication to.  Connected members
+ * are preferred, then, for the least queued policy, those with the fewest messages waiting.
+ * Otherwise equal members are taken in turn.
+ * @param se pointer to the subscription engine state structure
+ * @param ss the shared subscription group
+ * @param clientID the id of the publishing client
+ * @return the subscription of the chosen member, or NULL if no member can be given the publication
+ */
+static Subscriptions* SubscriptionEngines_sharedMember(SubscriptionEngines* se, SharedSubscriptions* ss, char* clientID)
+{
+	Subscriptions* rc = NULL;
+	ListElement* current = NULL;
+	int count = ss->members->count;
+	int start = ss->next % count;
+	int i = 0, chosen = 0, chosen_load = 0, chosen_order = 0;
+
+	FUNC_ENTRY;
+	while (ListNextElement(ss->members, &current))
+	{
+		Subscriptions* s = current->content;
+		int order = (i - start + count) % count;
+
+		if (s->noLocal == 0 || strcmp(s->clientName, clientID) != 0)
+		{
+			int load = (se->client_load) ? (se->client_load)(s->clientName) : 0;
+
+			if (load < 0)
+				load = INT_MAX; /* not connected, so only if no member is */
+			else if (se->shared_policy == SHARED_ROUND_ROBIN)
+				load = 0;
+			if (rc == NULL || load < chosen_load || (load == chosen_load && order < chosen_order))
+			{
+				rc = s;
+				chosen = i;
+				chosen_load = load;
+				chosen_order = order;
+			}
+		}
+		++i;
+	}
+	if (rc)
+	{
+		ss->next = chosen + 1;
+		++(ss->delivered);
+	}
+	FUNC_EXIT;
+	return rc;
+}
+
+
+/**
+ * Add one member of each shared subscription group matching a topic to the subscribers for it.
+ * @param se pointer to the subscription engine state structure
+ * @param rc the subscribers found for the topic
+ * @param cached boolean - whether rc is a subscribers cache entry's list, which must not be changed
+ * @param aTopic a topic name string
+ * @param clientID the id of the publishing client
+ * @return the subscribers list - rc, or a copy of it if members had to be added to a cached list
+ */
+static List* SubscriptionEngines_addShared(SubscriptionEngines* se, List* rc, int cached, char* aTopic, char* clientID)
+{
+	Node* node = NULL;
+	int system = (strncmp(aTopic, sysprefix, strlen(sysprefix)) == 0);
+
+	FUNC_ENTRY;
+	while ((node = TreeNextElement(se->shared, node)) != NULL)
+	{
+		SharedSubscriptions* ss = (SharedSubscriptions*)(node->content);
+		Subscriptions* s = NULL;
+
+		/* as for other subscriptions, only a filter in the system topic space matches system topics */
+		if ((strncmp(ss->filter, sysprefix, strlen(sysprefix)) == 0) != system ||
+			!Topics_matches(ss->filter, ss->wildcards, aTopic) ||
+			(s = SubscriptionEngines_sharedMember(se, ss, clientID)) == NULL)
+			continue;
+		if (cached)
+		{
+			List* copy = ListInitialize();
+			ListElement* current = NULL;
+
+			while (ListNextElement(rc, &current))
+			{
+				Subscriptions* rcs = malloc(sizeof(Subscriptions));
+				*rcs = *(Subscriptions*)(current->content);
+				ListAppend(copy, rcs, sizeof(Subscriptions));
+			}
+			SubscriptionEngines_releaseSubscribers(se, aTopic, rc);
+			rc = copy;
+			cached = 0;
+		}
+		rc->current = NULL;
+		if (ListFindItem(rc, s->clientName, subsClientIDCompare) == NULL)
+		{ /* a member which is already a subscriber gets the publication once */
+			Subscriptions* rcs = malloc(sizeof(Subscriptions));
+			Log(TRACE_MINIMUM, 25, NULL, s->clientName);
+			*rcs = *s;
+			ListAppend(rc, rcs, sizeof(Subscriptions));
+		}
+	}
+	FUNC_EXIT;
+	return rc;
+}
+
+
+/**
+ * Find all the subscribers for a topic.  Subscribers for topics outside the system topic space
+ * are kept in a least recently used cache, until the next change to the subscriptions.
+ * Members of shared subscription groups are chosen afresh for every call.
  * @param se pointer to the subscription engine state structure
  * @param aTopic a topic name string
  * @param clientID	the id of the client
- * @return a List of clients subscribed to the topic
+ * @return a List of clients subscribed to the topic, which must not be changed unless the topic
+ * is a system topic, and must be given back with SubscriptionEngines_releaseSubscribers
  */
 List* SubscriptionEngines_getSubscribers(SubscriptionEngines* se, char* aTopic, char* clientID)
 {
 	List* rc = NULL;
+	SubscribersCache* cache = &se->cache;
+	SubscribersCacheEntry* entry = NULL;
+	Node* node = NULL;
+	int nolocal = 0;
 
 	FUNC_ENTRY;
 	if (strncmp(aTopic, sysprefix, strlen(sysprefix)) == 0)
-		rc = SubscriptionEngines_getSubscribers1(se->system.subs, aTopic, clientID);
-	else
 	{
-		rc = SubscriptionEngines_getSubscribers1(se->wsubs, aTopic, clientID);
-		rc = SubscriptionEngines_getSubscribers2(se->subs, rc, aTopic, clientID);
+		rc = SubscriptionEngines_getSubscribers1(se->system.subs, aTopic, clientID, &nolocal);
+		goto exit;
+	}
+	if (cache->size > 0 && (node = TreeFind(cache->entries, aTopic)) != NULL)
+	{
+		entry = (SubscribersCacheEntry*)(node->content);
+		if (entry->generation == cache->generation &&
+			(entry->clientID == NULL || strcmp(entry->clientID, clientID) == 0))
+		{
+			++(cache->hits);
+			++(entry->inuse);
+			SubscriptionEngines_unlinkEntry(cache, entry);
+			SubscriptionEngines_linkEntry(cache, entry);
+			rc = &entry->subscribers;
+			goto exit;
+		}
+	}
+
+	rc = SubscriptionEngines_getSubscribers1(se->wsubs, aTopic, clientID, &nolocal);
+	rc = SubscriptionEngines_getSubscribers2(se->subs, rc, aTopic, clientID, &nolocal);
+	if (cache->size > 0)
+	{
+		++(cache->misses);
+		if ((entry = SubscriptionEngines_newEntry(cache, entry, aTopic)) != NULL)
+		{
+			/* with a noLocal subscription, the subscribers depend on who is publishing */
+			SubscriptionEngines_fillEntry(entry, rc, nolocal ? clientID : NULL, cache->generation);
+			ListFree(rc);
+			++(entry->inuse);
+			rc = &entry->subscribers;
+		}
 	}
+exit:
+	if (se->shared->count > 0)
+		rc = SubscriptionEngines_addShared(se, rc, (entry && rc == &entry->subscribers), aTopic, clientID);
 	FUNC_EXIT;
 	return rc;
 }
 
 
+/**
+ * Give back a list of subscribers returned by SubscriptionEngines_getSubscribers
+ * @param se pointer to the subscription engine state structure
+ * @param aTopic the topic name string the subscribers were found for
+ * @param subscribers the list of subscribers
+ */
+void SubscriptionEngines_releaseSubscribers(SubscriptionEngines* se, char* aTopic, List* subscribers)
+{
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if ((node = TreeFind(se->cache.entries, aTopic)) != NULL &&
+		&((SubscribersCacheEntry*)(node->content))->subscribers == subscribers)
+		--(((SubscribersCacheEntry*)(node->content))->inuse);
+	else
+		ListFree(subscribers);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Set the maximum number of topics for which the subscribers are cached
+ * @param se pointer to the subscription engine state structure
+ * @param size the number of topics, 0 for no cache
+ */
+void SubscriptionEngines_setCacheSize(SubscriptionEngines* se, int size)
+{
+	FUNC_ENTRY;
+	se->cache.size = (size < 0) ? 0 : size;
+	while (se->cache.entries->count > se->cache.size && se->cache.oldest && se->cache.oldest->inuse == 0)
+		SubscriptionEngines_freeEntry(&se->cache, se->cache.oldest);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Set how a member of a shared subscription group is chosen for each publication
+ * @param se pointer to the subscription engine state structure
+ * @param policy "round_robin" or "least_queued"; NULL for the default, round_robin
+ * @param client_load function returning the number of messages waiting for a client,
+ * or -1 if it is not connected
+ */
+void SubscriptionEngines_setSharedPolicy(SubscriptionEngines* se, char* policy, int (*client_load)(char*))
+{
+	FUNC_ENTRY;
+	se->shared_policy = SHARED_ROUND_ROBIN;
+	if (policy && strcmp(policy, "least_queued") == 0)
+		se->shared_policy = SHARED_LEAST_QUEUED;
+	else if (policy && strcmp(policy, "round_robin") != 0)
+		Log(LOG_WARNING, 164, NULL, policy);
+	se->client_load = client_load;
+	FUNC_EXIT;
+}
+
+
 /**
  *	Set a retained publication in the normal or system topic space (internal to this module).
  *	@param rl the normal or system list of retained publications
@@ -676,7 +1480,7 @@ void SubscriptionEngines_setRetained1(Tree* rl, char* topicName, int qos, char*
 		{
 			/* remove current retained publication */
 			found = TreeRemoveNodeIndex(rl, current, 0);
-			free(found->topicName);
+			Topics_release(found->topicName);
 			free(found->payload);
 			free(found);
 		}
@@ -686,15 +1490,8 @@ void SubscriptionEngines_setRetained1(Tree* rl, char* topicName, int qos, char*
 	{
 		found = malloc(sizeof(RetainedPublications));
 		memset(found, '\0', sizeof(RetainedPublications));
+		found->topicName = Topics_intern(topicName);
 	}
-	if (found->topicName != NULL)
-	{
-		if (strlen(topicName) != strlen(found->topicName))
-			found->topicName = realloc(found->topicName, strlen(topicName)+1);
-	}
-	else
-		found->topicName = malloc(strlen(topicName)+1);
-	strcpy(found->topicName, topicName);
 	found->qos = qos;
 	if (found->payload != NULL)
 	{
@@ -727,7 +1524,31 @@ void SubscriptionEngines_setRetained(SubscriptionEngines* se, char* topicName, i
 	else
 	{
 		(se->retained_changes)++;
-		SubscriptionEngines_setRetained1(se->retaineds, topicName, qos, payload, payloadlen);
+#if !defined(SUBSENGINE_UNIT_TESTS)
+		Persistence_journal_retained(topicName, qos, payload, payloadlen);
+#endif
+		if (payloadlen == 0 && SubscriptionEngines_findMapped(se->retained_map, topicName) >= 0)
+		{
+			/* keep an entry with no payload, to hide the mapped one */
+			Node* current = TreeFind(se->retaineds, topicName);
+			RetainedPublications* r = (current) ? current->content : NULL;
+
+			if (r == NULL)
+			{
+				r = malloc(sizeof(RetainedPublications));
+				memset(r, '\0', sizeof(RetainedPublications));
+				r->topicName = Topics_intern(topicName);
+				TreeAdd(se->retaineds, r, sizeof(RetainedPublications) + strlen(r->topicName));
+			}
+			else if (r->payload)
+			{
+				free(r->payload);
+				r->payload = NULL;
+				r->payloadlen = 0;
+			}
+		}
+		else
+			SubscriptionEngines_setRetained1(se->retaineds, topicName, qos, payload, payloadlen);
 	}
 	FUNC_EXIT;
 }
@@ -783,8 +1604,38 @@ List* SubscriptionEngines_getRetained(SubscriptionEngines* se, char* topicName)
 	FUNC_ENTRY;
 	if (strncmp(topicName, sysprefix, strlen(sysprefix)) == 0)
 		rc = SubscriptionEngines_getRetained1(se->system.retaineds, topicName);
-	else
+	else if (se->retained_map == NULL)
 		rc =  SubscriptionEngines_getRetained1(se->retaineds, topicName);
+	else
+	{
+		int wildcards = 0;
+		RetainedPublications* r = NULL;
+
+		rc = ListInitialize();
+		if ((wildcards = Topics_hasWildcards(topicName)) == 1)
+		{
+			Node* node = NULL;
+			int pos = 0;
+
+			while ((r = SubscriptionEngines_nextRetained(se, &pos, &node)) != NULL)
+			{
+				if (Topics_matches(topicName, wildcards, r->topicName))
+					ListAppend(rc, r, sizeof(RetainedPublications));
+			}
+		}
+		else
+		{
+			Node* current = TreeFind(se->retaineds, topicName);
+			int pos = -1;
+
+			if (current)
+				r = current->content;
+			else if ((pos = SubscriptionEngines_findMapped(se->retained_map, topicName)) >= 0)
+				r = SubscriptionEngines_mapped(se->retained_map, pos);
+			if (r && r->payloadlen > 0)
+				ListAppend(rc, r, sizeof(RetainedPublications));
+		}
+	}
 	FUNC_EXIT;
 	return rc;
 }
@@ -805,28 +1656,116 @@ void SubscriptionEngines_clearRetained(SubscriptionEngines* se, char* topicName)
 	if (strncmp(topicName, sysprefix, strlen(sysprefix)) == 0)
 		Log(LOG_AUDIT, 65, NULL, topicName);
 	else
+	{
+		RetainedPublications* r = NULL;
+		Node* node = NULL;
+		int pos = 0;
+		List* matches = ListInitialize();
+		ListElement* elem = NULL;
+
+		/* find the matches first, as removing nodes from the tree invalidates the iteration */
+		while ((r = SubscriptionEngines_nextRetained(se, &pos, &node)) != NULL)
+		{
+			if (Topics_matches(topicName, wildcards, r->topicName))
+				ListAppend(matches, r, sizeof(RetainedPublications));
+		}
+		while (ListNextElement(matches, &elem))
+		{
+			r = elem->content;
+			SubscriptionEngines_setRetained(se, r->topicName, 0, NULL, 0);
+		}
+		ListFreeNoContent(matches);
+	}
+	FUNC_EXIT;
+}
+
+
+
+/**
+ * Count the retained messages, other than those on system topics.
+ * @param se pointer to a subscription engine structure
+ * @return the number of retained messages
+ */
+int SubscriptionEngines_retainedCount(SubscriptionEngines* se)
+{
+	int count = se->retaineds->count;
+
+	FUNC_ENTRY;
+	if (se->retained_map)
 	{
 		Node* current = NULL;
 
-		current = TreeNextElement(se->retaineds, current);
+		count += se->retained_map->count;
+		while ((current = TreeNextElement(se->retaineds, current)) != NULL)
+		{
+			RetainedPublications* r = current->content;
 
-		while (current)
+			if (SubscriptionEngines_findMapped(se->retained_map, r->topicName) >= 0)
+				--count; /* counted in the map */
+			if (r->payloadlen == 0)
+				--count; /* hides a mapped message */
+		}
+	}
+	FUNC_EXIT_RC(count);
+	return count;
+}
+
+
+/**
+ * Map the retained message file which has just been saved, in place of the current map.
+ * The changes it holds are removed from the tree, so that only those made since it was
+ * written are kept there.
+ * @param se pointer to a subscription engine structure
+ */
+void SubscriptionEngines_remapRetained(SubscriptionEngines* se)
+{
+#if !defined(SUBSENGINE_UNIT_TESTS)
+	RetainedMap* m = NULL;
+
+	FUNC_ENTRY;
+	if ((m = Persistence_map_retained()) != NULL)
+	{
+		Node* current = NULL;
+		List* saved = ListInitialize();
+		ListElement* elem = NULL;
+
+		if (se->retained_map)
+			Persistence_unmap_retained(se->retained_map);
+		se->retained_map = m;
+		while ((current = TreeNextElement(se->retaineds, current)) != NULL)
 		{
 			RetainedPublications* r = current->content;
-			current = TreeNextElement(se->retaineds, current);
-			if (Topics_matches(topicName, wildcards, r->topicName))
+			int pos = SubscriptionEngines_findMapped(m, r->topicName);
+
+			if (pos == -1)
 			{
-				free(r->topicName);
-				free(r->payload);
-				TreeRemoveNodeIndex(se->retaineds, current, 0);
-				(se->retained_changes)++;
+				if (r->payloadlen == 0)
+					ListAppend(saved, r, sizeof(RetainedPublications));
+			}
+			else
+			{
+				RetainedPublications* mapped = SubscriptionEngines_mapped(m, pos);
+
+				if (r->payloadlen == mapped->payloadlen && r->qos == mapped->qos
+					&& memcmp(r->payload, mapped->payload, r->payloadlen) == 0)
+					ListAppend(saved, r, sizeof(RetainedPublications));
 			}
 		}
+		while (ListNextElement(saved, &elem))
+		{
+			RetainedPublications* r = TreeRemove(se->retaineds, elem->content);
+
+			Topics_release(r->topicName);
+			if (r->payload)
+				free(r->payload);
+			free(r);
+		}
+		ListFreeNoContent(saved);
 	}
 	FUNC_EXIT;
+#endif
 }
 
-
 #if defined(SUBSENGINE_UNIT_TESTS)
 
 #if !defined(ARRAY_SIZE)
@@ -85,11 +85,172 @@ typedef struct
 	unsigned int payloadlen;	/**< length of payload */
 } RetainedPublications;
 
-Subscriptions* Subscriptions_initialize(char*, char*, int, int, int, int);
+/*BE
+def RETAINEDMAPENTRY
+{
+	n64 dec "topic"
+	n64 dec "payload"
+	n32 dec "payloadlen"
+	n32 dec "qos"
+}
+BE*/
+/**
+ * Index entry for a retained message in a retained message map file
+ */
+typedef struct
+{
+	long long topic;		/**< offset of the null-terminated topic name */
+	long long payload;		/**< offset of the payload */
+	int payloadlen;			/**< length of payload */
+	int qos;				/**< quality of service */
+} RetainedMapEntry;
+
 
 /*BE
+def RETAINEDMAP
+{
+	n32 ptr DATA "base"
+	n32 dec "length"
+	n32 dec "count"
+	n32 ptr RETAINEDMAPENTRY "index"
+	n32 ptr RETAINEDPUBLICATIONS "entries"
+}
+BE*/
+/**
+ * Retained messages in a file mapped into memory.  The index is in descending topic name order.
+ */
+typedef struct
+{
+	char* base;						/**< start of the mapped file */
+	long length;					/**< length of the mapped file */
+	int count;						/**< number of retained messages */
+	RetainedMapEntry* index;		/**< the index, in the mapped file */
+	RetainedPublications* entries;	/**< publication structures, filled in as they are used */
+} RetainedMap;
+
+Subscriptions* Subscriptions_initialize(char*, char*, int, int, int, int);
 
+/*BE
 defList(SUBSCRIPTIONS)
+
+def SUBSCRIBERSCACHEENTRY
+{
+	SUBSCRIPTIONSList "subscribers"
+	n32 ptr STRING open "topic"
+	n32 ptr STRING open "clientID"
+	n32 dec "generation"
+	n32 dec "inuse"
+	n32 ptr SUBSCRIPTIONS "contents"
+	n32 ptr DATA "elements"
+	n32 ptr SUBSCRIBERSCACHEENTRY "newer"
+	n32 ptr SUBSCRIBERSCACHEENTRY "older"
+}
+BE*/
+/**
+ * The subscribers found for a topic, kept so that the next publication on the topic does not
+ * have to search the subscriptions again.  The subscriber list, its elements and contents
+ * all belong to the entry.
+ */
+typedef struct SubscribersCacheEntryStruct
+{
+	List subscribers;				/**< the subscribers, as returned by getSubscribers */
+	char* topic;					/**< the topic published to */
+	char* clientID;					/**< the publishing client, if it had to be excluded by noLocal; otherwise NULL */
+	unsigned int generation;		/**< subscription generation in which the subscribers were found */
+	int inuse;						/**< number of callers still using the subscriber list */
+	Subscriptions* contents;		/**< storage for the subscriber list contents */
+	ListElement* elements;			/**< storage for the subscriber list elements */
+	struct SubscribersCacheEntryStruct *newer,	/**< next most recently used entry */
+		*older;						/**< next least recently used entry */
+} SubscribersCacheEntry;
+
+/*BE
+defTree(SUBSCRIBERSCACHEENTRY)
+
+def SUBSCRIBERSCACHE
+{
+	n32 ptr SUBSCRIBERSCACHEENTRYTree open "entries"
+	n32 ptr SUBSCRIBERSCACHEENTRY "newest"
+	n32 ptr SUBSCRIBERSCACHEENTRY "oldest"
+	n32 dec "size"
+	n32 dec "generation"
+	n32 dec "hits"
+	n32 dec "misses"
+	n32 dec "evictions"
+}
+BE*/
+/**
+ * Least recently used cache of the subscribers for each topic.  Any subscribe or unsubscribe
+ * increments the generation, which makes all existing entries out of date.
+ */
+typedef struct
+{
+	Tree* entries;					/**< entries by topic */
+	SubscribersCacheEntry* newest;	/**< most recently used entry */
+	SubscribersCacheEntry* oldest;	/**< least recently used entry, the first to be evicted */
+	int size;						/**< maximum number of entries, 0 for no cache */
+	unsigned int generation;		/**< incremented on every change to the subscriptions */
+	unsigned int hits;				/**< statistics: lookups answered from the cache */
+	unsigned int misses;			/**< statistics: lookups which had to search the subscriptions */
+	unsigned int evictions;			/**< statistics: entries removed to make room for others */
+} SubscribersCache;
+
+/*BE
+def CLIENTSUBSCRIPTIONS
+{
+	n32 ptr STRING open "clientName"
+	n32 ptr TMPList open "elements"
+}
+defTree(CLIENTSUBSCRIPTIONS)
+BE*/
+/**
+ * Index of the subscriptions held by one client.  Each element of the list points to the
+ * element holding one of the client's subscriptions in its subscription list, so that the
+ * client's subscriptions can be found and removed without searching the others.
+ */
+typedef struct
+{
+	char* clientName;	/**< ID of the client, owned by the index */
+	List* elements;		/**< the subscription list elements holding this client's subscriptions */
+} ClientSubscriptions;
+
+/*BE
+def SHAREDSUBSCRIPTIONS
+{
+	n32 ptr STRING open "topicName"
+	n32 ptr STRING open "filter"
+	n32 map bool "wildcards"
+	n32 ptr SUBSCRIPTIONSList open "members"
+	n32 dec "next"
+	n32 dec "delivered"
+}
+defTree(SHAREDSUBSCRIPTIONS)
+BE*/
+/**
+ * The members of a shared subscription group for one topic filter, "$share/<group>/<filter>".
+ * Each publication matching the filter goes to only one of the members.
+ */
+typedef struct
+{
+	char* topicName;		/**< the interned shared subscription name, referenced by the group */
+	char* filter;			/**< the topic filter, within topicName */
+	int wildcards;			/**< whether the filter has wildcards */
+	List* members;			/**< the subscriptions of the group members */
+	unsigned int next;		/**< position in the member list at which to start looking for the next member */
+	unsigned int delivered;	/**< statistics: publications given to a member */
+} SharedSubscriptions;
+
+/**
+ * How a member of a shared subscription group is chosen for each publication
+ */
+enum
+{
+	SHARED_ROUND_ROBIN,		/**< each member in turn */
+	SHARED_LEAST_QUEUED,	/**< the member with the fewest queued and in-flight messages */
+};
+
+/*BE
+
 defTree(RETAINEDPUBLICATIONS)
 defTree(SUBSCRIPTIONSList)
 
@@ -98,7 +259,13 @@ def SUBSCRIPTIONENGINES
 	n32 ptr SUBSCRIPTIONSListTree open "subs"
 	n32 ptr SUBSCRIPTIONSList open "wsubs"
 	n32 ptr RETAINEDPUBLICATIONSTree open "retaineds"
+	n32 ptr RETAINEDMAP open "retained_map"
 	n32 dec "retained_changes"
+	SUBSCRIBERSCACHE "cache"
+	n32 ptr CLIENTSUBSCRIPTIONSTree open "clients"
+	n32 ptr SHAREDSUBSCRIPTIONSTree open "shared"
+	n32 dec "shared_policy"
+	n32 ptr DATA "client_load"
 	struct
 	{
 		n32 ptr SUBSCRIPTIONSList open "system_subs"
@@ -113,8 +280,14 @@ typedef struct
 {
 	Tree* subs;     		      /**< non-wildcard main subscriptions */
 	List* wsubs;			        /**< main subscription list - wildcard subscriptions */
-	Tree* retaineds;		      /**< main retained message list */
+	Tree* retaineds;		      /**< main retained message list - changes since the map was made, if there is one */
+	RetainedMap* retained_map;	/**< retained messages mapped from the persistence file */
 	int retained_changes;	    /**< flag to show whether changes have been made since last save */
+	SubscribersCache cache;		/**< subscribers found for recently published topics */
+	Tree* clients;				/**< index of the subscriptions held by each client */
+	Tree* shared;				/**< shared subscription groups, by shared subscription name */
+	int shared_policy;			/**< how a shared subscription group member is chosen */
+	int (*client_load)(char*);	/**< number of messages waiting for a client, or -1 if it is not connected */
 	struct
 	{
 		List* subs;			        /**< system topics */
@@ -124,15 +297,23 @@ typedef struct
 
 SubscriptionEngines* SubscriptionEngines_initialize();
 void SubscriptionEngines_save(SubscriptionEngines* se);
+void SubscriptionEngines_snapshot(SubscriptionEngines* se);
 void SubscriptionEngines_terminate(SubscriptionEngines* se);
 
 int SubscriptionEngines_subscribe(SubscriptionEngines*, char*, char*, int, int, int, int);
 void SubscriptionEngines_unsubscribe(SubscriptionEngines*, char*, char*);
 char* SubscriptionEngines_mostSpecific(char* topicA, char* topicB);
 List* SubscriptionEngines_getSubscribers(SubscriptionEngines*, char* topic, char* clientID);
+void SubscriptionEngines_releaseSubscribers(SubscriptionEngines* se, char* topic, List* subscribers);
+void SubscriptionEngines_setCacheSize(SubscriptionEngines* se, int size);
+void SubscriptionEngines_setSharedPolicy(SubscriptionEngines* se, char* policy, int (*client_load)(char*));
 
 void SubscriptionEngines_setRetained(SubscriptionEngines* se, char* topicName, int qos, char* payload, unsigned int payloadlen);
 List* SubscriptionEngines_getRetained(SubscriptionEngines* se, char* topicName);
 void SubscriptionEngines_clearRetained(SubscriptionEngines* se, char* topicName);
+int SubscriptionEngines_retainedCount(SubscriptionEngines* se);
+void SubscriptionEngines_remapRetained(SubscriptionEngines* se);
+
+void SubscriptionEngines_replay(SubscriptionEngines* se, int type, void* content);
 
 #endif
@@ -0,0 +1,223 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Traffic accounting for topic subtrees, to find the ones which load the broker.
+ *
+ * Each publication is counted against the first levels of its topic, its subtree.  There are
+ * too many subtrees to count them all, so only a fixed number are kept, chosen by the
+ * space-saving algorithm: a subtree which is not in the full table replaces the one with the
+ * least weight, and inherits that weight.  Any subtree whose weight is more than the total
+ * divided by the table size is then sure to be in the table, and the weight of each one is over
+ * by no more than its error.  The table is TOPICSTATS_TABLE_FACTOR times the number of subtrees
+ * published, so that those are very likely to be the real heaviest.  Finding a subtree is a tree
+ * search, and only replacing one needs the whole table to be scanned.
+ */
+
+#include "TopicStats.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Heap.h"
+
+/**
+ * The first levels of a topic, to look them up without copying them
+ */
+typedef struct
+{
+	char* name;
+	int len;
+} SubtreeKey;
+
+static Tree* subtrees = NULL;	/**< the subtrees being counted, indexed by name */
+static TopicStat** ranks = NULL;	/**< the subtrees in order of weight, once they have been ranked */
+static int depth = 0;	/**< the number of topic levels in a subtree, or 0 if accounting is off */
+static int size = 0;	/**< the most subtrees in the table */
+
+
+/**
+ * Tree callback to compare subtrees by name.
+ * @param a the subtree in the tree
+ * @param b another subtree if value is true, otherwise a SubtreeKey
+ * @param value is b a subtree?
+ * @return less than, equal to or greater than 0, as for strcmp
+ */
+static int subtreeCompare(void* a, void* b, int value)
+{
+	char* as = ((TopicStat*)a)->subtree;
+	SubtreeKey* key = (SubtreeKey*)b;
+	int rc;
+
+	if (value)
+		return strcmp(as, ((TopicStat*)b)->subtree);
+	if ((rc = strncmp(as, key->name, key->len)) == 0)
+		rc = (as[key->len] != '\0');
+	return rc;
+}
+
+
+/**
+ * Start accounting for topic subtrees.
+ * @param levels the number of topic levels in a subtree, or 0 for no accounting
+ * @param top the number of subtrees which will be ranked
+ */
+void TopicStats_initialize(int levels, int top)
+{
+	FUNC_ENTRY;
+	if (levels <= 0 || top <= 0)
+		goto exit;
+	depth = levels;
+	size = top * TOPICSTATS_TABLE_FACTOR;
+	subtrees = TreeInitialize(subtreeCompare);
+	ranks = malloc(sizeof(TopicStat*) * size);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Stop accounting for topic subtrees, and free the table.
+ */
+void TopicStats_terminate()
+{
+	FUNC_ENTRY;
+	if (subtrees)
+	{
+		TreeFree(subtrees); /* frees the subtree names too, which are allocated with their structures */
+		subtrees = NULL;
+	}
+	if (ranks)
+	{
+		free(ranks);
+		ranks = NULL;
+	}
+	depth = size = 0;
+	FUNC_EXIT;
+}
+
+
+/**
+ * Make room for a new subtree, replacing the lightest one if the table is full.
+ * @param key the subtree
+ * @return the new entry, with the weight of the one it replaced
+ */
+static TopicStat* TopicStats_add(SubtreeKey* key)
+{
+	TopicStat* ts = NULL;
+	unsigned long long weight = 0;
+
+	FUNC_ENTRY;
+	if (subtrees->count >= size)
+	{
+		Node* current = NULL;
+		TopicStat* lightest = NULL;
+
+		while ((current = TreeNextElement(subtrees, current)) != NULL)
+		{
+			TopicStat* candidate = (TopicStat*)(current->content);
+
+			if (lightest == NULL || candidate->weight < lightest->weight)
+				lightest = candidate;
+		}
+		weight = lightest->weight;
+		TreeRemove(subtrees, lightest);
+		free(lightest);
+	}
+	ts = malloc(sizeof(TopicStat) + key->len + 1);
+	memset(ts, '\0', sizeof(TopicStat));
+	ts->subtree = (char*)(ts + 1);
+	memcpy(ts->subtree, key->name, key->len);
+	ts->subtree[key->len] = '\0';
+	ts->weight = ts->error = weight;
+	TreeAdd(subtrees, ts, sizeof(TopicStat) + key->len + 1);
+	FUNC_EXIT;
+	return ts;
+}
+
+
+/**
+ * Count a publication against the subtree of its topic.  The broker's own $SYS topics are not
+ * counted, as they are not in the broker's message counts either.
+ * @param topic the topic of the publication
+ * @param payloadlen the length of its payload
+ * @param deliveries the number of subscribers it has been sent or queued to
+ */
+void TopicStats_record(char* topic, int payloadlen, int deliveries)
+{
+	SubtreeKey key;
+	Node* found = NULL;
+	TopicStat* ts = NULL;
+	int levels = 0;
+
+	if (depth == 0 || strncmp(topic, "$SYS", 4) == 0)
+		return;
+	FUNC_ENTRY;
+	key.name = topic;
+	for (key.len = 0; topic[key.len] != '\0'; ++key.len)
+	{
+		if (topic[key.len] == '/' && ++levels == depth)
+			break;
+	}
+	if ((found = TreeFind(subtrees, &key)) != NULL)
+		ts = (TopicStat*)(found->content);
+	else
+		ts = TopicStats_add(&key);
+	ts->weight += 1 + deliveries;
+	++(ts->msgs_received);
+	ts->msgs_sent += deliveries;
+	ts->bytes_received += payloadlen;
+	ts->bytes_sent += (unsigned long long)payloadlen * deliveries;
+	FUNC_EXIT;
+}
+
+
+/**
+ * qsort callback to order subtrees by decreasing weight.
+ */
+static int weightCompare(const void* a, const void* b)
+{
+	unsigned long long aw = (*(TopicStat**)a)->weight, bw = (*(TopicStat**)b)->weight;
+
+	return (aw > bw) ? -1 : (aw < bw) ? 1 : 0;
+}
+
+
+/**
+ * Rank the subtrees by weight.  The ranking is only valid until the next publication is counted.
+ * @param ranked set to the subtrees, heaviest first
+ * @return the number of subtrees
+ */
+int TopicStats_ranked(TopicStat*** ranked)
+{
+	Node* current = NULL;
+	int count = 0;
+
+	FUNC_ENTRY;
+	if (subtrees)
+	{
+		while ((current = TreeNextElement(subtrees, current)) != NULL)
+			ranks[count++] = (TopicStat*)(current->content);
+		qsort(ranks, count, sizeof(TopicStat*), weightCompare);
+	}
+	*ranked = ranks;
+	FUNC_EXIT_RC(count);
+	return count;
+}
@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+#if !defined(TOPICSTATS_H)
+#define TOPICSTATS_H
+
+#define TOPICSTATS_TABLE_FACTOR 4	/**< subtrees tracked for each one published */
+
+/**
+ * The traffic on the topics of one subtree
+ */
+typedef struct
+{
+	char* subtree;					/**< the first levels of the topics */
+	unsigned long long weight;		/**< messages received and sent, including those of subtrees it replaced */
+	unsigned long long error;		/**< the most of the weight which may belong to the subtrees it replaced */
+	unsigned int msgs_received;		/**< publications received since the subtree was added to the table */
+	unsigned int msgs_sent;			/**< copies of those publications sent or queued to subscribers */
+	unsigned long long bytes_received;	/**< payload bytes received */
+	unsigned long long bytes_sent;	/**< payload bytes sent or queued */
+} TopicStat;
+
+void TopicStats_initialize(int depth, int top);
+void TopicStats_terminate(void);
+void TopicStats_record(char* topic, int payloadlen, int deliveries);
+int TopicStats_ranked(TopicStat*** ranked);
+
+#endif
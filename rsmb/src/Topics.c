@@ -31,6 +31,9 @@
 
 #include "Log.h"
 
+static Tree* interned = NULL; /**< the topic intern table */
+static TopicsInternInfo intern_info = {0, 0, 0, 0};
+
 /**
  * Checks that the syntax of a topic string is correct.
  * @param aName the topic name string
@@ -70,11 +73,37 @@ int Topics_isValidName(char* aName)
 			pos = strchr(pos + 1, *c);
 		}
 	}
+
+	/* a shared subscription needs a group name, without wildcards, and a topic filter */
+	if (rc && strncmp(aName, SHARED_SUBSCRIPTION_PREFIX, strlen(SHARED_SUBSCRIPTION_PREFIX)) == 0)
+	{
+		char* group = aName + strlen(SHARED_SUBSCRIPTION_PREFIX);
+		char* filter = Topics_sharedFilter(aName);
+
+		if (filter == NULL || filter - group == 1 || *filter == '\0' || strcspn(group, "#+") < filter - group)
+			rc = false;
+	}
 	FUNC_EXIT_MED_RC(rc);
 	return rc;
 }
 
 
+/**
+ * Find the topic filter in a shared subscription name, "$share/<group>/<filter>".
+ * @param topic the topic name string
+ * @return pointer to the filter within the name, or NULL if the name is not a shared subscription
+ */
+char* Topics_sharedFilter(char* topic)
+{
+	char* rc = NULL;
+
+	if (strncmp(topic, SHARED_SUBSCRIPTION_PREFIX, strlen(SHARED_SUBSCRIPTION_PREFIX)) == 0 &&
+		(rc = strchr(topic + strlen(SHARED_SUBSCRIPTION_PREFIX), '/')) != NULL)
+		++rc;
+	return rc;
+}
+
+
 #if defined(WIN32)
 #define strtok_r strtok_s
 #else
@@ -242,6 +271,159 @@ exit:
 	return rc;
 }                                                            /* end matches*/
 
+
+/**
+ * Hash a topic name, FNV-1a.
+ * @param name the topic name
+ * @return the hash value
+ */
+static unsigned int Topics_hash(char* name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/**
+ * Compare intern table entries by hash, then by name, so that most comparisons made
+ * in the table do not need to look at the strings.
+ */
+static int internedTopicCompare(void* a, void* b, int value)
+{
+	InternedTopics* at = (InternedTopics*)a;
+	InternedTopics* bt = (InternedTopics*)b;
+
+	if (at->hash != bt->hash)
+		return (at->hash > bt->hash) ? 1 : -1;
+	return strcmp(at->name, bt->name);
+}
+
+
+/**
+ * Find a topic name in the intern table.
+ * @param name the topic name
+ * @return the table entry, or NULL if the name is not there
+ */
+static InternedTopics* Topics_findInterned(char* name)
+{
+	InternedTopics key;
+	Node* node = NULL;
+
+	if (interned == NULL)
+		return NULL;
+	key.name = name;
+	key.hash = Topics_hash(name);
+	node = TreeFind(interned, &key);
+	return (node) ? (InternedTopics*)(node->content) : NULL;
+}
+
+
+/**
+ * Get the interned copy of a topic name, adding it to the intern table if it is not
+ * already there.  Interned names can be compared by pointer, and must be given back
+ * with Topics_release rather than freed.
+ * @param name the topic name, which is not taken over
+ * @return the interned topic name
+ */
+char* Topics_intern(char* name)
+{
+	InternedTopics* t = NULL;
+
+	FUNC_ENTRY;
+	if ((t = Topics_findInterned(name)) != NULL)
+		++(intern_info.hits);
+	else
+	{
+		int size = sizeof(InternedTopics) + strlen(name) + 1;
+
+		if (interned == NULL)
+			interned = TreeInitialize(internedTopicCompare);
+		t = malloc(size);
+		t->name = (char*)(t + 1);
+		strcpy(t->name, name);
+		t->hash = Topics_hash(name);
+		t->refcount = 0;
+		TreeAdd(interned, t, size);
+		++(intern_info.misses);
+		++(intern_info.count);
+		intern_info.size += size;
+	}
+	++(t->refcount);
+	FUNC_EXIT;
+	return t->name;
+}
+
+
+/**
+ * Look up the interned copy of a topic name, without adding it or taking a reference.
+ * @param name the topic name
+ * @return the interned topic name, or NULL if it is not interned
+ */
+char* Topics_interned(char* name)
+{
+	InternedTopics* t = Topics_findInterned(name);
+
+	return (t) ? t->name : NULL;
+}
+
+
+/**
+ * Give back a reference to an interned topic name, removing it from the intern table
+ * when it has no more holders.
+ * @param name the interned topic name, as returned by Topics_intern
+ */
+void Topics_release(char* name)
+{
+	InternedTopics* t = ((InternedTopics*)name) - 1;
+
+	FUNC_ENTRY;
+	if (--(t->refcount) == 0)
+	{
+		TreeRemove(interned, t);
+		--(intern_info.count);
+		intern_info.size -= sizeof(InternedTopics) + strlen(name) + 1;
+		free(t);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Get the topic intern table statistics.
+ * @return pointer to the statistics structure
+ */
+TopicsInternInfo* Topics_internInfo()
+{
+	return &intern_info;
+}
+
+
+/**
+ * Free the topic intern table, with any names still in it.
+ */
+void Topics_terminate()
+{
+	FUNC_ENTRY;
+	if (interned)
+	{
+		Node* node = NULL;
+
+		while ((node = TreeNextElement(interned, NULL)) != NULL)
+			free(TreeRemove(interned, node->content));
+		TreeFree(interned);
+		interned = NULL;
+	}
+	memset(&intern_info, '\0', sizeof(intern_info));
+	FUNC_EXIT;
+}
+
+
 #if defined(MQTTS)
 /**
  * List callback function for comparing clients by socket
@@ -24,12 +24,56 @@
 #define SINGLE_LEVEL_WILDCARD "+"
 #define MULTI_LEVEL_WILDCARD "#"
 
+/**
+ * Prefix of a shared subscription, "$share/<group>/<filter>"
+ */
+#define SHARED_SUBSCRIPTION_PREFIX "$share/"
+
 int Topics_isValidName(char* aName);
 
 int Topics_hasWildcards(char* topic);
 
 int Topics_matches(char* wildTopic, int wildcards, char* topic);
 
+char* Topics_sharedFilter(char* topic);
+
+/*BE
+def INTERNEDTOPICS
+{
+	n32 ptr STRING open "name"
+	n32 hex "hash"
+	n32 dec "refcount"
+}
+defTree(INTERNEDTOPICS)
+BE*/
+/**
+ * An entry in the topic intern table.  The topic name string follows the structure in the
+ * same allocation, so that there is one copy of each topic name however many times it is used.
+ */
+typedef struct
+{
+	char* name;					/**< the topic name, which follows this structure */
+	unsigned int hash;			/**< hash of the topic name, which orders the table */
+	int refcount;				/**< number of holders of the interned name */
+} InternedTopics;
+
+/**
+ * Topic intern table statistics
+ */
+typedef struct
+{
+	int count;					/**< number of topic names in the table */
+	int size;					/**< bytes held by the table entries */
+	unsigned int hits;			/**< names found already in the table */
+	unsigned int misses;		/**< names which had to be added */
+} TopicsInternInfo;
+
+char* Topics_intern(char* name);
+char* Topics_interned(char* name);
+void Topics_release(char* name);
+TopicsInternInfo* Topics_internInfo();
+void Topics_terminate();
+
 #if defined(MQTTS)
 
 typedef struct
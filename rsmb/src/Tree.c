@@ -66,21 +66,17 @@ void TreeAddIndex(Tree* aTree, int(*compare)(void*, void*, int))
 
 void TreeFree(Tree* aTree)
 {
-	Node* curnode = TreeNextElement(aTree, NULL);
+	Node* curnode = NULL;
 
-	while (curnode)
+	/* removing a node can free its successor instead, so always start again from the first */
+	while ((curnode = TreeNextElement(aTree, NULL)) != NULL)
 	{
-		Node* next = TreeNextElement(aTree, curnode);
-
-		TreeRemoveNodeIndex(aTree, curnode, 0);
+		void* content = TreeRemoveNodeIndex(aTree, curnode, 0);
 #if defined(UNIT_TESTS)
-		free(curnode->content);
-		//free(curnode);
+		free(content);
 #else
-		(aTree->heap_tracking) ? myfree(__FILE__, __LINE__, curnode->content) : free(curnode->content);
-		//(aTree->heap_tracking) ? myfree(__FILE__, __LINE__, curnode) : free(curnode);
+		(aTree->heap_tracking) ? myfree(__FILE__, __LINE__, content) : free(content);
 #endif
-		curnode = next;
 	}
 #if defined(UNIT_TESTS)
 	free(aTree);
@@ -33,36 +33,293 @@
 
 #include "Heap.h"
 
+/**
+ * Permission bit in an AclNode for an action, ACL_WRITE or ACL_READ
+ */
+#define ACL_BIT(action) (1 << (action))
+
+/**
+ * A topic level which is not null-terminated, to look up in the children of an AclNode
+ */
+typedef struct
+{
+	char* name;		/**< start of the level */
+	int len;		/**< length of the level */
+} AclLevel;
+
 BrokerStates* bstate;
 
+/**
+ * Incremented on every change to the users or access control lists, which makes all the
+ * decisions in the ACL decision caches out of date
+ */
+static unsigned int acl_generation = 0;
+
+static AclCacheStats acl_cache_stats = {0, 0};
+
+AclTrie* Users_new_trie();
+
 void Users_initialize(BrokerStates* aBrokerState)
 {
 	FUNC_ENTRY;
 	bstate = aBrokerState;
 	bstate->defaultACL = ListInitialize();
+	bstate->defaultTrie = Users_new_trie();
 	FUNC_EXIT;
 }
 
 /**
- * Adds the specified user to the known user list.
+ * Adds the specified user to the known user list.  If the user is already known, the
+ * first entry is kept, as the first entry was always the one found.
  * @param username
  * @param pword
  */
 void Users_add_user(char* username, char* pword)
 {
-	User* u = malloc(sizeof(User));
+	User* u = NULL;
 
 	FUNC_ENTRY;
+	if (Users_get_user(username) != NULL)
+		goto exit;
+	u = malloc(sizeof(User));
 	memset(u, '\0', sizeof(User));
 	u->username = malloc(strlen(username)+1);
 	u->password = malloc(strlen(pword)+1);
 	strcpy(u->username,username);
 	strcpy(u->password,pword);
 	u->acl = ListInitialize();
-	ListAppend(bstate->users,u,sizeof(u)+strlen(username)+strlen(pword)+2);
+	u->trie = Users_new_trie();
+	TreeAdd(bstate->users,u,sizeof(User)+strlen(username)+strlen(pword)+2);
+	++acl_generation;
+exit:
+	FUNC_EXIT;
+}
+
+/**
+ * Compare ACL topic levels by name, so that the children of an AclNode are ordered by name.
+ * The key is an AclLevel.
+ */
+int aclNodeCompare(void* a, void* b, int value)
+{
+	char* as = ((AclNode*)a)->level;
+	char* bs = (value) ? ((AclNode*)b)->level : ((AclLevel*)b)->name;
+	int blen = (value) ? strlen(bs) : ((AclLevel*)b)->len;
+	int rc = strncmp(as, bs, blen);
+
+	if (rc == 0 && as[blen] != '\0')
+		rc = 1;
+	return rc;
+}
+
+/**
+ * Creates an AclNode for a topic level
+ * @param level the level, or NULL for a root
+ * @param len the length of the level
+ * @return the new node
+ */
+AclNode* Users_new_node(char* level, int len)
+{
+	AclNode* node = malloc(sizeof(AclNode));
+
+	memset(node, '\0', sizeof(AclNode));
+	if (level)
+	{
+		node->level = malloc(len + 1);
+		strncpy(node->level, level, len);
+		node->level[len] = '\0';
+	}
+	node->children = TreeInitialize(aclNodeCompare);
+	return node;
+}
+
+/**
+ * Creates an empty compiled ACL
+ */
+AclTrie* Users_new_trie()
+{
+	AclTrie* trie = malloc(sizeof(AclTrie));
+
+	trie->exact = TreeInitialize(aclNodeCompare);
+	trie->root = Users_new_node(NULL, 0);
+	trie->slash_root = Users_new_node(NULL, 0);
+	trie->others = ListInitialize();
+	return trie;
+}
+
+/**
+ * Frees the memory used by an AclNode and all the levels below it
+ */
+void Users_free_node(AclNode* node)
+{
+	while (node->children->count > 0)
+		Users_free_node(TreeRemove(node->children, TreeNextElement(node->children, NULL)->content));
+	TreeFree(node->children);
+	if (node->plus)
+		Users_free_node(node->plus);
+	if (node->level)
+		free(node->level);
+	free(node);
+}
+
+/**
+ * Frees the memory used by a compiled ACL.  The rules in its list belong to the ACL list.
+ */
+void Users_free_trie(AclTrie* trie)
+{
+	while (trie->exact->count > 0)
+		Users_free_node(TreeRemove(trie->exact, TreeNextElement(trie->exact, NULL)->content));
+	TreeFree(trie->exact);
+	Users_free_node(trie->root);
+	Users_free_node(trie->slash_root);
+	ListFreeNoContent(trie->others);
+	free(trie);
+}
+
+/**
+ * Adds a rule to a compiled ACL.  Wildcard rules which are not valid topic names never match
+ * a topic, so they are left out.
+ * @param trie the compiled ACL
+ * @param rule the rule, which stays in its ACL list
+ */
+void Users_compile_rule(AclTrie* trie, Rule* rule)
+{
+	int perms = (rule->permission == ACL_FULL) ? ACL_BIT(ACL_WRITE) | ACL_BIT(ACL_READ) : ACL_BIT(rule->permission);
+	AclNode* node = (rule->topic[0] == '/') ? trie->slash_root : trie->root;
+	char* level = rule->topic;
+
+	FUNC_ENTRY;
+	if (!Topics_hasWildcards(rule->topic))
+	{
+		AclLevel key;
+		Node* exact = NULL;
+
+		key.name = rule->topic;
+		key.len = strlen(rule->topic);
+		if ((exact = TreeFind(trie->exact, &key)) != NULL)
+			node = (AclNode*)(exact->content);
+		else
+		{
+			node = Users_new_node(rule->topic, key.len);
+			TreeAdd(trie->exact, node, sizeof(AclNode) + key.len + 1);
+		}
+		node->perms |= perms;
+		goto exit;
+	}
+	if (!Topics_isValidName(rule->topic))
+		goto exit;
+	if (rule->topic[0] == '#' && rule->topic[1] != '\0')
+	{
+		ListAppend(trie->others, rule, sizeof(Rule));
+		goto exit;
+	}
+	while (*level)
+	{
+		int len = strcspn(level, "/");
+
+		if (len == 1 && *level == '#')
+		{
+			node->hash_perms |= perms; /* # matches anything, so the rest of the rule is never looked at */
+			goto exit;
+		}
+		if (len == 1 && *level == '+')
+		{
+			if (node->plus == NULL)
+				node->plus = Users_new_node(level, len);
+			node = node->plus;
+		}
+		else if (len > 0) /* empty levels are skipped, as strtok skips them in Topics_matches */
+		{
+			AclLevel key;
+			Node* child = NULL;
+
+			key.name = level;
+			key.len = len;
+			if ((child = TreeFind(node->children, &key)) == NULL)
+			{
+				AclNode* newnode = Users_new_node(level, len);
+				TreeAdd(node->children, newnode, sizeof(AclNode) + len + 1);
+				node = newnode;
+			}
+			else
+				node = (AclNode*)(child->content);
+		}
+		level += len;
+		if (*level == '/')
+			++level;
+	}
+	node->perms |= perms;
+exit:
 	FUNC_EXIT;
 }
 
+/**
+ * Checks whether any rule below an AclNode matches the rest of a topic
+ * @param node the node matched by the previous level of the topic
+ * @param topic the rest of the topic
+ * @param perm the permission bit needed
+ * @param plus boolean - whether + can match the next level
+ * @return boolean - whether a rule matches
+ */
+int Users_trie_matches(AclNode* node, char* topic, int perm, int plus)
+{
+	AclLevel key;
+	Node* child = NULL;
+
+	if (node->hash_perms & perm)
+		return true;
+	while (*topic == '/')
+		++topic;
+	if (*topic == '\0')
+		return (node->perms & perm) != 0;
+	key.name = topic;
+	key.len = strcspn(topic, "/");
+	if ((child = TreeFind(node->children, &key)) != NULL &&
+		Users_trie_matches((AclNode*)(child->content), topic + key.len, perm, 1))
+		return true;
+	return plus && node->plus && Users_trie_matches(node->plus, topic + key.len, perm, 1);
+}
+
+/**
+ * Checks whether any rule in a compiled ACL gives permission for a topic without wildcards
+ * @param trie the compiled ACL
+ * @param topic the topic
+ * @param action ACL_WRITE or ACL_READ
+ * @return boolean - whether a rule gives permission
+ */
+int Users_authorise_trie(AclTrie* trie, char* topic, int action)
+{
+	int rc = true;
+	int perm = ACL_BIT(action);
+	ListElement* current = NULL;
+	Node* exact = NULL;
+	AclLevel key;
+
+	FUNC_ENTRY;
+	key.name = topic;
+	key.len = strlen(topic);
+	if ((exact = TreeFind(trie->exact, &key)) != NULL && (((AclNode*)(exact->content))->perms & perm))
+		goto exit;
+	if (!Topics_isValidName(topic))
+	{
+		rc = false; /* no wildcard rule matches an invalid topic */
+		goto exit;
+	}
+	/* a rule starting with + does not match a topic starting with /, as in Topics_matches */
+	if (Users_trie_matches(trie->root, topic, perm, topic[0] != '/') ||
+		(topic[0] == '/' && Users_trie_matches(trie->slash_root, topic, perm, 1)))
+		goto exit;
+	while (ListNextElement(trie->others, &current))
+	{
+		Rule* rule = (Rule*)(current->content);
+		if ((rule->permission == ACL_FULL || rule->permission == action) && Topics_matches(rule->topic, 1, topic))
+			goto exit;
+	}
+	rc = false;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
 /**
  * Frees the memory used by the provided list of ACL structs
  */
@@ -85,26 +342,33 @@ void Users_free_acl(List* list)
  */
 void Users_free_list()
 {
-	ListElement* current = NULL;
-
 	FUNC_ENTRY;
-	while (ListNextElement(bstate->users, &current))
+	while (bstate->users->count > 0)
 	{
-		User* user = (User*)(current->content);
+		User* user = (User*)(TreeRemove(bstate->users, TreeNextElement(bstate->users, NULL)->content));
 		free(user->username);
 		free(user->password);
+		Users_free_trie(user->trie);
 		Users_free_acl(user->acl);
+		free(user);
 	}
-	ListFree(bstate->users);
+	TreeFree(bstate->users);
+	Users_free_trie(bstate->defaultTrie);
 	Users_free_acl(bstate->defaultACL);
+	++acl_generation;
 
 	FUNC_EXIT;
 }
 
-int userCompare(void* a, void* b)
+/**
+ * Compare users by username, so that the user tree is ordered by username.
+ */
+int userCompare(void* a, void* b, int value)
 {
-	User* user = (User*)a;
-	return strcmp(user->username,(char*)b) == 0;
+	char* as = ((User*)a)->username;
+	char* bs = (value) ? ((User*)b)->username : (char*)b;
+
+	return strcmp(as, bs);
 }
 
 /**
@@ -149,11 +413,11 @@ int Users_authenticate(char* username, char* pword)
 User* Users_get_user(char* username)
 {
 	User* user = NULL;
-	ListElement* elem = NULL;
+	Node* node = NULL;
 
-	if ((elem = ListFindItem(bstate->users, username, userCompare)) != NULL)
+	if ((node = TreeFind(bstate->users, username)) != NULL)
 	{
-		user = (User*)elem->content;
+		user = (User*)node->content;
 	}
 	return user;
 }
@@ -184,6 +448,8 @@ void Users_add_default_rule(char* topic, int permission)
 	FUNC_ENTRY;
 	rule = Users_create_rule(topic,permission);
 	ListAppend(bstate->defaultACL, rule, sizeof(rule)+strlen(topic)+1);
+	Users_compile_rule(bstate->defaultTrie, rule);
+	++acl_generation;
 	FUNC_EXIT;
 }
 
@@ -197,6 +463,8 @@ void Users_add_rule(User* user, char* topic, int permission)
 	FUNC_ENTRY;
 	rule = Users_create_rule(topic,permission);
 	ListAppend(user->acl, rule, sizeof(rule)+strlen(topic)+1);
+	Users_compile_rule(user->trie, rule);
+	++acl_generation;
 	FUNC_EXIT;
 }
 
@@ -249,28 +517,252 @@ exit:
 }
 
 /**
- * Checks whether the specified user is allowed to access the specified topic
+ * Checks whether the specified user is allowed to access the specified topic.
+ * Topics without wildcards are looked up in the compiled ACLs; subscriptions with
+ * wildcards are compared with each rule.
  */
 int Users_authorise(User* user, char* topic, int action)
 {
 	int rc = true;
 
 	FUNC_ENTRY;
-	if (!Users_authorise1(bstate->defaultACL, topic, action))
+	if (action == ACL_READ && Topics_hasWildcards(topic))
+	{
+		if (!Users_authorise1(bstate->defaultACL, topic, action))
+			rc = (user != NULL) ? Users_authorise1(user->acl, topic, action) : false;
+		goto exit;
+	}
+	if (!Users_authorise_trie(bstate->defaultTrie, topic, action))
+		rc = (user != NULL) ? Users_authorise_trie(user->trie, topic, action) : false;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+/**
+ * Forgets all the decisions in an ACL decision cache
+ */
+void Users_emptyCache(AclCache* cache)
+{
+	int i;
+
+	for (i = 0; i < ACL_CACHE_SIZE; ++i)
 	{
-		if (user != NULL)
+		if (cache->entries[i].topic)
 		{
-			rc = Users_authorise1(user->acl, topic, action);
-			goto exit;
+			free(cache->entries[i].topic);
+			cache->entries[i].topic = NULL;
 		}
-		else
+	}
+}
+
+/**
+ * Checks whether a user is allowed to access a topic, remembering the decision in a client's
+ * ACL decision cache so that the next check for the same topic does not look at the ACLs
+ * @param cache the client's cache, which is created if it is NULL
+ * @param user the user, or NULL
+ * @param topic the topic
+ * @param action ACL_WRITE or ACL_READ
+ * @return boolean - whether the user is allowed to access the topic
+ */
+int Users_authoriseCached(AclCache** cache, User* user, char* topic, int action)
+{
+	AclCacheEntry* entry = NULL;
+	unsigned int hash = 2166136261U ^ action; /* FNV-1a, so that one topic can have a decision for each action */
+	char* c = topic;
+	int rc = false;
+
+	FUNC_ENTRY;
+	while (*c)
+	{
+		hash ^= (unsigned char)*c++;
+		hash *= 16777619U;
+	}
+	if (*cache == NULL)
+	{
+		*cache = malloc(sizeof(AclCache));
+		memset(*cache, '\0', sizeof(AclCache));
+		(*cache)->user = user;
+		(*cache)->generation = acl_generation;
+	}
+	else if ((*cache)->user != user || (*cache)->generation != acl_generation)
+	{
+		Users_emptyCache(*cache);
+		(*cache)->user = user;
+		(*cache)->generation = acl_generation;
+	}
+	entry = &(*cache)->entries[hash % ACL_CACHE_SIZE];
+	if (entry->topic && entry->hash == hash && entry->action == action && strcmp(entry->topic, topic) == 0)
+	{
+		++(acl_cache_stats.hits);
+		rc = entry->allowed;
+	}
+	else
+	{
+		++(acl_cache_stats.misses);
+		rc = Users_authorise(user, topic, action);
+		if (entry->topic == NULL || strlen(entry->topic) < (c - topic))
 		{
-			rc = false;
-			goto exit;
+			if (entry->topic)
+				free(entry->topic);
+			entry->topic = malloc(c - topic + 1);
 		}
+		strcpy(entry->topic, topic);
+		entry->hash = hash;
+		entry->action = action;
+		entry->allowed = rc;
 	}
-exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
+/**
+ * Frees an ACL decision cache
+ */
+void Users_freeCache(AclCache* cache)
+{
+	FUNC_ENTRY;
+	Users_emptyCache(cache);
+	free(cache);
+	FUNC_EXIT;
+}
+
+/**
+ * Get the ACL decision cache statistics
+ * @return pointer to the statistics structure
+ */
+AclCacheStats* Users_getCacheStats()
+{
+	return &acl_cache_stats;
+}
+
+
+#if defined(USERS_UNIT_TESTS)
+
+#include <assert.h>
+
+#if !defined(ARRAY_SIZE)
+/**
+ * Macro to calculate the number of entries in an array
+ */
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#endif
+
+/*
+ * The stubs for the functions of Broker.c, which is not linked in
+ */
+int Broker_stop(char* s)
+{
+	return 0;
+}
+
+int Broker_dumpHeap(char* dest)
+{
+	return 0;
+}
+
+char* Broker_recordFFDC(char* symptoms)
+{
+	return NULL;
+}
+
+/**
+ * The decision of an uncompiled ACL: whether any rule gives permission for a topic, by
+ * comparing it with each rule using Topics_matches.
+ */
+int Users_authorise_linear(Rule** rules, int count, char* topic, int action)
+{
+	int i;
+
+	for (i = 0; i < count; ++i)
+	{
+		if ((rules[i]->permission == ACL_FULL || rules[i]->permission == action) &&
+			Topics_matches(rules[i]->topic, Topics_hasWildcards(rules[i]->topic), topic))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Checks that a compiled ACL gives the same decision as Topics_matches for every topic and action
+ * @return the number of differences
+ */
+int Users_compare_trie(Rule** rules, int count, char** topics, int ntopics)
+{
+	AclTrie* trie = Users_new_trie();
+	int actions[] = { ACL_WRITE, ACL_READ };
+	int failures = 0;
+	int i, j;
+
+	for (i = 0; i < count; ++i)
+		Users_compile_rule(trie, rules[i]);
+	for (i = 0; i < ntopics; ++i)
+	{
+		for (j = 0; j < ARRAY_SIZE(actions); ++j)
+		{
+			int expected = Users_authorise_linear(rules, count, topics[i], actions[j]);
+			int result = Users_authorise_trie(trie, topics[i], actions[j]);
+
+			if (result != expected)
+			{
+				printf("rule %s%s, topic \"%s\", action %d: trie %d, Topics_matches %d\n", rules[0]->topic,
+					(count > 1) ? " and others" : "", topics[i], actions[j], result, expected);
+				++failures;
+			}
+		}
+	}
+	Users_free_trie(trie);
+	return failures;
+}
+
+int main(int argc, char *argv[])
+{
+	char* rule_topics[] = {
+		"#", "/#", "//#", "a/#", "/a/#", "a//#", "a/b/#",
+		"+", "/+", "+/", "+/+", "+/+/+", "//+", "+//+", "a/+", "/a/+", "+/b", "+/b/#", "a/+/c", "a//+",
+		"#/c", "#/b/c", "a", "a/b", "/a", "a//b", "a/", "/", "//", "a/#/b", "a/b+", "+a/b"
+	};
+	char* topics[] = {
+		"a", "b", "c", "a/b", "a/c", "b/c", "a/b/c", "a/x/c", "a/b/c/d", "x/b", "x/b/c",
+		"/a", "/b", "/a/b", "/a/b/c", "/", "//", "///", "a/", "a//", "/a/", "a//b", "a//c", "a///c",
+		"//a", "//a/b", "a/b/", "", "$SYS/a", "a+", "a/b+"
+	};
+	int permissions[] = { ACL_FULL, ACL_WRITE, ACL_READ };
+	Rule* rules[ARRAY_SIZE(rule_topics)];
+	int failures = 0;
+	int i, j;
+
+	Heap_initialize();
+	Log_initialize();
+	trace_settings.log_level = LOG_FATAL; /* Topics_matches reports the invalid rules and topics */
+
+	/* each rule on its own, with each permission */
+	for (i = 0; i < ARRAY_SIZE(rule_topics); ++i)
+	{
+		for (j = 0; j < ARRAY_SIZE(permissions); ++j)
+		{
+			Rule* rule = Users_create_rule(rule_topics[i], permissions[j]);
+
+			failures += Users_compare_trie(&rule, 1, topics, ARRAY_SIZE(topics));
+			free(rule->topic);
+			free(rule);
+		}
+	}
+
+	/* all the rules in one ACL, with mixed permissions */
+	for (i = 0; i < ARRAY_SIZE(rule_topics); ++i)
+		rules[i] = Users_create_rule(rule_topics[i], permissions[i % ARRAY_SIZE(permissions)]);
+	for (i = 1; i <= ARRAY_SIZE(rule_topics); ++i)
+		failures += Users_compare_trie(&rules[ARRAY_SIZE(rule_topics) - i], i, topics, ARRAY_SIZE(topics));
+	for (i = 0; i < ARRAY_SIZE(rule_topics); ++i)
+	{
+		free(rules[i]->topic);
+		free(rules[i]);
+	}
+
+	printf("%d differences between the compiled ACLs and Topics_matches\n", failures);
+	assert(failures == 0);
+	return (failures == 0) ? 0 : 1;
+}
+
+#endif
@@ -18,6 +18,7 @@
 #define USERS_H
 
 #include "LinkedList.h"
+#include "Tree.h"
 
 #define ACL_FULL 0
 #define ACL_WRITE 1
@@ -25,6 +26,7 @@
 
 /*BE
 include "LinkedList"
+include "Tree"
 BE*/
 /*BE
 map permission
@@ -41,30 +43,135 @@ def RULE
 defList(RULE)
 BE*/
 
+typedef struct
+{
+	char* topic;
+	int permission;
+} Rule;
+
+/*BE
+def ACLNODE
+{
+   n32 ptr STRING open "level"
+   n32 dec "perms"
+   n32 dec "hash_perms"
+   n32 ptr DATA "children"
+   n32 ptr DATA "plus"
+}
+defTree(ACLNODE)
+
+def ACLTRIE
+{
+   n32 ptr ACLNODETree open "exact"
+   n32 ptr ACLNODE open "root"
+   n32 ptr ACLNODE open "slash_root"
+   n32 ptr RULEList open "others"
+}
+BE*/
+/**
+ * One topic level of the rules in an access control list
+ */
+typedef struct AclNodeStruct
+{
+	char* level;					/**< the topic level, NULL for a root */
+	int perms;						/**< permission bits of the rules ending at this level */
+	int hash_perms;					/**< permission bits of the rules ending in # after this level */
+	Tree* children;					/**< the next levels, by name */
+	struct AclNodeStruct* plus;		/**< + at the next level */
+} AclNode;
+
+/**
+ * An access control list compiled into a tree of topic levels, so that checking a topic
+ * takes one lookup for each of its levels.  Levels are split as Topics_matches splits them.
+ */
+typedef struct
+{
+	Tree* exact;			/**< rules without wildcards, which match only the same string, by topic */
+	AclNode* root;			/**< rules not starting with / */
+	AclNode* slash_root;	/**< rules starting with /, which match only topics starting with / */
+	List* others;			/**< rules starting with # and more levels, which are matched in reverse */
+} AclTrie;
+
 /*BE
 def USER
 {
    n32 ptr STRING open "username"
    n32 ptr STRING open "password"
    n32 ptr RULEList open "acl"
+   n32 ptr ACLTRIE open "trie"
 }
-defList(USER)
+defTree(USER)
 BE*/
 typedef struct
 {
 	char* username;           /**< username */
 	char* password;           /**< password */
 	List* acl;                /**< Access Control List */
+	AclTrie* trie;            /**< the Access Control List, compiled */
 } User;
 
+/**
+ * Number of decisions in each client's ACL decision cache
+ */
+#if !defined(ACL_CACHE_SIZE)
+#define ACL_CACHE_SIZE 16
+#endif
+
+/*BE
+def ACLCACHEENTRY
+{
+   n32 ptr STRING open "topic"
+   n32 dec "hash"
+   n32 map permission "action"
+   n32 map bool "allowed"
+}
+
+def ACLCACHE
+{
+   n32 ptr USER suppress "user"
+   n32 dec "generation"
+   ACLCACHEENTRY ACL_CACHE_SIZE "entries"
+}
+BE*/
+/**
+ * One remembered authorisation decision
+ */
 typedef struct
 {
-	char* topic;
-	int permission;
-} Rule;
+	char* topic;			/**< the topic, NULL if the entry is empty */
+	unsigned int hash;		/**< hash of the topic and action */
+	int action;				/**< ACL_WRITE or ACL_READ */
+	int allowed;			/**< the decision */
+} AclCacheEntry;
 
+/**
+ * The authorisation decisions most recently made for one client, by topic hash.  The decisions
+ * are forgotten when the client's user or any access control list changes.
+ */
+typedef struct
+{
+	User* user;				/**< the user the decisions were made for */
+	unsigned int generation;	/**< the ACL generation in which the decisions were made */
+	AclCacheEntry entries[ACL_CACHE_SIZE];	/**< the decisions */
+} AclCache;
 
+/*BE
+def ACLCACHESTATS
+{
+   n32 dec "hits"
+   n32 dec "misses"
+}
+BE*/
+/**
+ * Statistics for the ACL decision caches of all clients
+ */
+typedef struct
+{
+	unsigned int hits;		/**< decisions found in a cache */
+	unsigned int misses;	/**< decisions which had to be made */
+} AclCacheStats;
 
+int userCompare(void* a, void* b, int value);
 void Users_add_user(char* username, char* pword);
 void Users_free_list();
 int Users_authenticate(char* username, char* pword);
@@ -74,5 +181,8 @@ void Users_add_default_rule(char* topic, int permission);
 void Users_add_rule(User* user, char* topic, int permission);
 
 int Users_authorise(User* user, char* topic, int action);
+int Users_authoriseCached(AclCache** cache, User* user, char* topic, int action);
+void Users_freeCache(AclCache* cache);
+AclCacheStats* Users_getCacheStats();
 
 #endif /* USERS_H_ */
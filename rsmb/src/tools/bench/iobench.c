@@ -0,0 +1,427 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Socket backend benchmark.
+ *
+ * Starts each broker executable named on the command line in turn, and passes QoS 0 messages
+ * through it from publisher to subscriber connection pairs, each pair with its own topic.
+ * Reports the message rate and the broker's CPU time per message.  Used to compare the select,
+ * epoll and io_uring socket backends:
+ *
+ *    make bench_io
+ *    ./iobench -c 100 -n 10000 ./broker_epoll ./broker_uring
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * One client connection
+ */
+typedef struct
+{
+	int fd;
+	char* in;		/**< input not yet parsed */
+	int inlen;
+	int insize;
+	char* out;		/**< output not yet written */
+	int outlen;
+	int outsize;
+	long sent;		/**< messages published, for a publisher */
+	long received;	/**< messages received, for a subscriber */
+} Conn;
+
+static int pairs = 50;			/**< number of publisher/subscriber pairs */
+static long messages = 10000;	/**< messages per pair */
+static int size = 64;			/**< payload size */
+static int window = 64;			/**< messages in flight per pair */
+static int port = 18883;
+
+
+static double now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static void append(Conn* c, char* data, int len)
+{
+	if (c->outlen + len > c->outsize)
+	{
+		c->outsize = (c->outlen + len) * 2;
+		c->out = realloc(c->out, c->outsize);
+	}
+	memcpy(&c->out[c->outlen], data, len);
+	c->outlen += len;
+}
+
+
+/**
+ * Add an MQTT packet to a connection's output.
+ */
+static void packet(Conn* c, int type, char* body, int len)
+{
+	char hdr[5];
+	int hlen = 1, rem = len;
+
+	hdr[0] = type;
+	do
+	{
+		char d = rem % 128;
+
+		rem /= 128;
+		hdr[hlen++] = (rem > 0) ? (d | 0x80) : d;
+	} while (rem > 0);
+	append(c, hdr, hlen);
+	append(c, body, len);
+}
+
+
+static int flush(Conn* c)
+{
+	while (c->outlen > 0)
+	{
+		int rc = write(c->fd, c->out, c->outlen);
+
+		if (rc < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		memmove(c->out, &c->out[rc], c->outlen - rc);
+		c->outlen -= rc;
+	}
+	return 0;
+}
+
+
+/**
+ * Read what is available and count complete packets of the given type, or of any type if type is -1.
+ * @return the number of packets, or -1 if the connection has failed
+ */
+static int readpackets(Conn* c, int type)
+{
+	int count = 0, pos = 0, rc;
+
+	if (c->insize - c->inlen < 65536)
+	{
+		c->insize = c->inlen + 65536;
+		c->in = realloc(c->in, c->insize);
+	}
+	if ((rc = read(c->fd, &c->in[c->inlen], c->insize - c->inlen)) <= 0)
+		return (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+	c->inlen += rc;
+	while (pos < c->inlen)
+	{
+		int len = 0, mult = 1, i = pos + 1;
+
+		while (i < c->inlen && (c->in[i] & 0x80))
+		{
+			len += (c->in[i++] & 0x7F) * mult;
+			mult *= 128;
+		}
+		if (i >= c->inlen)
+			break;
+		len += c->in[i++] * mult;
+		if (i + len > c->inlen)
+			break;
+		if (type == -1 || ((unsigned char)c->in[pos] >> 4) == type)
+			++count;
+		pos = i + len;
+	}
+	memmove(c->in, &c->in[pos], c->inlen - pos);
+	c->inlen -= pos;
+	return count;
+}
+
+
+static int string(char* buf, char* str)
+{
+	int len = strlen(str);
+
+	buf[0] = len / 256;
+	buf[1] = len % 256;
+	memcpy(&buf[2], str, len);
+	return len + 2;
+}
+
+
+/**
+ * Connect a client, and optionally subscribe, waiting for the acknowledgements.
+ */
+static int connectClient(Conn* c, char* clientid, char* subscribe)
+{
+	struct sockaddr_in addr;
+	char body[300];
+	int len = 0, flag = 1, acks = 0, want = subscribe ? 2 : 1;
+	double start = now();
+
+	memset(c, '\0', sizeof(Conn));
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		return -1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	len = string(body, "MQIsdp");
+	body[len++] = 3;		/* protocol version */
+	body[len++] = 2;		/* clean session */
+	body[len++] = 0;
+	body[len++] = 60;		/* keepalive */
+	len += string(&body[len], clientid);
+	packet(c, 0x10, body, len);
+	if (subscribe)
+	{
+		body[0] = 0;
+		body[1] = 1;		/* msgid */
+		len = 2 + string(&body[2], subscribe);
+		body[len++] = 0;	/* qos */
+		packet(c, 0x82, body, len);
+	}
+	flush(c);
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+	while (acks < want && now() - start < 5)
+	{
+		struct pollfd pfd;
+		int rc;
+
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 100);
+		if ((rc = readpackets(c, -1)) < 0) /* CONNACK and SUBACK */
+			return -1;
+		acks += rc;
+	}
+	return (acks == want) ? 0 : -1;
+}
+
+
+/**
+ * Read the broker process's CPU time in seconds.
+ */
+static double usage(pid_t pid)
+{
+	char fn[64], buf[1024];
+	unsigned long utime = 0, stime = 0;
+	double rc = -1;
+	FILE* f;
+
+	sprintf(fn, "/proc/%d/stat", (int)pid);
+	if ((f = fopen(fn, "r")) != NULL)
+	{
+		if (fgets(buf, sizeof(buf), f))
+		{
+			char* p = strrchr(buf, ')');
+
+			if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+				rc = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+		fclose(f);
+	}
+	return rc;
+}
+
+
+static pid_t startBroker(char* broker)
+{
+	char dir[] = "/tmp/iobenchXXXXXX", cfg[64], path[PATH_MAX];
+	pid_t pid;
+	FILE* f;
+
+	if (realpath(broker, path) == NULL || mkdtemp(dir) == NULL)
+		return -1;
+	sprintf(cfg, "%s/broker.cfg", dir);
+	if ((f = fopen(cfg, "w")) == NULL)
+		return -1;
+	fprintf(f, "port %d\nmax_inflight_messages %d\nmax_queued_messages %d\n", port, window, window * 4);
+	fclose(f);
+	if ((pid = fork()) == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+
+		if (chdir(dir) != 0)
+			_exit(1);
+		dup2(null, 1);
+		dup2(null, 2);
+		execl(path, path, "broker.cfg", (char*)NULL);
+		_exit(1);
+	}
+	return pid;
+}
+
+
+/**
+ * Run the benchmark against one broker executable.
+ */
+static int run(char* broker)
+{
+	Conn* pubs = calloc(pairs, sizeof(Conn));
+	Conn* subs = calloc(pairs, sizeof(Conn));
+	struct pollfd* pfds = calloc(pairs * 2, sizeof(struct pollfd));
+	char* body = malloc(size + 64);
+	long total = 0, expected = (long)pairs * messages;
+	double start, elapsed, last, cpu0, cpu1;
+	int i, rc = -1, status;
+	pid_t pid;
+
+	if ((pid = startBroker(broker)) < 0)
+	{
+		printf("%s: cannot start\n", broker);
+		return -1;
+	}
+	for (start = now(); now() - start < 5; usleep(50000))
+	{
+		if (connectClient(&pubs[0], "iobench-probe", NULL) == 0)
+			break;
+		if (pubs[0].fd >= 0)
+			close(pubs[0].fd);
+	}
+	close(pubs[0].fd);
+	for (i = 0; i < pairs; ++i)
+	{
+		char id[32], topic[32];
+
+		sprintf(id, "iobench-sub-%d", i);
+		sprintf(topic, "iobench/%d", i);
+		if (connectClient(&subs[i], id, topic) != 0)
+			goto exit;
+		sprintf(id, "iobench-pub-%d", i);
+		if (connectClient(&pubs[i], id, NULL) != 0)
+			goto exit;
+	}
+
+	cpu0 = usage(pid);
+	start = last = now();
+	while (total < expected && now() - last < 5)
+	{
+		for (i = 0; i < pairs; ++i)
+		{
+			while (pubs[i].sent < messages && pubs[i].sent - subs[i].received < window)
+			{
+				char topic[32];
+				int len = 0;
+
+				sprintf(topic, "iobench/%d", i);
+				len = string(body, topic);
+				memset(&body[len], 'x', size);
+				packet(&pubs[i], 0x30, body, len + size);
+				++pubs[i].sent;
+			}
+			if (flush(&pubs[i]) < 0)
+				goto exit;
+			pfds[i * 2].fd = pubs[i].fd;
+			pfds[i * 2].events = pubs[i].outlen > 0 ? POLLOUT : 0;
+			pfds[i * 2 + 1].fd = subs[i].fd;
+			pfds[i * 2 + 1].events = POLLIN;
+		}
+		poll(pfds, pairs * 2, 100);
+		for (i = 0; i < pairs; ++i)
+		{
+			if (pfds[i * 2 + 1].revents)
+			{
+				int n = readpackets(&subs[i], 3);
+
+				if (n < 0)
+					goto exit;
+				if (n > 0)
+				{
+					subs[i].received += n;
+					total += n;
+					last = now();
+				}
+			}
+		}
+	}
+	elapsed = now() - start;
+	cpu1 = usage(pid);
+	printf("%-24s %9ld msgs %8.3f s %10.0f msgs/s %8.2f us cpu/msg", broker, total, elapsed,
+			total / elapsed, (cpu1 - cpu0) * 1e6 / (total ? total : 1));
+	printf("%s\n", (total < expected) ? " (incomplete)" : "");
+	rc = 0;
+exit:
+	if (rc != 0)
+		printf("%s: connection failed\n", broker);
+	for (i = 0; i < pairs; ++i)
+	{
+		if (pubs[i].fd > 0)
+			close(pubs[i].fd);
+		if (subs[i].fd > 0)
+			close(subs[i].fd);
+		free(pubs[i].in);
+		free(pubs[i].out);
+		free(subs[i].in);
+		free(subs[i].out);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	free(pubs);
+	free(subs);
+	free(pfds);
+	free(body);
+	return rc;
+}
+
+
+int main(int argc, char** argv)
+{
+	int i, rc = 0;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (i + 1 >= argc)
+			break;
+		if (strcmp(argv[i], "-c") == 0)
+			pairs = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-n") == 0)
+			messages = atol(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			size = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-w") == 0)
+			window = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-p") == 0)
+			port = atoi(argv[i + 1]);
+		else
+			break;
+	}
+	if (i >= argc)
+	{
+		fprintf(stderr, "usage: iobench [-c pairs] [-n messages per pair] [-s payload size] [-w window] [-p port] broker...\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	printf("%d pairs, %ld messages each, %d byte payloads, window %d\n", pairs, messages, size, window);
+	for (; i < argc; ++i)
+		if (run(argv[i]) != 0)
+			rc = 1;
+	return rc;
+}
@@ -0,0 +1,1203 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief MQTT and MQTT-SN load generator.
+ *
+ * Opens many local client connections to a broker and runs scripted scenarios through it:
+ *
+ *    fanin     many publishers, one subscriber to a wildcard covering all their topics
+ *    fanout    one publisher, every other client subscribed to its topic
+ *    wildcard  publishers on distinct topics, subscribers each with several overlapping wildcards
+ *    retained  retained publications over many topics, then one late subscriber to all of them
+ *    qos       publisher/subscriber pairs at QoS 0, 1 and 2 in turn
+ *    sn_sleep  QoS 1 MQTT publishers to MQTT-SN subscribers over UDP which sleep (disconnect
+ *              with a duration) and wake to collect what was queued for them
+ *
+ * Every publication carries the time it was sent, so each delivery gives an end to end latency.
+ * One line of JSON is written for each scenario with the delivery rate, the 50th, 99th and 99.9th
+ * percentile latencies and, when the broker process is known, its CPU time per delivery, so that
+ * results can be collected and compared from run to run:
+ *
+ *    make bench_load
+ *    ./loadgen -c 1000 -n 1000 -b ./broker_epoll -o results.json
+ *    ./loadgen -t fanin,qos -P `pidof broker` -p 1883
+ *
+ * With -b the broker is started with its own configuration, listening for MQTT-SN on the port
+ * after the MQTT port.  Otherwise the broker at -h and -p is used, and -P gives its process id
+ * for the CPU figures.  More than about 1000 clients need a broker built with the epoll or
+ * io_uring socket backend.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_FILTERS 3
+#define RETAINED_TOPICS 16		/**< topics each publisher cycles through in the retained scenario */
+
+enum { SN_AWAKE, SN_ASLEEP, SN_WAKING };
+
+/**
+ * One client connection
+ */
+typedef struct
+{
+	int fd;
+	int udp;		/**< MQTT-SN over UDP rather than MQTT over TCP */
+	char* in;		/**< input not yet parsed */
+	int inlen;
+	int insize;
+	char* out;		/**< output not yet written */
+	int outlen;
+	int outsize;
+	int acks;		/**< CONNACKs and SUBACKs received */
+	int refused;	/**< a non-zero return code was received */
+	int msgid;		/**< last message id used */
+	char topic[64];	/**< the topic published to, for a publisher */
+	char* filters[MAX_FILTERS];	/**< the topics subscribed to, for a subscriber */
+	int nfilters;
+	int qos;
+	int fanout;		/**< number of subscribers which receive each publication, for a publisher */
+	long sent;		/**< messages published, for a publisher */
+	long delivered;	/**< copies of this publisher's messages received */
+	long received;	/**< messages received, for a subscriber */
+	int catchup;	/**< a late subscriber receiving retained messages */
+	int state;		/**< SN_AWAKE, SN_ASLEEP or SN_WAKING, for an MQTT-SN subscriber */
+	double wake;	/**< when to wake up, for a sleeping MQTT-SN subscriber */
+	long burst;		/**< messages received since waking, for an MQTT-SN subscriber */
+} Conn;
+
+/**
+ * Stamped on the front of every payload
+ */
+typedef struct
+{
+	int64_t sent;		/**< CLOCK_MONOTONIC nanoseconds */
+	uint32_t publisher;
+	uint32_t run;		/**< so that messages from other runs are not counted */
+} Stamp;
+
+/**
+ * One scenario run
+ */
+typedef struct
+{
+	char* name;
+	int scenario;		/**< index of the scenario, to make client identifiers unique */
+	Conn* pubs;
+	int npubs;
+	Conn* subs;
+	int nsubs;
+	int retain;
+	uint32_t id;
+	char* body;
+	long published;
+	long expected;
+	long received;
+	float* latency;		/**< microseconds, one for each delivery */
+	long nlatency;
+	long latsize;
+} Run;
+
+typedef struct
+{
+	char* name;
+	int (*setup)(Run*);
+} Scenario;
+
+static int clients = 100;		/**< client connections for each scenario */
+static long messages = 1000;	/**< messages per publisher */
+static int size = 64;			/**< payload size */
+static int window = 64;			/**< messages in flight per publisher */
+static char* host = "127.0.0.1";
+static int port = 18883;
+static int snport = 0;			/**< MQTT-SN UDP port, the port after the MQTT port by default */
+static int sleep_ms = 100;		/**< how long MQTT-SN subscribers sleep */
+static pid_t broker_pid = 0;
+static char* broker_name = NULL;
+static FILE* output = NULL;
+static double idle = 5;			/**< seconds without a delivery after which a scenario is abandoned */
+
+
+static double now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static int64_t nanos()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void append(Conn* c, char* data, int len)
+{
+	if (c->outlen + len > c->outsize)
+	{
+		c->outsize = (c->outlen + len) * 2;
+		c->out = realloc(c->out, c->outsize);
+	}
+	memcpy(&c->out[c->outlen], data, len);
+	c->outlen += len;
+}
+
+
+/**
+ * Add an MQTT packet to a connection's output.
+ */
+static void packet(Conn* c, int type, char* body, int len)
+{
+	char hdr[5];
+	int hlen = 1, rem = len;
+
+	hdr[0] = type;
+	do
+	{
+		char d = rem % 128;
+
+		rem /= 128;
+		hdr[hlen++] = (rem > 0) ? (d | 0x80) : d;
+	} while (rem > 0);
+	append(c, hdr, hlen);
+	append(c, body, len);
+}
+
+
+/**
+ * Send an MQTT-SN packet.  Packets are sent at once, one datagram each, and a packet which
+ * cannot be sent is left to the broker's retries.
+ */
+static void snpacket(Conn* c, int type, char* body, int len)
+{
+	char buf[512];
+
+	buf[0] = len + 2;
+	buf[1] = type;
+	memcpy(&buf[2], body, len);
+	send(c->fd, buf, len + 2, 0);
+}
+
+
+static int flush(Conn* c)
+{
+	while (c->outlen > 0)
+	{
+		int rc = write(c->fd, c->out, c->outlen);
+
+		if (rc < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		memmove(c->out, &c->out[rc], c->outlen - rc);
+		c->outlen -= rc;
+	}
+	return 0;
+}
+
+
+static int string(char* buf, char* str)
+{
+	int len = strlen(str);
+
+	buf[0] = len / 256;
+	buf[1] = len % 256;
+	memcpy(&buf[2], str, len);
+	return len + 2;
+}
+
+
+static int nextMsgId(Conn* c)
+{
+	c->msgid = (c->msgid == 65535) ? 1 : c->msgid + 1;
+	return c->msgid;
+}
+
+
+static void ack(Conn* c, int type, int msgid)
+{
+	char body[2];
+
+	body[0] = msgid / 256;
+	body[1] = msgid % 256;
+	packet(c, type, body, 2);
+}
+
+
+/**
+ * Does a topic match a subscription?
+ */
+static int matches(char* filter, char* topic)
+{
+	while (*filter && *topic)
+	{
+		if (*filter == '#')
+			return 1;
+		if (*filter == '+')
+		{
+			while (*topic && *topic != '/')
+				++topic;
+			++filter;
+		}
+		else if (*filter++ != *topic++)
+			return 0;
+	}
+	return (*filter == *topic) || strcmp(filter, "/#") == 0 || strcmp(filter, "#") == 0;
+}
+
+
+/**
+ * Make a client identifier unique to this process, scenario and client.
+ */
+static char* clientId(Run* r, char* buf, char role, int i)
+{
+	sprintf(buf, "lg%d-%d%c%d", (int)(getpid() % 100000), r->scenario, role, i);
+	return buf;
+}
+
+
+static void addLatency(Run* r, float us)
+{
+	if (r->nlatency == r->latsize)
+	{
+		r->latsize = (r->latsize == 0) ? 65536 : r->latsize * 2;
+		r->latency = realloc(r->latency, r->latsize * sizeof(float));
+	}
+	r->latency[r->nlatency++] = us;
+}
+
+
+/**
+ * Count a message received by a subscriber against the publisher which sent it.
+ */
+static void delivered(Run* r, Conn* c, unsigned char* payload, int len)
+{
+	Stamp s;
+
+	++c->received;
+	if (c->udp)
+		++c->burst;
+	if (c->catchup || len < (int)sizeof(Stamp))
+		return;
+	memcpy(&s, payload, sizeof(Stamp));
+	if (s.run != r->id || s.publisher >= (uint32_t)r->npubs)
+		return;
+	++r->received;
+	++r->pubs[s.publisher].delivered;
+	addLatency(r, (nanos() - s.sent) / 1000.0);
+}
+
+
+static void handle(Run* r, Conn* c, unsigned char type, unsigned char* body, int len)
+{
+	int msgid = (len >= 2) ? body[0] * 256 + body[1] : 0;
+
+	switch (type >> 4)
+	{
+	case 2: /* CONNACK */
+		++c->acks;
+		if (len >= 2 && body[1] != 0)
+			c->refused = 1;
+		break;
+	case 3: /* PUBLISH */
+	{
+		int qos = (type >> 1) & 3, pos = 2 + body[0] * 256 + body[1];
+
+		if (qos > 0)
+		{
+			msgid = body[pos] * 256 + body[pos + 1];
+			pos += 2;
+		}
+		delivered(r, c, &body[pos], len - pos);
+		if (qos == 1)
+			ack(c, 0x40, msgid);	/* PUBACK */
+		else if (qos == 2)
+			ack(c, 0x50, msgid);	/* PUBREC */
+		break;
+	}
+	case 5: /* PUBREC */
+		ack(c, 0x62, msgid);	/* PUBREL */
+		break;
+	case 6: /* PUBREL */
+		ack(c, 0x70, msgid);	/* PUBCOMP */
+		break;
+	case 9: /* SUBACK */
+		++c->acks;
+		if (len >= 3 && body[2] == 0x80)
+			c->refused = 1;
+		break;
+	}
+}
+
+
+static void snhandle(Run* r, Conn* c, unsigned char* pkt, int len)
+{
+	int hl = (pkt[0] == 1) ? 3 : 1;
+	unsigned char* p = &pkt[hl + 1];
+
+	if (len < hl + 1)
+		return;
+	switch (pkt[hl])
+	{
+	case 0x05: /* CONNACK */
+		++c->acks;
+		if (p[0] != 0)
+			c->refused = 1;
+		if (c->state == SN_WAKING)
+		{
+			c->state = SN_AWAKE;
+			c->burst = 0;
+		}
+		break;
+	case 0x0A: /* REGISTER */
+	{
+		char regack[5];
+
+		memcpy(regack, p, 4);	/* topic id and msgid */
+		regack[4] = 0;
+		snpacket(c, 0x0B, regack, 5);
+		break;
+	}
+	case 0x0C: /* PUBLISH */
+	{
+		char puback[5];
+
+		delivered(r, c, &p[5], len - hl - 6);
+		if (((p[0] >> 5) & 3) == 1)
+		{
+			memcpy(puback, &p[1], 4);	/* topic id and msgid */
+			puback[4] = 0;
+			snpacket(c, 0x0D, puback, 5);
+		}
+		break;
+	}
+	case 0x13: /* SUBACK */
+		++c->acks;
+		if (p[5] != 0)
+			c->refused = 1;
+		break;
+	}
+}
+
+
+/**
+ * Read what is available and handle all the complete packets.
+ * @return 0, or -1 if the connection has failed
+ */
+static int readConn(Run* r, Conn* c)
+{
+	int pos = 0, rc;
+
+	if (c->insize - c->inlen < 65536)
+	{
+		c->insize = c->inlen + 65536;
+		c->in = realloc(c->in, c->insize);
+	}
+	if (c->udp)
+	{
+		while ((rc = recv(c->fd, c->in, c->insize, 0)) > 0)
+			snhandle(r, c, (unsigned char*)c->in, rc);
+		return (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) ? -1 : 0;
+	}
+	if ((rc = read(c->fd, &c->in[c->inlen], c->insize - c->inlen)) <= 0)
+		return (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+	c->inlen += rc;
+	while (pos < c->inlen)
+	{
+		int len = 0, mult = 1, i = pos + 1;
+
+		while (i < c->inlen && (c->in[i] & 0x80))
+		{
+			len += (c->in[i++] & 0x7F) * mult;
+			mult *= 128;
+		}
+		if (i >= c->inlen)
+			break;
+		len += c->in[i++] * mult;
+		if (i + len > c->inlen)
+			break;
+		handle(r, c, (unsigned char)c->in[pos], (unsigned char*)&c->in[i], len);
+		pos = i + len;
+	}
+	memmove(c->in, &c->in[pos], c->inlen - pos);
+	c->inlen -= pos;
+	return 0;
+}
+
+
+/**
+ * Wait for a number of CONNACKs and SUBACKs on one connection.
+ */
+static int await(Run* r, Conn* c, int want)
+{
+	double start = now();
+
+	while (c->acks < want && !c->refused && now() - start < idle)
+	{
+		struct pollfd pfd;
+
+		if (flush(c) < 0)
+			return -1;
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 100);
+		if (readConn(r, c) < 0)
+			return -1;
+	}
+	return (c->acks >= want && !c->refused) ? 0 : -1;
+}
+
+
+static int openSocket(Conn* c, int udp)
+{
+	struct sockaddr_in addr;
+	int flag = 1;
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(udp ? snport : port);
+	addr.sin_addr.s_addr = inet_addr(host);
+	c->udp = udp;
+	if ((c->fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0 ||
+			connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		return -1;
+	if (!udp)
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+	return 0;
+}
+
+
+static void snconnect(Conn* c, char* clientid, int cleansession)
+{
+	char body[64];
+	int len = 0;
+
+	body[len++] = cleansession ? 0x04 : 0;	/* flags */
+	body[len++] = 1;		/* protocol id */
+	body[len++] = 0;
+	body[len++] = 0;		/* duration: no keepalive, as long runs send nothing on some connections */
+	len += strlen(strcpy(&body[len], clientid));
+	snpacket(c, 0x04, body, len);
+}
+
+
+static void sndisconnect(Conn* c, int duration)
+{
+	char body[2];
+
+	body[0] = duration / 256;
+	body[1] = duration % 256;
+	snpacket(c, 0x18, body, duration ? 2 : 0);
+}
+
+
+/**
+ * Connect a client and make its subscriptions, waiting for the acknowledgements.
+ */
+static int connectClient(Run* r, Conn* c, char* clientid)
+{
+	char body[300];
+	int i, len;
+
+	if (openSocket(c, c->udp) != 0)
+		return -1;
+	if (c->udp)
+	{
+		snconnect(c, clientid, 0);
+		for (i = 0; i < c->nfilters; ++i)
+		{
+			int msgid = nextMsgId(c);
+
+			body[0] = c->qos << 5;	/* flags: topic name */
+			body[1] = msgid / 256;
+			body[2] = msgid % 256;
+			len = 3 + strlen(strcpy(&body[3], c->filters[i]));
+			snpacket(c, 0x12, body, len);
+		}
+		return await(r, c, 1 + c->nfilters);
+	}
+
+	len = string(body, "MQIsdp");
+	body[len++] = 3;		/* protocol version */
+	body[len++] = 2;		/* clean session */
+	body[len++] = 0;
+	body[len++] = 0;		/* no keepalive, as long runs send nothing on some connections */
+	len += string(&body[len], clientid);
+	packet(c, 0x10, body, len);
+	for (i = 0; i < c->nfilters; ++i)
+	{
+		int msgid = nextMsgId(c);
+
+		body[0] = msgid / 256;
+		body[1] = msgid % 256;
+		len = 2 + string(&body[2], c->filters[i]);
+		body[len++] = c->qos;
+		packet(c, 0x82, body, len);
+	}
+	return await(r, c, 1 + c->nfilters);
+}
+
+
+static void publish(Run* r, Conn* p, char* topic, int retain, int payloadlen)
+{
+	int len = string(r->body, topic);
+
+	if (p->qos > 0)
+	{
+		int msgid = nextMsgId(p);
+
+		r->body[len++] = msgid / 256;
+		r->body[len++] = msgid % 256;
+	}
+	if (payloadlen > 0)
+	{
+		Stamp s;
+
+		s.sent = nanos();
+		s.publisher = p - r->pubs;
+		s.run = r->id;
+		memcpy(&r->body[len], &s, sizeof(Stamp));
+	}
+	packet(p, 0x30 | (p->qos << 1) | retain, r->body, len + payloadlen);
+}
+
+
+static void addFilter(Conn* c, char* fmt, int a, int b)
+{
+	char buf[64];
+
+	sprintf(buf, fmt, a, b);
+	c->filters[c->nfilters] = malloc(strlen(buf) + 1);
+	strcpy(c->filters[c->nfilters++], buf);
+}
+
+
+static void newRun(Run* r, int npubs, int nsubs)
+{
+	r->npubs = (npubs > 0) ? npubs : 1;
+	r->nsubs = (nsubs > 0) ? nsubs : 1;
+	r->pubs = calloc(r->npubs, sizeof(Conn));
+	r->subs = calloc(r->nsubs, sizeof(Conn));
+}
+
+
+static int fanin(Run* r)
+{
+	int i;
+
+	newRun(r, clients - 1, 1);
+	for (i = 0; i < r->npubs; ++i)
+		sprintf(r->pubs[i].topic, "lg/fanin/%d", i);
+	addFilter(&r->subs[0], "lg/fanin/+", 0, 0);
+	return 0;
+}
+
+
+static int fanout(Run* r)
+{
+	int i;
+
+	newRun(r, 1, clients - 1);
+	strcpy(r->pubs[0].topic, "lg/fanout");
+	for (i = 0; i < r->nsubs; ++i)
+		addFilter(&r->subs[i], "lg/fanout", 0, 0);
+	return 0;
+}
+
+
+static int wildcard(Run* r)
+{
+	int i;
+
+	newRun(r, clients / 2, clients - clients / 2);
+	for (i = 0; i < r->npubs; ++i)
+		sprintf(r->pubs[i].topic, "lg/wild/%d/%d/data", i % 8, i);
+	for (i = 0; i < r->nsubs; ++i)
+	{
+		addFilter(&r->subs[i], "lg/wild/%d/+/data", i % 8, 0);
+		addFilter(&r->subs[i], "lg/wild/+/%d/#", i % r->npubs, 0);
+		addFilter(&r->subs[i], "lg/+/%d/#", (i + 1) % 8, 0);
+	}
+	return 0;
+}
+
+
+static int retained(Run* r)
+{
+	int i;
+
+	newRun(r, clients / 2, clients - clients / 2);
+	r->retain = 1;
+	for (i = 0; i < r->npubs; ++i)
+		sprintf(r->pubs[i].topic, "lg/ret/%d/0", i);
+	for (i = 0; i < r->nsubs; ++i)
+		addFilter(&r->subs[i], "lg/ret/%d/+", i % r->npubs, 0);
+	return 0;
+}
+
+
+static int qosmix(Run* r)
+{
+	int i;
+
+	newRun(r, clients / 2, clients / 2);
+	for (i = 0; i < r->npubs; ++i)
+	{
+		r->pubs[i].qos = r->subs[i].qos = i % 3;
+		sprintf(r->pubs[i].topic, "lg/qos/%d", i);
+		addFilter(&r->subs[i], "lg/qos/%d", i, 0);
+	}
+	return 0;
+}
+
+
+static int snsleep(Run* r)
+{
+	int i;
+
+	newRun(r, clients / 2, clients / 2);
+	for (i = 0; i < r->npubs; ++i)
+	{
+		r->pubs[i].qos = r->subs[i].qos = 1;	/* QoS 0 messages are not queued for sleeping clients */
+		r->subs[i].udp = 1;
+		sprintf(r->pubs[i].topic, "lg/sn/%d", i);
+		addFilter(&r->subs[i], "lg/sn/%d", i, 0);
+	}
+	return 0;
+}
+
+
+static Scenario scenarios[] =
+{
+	{ "fanin", fanin },
+	{ "fanout", fanout },
+	{ "wildcard", wildcard },
+	{ "retained", retained },
+	{ "qos", qosmix },
+	{ "sn_sleep", snsleep },
+};
+
+
+/**
+ * Put MQTT-SN subscribers to sleep when they have collected enough messages, and wake them
+ * when they have slept for long enough.
+ */
+static void snschedule(Run* r, Conn* c, char* clientid)
+{
+	if (c->state == SN_AWAKE && c->burst >= window / 2)
+	{
+		sndisconnect(c, 60);
+		c->state = SN_ASLEEP;
+		c->wake = now() + sleep_ms / 1000.0;
+	}
+	else if (c->state == SN_ASLEEP && now() >= c->wake)
+	{
+		snconnect(c, clientid, 0);
+		c->state = SN_WAKING;
+	}
+}
+
+
+/**
+ * Read the broker process's CPU time in seconds.
+ */
+static double usage(pid_t pid)
+{
+	char fn[64], buf[1024];
+	unsigned long utime = 0, stime = 0;
+	double rc = -1;
+	FILE* f;
+
+	sprintf(fn, "/proc/%d/stat", (int)pid);
+	if (pid > 0 && (f = fopen(fn, "r")) != NULL)
+	{
+		if (fgets(buf, sizeof(buf), f))
+		{
+			char* p = strrchr(buf, ')');
+
+			if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+				rc = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+		fclose(f);
+	}
+	return rc;
+}
+
+
+static int compareFloats(const void* a, const void* b)
+{
+	float x = *(float*)a, y = *(float*)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+static float percentile(Run* r, double q)
+{
+	long i = (long)(r->nlatency * q);
+
+	if (r->nlatency == 0)
+		return 0;
+	return r->latency[(i >= r->nlatency) ? r->nlatency - 1 : i];
+}
+
+
+static void report(Run* r, double elapsed, double cpu, long catchup, double catchup_time)
+{
+	char line[1024];
+	int len = 0;
+
+	qsort(r->latency, r->nlatency, sizeof(float), compareFloats);
+	len += sprintf(&line[len], "{\"scenario\":\"%s\",\"broker\":\"%s\",\"clients\":%d,\"publishers\":%d,"
+			"\"subscribers\":%d,\"payload\":%d,\"window\":%d,", r->name, broker_name ? broker_name : "",
+			r->npubs + r->nsubs, r->npubs, r->nsubs, size, window);
+	len += sprintf(&line[len], "\"published\":%ld,\"expected\":%ld,\"received\":%ld,\"seconds\":%.3f,"
+			"\"msgs_per_sec\":%.0f,", r->published, r->expected, r->received, elapsed,
+			elapsed > 0 ? r->received / elapsed : 0);
+	len += sprintf(&line[len], "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,",
+			percentile(r, 0.5), percentile(r, 0.99), percentile(r, 0.999), percentile(r, 1));
+	if (cpu >= 0 && r->received > 0)
+		len += sprintf(&line[len], "\"cpu_us_per_msg\":%.2f", cpu * 1e6 / r->received);
+	else
+		len += sprintf(&line[len], "\"cpu_us_per_msg\":null");
+	if (catchup >= 0)
+		len += sprintf(&line[len], ",\"retained_catchup\":%ld,\"retained_catchup_seconds\":%.3f", catchup, catchup_time);
+	sprintf(&line[len], "}\n");
+	fputs(line, stdout);
+	fflush(stdout);
+	if (output)
+	{
+		fputs(line, output);
+		fflush(output);
+	}
+}
+
+
+/**
+ * Pass messages from the publishers to the subscribers until all have been delivered, or
+ * until none has been delivered for a while.
+ */
+static int pump(Run* r, Conn** all, struct pollfd* pfds, int count)
+{
+	char id[32];
+	double last = now();
+	int i, rc = -1;
+
+	while (r->received < r->expected && now() - last < idle)
+	{
+		long before = r->received;
+		int timeout = 100;
+
+		for (i = 0; i < r->npubs; ++i)
+		{
+			Conn* p = &r->pubs[i];
+
+			while (p->sent < messages && p->sent - p->delivered / p->fanout < window)
+			{
+				if (r->retain)
+				{
+					char* last_level = strrchr(p->topic, '/') + 1;
+
+					sprintf(last_level, "%d", (int)(p->sent % RETAINED_TOPICS));
+				}
+				publish(r, p, p->topic, r->retain, size);
+				++p->sent;
+				++r->published;
+			}
+		}
+		for (i = 0; i < count; ++i)
+		{
+			if (all[i]->udp)
+			{
+				snschedule(r, all[i], clientId(r, id, 'n', all[i] - r->subs));
+				if (all[i]->state == SN_ASLEEP)
+				{
+					int wait = (int)((all[i]->wake - now()) * 1000) + 1;
+
+					if (wait < timeout)
+						timeout = (wait > 0) ? wait : 0;
+				}
+			}
+			else if (flush(all[i]) < 0)
+				goto exit;
+			pfds[i].fd = all[i]->fd;
+			pfds[i].events = POLLIN | ((all[i]->outlen > 0) ? POLLOUT : 0);
+		}
+		poll(pfds, count, timeout);
+		for (i = 0; i < count; ++i)
+		{
+			if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) && readConn(r, all[i]) < 0)
+				goto exit;
+		}
+		if (r->received > before)
+			last = now();
+	}
+	rc = 0;
+exit:
+	return rc;
+}
+
+
+/**
+ * Subscribe a new client to all the retained messages, and count them as they arrive.
+ */
+static long catchup(Run* r, double* elapsed)
+{
+	Conn c;
+	long want = r->npubs * ((messages < RETAINED_TOPICS) ? messages : RETAINED_TOPICS);
+	double start = now(), last = start;
+	char id[32];
+
+	memset(&c, '\0', sizeof(Conn));
+	c.catchup = 1;
+	addFilter(&c, "lg/ret/#", 0, 0);
+	if (connectClient(r, &c, clientId(r, id, 'c', 0)) == 0)
+	{
+		while (c.received < want && now() - last < idle)
+		{
+			struct pollfd pfd;
+			long before = c.received;
+
+			pfd.fd = c.fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, 100);
+			if (readConn(r, &c) < 0)
+				break;
+			if (c.received > before)
+				last = now();
+		}
+	}
+	*elapsed = now() - start;
+	if (c.fd > 0)
+		close(c.fd);
+	free(c.filters[0]);
+	free(c.in);
+	free(c.out);
+	return c.received;
+}
+
+
+/**
+ * Remove the retained messages, and the MQTT-SN subscribers' sessions, left by a scenario.
+ */
+static void cleanup(Run* r)
+{
+	char id[32];
+	int i, k;
+
+	for (i = 0; r->retain && i < r->npubs; ++i)
+	{
+		Conn* p = &r->pubs[i];
+
+		p->qos = 0;
+		for (k = 0; k < RETAINED_TOPICS && k < messages; ++k)
+		{
+			sprintf(strrchr(p->topic, '/') + 1, "%d", k);
+			publish(r, p, p->topic, 1, 0);
+		}
+		while (p->outlen > 0 && flush(p) == 0)
+			usleep(1000);
+	}
+	for (i = 0; i < r->nsubs; ++i)
+	{
+		if (r->subs[i].udp && r->subs[i].fd > 0)
+		{
+			snconnect(&r->subs[i], clientId(r, id, 'n', i), 1);
+			sndisconnect(&r->subs[i], 0);
+		}
+	}
+}
+
+
+/**
+ * Run one scenario against the broker.
+ */
+static int run(Scenario* s)
+{
+	Run r;
+	Conn** all = NULL;
+	struct pollfd* pfds = NULL;
+	double start, elapsed, cpu0, cpu1, catchup_time = 0;
+	long catchup_count = -1;
+	int i, j, k, count = 0, rc = -1;
+
+	memset(&r, '\0', sizeof(Run));
+	r.name = s->name;
+	r.scenario = s - scenarios;
+	r.id = (uint32_t)(nanos() ^ getpid());
+	r.body = malloc(size + 256);
+	memset(r.body, 'x', size + 256);
+	s->setup(&r);
+	all = malloc((r.npubs + r.nsubs) * sizeof(Conn*));
+	pfds = calloc(r.npubs + r.nsubs, sizeof(struct pollfd));
+
+	for (i = 0; i < r.nsubs; ++i)
+	{
+		char id[32];
+
+		all[count++] = &r.subs[i];
+		if (connectClient(&r, &r.subs[i], clientId(&r, id, r.subs[i].udp ? 'n' : 's', i)) != 0)
+		{
+			fprintf(stderr, "%s: subscriber %d could not connect and subscribe\n", s->name, i);
+			goto exit;
+		}
+	}
+	for (i = 0; i < r.npubs; ++i)
+	{
+		char id[32];
+
+		all[count++] = &r.pubs[i];
+		if (connectClient(&r, &r.pubs[i], clientId(&r, id, 'p', i)) != 0)
+		{
+			fprintf(stderr, "%s: publisher %d could not connect\n", s->name, i);
+			goto exit;
+		}
+		for (j = 0; j < r.nsubs; ++j)
+		{
+			for (k = 0; k < r.subs[j].nfilters; ++k)
+			{
+				if (matches(r.subs[j].filters[k], r.pubs[i].topic))
+				{
+					++r.pubs[i].fanout;
+					break;
+				}
+			}
+		}
+		r.expected += r.pubs[i].fanout * messages;
+		if (r.pubs[i].fanout == 0)
+			r.pubs[i].fanout = 1;
+	}
+
+	cpu0 = usage(broker_pid);
+	start = now();
+	if (pump(&r, all, pfds, count) != 0)
+	{
+		fprintf(stderr, "%s: connection failed\n", s->name);
+		goto exit;
+	}
+	elapsed = now() - start;
+	cpu1 = usage(broker_pid);
+	if (r.retain)
+		catchup_count = catchup(&r, &catchup_time);
+	report(&r, elapsed, (cpu0 >= 0 && cpu1 >= 0) ? cpu1 - cpu0 : -1, catchup_count, catchup_time);
+	rc = 0;
+exit:
+	cleanup(&r);
+	for (i = 0; i < count; ++i)
+	{
+		if (all[i]->fd > 0)
+			close(all[i]->fd);
+		for (k = 0; k < all[i]->nfilters; ++k)
+			free(all[i]->filters[k]);
+		free(all[i]->in);
+		free(all[i]->out);
+	}
+	free(all);
+	free(pfds);
+	free(r.pubs);
+	free(r.subs);
+	free(r.body);
+	free(r.latency);
+	return rc;
+}
+
+
+static pid_t startBroker(char* broker)
+{
+	char dir[] = "/tmp/loadgenXXXXXX", cfg[64], path[PATH_MAX];
+	pid_t pid;
+	FILE* f;
+
+	if (realpath(broker, path) == NULL || mkdtemp(dir) == NULL)
+		return -1;
+	sprintf(cfg, "%s/broker.cfg", dir);
+	if ((f = fopen(cfg, "w")) == NULL)
+		return -1;
+	fprintf(f, "port %d\nmax_inflight_messages %d\nmax_queued_messages %d\nlistener %d 127.0.0.1 mqtts\n",
+			port, window, window * 4 + RETAINED_TOPICS * clients, snport);
+	fclose(f);
+	if ((pid = fork()) == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+
+		if (chdir(dir) != 0)
+			_exit(1);
+		dup2(null, 1);
+		dup2(null, 2);
+		execl(path, path, "broker.cfg", (char*)NULL);
+		_exit(1);
+	}
+	return pid;
+}
+
+
+/**
+ * Wait for a broker to accept connections.
+ */
+static int probe()
+{
+	double start;
+
+	for (start = now(); now() - start < idle; usleep(50000))
+	{
+		Conn c;
+		Run r;
+		int rc;
+
+		memset(&c, '\0', sizeof(Conn));
+		memset(&r, '\0', sizeof(Run));
+		rc = connectClient(&r, &c, "loadgen-probe");
+		if (c.fd > 0)
+			close(c.fd);
+		free(c.in);
+		free(c.out);
+		if (rc == 0)
+			return 0;
+	}
+	return -1;
+}
+
+
+int main(int argc, char** argv)
+{
+	char* list = NULL;
+	char* broker = NULL;
+	struct rlimit rl;
+	int i, rc = 0, status;
+	pid_t started = 0;
+
+	for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (strcmp(argv[i], "-c") == 0)
+			clients = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-n") == 0)
+			messages = atol(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			size = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-w") == 0)
+			window = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-h") == 0)
+			host = argv[i + 1];
+		else if (strcmp(argv[i], "-p") == 0)
+			port = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-u") == 0)
+			snport = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-z") == 0)
+			sleep_ms = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-t") == 0)
+			list = argv[i + 1];
+		else if (strcmp(argv[i], "-b") == 0)
+			broker = argv[i + 1];
+		else if (strcmp(argv[i], "-P") == 0)
+			broker_pid = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-o") == 0)
+		{
+			if ((output = fopen(argv[i + 1], "a")) == NULL)
+			{
+				fprintf(stderr, "cannot open %s\n", argv[i + 1]);
+				return 1;
+			}
+		}
+		else
+			break;
+	}
+	if (i < argc || clients < 2 || messages < 1 || window < 2)
+	{
+		fprintf(stderr, "usage: loadgen [-c clients] [-n messages per publisher] [-s payload size] [-w window]\n"
+				"               [-t scenario,...] [-b broker executable | -h host -p port [-P broker pid]]\n"
+				"               [-u MQTT-SN port] [-z MQTT-SN sleep ms] [-o results file]\n"
+				"scenarios: fanin fanout wildcard retained qos sn_sleep\n");
+		return 1;
+	}
+	if (size < (int)sizeof(Stamp))
+		size = sizeof(Stamp);
+	if (snport == 0)
+		snport = port + 1;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (broker == NULL)
+	{
+		broker_name = malloc(strlen(host) + 8);
+		sprintf(broker_name, "%s:%d", host, port);
+	}
+	else
+	{
+		broker_name = broker;
+		if ((broker_pid = started = startBroker(broker)) < 0)
+		{
+			fprintf(stderr, "%s: cannot start\n", broker);
+			return 1;
+		}
+	}
+	if (probe() != 0)
+	{
+		fprintf(stderr, "cannot connect to the broker at %s:%d\n", host, port);
+		rc = 1;
+		goto exit;
+	}
+	for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); ++i)
+	{
+		char* name = scenarios[i].name;
+		char* found = list ? strstr(list, name) : NULL;
+		int len = strlen(name);
+
+		if (list && (found == NULL || (found != list && found[-1] != ',') || (found[len] != '\0' && found[len] != ',')))
+			continue;
+		if (probe() != 0)
+		{
+			fprintf(stderr, "%s: the broker is not accepting connections\n", name);
+			rc = 1;
+		}
+		else if (run(&scenarios[i]) != 0)
+			rc = 1;
+	}
+exit:
+	if (started > 0)
+	{
+		kill(started, SIGTERM);
+		waitpid(started, &status, 0);
+	}
+	if (output)
+		fclose(output);
+	return rc;
+}
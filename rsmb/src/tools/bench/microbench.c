@@ -0,0 +1,863 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Micro-benchmarks for the broker's core data structures and matching.
+ *
+ * Linked with the broker's own object files, so that what is measured is what the broker runs:
+ *
+ *    topics       Topics_matches, for exact, single and multi-level wildcard filters, and misses
+ *    tree         TreeAdd, TreeFind and TreeRemove at sizes from 1e3 up to the -m maximum
+ *    list         ListFindItem over lists of 10 to 10000 items
+ *    subscribers  SubscriptionEngines_getSubscribers with a mix of exact, wildcard and catch-all
+ *                 subscriptions, with and without the subscribers cache
+ *    retained     SubscriptionEngines_setRetained, and SubscriptionEngines_getRetained with
+ *                 exact and wildcard filters
+ *    packet       parsing of CONNECT, SUBSCRIBE and PUBLISH packets from memory, and
+ *                 MQTTPacket_Factory reading PUBLISH packets from a socket pair
+ *
+ * Every benchmark is run for a fixed time several times over, and one line of JSON is written
+ * for each with the median and best times per operation.  Keys and topics come from a seeded
+ * generator, so that runs can be compared with each other:
+ *
+ *    make bench_micro
+ *    ./microbench -t tree,retained -m 10000000 -o results.json
+ *
+ * The trees of the tree benchmarks are not heap tracked, so that 1e7 entries fit in memory and
+ * the figures are those of the tree alone.
+ */
+
+#define NO_HEAP_TRACKING 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "Broker.h"
+#include "Persistence.h"
+#include "Topics.h"
+#include "Tree.h"
+#include "LinkedList.h"
+#include "SubsEngine.h"
+#include "MQTTPacket.h"
+#include "Heap.h"
+#include "Log.h"
+
+/**
+ * A benchmark: performs n operations and returns the seconds spent on them, leaving out any
+ * setup it had to do along the way
+ */
+typedef double (*Bench)(void* arg, long n);
+
+static int repeats = 5;			/**< number of timed runs of each benchmark */
+static double duration = 0.1;	/**< seconds per timed run */
+static long max_size = 1000000;	/**< largest tree size */
+static unsigned long long seed = 20261018;
+static FILE* output = NULL;
+static volatile long sink = 0;	/**< results are added here so that no work is optimized away */
+
+
+/**
+ * The stubs for the functions of Broker.c, which is not linked in
+ */
+int Broker_stop(char* s)
+{
+	return 0;
+}
+
+
+int Broker_dumpHeap(char* dest)
+{
+	return 0;
+}
+
+
+char* Broker_recordFFDC(char* symptoms)
+{
+	fprintf(stderr, "FFDC: %s\n", symptoms);
+	return NULL;
+}
+
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * xorshift64*, so that the same seed gives the same keys on every platform
+ */
+static unsigned long long next()
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+
+/**
+ * A random permutation of 0..n-1
+ */
+static int* shuffled(long n)
+{
+	int* order = malloc(sizeof(int) * n);
+	long i;
+
+	for (i = 0; i < n; ++i)
+		order[i] = i;
+	for (i = n - 1; i > 0; --i)
+	{
+		long j = next() % (i + 1);
+		int t = order[i];
+
+		order[i] = order[j];
+		order[j] = t;
+	}
+	return order;
+}
+
+
+static int compareDoubles(const void* a, const void* b)
+{
+	double x = *(double*)a, y = *(double*)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+/**
+ * Run a benchmark, and write its results
+ * @param name the benchmark name
+ * @param params the JSON members which describe this run of it, or NULL
+ * @param fn the benchmark function
+ * @param arg its argument
+ * @param unit the number of operations in each run is a multiple of this
+ */
+static void run(char* name, char* params, Bench fn, void* arg, long unit)
+{
+	double samples[100];
+	double t = 0;
+	char line[1024];
+	long n = unit;
+	int i;
+
+	/* find a number of operations which takes at least a tenth of the run time, which also warms up */
+	while ((t = fn(arg, n)) < duration / 10 && n < LONG_MAX / 4)
+		n *= 2;
+	if (t < duration)
+		n = (long)(n * (duration / ((t > 0) ? t : 1e-9)));
+	n = ((n + unit - 1) / unit) * unit;
+	for (i = 0; i < repeats; ++i)
+		samples[i] = fn(arg, n) * 1e9 / n;
+	qsort(samples, repeats, sizeof(double), compareDoubles);
+
+	sprintf(line, "{\"benchmark\":\"%s\",%s%s\"ops\":%ld,\"repeats\":%d,\"ns_per_op\":%.2f,"
+			"\"ns_per_op_min\":%.2f,\"ops_per_sec\":%.0f}\n", name, params ? params : "", params ? "," : "",
+			n, repeats, samples[repeats / 2], samples[0], 1e9 / samples[repeats / 2]);
+	fputs(line, stdout);
+	fflush(stdout);
+	if (output)
+	{
+		fputs(line, output);
+		fflush(output);
+	}
+}
+
+
+/****************************   topics   ****************************/
+
+typedef struct
+{
+	char* name;
+	char* filter;
+	char* topic;
+	int wildcards;
+} MatchCase;
+
+
+static double benchMatches(void* arg, long n)
+{
+	MatchCase* c = arg;
+	double start = now();
+	long i, matched = 0;
+
+	for (i = 0; i < n; ++i)
+		matched += Topics_matches(c->filter, c->wildcards, c->topic);
+	sink += matched;
+	return now() - start;
+}
+
+
+static void topics()
+{
+	MatchCase cases[] =
+	{
+		{ "exact", "site/3/dev/42/status", "site/3/dev/42/status" },
+		{ "single_level", "site/+/dev/+/status", "site/3/dev/42/status" },
+		{ "multi_level", "site/3/#", "site/3/dev/42/status" },
+		{ "mixed", "+/+/dev/#", "site/3/dev/42/status" },
+		{ "miss_first_level", "factory/+/dev/+/status", "site/3/dev/42/status" },
+		{ "miss_last_level", "site/+/dev/+/alarm", "site/3/dev/42/status" },
+	};
+	char params[256];
+	int i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		cases[i].wildcards = Topics_hasWildcards(cases[i].filter);
+		sprintf(params, "\"case\":\"%s\",\"filter\":\"%s\",\"topic\":\"%s\"", cases[i].name,
+				cases[i].filter, cases[i].topic);
+		run("topics_matches", params, benchMatches, &cases[i], 1);
+	}
+}
+
+
+/****************************   tree   ****************************/
+
+typedef struct
+{
+	Tree tree;
+	long size;
+	int* keys;		/**< the tree contents point into this array */
+	int* order;		/**< the order in which keys are added, found and removed */
+	long pos;		/**< how many keys are in the tree, for add and remove */
+} TreeState;
+
+
+static void fill(TreeState* s)
+{
+	for (; s->pos < s->size; ++s->pos)
+		TreeAdd(&s->tree, &s->keys[s->order[s->pos]], sizeof(int));
+}
+
+
+static void empty(TreeState* s)
+{
+	for (; s->pos > 0; --s->pos)
+		TreeRemove(&s->tree, &s->keys[s->order[s->pos - 1]]);
+}
+
+
+static double benchTreeAdd(void* arg, long n)
+{
+	TreeState* s = arg;
+	double elapsed = 0;
+
+	while (n > 0)
+	{
+		long i, count = (s->size - s->pos < n) ? s->size - s->pos : n;
+		double start = now();
+
+		for (i = 0; i < count; ++i, ++s->pos)
+			TreeAdd(&s->tree, &s->keys[s->order[s->pos]], sizeof(int));
+		elapsed += now() - start;
+		n -= count;
+		if (s->pos == s->size)
+			empty(s);
+	}
+	return elapsed;
+}
+
+
+static double benchTreeFind(void* arg, long n)
+{
+	TreeState* s = arg;
+	double start = now();
+	long i, found = 0;
+
+	for (i = 0; i < n; ++i)
+		found += (TreeFind(&s->tree, &s->keys[s->order[i % s->size]]) != NULL);
+	sink += found;
+	return now() - start;
+}
+
+
+static double benchTreeRemove(void* arg, long n)
+{
+	TreeState* s = arg;
+	double elapsed = 0;
+
+	while (n > 0)
+	{
+		long i, count = (s->pos < n) ? s->pos : n;
+		double start = now();
+
+		for (i = 0; i < count; ++i, --s->pos)
+			TreeRemove(&s->tree, &s->keys[s->order[s->size - s->pos]]);
+		elapsed += now() - start;
+		n -= count;
+		if (s->pos == 0)
+		{
+			for (; s->pos < s->size; ++s->pos)
+				TreeAdd(&s->tree, &s->keys[s->order[s->size - 1 - s->pos]], sizeof(int));
+		}
+	}
+	return elapsed;
+}
+
+
+static void tree()
+{
+	long size;
+
+	for (size = 1000; size <= max_size; size *= 10)
+	{
+		TreeState s;
+		char params[64];
+		long i;
+
+		memset(&s, '\0', sizeof(s));
+		TreeInitializeNoMalloc(&s.tree, TreeIntCompare);
+		s.tree.heap_tracking = 0;
+		s.size = size;
+		s.keys = malloc(sizeof(int) * size);
+		for (i = 0; i < size; ++i)	/* distinct keys: an odd multiplier is a permutation of the integers */
+			s.keys[i] = (int)((unsigned int)i * 2654435761U ^ (unsigned int)seed);
+		s.order = shuffled(size);
+		sprintf(params, "\"size\":%ld", size);
+
+		run("tree_add", params, benchTreeAdd, &s, size);
+		fill(&s);
+		run("tree_find", params, benchTreeFind, &s, 1);
+		run("tree_remove", params, benchTreeRemove, &s, size);
+		empty(&s);
+		free(s.order);
+		free(s.keys);
+	}
+}
+
+
+/****************************   list   ****************************/
+
+typedef struct
+{
+	List* list;
+	int size;
+	int* values;
+	int* order;
+} ListState;
+
+
+static double benchListFind(void* arg, long n)
+{
+	ListState* s = arg;
+	double start = now();
+	long i, found = 0;
+
+	for (i = 0; i < n; ++i)
+		found += (ListFindItem(s->list, &s->values[s->order[i % s->size]], intcompare) != NULL);
+	sink += found;
+	return now() - start;
+}
+
+
+static void list()
+{
+	int size;
+
+	for (size = 10; size <= 10000; size *= 10)
+	{
+		ListState s;
+		char params[64];
+		int i;
+
+		s.size = size;
+		s.list = ListInitialize();
+		s.values = malloc(sizeof(int) * size);
+		for (i = 0; i < size; ++i)
+		{
+			s.values[i] = (int)next();
+			ListAppend(s.list, &s.values[i], sizeof(int));
+		}
+		s.order = shuffled(size);
+		sprintf(params, "\"size\":%d", size);
+		run("list_find_item", params, benchListFind, &s, 1);
+		ListFreeNoContent(s.list);
+		free(s.order);
+		free(s.values);
+	}
+}
+
+
+/****************************   subscription engine   ****************************/
+
+#define TOPIC_ORDER 4096	/**< length of the repeating sequence of topics published to */
+
+typedef struct
+{
+	SubscriptionEngines* se;
+	char** topics;
+	int* order;
+	long subscribers;	/**< total number of subscribers found */
+} SubscribersState;
+
+
+static double benchSubscribers(void* arg, long n)
+{
+	SubscribersState* s = arg;
+	double start = now();
+	long i;
+
+	s->subscribers = 0;
+	for (i = 0; i < n; ++i)
+	{
+		char* topic = s->topics[s->order[i % TOPIC_ORDER]];
+		List* subscribers = SubscriptionEngines_getSubscribers(s->se, topic, "publisher");
+
+		s->subscribers += subscribers->count;
+		SubscriptionEngines_releaseSubscribers(s->se, topic, subscribers);
+	}
+	return now() - start;
+}
+
+
+/**
+ * One subscription mix: every client subscribes to its own device's command topic, one in
+ * twenty to the status of all the devices at its site, one in a hundred to everything at its
+ * site, and one client to the status of every device.  Half the publications are device
+ * status, and half are commands.
+ * @param clients the number of clients
+ */
+static void subscribers(int clients)
+{
+	SubscribersState s;
+	char** clientids = malloc(sizeof(char*) * clients);
+	int ntopics = clients * 2;
+	int i, cache, subscriptions = 0;
+	char buf[64];
+
+	s.se = SubscriptionEngines_initialize();
+	for (i = 0; i < clients; ++i)
+	{
+		int site = i % 10, device = i / 10;
+
+		sprintf(buf, "client%d", i);
+		clientids[i] = strdup(buf);
+		sprintf(buf, "site/%d/dev/%d/cmd", site, device);
+		subscriptions += SubscriptionEngines_subscribe(s.se, clientids[i], buf, 1, 0, 0, PRIORITY_NORMAL);
+		if (i % 20 == 1)
+		{
+			sprintf(buf, "site/%d/dev/+/status", site);
+			subscriptions += SubscriptionEngines_subscribe(s.se, clientids[i], buf, 0, 0, 0, PRIORITY_NORMAL);
+		}
+		if (i % 100 == 2)
+		{
+			sprintf(buf, "site/%d/#", site);
+			subscriptions += SubscriptionEngines_subscribe(s.se, clientids[i], buf, 1, 0, 0, PRIORITY_NORMAL);
+		}
+		if (i == 4)
+			subscriptions += SubscriptionEngines_subscribe(s.se, clientids[i], "site/+/dev/+/status", 0, 0, 0, PRIORITY_NORMAL);
+	}
+
+	s.topics = malloc(sizeof(char*) * ntopics);
+	for (i = 0; i < ntopics; ++i)
+	{
+		sprintf(buf, "site/%d/dev/%d/%s", (i / 2) % 10, (i / 2) / 10, (i % 2) ? "cmd" : "status");
+		s.topics[i] = strdup(buf);
+	}
+	s.order = malloc(sizeof(int) * TOPIC_ORDER);
+	for (i = 0; i < TOPIC_ORDER; ++i)
+		s.order[i] = next() % ntopics;
+
+	for (cache = 0; cache <= 1000; cache += 1000)
+	{
+		char params[256];
+		long found;
+
+		SubscriptionEngines_setCacheSize(s.se, cache);
+		benchSubscribers(&s, TOPIC_ORDER);
+		found = s.subscribers;
+		sprintf(params, "\"clients\":%d,\"subscriptions\":%d,\"topics\":%d,\"cache\":%d,\"subscribers_per_call\":%.2f",
+				clients, subscriptions, ntopics, cache, (double)found / TOPIC_ORDER);
+		run("get_subscribers", params, benchSubscribers, &s, 1);
+	}
+
+	SubscriptionEngines_terminate(s.se);
+	for (i = 0; i < ntopics; ++i)
+		free(s.topics[i]);
+	free(s.topics);
+	free(s.order);
+	for (i = 0; i < clients; ++i)
+		free(clientids[i]);
+	free(clientids);
+}
+
+
+static void subscriberMixes()
+{
+	subscribers(100);
+	subscribers(1000);
+	subscribers(10000);
+}
+
+
+typedef struct
+{
+	SubscriptionEngines* se;
+	int size;
+	char* filter;	/**< the filter to get, or NULL for a random existing topic */
+	char** topics;
+	int* order;
+	char payload[64];
+	long matches;	/**< total number of retained publications found */
+} RetainedState;
+
+
+static double benchSetRetained(void* arg, long n)
+{
+	RetainedState* s = arg;
+	double start = now();
+	long i;
+
+	for (i = 0; i < n; ++i)
+	{
+		s->payload[0] = (char)i;	/* a replacement of an existing publication, with a new payload */
+		SubscriptionEngines_setRetained(s->se, s->topics[s->order[i % s->size]], 1, s->payload,
+				sizeof(s->payload));
+	}
+	return now() - start;
+}
+
+
+static double benchGetRetained(void* arg, long n)
+{
+	RetainedState* s = arg;
+	double start = now();
+	long i;
+
+	s->matches = 0;
+	for (i = 0; i < n; ++i)
+	{
+		List* found = SubscriptionEngines_getRetained(s->se, s->filter ? s->filter : s->topics[s->order[i % s->size]]);
+
+		s->matches += found->count;
+		ListFreeNoContent(found);
+	}
+	return now() - start;
+}
+
+
+static void retained()
+{
+	char* filters[] = { NULL, "site/3/dev/+/status", "site/+/dev/7/status", "site/3/#", "#" };
+	int size;
+
+	for (size = 1000; size <= 100000 && size <= max_size; size *= 10)
+	{
+		RetainedState s;
+		char params[256], buf[64];
+		int i;
+
+		memset(&s, '\0', sizeof(s));
+		s.se = SubscriptionEngines_initialize();
+		s.size = size;
+		s.topics = malloc(sizeof(char*) * size);
+		for (i = 0; i < size; ++i)
+		{
+			sprintf(buf, "site/%d/dev/%d/status", i % 10, i / 10);
+			s.topics[i] = strdup(buf);
+			SubscriptionEngines_setRetained(s.se, s.topics[i], 1, s.payload, sizeof(s.payload));
+		}
+		s.order = shuffled(size);
+
+		sprintf(params, "\"size\":%d", size);
+		run("set_retained", params, benchSetRetained, &s, 1);
+		for (i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i)
+		{
+			s.filter = filters[i];
+			benchGetRetained(&s, 1);
+			sprintf(params, "\"size\":%d,\"filter\":\"%s\",\"matches\":%ld", size,
+					filters[i] ? filters[i] : "<topic>", s.matches);
+			run("get_retained", params, benchGetRetained, &s, 1);
+		}
+
+		SubscriptionEngines_terminate(s.se);
+		for (i = 0; i < size; ++i)
+			free(s.topics[i]);
+		free(s.topics);
+		free(s.order);
+	}
+}
+
+
+/****************************   packets   ****************************/
+
+typedef struct
+{
+	char data[1024];
+	int len;
+} Packet;
+
+
+static void addString(Packet* p, char* s)
+{
+	int len = strlen(s);
+
+	p->data[p->len++] = len / 256;
+	p->data[p->len++] = len % 256;
+	memcpy(&p->data[p->len], s, len);
+	p->len += len;
+}
+
+
+/**
+ * Put the fixed header in front of the variable header and payload built so far
+ */
+static void addHeader(Packet* p, unsigned char byte)
+{
+	char header[5];
+	int len;
+
+	header[0] = byte;
+	len = 1 + MQTTPacket_encode(&header[1], p->len);
+	memmove(&p->data[len], p->data, p->len);
+	memcpy(p->data, header, len);
+	p->len += len;
+}
+
+
+typedef struct
+{
+	Packet packet;
+	int offset;		/**< of the variable header, after the fixed header */
+} ParseState;
+
+
+static double benchParse(void* arg, long n)
+{
+	ParseState* s = arg;
+	Header header;
+	void* (*parse)(unsigned char, char*, int) = NULL;
+	double start;
+	long i;
+
+	header.byte = s->packet.data[0];
+	if (header.bits.type == CONNECT)
+		parse = MQTTPacket_connect;
+	else if (header.bits.type == SUBSCRIBE)
+		parse = MQTTPacket_subscribe;
+	else
+		parse = MQTTPacket_publish;
+	start = now();
+	for (i = 0; i < n; ++i)
+	{
+		MQTTPacket* pack = parse(header.byte, &s->packet.data[s->offset], s->packet.len - s->offset);
+
+		if (header.bits.type == CONNECT)
+			MQTTPacket_freeConnect((Connect*)pack);
+		else
+			MQTTPacket_free_packet(pack);
+	}
+	return now() - start;
+}
+
+
+typedef struct
+{
+	int fds[2];
+	char* batch;	/**< PUBLISH packets, as many as fit in a socket buffer */
+	int batchlen;
+	int count;		/**< packets in a batch */
+	int left;		/**< packets in the socket not yet read */
+} FactoryState;
+
+
+static double benchFactory(void* arg, long n)
+{
+	FactoryState* s = arg;
+	double elapsed = 0;
+
+	while (n > 0)
+	{
+		long i, count;
+		double start;
+
+		if (s->left == 0)
+		{
+			if (write(s->fds[1], s->batch, s->batchlen) != s->batchlen)
+			{
+				fprintf(stderr, "packet_factory: could not write a batch of %d bytes\n", s->batchlen);
+				exit(1);
+			}
+			s->left = s->count;
+		}
+		count = (s->left < n) ? s->left : n;
+		start = now();
+		for (i = 0; i < count; ++i)
+		{
+			int error = 0;
+			MQTTPacket* pack = MQTTPacket_Factory(s->fds[0], &error);
+
+			if (pack == NULL)
+			{
+				fprintf(stderr, "packet_factory: no packet read, rc %d\n", error);
+				exit(1);
+			}
+			MQTTPacket_free_packet(pack);
+		}
+		elapsed += now() - start;
+		s->left -= count;
+		n -= count;
+	}
+	return elapsed;
+}
+
+
+static void packets()
+{
+	ParseState connect, subscribe, publish;
+	FactoryState factory;
+	char payload[64], params[64];
+	int i;
+
+	memset(payload, 'x', sizeof(payload));
+
+	connect.packet.len = 0;
+	addString(&connect.packet, "MQTT");
+	connect.packet.data[connect.packet.len++] = 4;		/* version */
+	connect.packet.data[connect.packet.len++] = (char)0xEE;	/* username, password, will QoS 1, will, clean session */
+	connect.packet.data[connect.packet.len++] = 0;
+	connect.packet.data[connect.packet.len++] = 60;		/* keepalive */
+	addString(&connect.packet, "microbench-client-0001");
+	addString(&connect.packet, "site/3/dev/42/online");
+	addString(&connect.packet, "offline");
+	addString(&connect.packet, "user");
+	addString(&connect.packet, "password");
+	addHeader(&connect.packet, 0x10);
+
+	subscribe.packet.len = 0;
+	subscribe.packet.data[subscribe.packet.len++] = 0;
+	subscribe.packet.data[subscribe.packet.len++] = 1;	/* message id */
+	for (i = 0; i < 4; ++i)
+	{
+		char* filters[] = { "site/3/dev/42/cmd", "site/3/dev/+/status", "site/3/#", "$SYS/broker/uptime" };
+
+		addString(&subscribe.packet, filters[i]);
+		subscribe.packet.data[subscribe.packet.len++] = 1;
+	}
+	addHeader(&subscribe.packet, 0x82);
+
+	publish.packet.len = 0;
+	addString(&publish.packet, "site/3/dev/42/status");
+	publish.packet.data[publish.packet.len++] = 0;
+	publish.packet.data[publish.packet.len++] = 1;	/* message id */
+	memcpy(&publish.packet.data[publish.packet.len], payload, sizeof(payload));
+	publish.packet.len += sizeof(payload);
+	addHeader(&publish.packet, 0x32);	/* QoS 1 */
+
+	/* all these packets are short enough for a one byte remaining length */
+	connect.offset = subscribe.offset = publish.offset = 2;
+	run("packet_parse", "\"type\":\"CONNECT\"", benchParse, &connect, 1);
+	run("packet_parse", "\"type\":\"SUBSCRIBE\"", benchParse, &subscribe, 1);
+	run("packet_parse", "\"type\":\"PUBLISH\"", benchParse, &publish, 1);
+
+	memset(&factory, '\0', sizeof(factory));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, factory.fds) != 0)
+	{
+		perror("socketpair");
+		return;
+	}
+	fcntl(factory.fds[0], F_SETFL, fcntl(factory.fds[0], F_GETFL, 0) | O_NONBLOCK);
+	factory.count = 32768 / publish.packet.len;
+	factory.batchlen = factory.count * publish.packet.len;
+	factory.batch = malloc(factory.batchlen);
+	for (i = 0; i < factory.count; ++i)
+		memcpy(&factory.batch[i * publish.packet.len], publish.packet.data, publish.packet.len);
+	sprintf(params, "\"type\":\"PUBLISH\",\"bytes\":%d", publish.packet.len);
+	run("packet_factory", params, benchFactory, &factory, 1);
+	while (factory.left > 0)
+		benchFactory(&factory, factory.left);
+	close(factory.fds[0]);
+	close(factory.fds[1]);
+	free(factory.batch);
+}
+
+
+int main(int argc, char** argv)
+{
+	struct
+	{
+		char* name;
+		void (*fn)();
+	} groups[] = { {"topics", topics}, {"tree", tree}, {"list", list}, {"subscribers", subscriberMixes},
+			{"retained", retained}, {"packet", packets} };
+	BrokerStates bs;
+	char* list = NULL;
+	int i;
+
+	for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (strcmp(argv[i], "-t") == 0)
+			list = argv[i + 1];
+		else if (strcmp(argv[i], "-m") == 0)
+			max_size = atol(argv[i + 1]);
+		else if (strcmp(argv[i], "-r") == 0)
+			repeats = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-d") == 0)
+			duration = atoi(argv[i + 1]) / 1000.0;
+		else if (strcmp(argv[i], "-s") == 0)
+			seed = strtoull(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "-o") == 0)
+		{
+			if ((output = fopen(argv[i + 1], "a")) == NULL)
+			{
+				fprintf(stderr, "cannot open %s\n", argv[i + 1]);
+				return 1;
+			}
+		}
+		else
+			break;
+	}
+	if (i < argc || repeats < 1 || repeats > 100 || duration <= 0 || max_size < 1000 || seed == 0)
+	{
+		fprintf(stderr, "usage: microbench [-t group,...] [-m max tree size] [-r repeats] [-d ms per run]\n"
+				"                  [-s seed] [-o results file]\n"
+				"groups: topics tree list subscribers retained packet\n");
+		return 1;
+	}
+
+	Heap_initialize();
+	Log_initialize();
+	/* no configuration file, so no persistence: the subscription engine reads and writes nothing */
+	memset(&bs, '\0', sizeof(bs));
+	bs.listeners = ListInitialize();
+	Persistence_read_config("", &bs, 0);
+	Socket_outInitialize();
+
+	for (i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i)
+	{
+		char* found = list ? strstr(list, groups[i].name) : NULL;
+		int len = strlen(groups[i].name);
+
+		if (list && (found == NULL || (found != list && found[-1] != ',') || (found[len] != '\0' && found[len] != ',')))
+			continue;
+		groups[i].fn();
+	}
+	if (output)
+		fclose(output);
+	return 0;
+}
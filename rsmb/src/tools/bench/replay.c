@@ -0,0 +1,857 @@
+/*******************************************************************************
+ * Copyright (c) 2026 rsmb contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    rsmb contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Replay of a traffic capture against a broker.
+ *
+ * Reads a file written by a broker with the capture_file setting, and sends the same packets
+ * to another broker on the same number of connections, either with the captured timing, scaled
+ * by the -x factor, or as fast as possible with -x 0:
+ *
+ *    make replay
+ *    ./replay -b ./broker_epoll capture.bin
+ *    ./replay -x 0 -p 1883 -P `pidof broker` -o results.json capture.bin
+ *
+ * A TCP connection is opened for each captured CONNECT, replacing any still open for the same
+ * captured connection.  It is closed where the capture shows a DISCONNECT or the client closing
+ * it, once the responses to its requests have arrived.  Packets on connections which are not
+ * open, such as those of clients which were already connected when the capture started, are
+ * skipped.  Each MQTT-SN client address gets a UDP socket of its own.  Everything is sent as it was captured, so acknowledgements of
+ * messages from the broker only match if the broker numbers its messages the same way.
+ *
+ * The time from each request to its response (CONNECT to CONNACK, PUBLISH to PUBACK or PUBREC,
+ * SUBSCRIBE to SUBACK and so on) is measured, and one line of JSON is written with the replay
+ * rate, the response time percentiles, how far the replay fell behind the captured timing and,
+ * when the broker process is known, its CPU time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "Capture.h"
+
+#define MAX_PENDING 64			/**< outstanding requests timed on one connection */
+#define MAX_BUFFERED 1048576	/**< output held for one connection before waiting for the broker */
+
+/**
+ * One captured record
+ */
+typedef struct
+{
+	double time;		/**< seconds since the start of the capture */
+	unsigned int connection;
+	unsigned char type;
+	unsigned int length;
+	unsigned char* data;
+} Record;
+
+/**
+ * A request waiting for its response
+ */
+typedef struct
+{
+	unsigned char response;	/**< packet type of the response */
+	double sent;
+} Pending;
+
+/**
+ * One replayed connection
+ */
+typedef struct
+{
+	unsigned int connection;	/**< the captured connection id */
+	unsigned char type;		/**< CAPTURE_MQTT or CAPTURE_MQTTS */
+	int fd;					/**< -1 when not open */
+	int slot;				/**< index in the poll array */
+	int closing;			/**< close once the output is written and the responses have arrived */
+	int detached;			/**< replaced by a later connection with the same id: free when closed */
+	char* in;				/**< input not yet parsed */
+	int inlen;
+	int insize;
+	char* out;				/**< output not yet written */
+	int outlen;
+	int outsize;
+	Pending pending[MAX_PENDING];
+	int npending;
+} Conn;
+
+static char* host = "127.0.0.1";
+static int port = 1883;
+static int snport = 0;			/**< MQTT-SN UDP port, the port after the MQTT port by default */
+static double speed = 1;		/**< 1 for the captured timing, 0 for as fast as possible */
+static double drain = 1;		/**< seconds to wait for the last responses */
+static pid_t broker_pid = 0;
+static char* broker_name = NULL;
+static FILE* output = NULL;
+
+static Conn** table = NULL;		/**< hash table of connections by captured id */
+static int table_size = 0;
+static int table_count = 0;
+static struct pollfd* pfds = NULL;
+static Conn** pconns = NULL;	/**< the connection for each entry of pfds */
+static int npfds = 0;
+static int pfds_size = 0;
+
+static struct
+{
+	long records;
+	long skipped;		/**< records for connections which were not open */
+	long connections;	/**< connections opened */
+	long failures;		/**< connections which could not be opened */
+	long closed;		/**< connections closed by the broker */
+	long long bytes_sent;
+	long long bytes_received;
+	long received;		/**< packets received */
+	long responses;		/**< requests whose responses were timed */
+	float* latency;		/**< response times in microseconds */
+	long nlatency;
+	long latsize;
+	float* lag;			/**< milliseconds behind the captured timing, for each record */
+	long nlag;
+} stats;
+
+
+static double now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static unsigned int readInt(unsigned char* p)
+{
+	unsigned int value;
+
+	memcpy(&value, p, 4);
+	return ntohl(value);
+}
+
+
+/**
+ * Read a capture file into memory.
+ * @param filename the capture file
+ * @param records set to the array of records, which point into the file contents
+ * @return the number of records, or -1 if the file cannot be read
+ */
+static long load(char* filename, Record** records)
+{
+	unsigned char* buf = NULL;
+	struct stat st;
+	long count = 0, size = 0, pos = CAPTURE_FILE_HEADER;
+	double time = 0;
+	FILE* f;
+
+	if ((f = fopen(filename, "rb")) == NULL || fstat(fileno(f), &st) != 0)
+	{
+		fprintf(stderr, "cannot open %s\n", filename);
+		return -1;
+	}
+	buf = malloc(st.st_size + 1);
+	if (fread(buf, 1, st.st_size, f) != st.st_size || st.st_size < CAPTURE_FILE_HEADER ||
+			memcmp(buf, CAPTURE_EYECATCHER, 8) != 0)
+	{
+		fprintf(stderr, "%s is not a capture file\n", filename);
+		fclose(f);
+		free(buf);
+		return -1;
+	}
+	fclose(f);
+	*records = NULL;
+	while (pos + CAPTURE_RECORD_HEADER <= st.st_size)
+	{
+		Record* r;
+
+		if (count == size)
+		{
+			size = (size == 0) ? 1024 : size * 2;
+			*records = realloc(*records, sizeof(Record) * size);
+		}
+		r = &(*records)[count];
+		time += readInt(&buf[pos]) / 1e6;
+		r->time = time;
+		r->connection = readInt(&buf[pos + 4]);
+		r->type = buf[pos + 8];
+		r->length = readInt(&buf[pos + 9]);
+		r->data = &buf[pos + CAPTURE_RECORD_HEADER];
+		if (pos + CAPTURE_RECORD_HEADER + (long)r->length > st.st_size)
+			break; /* the capture was cut short in the middle of a record */
+		pos += CAPTURE_RECORD_HEADER + r->length;
+		++count;
+	}
+	return count;
+}
+
+
+static int hashConn(unsigned int connection, unsigned char type)
+{
+	return ((connection * 2654435761U) ^ type) & (table_size - 1);
+}
+
+
+/**
+ * Find the connection for a captured connection id, adding it if it is new.
+ */
+static Conn* findConn(unsigned int connection, unsigned char type)
+{
+	int i;
+
+	if (table_count * 2 >= table_size)
+	{
+		Conn** old = table;
+		int old_size = table_size;
+
+		table_size = (table_size == 0) ? 1024 : table_size * 2;
+		table = calloc(table_size, sizeof(Conn*));
+		for (i = 0; i < old_size; ++i)
+		{
+			if (old[i])
+			{
+				int h = hashConn(old[i]->connection, old[i]->type);
+
+				while (table[h])
+					h = (h + 1) & (table_size - 1);
+				table[h] = old[i];
+			}
+		}
+		free(old);
+	}
+	for (i = hashConn(connection, type); table[i]; i = (i + 1) & (table_size - 1))
+	{
+		if (table[i]->connection == connection && table[i]->type == type)
+			return table[i];
+	}
+	table[i] = calloc(1, sizeof(Conn));
+	table[i]->connection = connection;
+	table[i]->type = type;
+	table[i]->fd = -1;
+	++table_count;
+	return table[i];
+}
+
+
+static void addLatency(double seconds)
+{
+	if (stats.nlatency == stats.latsize)
+	{
+		stats.latsize = (stats.latsize == 0) ? 4096 : stats.latsize * 2;
+		stats.latency = realloc(stats.latency, sizeof(float) * stats.latsize);
+	}
+	stats.latency[stats.nlatency++] = (float)(seconds * 1e6);
+}
+
+
+/**
+ * Remember a request, to time its response.
+ */
+static void expect(Conn* c, unsigned char response)
+{
+	if (c->npending == MAX_PENDING)
+	{
+		memmove(&c->pending[0], &c->pending[1], sizeof(Pending) * (MAX_PENDING - 1));
+		--c->npending;
+	}
+	c->pending[c->npending].response = response;
+	c->pending[c->npending++].sent = now();
+}
+
+
+/**
+ * A packet has been received: if it is the response to a request, time it.
+ */
+static void received(Conn* c, unsigned char type)
+{
+	int i;
+
+	++stats.received;
+	for (i = 0; i < c->npending; ++i)
+	{
+		if (c->pending[i].response == type)
+		{
+			addLatency(now() - c->pending[i].sent);
+			++stats.responses;
+			memmove(&c->pending[i], &c->pending[i + 1], sizeof(Pending) * (c->npending - i - 1));
+			--c->npending;
+			break;
+		}
+	}
+}
+
+
+/**
+ * The response expected for an MQTT packet, or 0 if none is
+ */
+static unsigned char mqttResponse(unsigned char* packet)
+{
+	int type = packet[0] >> 4, qos = (packet[0] >> 1) & 3;
+
+	if (type == 3)	/* PUBLISH */
+		return (qos == 1) ? 4 : (qos == 2) ? 5 : 0;
+	if (type == 1 || type == 6 || type == 8 || type == 10 || type == 12) /* CONNECT PUBREL SUBSCRIBE UNSUBSCRIBE PINGREQ */
+		return type + 1;
+	return 0;
+}
+
+
+/**
+ * The type of an MQTT-SN datagram, and the offset of its type byte
+ */
+static int snType(unsigned char* packet, int len, int* offset)
+{
+	*offset = (packet[0] == 1) ? 3 : 1;
+	return (len > *offset) ? packet[*offset] : -1;
+}
+
+
+/**
+ * The response expected for an MQTT-SN datagram, or 0 if none is
+ */
+static unsigned char snResponse(unsigned char* packet, int len)
+{
+	int offset = 0, type = snType(packet, len, &offset);
+
+	if (type == 0x0C && len > offset + 1)	/* PUBLISH */
+	{
+		int qos = (packet[offset + 1] >> 5) & 3;
+
+		return (qos == 1) ? 0x0D : (qos == 2) ? 0x0F : 0;
+	}
+	if (type == 0x04 || type == 0x0A || type == 0x12 || type == 0x14 || type == 0x16) /* CONNECT REGISTER SUBSCRIBE UNSUBSCRIBE PINGREQ */
+		return type + 1;
+	if (type == 0x10)	/* PUBREL */
+		return 0x0E;
+	if (type == 0x18)	/* DISCONNECT */
+		return 0x18;
+	return 0;
+}
+
+
+static void closeConn(Conn* c)
+{
+	if (c->fd < 0)
+		return;
+	close(c->fd);
+	c->fd = -1;
+	c->inlen = c->outlen = c->npending = c->closing = 0;
+	/* move the last poll entry into this one's place */
+	--npfds;
+	if (c->slot != npfds)
+	{
+		pfds[c->slot] = pfds[npfds];
+		pconns[c->slot] = pconns[npfds];
+		pconns[c->slot]->slot = c->slot;
+	}
+	if (c->detached)
+	{
+		free(c->in);
+		free(c->out);
+		free(c);
+	}
+}
+
+
+static int openConn(Conn* c)
+{
+	struct sockaddr_in addr;
+	int flag = 1, udp = (c->type == CAPTURE_MQTTS);
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(udp ? snport : port);
+	addr.sin_addr.s_addr = inet_addr(host);
+	if ((c->fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0 ||
+			connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		if (c->fd >= 0)
+			close(c->fd);
+		c->fd = -1;
+		++stats.failures;
+		return -1;
+	}
+	if (!udp)
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+	if (npfds == pfds_size)
+	{
+		pfds_size = (pfds_size == 0) ? 1024 : pfds_size * 2;
+		pfds = realloc(pfds, sizeof(struct pollfd) * pfds_size);
+		pconns = realloc(pconns, sizeof(Conn*) * pfds_size);
+	}
+	c->slot = npfds++;
+	pfds[c->slot].fd = c->fd;
+	pfds[c->slot].events = POLLIN;
+	pconns[c->slot] = c;
+	++stats.connections;
+	return 0;
+}
+
+
+static void flush(Conn* c)
+{
+	while (c->outlen > 0)
+	{
+		int rc = write(c->fd, c->out, c->outlen);
+
+		if (rc < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			++stats.closed;
+			closeConn(c);
+			return;
+		}
+		memmove(c->out, &c->out[rc], c->outlen - rc);
+		c->outlen -= rc;
+	}
+	pfds[c->slot].events = (c->outlen > 0) ? POLLIN | POLLOUT : POLLIN;
+	if (c->closing && c->outlen == 0 && c->npending == 0)
+		closeConn(c);
+}
+
+
+/**
+ * Read what is available on a connection, and time any responses in it.
+ */
+static void readConn(Conn* c)
+{
+	int pos = 0, rc;
+
+	if (c->insize - c->inlen < 65536)
+	{
+		c->insize = c->inlen + 65536;
+		c->in = realloc(c->in, c->insize);
+	}
+	if (c->type == CAPTURE_MQTTS)
+	{
+		while ((rc = recv(c->fd, c->in, c->insize, 0)) > 0)
+		{
+			int offset = 0, type = snType((unsigned char*)c->in, rc, &offset);
+
+			stats.bytes_received += rc;
+			if (type >= 0)
+				received(c, type);
+		}
+		return;
+	}
+	if ((rc = read(c->fd, &c->in[c->inlen], c->insize - c->inlen)) <= 0)
+	{
+		if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			++stats.closed;
+			closeConn(c);
+		}
+		return;
+	}
+	stats.bytes_received += rc;
+	c->inlen += rc;
+	while (pos < c->inlen)
+	{
+		int len = 0, mult = 1, i = pos + 1;
+
+		while (i < c->inlen && (c->in[i] & 0x80))
+		{
+			len += (c->in[i++] & 0x7F) * mult;
+			mult *= 128;
+		}
+		if (i >= c->inlen)
+			break;
+		len += c->in[i++] * mult;
+		if (i + len > c->inlen)
+			break;
+		received(c, ((unsigned char)c->in[pos]) >> 4);
+		pos = i + len;
+	}
+	memmove(c->in, &c->in[pos], c->inlen - pos);
+	c->inlen -= pos;
+	if (c->closing && c->outlen == 0 && c->npending == 0)
+		closeConn(c);
+}
+
+
+/**
+ * Wait for reads and writes on all the open connections.
+ * @param timeout the longest wait, in milliseconds
+ */
+static void pump(int timeout)
+{
+	int i;
+
+	if (poll(pfds, npfds, timeout) <= 0)
+		return;
+	for (i = npfds - 1; i >= 0; --i) /* backwards, as closing a connection moves the last one */
+	{
+		Conn* c = pconns[i];
+
+		if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+			readConn(c);
+		if (i < npfds && pconns[i] == c && (pfds[i].revents & POLLOUT))
+			flush(c);
+	}
+}
+
+
+/**
+ * Send one captured record.
+ */
+static void replay(Record* r)
+{
+	Conn* c = findConn(r->connection, (r->type == CAPTURE_MQTTS) ? CAPTURE_MQTTS : CAPTURE_MQTT);
+	unsigned char response = 0;
+
+	++stats.records;
+	if (r->type == CAPTURE_CLOSE)
+	{
+		if (c->fd >= 0)
+		{
+			c->closing = 1;
+			flush(c);
+		}
+		return;
+	}
+	if (r->length == 0)
+		return;
+	if (r->type == CAPTURE_MQTT && (r->data[0] >> 4) == 1) /* CONNECT: a new connection */
+	{
+		if (c->fd >= 0 && c->closing)
+		{
+			/* the disconnected client is still waiting for responses: let it finish on its own */
+			Conn* old = malloc(sizeof(Conn));
+
+			*old = *c;
+			old->detached = 1;
+			pconns[old->slot] = old;
+			c->fd = -1;
+			c->in = c->out = NULL;
+			c->inlen = c->insize = c->outlen = c->outsize = c->npending = c->closing = 0;
+		}
+		else
+			closeConn(c);
+		openConn(c);
+	}
+	else if (r->type == CAPTURE_MQTTS && c->fd < 0)
+		openConn(c);
+	if (c->fd < 0)
+	{
+		++stats.skipped;
+		return;
+	}
+
+	stats.bytes_sent += r->length;
+	if (r->type == CAPTURE_MQTTS)
+	{
+		response = snResponse(r->data, r->length);
+		if (send(c->fd, r->data, r->length, 0) == r->length && response)
+			expect(c, response);
+		return;
+	}
+	while (c->outlen > MAX_BUFFERED && c->fd >= 0)
+		pump(100);	/* the broker is not keeping up: wait for it */
+	if (c->fd < 0)
+		return;
+	if (c->outlen + (int)r->length > c->outsize)
+	{
+		c->outsize = (c->outlen + r->length) * 2;
+		c->out = realloc(c->out, c->outsize);
+	}
+	memcpy(&c->out[c->outlen], r->data, r->length);
+	c->outlen += r->length;
+	if ((response = mqttResponse(r->data)) != 0)
+		expect(c, response);
+	if ((r->data[0] >> 4) == 14) /* DISCONNECT */
+		c->closing = 1;
+	flush(c);
+}
+
+
+static double usage(pid_t pid)
+{
+	char fn[64], buf[1024];
+	unsigned long utime = 0, stime = 0;
+	double rc = -1;
+	FILE* f;
+
+	sprintf(fn, "/proc/%d/stat", (int)pid);
+	if (pid > 0 && (f = fopen(fn, "r")) != NULL)
+	{
+		if (fgets(buf, sizeof(buf), f))
+		{
+			char* p = strrchr(buf, ')');
+
+			if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+				rc = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+		fclose(f);
+	}
+	return rc;
+}
+
+
+static int compareFloats(const void* a, const void* b)
+{
+	float x = *(float*)a, y = *(float*)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+static float percentile(float* values, long count, double q)
+{
+	long i = (long)(count * q);
+
+	if (count == 0)
+		return 0;
+	return values[(i >= count) ? count - 1 : i];
+}
+
+
+static void report(char* capture, double captured, double elapsed, double cpu)
+{
+	char line[1024];
+	int len = 0;
+
+	qsort(stats.latency, stats.nlatency, sizeof(float), compareFloats);
+	qsort(stats.lag, stats.nlag, sizeof(float), compareFloats);
+	len += sprintf(&line[len], "{\"capture\":\"%s\",\"broker\":\"%s\",\"speed\":%g,\"records\":%ld,"
+			"\"skipped\":%ld,\"connections\":%ld,\"failures\":%ld,\"closed_by_broker\":%ld,", capture,
+			broker_name ? broker_name : "", speed, stats.records, stats.skipped, stats.connections,
+			stats.failures, stats.closed);
+	len += sprintf(&line[len], "\"captured_seconds\":%.3f,\"seconds\":%.3f,\"records_per_sec\":%.0f,"
+			"\"bytes_sent\":%lld,\"bytes_received\":%lld,\"received\":%ld,\"responses\":%ld,", captured,
+			elapsed, elapsed > 0 ? stats.records / elapsed : 0, stats.bytes_sent, stats.bytes_received,
+			stats.received, stats.responses);
+	len += sprintf(&line[len], "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,",
+			percentile(stats.latency, stats.nlatency, 0.5), percentile(stats.latency, stats.nlatency, 0.99),
+			percentile(stats.latency, stats.nlatency, 0.999), percentile(stats.latency, stats.nlatency, 1));
+	if (speed > 0)
+		len += sprintf(&line[len], "\"lag_p99_ms\":%.2f,\"lag_max_ms\":%.2f,",
+				percentile(stats.lag, stats.nlag, 0.99), percentile(stats.lag, stats.nlag, 1));
+	if (cpu >= 0)
+		len += sprintf(&line[len], "\"cpu_seconds\":%.3f", cpu);
+	else
+		len += sprintf(&line[len], "\"cpu_seconds\":null");
+	sprintf(&line[len], "}\n");
+	fputs(line, stdout);
+	fflush(stdout);
+	if (output)
+	{
+		fputs(line, output);
+		fflush(output);
+	}
+}
+
+
+static pid_t startBroker(char* broker, int mqtts)
+{
+	char dir[] = "/tmp/replayXXXXXX", cfg[64], path[PATH_MAX];
+	pid_t pid;
+	FILE* f;
+
+	if (realpath(broker, path) == NULL || mkdtemp(dir) == NULL)
+		return -1;
+	sprintf(cfg, "%s/broker.cfg", dir);
+	if ((f = fopen(cfg, "w")) == NULL)
+		return -1;
+	fprintf(f, "port %d\n", port);
+	if (mqtts)
+		fprintf(f, "listener %d 127.0.0.1 mqtts\n", snport);
+	fclose(f);
+	if ((pid = fork()) == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+
+		if (chdir(dir) != 0)
+			_exit(1);
+		dup2(null, 1);
+		dup2(null, 2);
+		execl(path, path, "broker.cfg", (char*)NULL);
+		_exit(1);
+	}
+	return pid;
+}
+
+
+/**
+ * Wait for a broker to accept connections.
+ */
+static int probe()
+{
+	struct sockaddr_in addr;
+	double start;
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(host);
+	for (start = now(); now() - start < 5; usleep(50000))
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0), rc;
+
+		rc = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+		close(fd);
+		if (rc == 0)
+			return 0;
+	}
+	return -1;
+}
+
+
+int main(int argc, char** argv)
+{
+	Record* records = NULL;
+	char* broker = NULL;
+	struct rlimit rl;
+	long count, i, mqtts = 0;
+	double start, cpu0, cpu1, last;
+	int rc = 0, status;
+	pid_t started = 0;
+
+	for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (strcmp(argv[i], "-h") == 0)
+			host = argv[i + 1];
+		else if (strcmp(argv[i], "-p") == 0)
+			port = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-u") == 0)
+			snport = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-x") == 0)
+			speed = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "-w") == 0)
+			drain = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "-b") == 0)
+			broker = argv[i + 1];
+		else if (strcmp(argv[i], "-P") == 0)
+			broker_pid = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-o") == 0)
+		{
+			if ((output = fopen(argv[i + 1], "a")) == NULL)
+			{
+				fprintf(stderr, "cannot open %s\n", argv[i + 1]);
+				return 1;
+			}
+		}
+		else
+			break;
+	}
+	if (i != argc - 1 || speed < 0)
+	{
+		fprintf(stderr, "usage: replay [-x speed, 0 for as fast as possible] [-w drain seconds]\n"
+				"              [-b broker executable | -h host -p port [-P broker pid]] [-u MQTT-SN port]\n"
+				"              [-o results file] capture-file\n");
+		return 1;
+	}
+	if ((count = load(argv[i], &records)) < 0)
+		return 1;
+	if (snport == 0)
+		snport = port + 1;
+	for (i = 0; i < count; ++i)
+		mqtts += (records[i].type == CAPTURE_MQTTS);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (broker == NULL)
+	{
+		broker_name = malloc(strlen(host) + 8);
+		sprintf(broker_name, "%s:%d", host, port);
+	}
+	else
+	{
+		broker_name = broker;
+		if ((broker_pid = started = startBroker(broker, mqtts > 0)) < 0)
+		{
+			fprintf(stderr, "%s: cannot start\n", broker);
+			return 1;
+		}
+	}
+	if (probe() != 0)
+	{
+		fprintf(stderr, "cannot connect to the broker at %s:%d\n", host, port);
+		rc = 1;
+		goto exit;
+	}
+	if (speed > 0)
+		stats.lag = malloc(sizeof(float) * (count + 1));
+
+	cpu0 = usage(broker_pid);
+	start = now();
+	for (i = 0; i < count; ++i)
+	{
+		if (speed > 0)
+		{
+			double due = start + records[i].time / speed, wait;
+
+			while ((wait = due - now()) > 0)
+				pump((wait > 0.001) ? (int)(wait * 1000) : 0);
+			stats.lag[stats.nlag++] = (float)((now() - due) * 1000);
+		}
+		else if (i % 64 == 0)
+			pump(0);
+		replay(&records[i]);
+	}
+	/* wait for the last responses, until nothing more arrives */
+	for (last = now(); now() - last < drain; )
+	{
+		long before = stats.received;
+
+		pump(10);
+		if (stats.received != before)
+			last = now();
+	}
+	cpu1 = usage(broker_pid);
+	report(argv[argc - 1], (count > 0) ? records[count - 1].time : 0, now() - start - drain,
+			(cpu0 >= 0 && cpu1 >= 0) ? cpu1 - cpu0 : -1);
+exit:
+	while (npfds > 0)
+		closeConn(pconns[npfds - 1]);
+	for (i = 0; i < table_size; ++i)
+	{
+		if (table && table[i])
+		{
+			free(table[i]->in);
+			free(table[i]->out);
+			free(table[i]);
+		}
+	}
+	if (started > 0)
+	{
+		kill(started, SIGTERM);
+		waitpid(started, &status, 0);
+	}
+	if (output)
+		fclose(output);
+	return rc;
+}